@@ -0,0 +1,451 @@
+// clock_gettime, nanosleep and setrlimit are hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "hist.h"
+#include "utils.h"
+
+#define RX_SIZE (9 + PROTO_SERVER_MAX)
+#define TX_SIZE 2048
+#define MAX_EVENTS 256
+// connects each worker keeps in flight while ramping up
+#define CONNECT_WINDOW 64
+// sends per loop pass, so receiving never starves
+#define SEND_BURST 1024
+// precedes the send timestamp inside every message
+#define MARKER "@@"
+#define JOIN_TIMEOUT_S 30
+// how long late deliveries are still collected after the window closes
+#define DRAIN_S 1
+
+typedef enum {
+  BOT_IDLE,
+  BOT_CONNECTING,
+  BOT_HANDSHAKE,
+  BOT_CHAT,
+  BOT_DEAD,
+} bot_state_e;
+
+typedef struct {
+  int fd;
+  int id;
+  bot_state_e state;
+  int attempts;
+  char rx_buf[RX_SIZE];
+  proto_reader_t rx;
+  // whatever the socket did not take yet
+  char tx[TX_SIZE];
+  size_t tx_off;
+  size_t tx_len;
+} bot_t;
+
+typedef struct {
+  pthread_t tid;
+  int epoll_fd;
+  bot_t *bots;
+  int count;
+  int next_connect;
+  int connecting;
+  int chatting;
+  // round robin position of the next sender
+  int cursor;
+  // everything below only counts inside the measured window
+  uint64_t sent;
+  // sends skipped because the bot's socket was still backed up
+  uint64_t stalled;
+  uint64_t received;
+  // bots that joined and then lost their connection
+  uint64_t dropped;
+  hist_t latency;
+} worker_t;
+
+static bench_options_t options;
+static struct sockaddr_in server_addr;
+static atomic_int joined;
+static atomic_int failed;
+// monotonic nanoseconds, 0 until the main thread opens the window
+static _Atomic int64_t window_start;
+static _Atomic int64_t window_end;
+static atomic_bool stopping;
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_ns(int64_t ns) {
+  if (ns <= 0)
+    return;
+  struct timespec ts = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+// BOTS
+
+static void bot_fail(worker_t *w, bot_t *bot) {
+  switch (bot->state) {
+  case BOT_CONNECTING:
+    w->connecting--;
+    atomic_fetch_add(&failed, 1);
+    break;
+  case BOT_HANDSHAKE:
+    atomic_fetch_add(&failed, 1);
+    break;
+  case BOT_CHAT:
+    w->chatting--;
+    w->dropped++;
+    break;
+  default:
+    return;
+  }
+  close(bot->fd);
+  bot->state = BOT_DEAD;
+}
+
+static void bot_connect(worker_t *w, bot_t *bot) {
+  bot->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (bot->fd == -1) {
+    log_perror(NULL, "socket");
+    bot->state = BOT_DEAD;
+    atomic_fetch_add(&failed, 1);
+    return;
+  }
+  bot->state = BOT_CONNECTING;
+  w->connecting++;
+
+  if (set_nonblocking(bot->fd) == -1 ||
+      (connect(bot->fd, (struct sockaddr *)&server_addr,
+               sizeof(server_addr)) == -1 &&
+       errno != EINPROGRESS)) {
+    log_perror(NULL, "connect");
+    bot_fail(w, bot);
+    return;
+  }
+
+  struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+      .data.ptr = bot,
+  };
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, bot->fd, &ev) == -1) {
+    log_perror(NULL, "epoll_ctl");
+    bot_fail(w, bot);
+  }
+}
+
+// returns -1 once the connection is gone
+static int bot_flush(worker_t *w, bot_t *bot) {
+  while (bot->tx_off < bot->tx_len) {
+    ssize_t n = send(bot->fd, bot->tx + bot->tx_off, bot->tx_len - bot->tx_off,
+                     MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      bot_fail(w, bot);
+      return -1;
+    }
+    bot->tx_off += n;
+  }
+  bot->tx_off = bot->tx_len = 0;
+  return 0;
+}
+
+// returns 1 if the socket is still backed up and nothing was sent
+static int bot_send(worker_t *w, bot_t *bot, const char *content, size_t len) {
+  if (bot->tx_len > 0)
+    return 1;
+
+  uint32_t magic = htonl(PROTO_MAGIC);
+  uint32_t net_len = htonl((uint32_t)len);
+  memcpy(bot->tx, &magic, 4);
+  memcpy(bot->tx + 4, &net_len, 4);
+  memcpy(bot->tx + 8, content, len);
+  bot->tx_len = 8 + len;
+  bot_flush(w, bot);
+  return 0;
+}
+
+static void bot_send_name(worker_t *w, bot_t *bot) {
+  if (++bot->attempts > 3) {
+    log_err(NULL, "bot %d could not pick a name\n", bot->id);
+    bot_fail(w, bot);
+    return;
+  }
+  char name[32];
+  int len = bot->attempts == 1
+                ? snprintf(name, sizeof(name), "bench%d", bot->id)
+                : snprintf(name, sizeof(name), "bench%d_%d", bot->id,
+                           bot->attempts);
+  bot_send(w, bot, name, len);
+}
+
+static void on_message(worker_t *w, const char *content, size_t len) {
+  int64_t start = atomic_load(&window_start);
+  if (!start)
+    return;
+
+  for (size_t i = 0; i + 2 < len; i++) {
+    if (content[i] != MARKER[0] || content[i + 1] != MARKER[1])
+      continue;
+    int64_t sent_at = 0;
+    for (size_t j = i + 2; j < len && content[j] >= '0' && content[j] <= '9';
+         j++) {
+      sent_at = sent_at * 10 + (content[j] - '0');
+    }
+    if (sent_at >= start && sent_at < atomic_load(&window_end)) {
+      w->received++;
+      hist_record(&w->latency, (uint64_t)(now_ns() - sent_at) / 1000);
+    }
+    return;
+  }
+}
+
+static void on_frame(worker_t *w, bot_t *bot, char type, const char *content,
+                     size_t len) {
+  if (type == 'm' && bot->state == BOT_CHAT) {
+    on_message(w, content, len);
+  } else if (type == 'p' && bot->state == BOT_HANDSHAKE) {
+    // the name prompt comes back after a rejected name, any other prompt
+    // means the handshake went through
+    static const char name_prompt[] = "display name";
+    bool asks_name = false;
+    for (size_t i = 0; i + sizeof(name_prompt) - 1 <= len; i++) {
+      if (memcmp(content + i, name_prompt, sizeof(name_prompt) - 1) == 0) {
+        asks_name = true;
+        break;
+      }
+    }
+    if (asks_name) {
+      bot_send_name(w, bot);
+    } else {
+      bot->state = BOT_CHAT;
+      w->chatting++;
+      atomic_fetch_add(&joined, 1);
+    }
+  }
+}
+
+static void bot_readable(worker_t *w, bot_t *bot) {
+  while (bot->state != BOT_DEAD) {
+    size_t avail;
+    char *dst = proto_reader_space(&bot->rx, &avail);
+    ssize_t n = recv(bot->fd, dst, avail, 0);
+    if (n == 0) {
+      bot_fail(w, bot);
+      return;
+    }
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        bot_fail(w, bot);
+      return;
+    }
+    proto_reader_filled(&bot->rx, n);
+
+    proto_frame_t frame;
+    proto_result_e result = PROTO_NEED_MORE;
+    while (bot->state != BOT_DEAD &&
+           (result = proto_next(&bot->rx, &frame)) == PROTO_FRAME)
+      on_frame(w, bot, frame.type, frame.content, frame.len);
+    if (bot->state != BOT_DEAD && result != PROTO_NEED_MORE) {
+      log_err(NULL, "bot %d: protocol error\n", bot->id);
+      bot_fail(w, bot);
+      return;
+    }
+  }
+}
+
+// WORKERS
+
+// keeps every joined bot sending at the configured rate while the window is
+// open, round robin so the load is spread evenly
+static void send_due(worker_t *w, int64_t now) {
+  int64_t start = atomic_load(&window_start);
+  if (!start || now < start || now >= atomic_load(&window_end) ||
+      w->chatting == 0)
+    return;
+
+  double elapsed = (now - start) / 1e9;
+  uint64_t due = (uint64_t)(elapsed * options.rate * w->chatting);
+  char content[1024];
+
+  for (int burst = 0; w->sent + w->stalled < due && burst < SEND_BURST;
+       burst++) {
+    bot_t *bot;
+    do {
+      bot = &w->bots[w->cursor];
+      w->cursor = (w->cursor + 1) % w->count;
+    } while (bot->state != BOT_CHAT);
+
+    int len = snprintf(content, sizeof(content), MARKER "%lld ",
+                       (long long)now_ns());
+    memset(content + len, 'x', options.size - len);
+    if (bot_send(w, bot, content, options.size)) {
+      w->stalled++;
+    } else {
+      w->sent++;
+    }
+    if (w->chatting == 0)
+      return;
+  }
+}
+
+static void *worker_run(void *w_raw) {
+  worker_t *w = w_raw;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (!atomic_load(&stopping)) {
+    while (w->connecting < CONNECT_WINDOW && w->next_connect < w->count)
+      bot_connect(w, &w->bots[w->next_connect++]);
+
+    int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 1);
+    if (n == -1 && errno != EINTR) {
+      log_perror(NULL, "epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      bot_t *bot = events[i].data.ptr;
+      uint32_t flags = events[i].events;
+      if (bot->state == BOT_DEAD)
+        continue;
+      if (flags & (EPOLLERR | EPOLLHUP)) {
+        bot_fail(w, bot);
+        continue;
+      }
+
+      if (bot->state == BOT_CONNECTING && (flags & EPOLLOUT)) {
+        w->connecting--;
+        bot->state = BOT_HANDSHAKE;
+      }
+      if (flags & (EPOLLIN | EPOLLRDHUP))
+        bot_readable(w, bot);
+      if ((flags & EPOLLOUT) && bot->state != BOT_DEAD)
+        bot_flush(w, bot);
+    }
+
+    send_due(w, now_ns());
+  }
+
+  for (int i = 0; i < w->count; i++) {
+    if (w->bots[i].state != BOT_DEAD && w->bots[i].state != BOT_IDLE)
+      close(w->bots[i].fd);
+  }
+  return NULL;
+}
+
+// thousands of sockets need more than the usual 1024 descriptors
+static void raise_fd_limit(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+int bench_start(bench_options_t opts) {
+  options = opts;
+  server_addr = (struct sockaddr_in){
+      .sin_family = AF_INET,
+      .sin_port = htons(options.port),
+  };
+  if (!inet_pton(AF_INET, options.host, &server_addr.sin_addr)) {
+    log_err(NULL, "malformed host ip address\n");
+    return 1;
+  }
+  raise_fd_limit();
+
+  worker_t *workers = calloc(options.threads, sizeof(*workers));
+  if (!workers) {
+    log_perror(NULL, "malloc");
+    return errno;
+  }
+
+  int next_id = 0;
+  for (int i = 0; i < options.threads; i++) {
+    worker_t *w = &workers[i];
+    w->count = options.clients / options.threads +
+               (i < options.clients % options.threads ? 1 : 0);
+    w->bots = calloc(w->count ? w->count : 1, sizeof(*w->bots));
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!w->bots || w->epoll_fd == -1) {
+      log_perror(NULL, "bench setup");
+      return errno;
+    }
+    for (int j = 0; j < w->count; j++) {
+      w->bots[j].id = next_id++;
+      proto_reader_init(&w->bots[j].rx, w->bots[j].rx_buf, RX_SIZE, true);
+    }
+
+    int err = pthread_create(&w->tid, NULL, worker_run, w);
+    if (err) {
+      log_err(NULL, "pthread_create: %s\n", strerror(err));
+      return err;
+    }
+  }
+
+  int64_t deadline = now_ns() + (int64_t)JOIN_TIMEOUT_S * 1000000000;
+  while (atomic_load(&joined) + atomic_load(&failed) < options.clients &&
+         now_ns() < deadline)
+    sleep_ns(10000000);
+  int ready = atomic_load(&joined);
+  log_info(NULL, "%d of %d clients joined, measuring for %gs\n", ready,
+           options.clients, options.duration);
+
+  // workers only start sending once start is set, so end goes first
+  int64_t start = now_ns() + 50000000;
+  int64_t end = start + (int64_t)(options.duration * 1e9);
+  atomic_store(&window_end, end);
+  atomic_store(&window_start, start);
+  sleep_ns(end + (int64_t)DRAIN_S * 1000000000 - now_ns());
+  atomic_store(&stopping, true);
+
+  static hist_t latency;
+  uint64_t sent = 0, stalled = 0, received = 0, dropped = 0;
+  for (int i = 0; i < options.threads; i++) {
+    pthread_join(workers[i].tid, NULL);
+    sent += workers[i].sent;
+    stalled += workers[i].stalled;
+    received += workers[i].received;
+    dropped += workers[i].dropped;
+    hist_merge(&latency, &workers[i].latency);
+    close(workers[i].epoll_fd);
+    free(workers[i].bots);
+  }
+  free(workers);
+
+  uint64_t expected = ready > 1 ? sent * (uint64_t)(ready - 1) : 0;
+  printf("{\"clients\":%d,\"joined\":%d,\"threads\":%d,\"rate\":%g,"
+         "\"duration\":%g,\"size\":%d,\"sent\":%llu,\"stalled\":%llu,"
+         "\"received\":%llu,\"expected\":%llu,\"dropped_clients\":%llu,"
+         "\"msgs_per_sec\":%.1f,\"deliveries_per_sec\":%.1f,"
+         "\"latency_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,"
+         "\"max\":%llu}}\n",
+         options.clients, ready, options.threads, options.rate,
+         options.duration, options.size, (unsigned long long)sent,
+         (unsigned long long)stalled, (unsigned long long)received,
+         (unsigned long long)expected, (unsigned long long)dropped,
+         sent / options.duration, received / options.duration,
+         (unsigned long long)hist_percentile(&latency, 0.5),
+         (unsigned long long)hist_percentile(&latency, 0.99),
+         (unsigned long long)hist_percentile(&latency, 0.999),
+         (unsigned long long)latency.max);
+  return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+typedef struct {
+  const char *host;
+  uint16_t port;
+  // simulated users, each a non-blocking connection that does the handshake
+  int clients;
+  // event loop threads the clients are spread over
+  int threads;
+  // messages per second sent by each client
+  double rate;
+  // seconds of measured load, after everyone has joined
+  double duration;
+  // bytes of message content, timestamp included
+  int size;
+} bench_options_t;
+
+#define BENCH_DEFAULT_CLIENTS 100
+#define BENCH_DEFAULT_RATE 1.0
+#define BENCH_DEFAULT_DURATION 10.0
+#define BENCH_DEFAULT_SIZE 64
+#define BENCH_MIN_SIZE 32
+#define BENCH_MAX_SIZE 512
+
+// drives load against a running server and prints one line of json with
+// throughput and fan-out latency percentiles to stdout
+int bench_start(bench_options_t);
+
+#endif // BENCH_H
@@ -0,0 +1,153 @@
+// fan-out cost of one large room against many small ones: n clients are split
+// into rooms of the same size and every room gets one message per round. the
+// member index only visits the room's own members, the registry walk visits
+// every client and filters, like fan-out without an index would. queues are
+// drained between rounds, outside the timed part. run from bench/build.sh.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../channels.h"
+#include "../frame.h"
+#include "../outq.h"
+
+#define ROUNDS 100
+
+typedef struct {
+  frame_t *frame;
+  int exclude_fd;
+  size_t delivered;
+} delivery_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void deliver_one(client_ctx_t *ctx, void *delivery_raw) {
+  delivery_t *delivery = delivery_raw;
+  if (ctx->fd == delivery->exclude_fd)
+    return;
+  outq_push_frame(ctx->out, delivery->frame);
+  delivery->delivered++;
+}
+
+// stands in for the socket, so queues never hit the high-water mark
+static void drain(client_ctx_t *ctxs, size_t n) {
+  struct iovec iov[64];
+  frame_t *frames[32];
+  for (size_t i = 0; i < n; i++) {
+    int iovcnt;
+    int claimed;
+    while ((claimed = outq_claim(ctxs[i].out, iov, &iovcnt, frames, 32)) > 0) {
+      size_t sent = 0;
+      for (int j = 0; j < iovcnt; j++)
+        sent += iov[j].iov_len;
+      outq_complete(ctxs[i].out, sent);
+      for (int j = 0; j < claimed; j++)
+        frame_put(frames[j]);
+    }
+  }
+}
+
+static void report(const char *how, size_t rooms, size_t size, size_t msgs,
+                   size_t delivered, double elapsed) {
+  printf("%-6s rooms=%-6zu size=%-6zu %10.0f ns/msg %8.2f M deliveries/s\n",
+         how, rooms, size, elapsed * 1e9 / msgs, delivered / elapsed / 1e6);
+}
+
+static int run(client_ctx_t *ctxs, size_t n, size_t size, frame_t *frame) {
+  size_t rooms = n / size;
+  char name[MAX_CHANNEL_LEN + 1];
+  for (size_t i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "room%zu", i / size);
+    if (channels_join(&ctxs[i], name)) {
+      fprintf(stderr, "join %zu failed\n", i);
+      return 1;
+    }
+  }
+
+  // the first member of every room is the sender
+  delivery_t delivery = {.frame = frame};
+  double elapsed = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    double start = now();
+    for (size_t r = 0; r < rooms; r++) {
+      client_ctx_t *sender = &ctxs[r * size];
+      delivery.exclude_fd = sender->fd;
+      channels_each(sender->channel, 0, deliver_one, &delivery);
+    }
+    elapsed += now() - start;
+    drain(ctxs, n);
+  }
+  report("index", rooms, size, rooms * ROUNDS, delivery.delivered, elapsed);
+
+  delivery.delivered = 0;
+  elapsed = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    double start = now();
+    for (size_t r = 0; r < rooms; r++) {
+      client_ctx_t *sender = &ctxs[r * size];
+      delivery.exclude_fd = sender->fd;
+      for (size_t i = 0; i < n; i++) {
+        if (ctxs[i].channel == sender->channel)
+          deliver_one(&ctxs[i], &delivery);
+      }
+    }
+    elapsed += now() - start;
+    drain(ctxs, n);
+  }
+  report("walk", rooms, size, rooms * ROUNDS, delivery.delivered, elapsed);
+
+  // back to the lobby, which empties and closes every room
+  for (size_t i = 0; i < n; i++)
+    channels_join(&ctxs[i], CHANNELS_LOBBY);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  // the client count can be given on the command line
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000;
+  size_t sizes[] = {n, 1000, 100, 10};
+
+  if (channels_configure(1)) {
+    perror("channels_configure");
+    return 1;
+  }
+  client_ctx_t *ctxs = calloc(n, sizeof(*ctxs));
+  if (!ctxs) {
+    perror("calloc");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    ctxs[i].fd = (int)i + 3;
+    // deferred queues never touch the fd
+    ctxs[i].out = outq_new(ctxs[i].fd, OUTQ_DRAIN_DEFERRED);
+    if (!ctxs[i].out) {
+      perror("outq_new");
+      return 1;
+    }
+  }
+
+  char content[64];
+  memset(content, 'x', sizeof(content) - 1);
+  content[sizeof(content) - 1] = '\0';
+  frame_t *frame = frame_new('m', content);
+  if (!frame) {
+    perror("frame_new");
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+    if (sizes[i] > n || sizes[i] == 0)
+      continue;
+    if (run(ctxs, n, sizes[i], frame))
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,126 @@
+// sustained append throughput of the chat log with each sync mode. every
+// thread appends the same 100 byte frame into a fresh temporary directory.
+// the slowest single append is what an event loop stalls for, rotations
+// included, so smaller segments show it more often.
+// usage: bench_chatlog [records] [threads] [segment size]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../chatlog.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static frame_t *frame;
+static size_t per_thread;
+static size_t segment_size = CHATLOG_DEFAULT_SEGMENT_SIZE;
+
+static pthread_mutex_t slowest_mu = PTHREAD_MUTEX_INITIALIZER;
+static double slowest;
+
+static void *append_run(void *) {
+  double worst = 0;
+  for (size_t i = 0; i < per_thread; i++) {
+    double start = now();
+    if (chatlog_append(frame) != 0) {
+      fprintf(stderr, "append failed\n");
+      exit(1);
+    }
+    double took = now() - start;
+    if (took > worst)
+      worst = took;
+  }
+  pthread_mutex_lock(&slowest_mu);
+  if (worst > slowest)
+    slowest = worst;
+  pthread_mutex_unlock(&slowest_mu);
+  return NULL;
+}
+
+static void remove_dir(const char *path) {
+  DIR *dir = opendir(path);
+  if (!dir)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    char file[4096];
+    snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+    unlink(file);
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+static int run(const char *name, chatlog_sync_e sync, size_t records,
+               int threads) {
+  char dir[] = "/tmp/bench_chatlog.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  chatlog_options_t options = {
+      .dir = dir,
+      .sync = sync,
+      .segment_size = segment_size,
+      .segment_age = CHATLOG_DEFAULT_SEGMENT_AGE,
+      .retain = CHATLOG_DEFAULT_RETAIN,
+  };
+  if (chatlog_open(options, 0, NULL) != 0)
+    return 1;
+
+  per_thread = records / threads;
+  slowest = 0;
+  pthread_t *tids = calloc(threads, sizeof(*tids));
+  double start = now();
+  for (int i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, append_run, NULL);
+  for (int i = 0; i < threads; i++)
+    pthread_join(tids[i], NULL);
+  chatlog_close();
+  double elapsed = now() - start;
+
+  size_t total = per_thread * threads;
+  printf("sync=%-6s threads=%-3d records=%-8zu %8.3f s %12.0f appends/s "
+         "slowest %8.1f us\n",
+         name, threads, total, elapsed, total / elapsed, slowest * 1e6);
+  free(tids);
+  remove_dir(dir);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t records = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+  int threads = argc > 2 ? atoi(argv[2]) : 4;
+  if (threads < 1)
+    threads = 1;
+  if (argc > 3)
+    segment_size = strtoull(argv[3], NULL, 10);
+
+  char content[100];
+  memset(content, 'x', sizeof(content));
+  frame = frame_new_len('m', content, sizeof(content));
+
+  // always mode pays for a sync per commit group, so it gets fewer records
+  if (run("none", CHATLOG_SYNC_NONE, records, threads) ||
+      run("batch", CHATLOG_SYNC_BATCH, records, threads) ||
+      run("always", CHATLOG_SYNC_ALWAYS, records / 20, threads) ||
+      run("always", CHATLOG_SYNC_ALWAYS, records / 20, 1))
+    return 1;
+
+  frame_put(frame);
+  return 0;
+}
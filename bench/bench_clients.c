@@ -0,0 +1,78 @@
+// join throughput of the client registry: registers n distinct names, renames
+// every client once, then removes them all. run from bench/build.sh.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../clients.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *op, size_t n, double elapsed) {
+  printf("%-8s n=%-8zu %8.3f s %12.0f ops/s\n", op, n, elapsed, n / elapsed);
+}
+
+static int run(size_t n) {
+  client_ctx_t *ctxs = calloc(n, sizeof(*ctxs));
+  if (!ctxs) {
+    perror("calloc");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    ctxs[i].fd = (int)i + 3;
+    snprintf(ctxs[i].name, sizeof(ctxs[i].name), "user%zu", i);
+  }
+
+  double start = now();
+  for (size_t i = 0; i < n; i++) {
+    if (clients_add(&ctxs[i]) != CLIENTS_ADD_OK) {
+      fprintf(stderr, "join %zu failed\n", i);
+      return 1;
+    }
+  }
+  report("join", n, now() - start);
+
+  // every rename also hits a duplicate check against the full index
+  char name[MAX_NAME_LEN + 1];
+  start = now();
+  for (size_t i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "renamed%zu", i);
+    if (clients_rename(&ctxs[i], name) != CLIENTS_RENAME_OK) {
+      fprintf(stderr, "rename %zu failed\n", i);
+      return 1;
+    }
+  }
+  report("rename", n, now() - start);
+
+  start = now();
+  for (size_t i = 0; i < n; i++)
+    clients_remove(&ctxs[i]);
+  report("leave", n, now() - start);
+
+  free(ctxs);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t sizes[] = {10000, 100000, 1000000};
+  size_t count = sizeof(sizes) / sizeof(*sizes);
+
+  // a single size can be given on the command line
+  if (argc > 1) {
+    sizes[0] = strtoull(argv[1], NULL, 10);
+    count = 1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (run(sizes[i]))
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,162 @@
+// what batching outbound frames per event loop iteration saves: a room of
+// clients on loopback tcp gets bursts of chat messages, every tick pushes a
+// burst to every member's queue. "push" writes each frame as it is queued,
+// like the reactor used to, "batch" holds them until the end of the tick and
+// writes each queue with one sendmsg. both run with nagle on and with
+// TCP_NODELAY. syscalls come from the queue's write counter, segments from
+// TCP_INFO on the sending sockets. run from bench/build.sh.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../frame.h"
+#include "../outq.h"
+#include "../utils.h"
+
+#define TICKS 200
+
+static atomic_bool stop;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// reads and drops everything, so queues never back up
+static void *reader(void *epoll_raw) {
+  int epoll_fd = *(int *)epoll_raw;
+  struct epoll_event events[64];
+  char buf[65536];
+  while (!atomic_load(&stop)) {
+    int n = epoll_wait(epoll_fd, events, 64, 100);
+    for (int i = 0; i < n; i++) {
+      while (recv(events[i].data.fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+      }
+    }
+  }
+  return NULL;
+}
+
+static uint64_t segments(const int *fds, size_t n) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fds[i], IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+      total += info.tcpi_data_segs_out;
+  }
+  return total;
+}
+
+static void run(const char *how, bool batched, int nodelay, outq_t **queues,
+                const int *fds, size_t n, size_t burst, frame_t *frame) {
+  for (size_t i = 0; i < n; i++)
+    setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  uint64_t writes = outq_stats().writes;
+  uint64_t segs = segments(fds, n);
+  double start = now();
+  for (int tick = 0; tick < TICKS; tick++) {
+    for (size_t m = 0; m < burst; m++) {
+      for (size_t i = 0; i < n; i++)
+        outq_push_frame(queues[i], frame);
+    }
+    if (batched)
+      outq_batch_flush();
+    // whatever a full socket turned away, outside the comparison
+    for (size_t i = 0; i < n; i++)
+      outq_flush(queues[i]);
+  }
+  double elapsed = now() - start;
+  // the last segments may still sit behind nagle
+  nanosleep(&(struct timespec){.tv_nsec = 100000000}, NULL);
+
+  double frames = (double)TICKS * burst * n;
+  printf("%-6s %-7s burst=%-3zu %6.3f syscalls/msg %6.3f segments/msg "
+         "%8.1f us/tick\n",
+         how, nodelay ? "nodelay" : "nagle", burst,
+         (outq_stats().writes - writes) / frames,
+         (segments(fds, n) - segs) / frames, elapsed * 1e6 / TICKS);
+}
+
+int main(int argc, char **argv) {
+  // the room size can be given on the command line
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 100;
+  size_t bursts[] = {1, 4, 16};
+
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (listen_fd == -1 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, 1024) == -1 ||
+      getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) == -1) {
+    perror("listen");
+    return 1;
+  }
+
+  int epoll_fd = epoll_create1(0);
+  int *fds = calloc(n, sizeof(*fds));
+  outq_t **queues = calloc(n, sizeof(*queues));
+  if (epoll_fd == -1 || !fds || !queues) {
+    perror("setup");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client_fd == -1 ||
+        connect(client_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      perror("connect");
+      return 1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = client_fd};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+
+    fds[i] = accept(listen_fd, NULL, NULL);
+    if (fds[i] == -1 || set_nonblocking(fds[i]) == -1) {
+      perror("accept");
+      return 1;
+    }
+    queues[i] = outq_new(fds[i], OUTQ_DRAIN_OWNER);
+    if (!queues[i]) {
+      perror("outq_new");
+      return 1;
+    }
+  }
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, reader, &epoll_fd);
+
+  // a typical chat line
+  frame_t *frame =
+      frame_new('m', "someone: did anybody see the game last night?");
+  if (!frame) {
+    perror("frame_new");
+    return 1;
+  }
+
+  for (size_t b = 0; b < sizeof(bursts) / sizeof(*bursts); b++) {
+    for (int nodelay = 0; nodelay <= 1; nodelay++) {
+      run("push", false, nodelay, queues, fds, n, bursts[b], frame);
+      outq_batch_begin();
+      run("batch", true, nodelay, queues, fds, n, bursts[b], frame);
+      outq_batch_end();
+    }
+  }
+
+  atomic_store(&stop, true);
+  pthread_join(tid, NULL);
+  return 0;
+}
@@ -0,0 +1,250 @@
+// what a hot restart costs the clients: starts ../main serve with a handover
+// socket, joins a few thousand clients to the lobby, then has one of them say
+// a numbered line every few milliseconds while a second server takes over.
+// every line's latency is measured at every other client, so the worst one
+// is the stall users saw, next to the latency before the handover. lost lines
+// and dropped connections are counted, both should be 0. needs ../main, run
+// from bench/build.sh.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../utils.h"
+
+#define SOCKET_PATH "/tmp/ctalk-bench-handover.sock"
+// one line every this many ms, for TICKS lines, the successor starts halfway
+#define TICK_MS 5
+#define TICKS 400
+
+typedef struct {
+  int fd;
+  char buf[9 + PROTO_SERVER_MAX];
+  size_t len;
+  size_t ticks;
+  double worst;
+  bool gone;
+} client_t;
+
+static double sent_at[TICKS];
+static double handover_at;
+// worst latency of a line sent before the successor started, and of any
+static double worst_before;
+static double worst_after;
+static double total_before;
+static size_t count_before;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t serve(const char *main_path, const char *backend,
+                   const char *port, bool takeover) {
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  if (takeover) {
+    execl(main_path, main_path, "serve", "-b", backend, "-p", port,
+          "--handover", SOCKET_PATH, "--takeover", SOCKET_PATH,
+          "--log-level", "error", (char *)NULL);
+  } else {
+    execl(main_path, main_path, "serve", "-b", backend, "-p", port,
+          "--handover", SOCKET_PATH, "--log-level", "error", (char *)NULL);
+  }
+  perror("exec");
+  _exit(1);
+}
+
+static int dial(uint16_t port) {
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      return fd;
+    close(fd);
+    nanosleep(&(struct timespec){.tv_nsec = 20000000}, NULL);
+  }
+  return -1;
+}
+
+static void say(int fd, const char *text) {
+  char frame[256];
+  uint32_t magic = htonl(PROTO_MAGIC);
+  uint32_t len = htonl((uint32_t)strlen(text));
+  memcpy(frame, &magic, 4);
+  memcpy(frame + 4, &len, 4);
+  memcpy(frame + 8, text, strlen(text));
+  send_all(fd, frame, 8 + strlen(text));
+}
+
+static void on_frame(client_t *c, const char *payload, size_t len) {
+  char text[PROTO_SERVER_MAX + 1];
+  memcpy(text, payload, len);
+  text[len] = '\0';
+  const char *tick = strstr(text, "tick ");
+  if (!tick)
+    return;
+  long k = strtol(tick + 5, NULL, 10);
+  if (k < 0 || k >= TICKS)
+    return;
+
+  double latency = now() - sent_at[k];
+  c->ticks++;
+  if (latency > c->worst)
+    c->worst = latency;
+  if (sent_at[k] < handover_at || handover_at == 0) {
+    total_before += latency;
+    count_before++;
+    if (latency > worst_before)
+      worst_before = latency;
+  } else if (latency > worst_after) {
+    worst_after = latency;
+  }
+}
+
+static void on_readable(int epoll_fd, client_t *c) {
+  while (true) {
+    ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len,
+                     MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      c->gone = true;
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+      return;
+    }
+    c->len += n;
+
+    size_t off = 0;
+    while (c->len - off >= 9) {
+      uint32_t len;
+      memcpy(&len, c->buf + off + 4, 4);
+      len = ntohl(len);
+      if (c->len - off < 9 + len)
+        break;
+      on_frame(c, c->buf + off + 9, len);
+      off += 9 + len;
+    }
+    memmove(c->buf, c->buf + off, c->len - off);
+    c->len -= off;
+  }
+}
+
+// reads whatever arrives for ms milliseconds
+static void pump(int epoll_fd, int ms) {
+  struct epoll_event events[256];
+  double until = now() + ms / 1000.0;
+  while (now() < until) {
+    int wait = (int)((until - now()) * 1000) + 1;
+    int n = epoll_wait(epoll_fd, events, 256, wait);
+    for (int i = 0; i < n; i++)
+      on_readable(epoll_fd, events[i].data.ptr);
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000;
+  const char *backend = argc > 2 ? argv[2] : "epoll";
+  const char *port = argc > 3 ? argv[3] : "18080";
+  const char *main_path = "../main";
+  if (n < 2) {
+    fprintf(stderr, "usage: bench_handover [clients >= 2] [backend] [port]\n");
+    return 1;
+  }
+
+  // clients, and the servers inheriting the limit, need an fd each
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  pid_t old = serve(main_path, backend, port, false);
+  client_t *clients = calloc(n, sizeof(*clients));
+  int epoll_fd = epoll_create1(0);
+  if (!clients || epoll_fd == -1) {
+    perror("setup");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    client_t *c = &clients[i];
+    c->fd = dial((uint16_t)atoi(port));
+    if (c->fd == -1) {
+      perror("connect");
+      kill(old, SIGTERM);
+      return 1;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "u%zu", i);
+    say(c->fd, name);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+  }
+  // the join announcements settle down
+  pump(epoll_fd, 1000);
+
+  pid_t successor = 0;
+  double started = now();
+  for (int k = 0; k < TICKS; k++) {
+    if (k == TICKS / 2) {
+      handover_at = now();
+      successor = serve(main_path, backend, port, true);
+    }
+    char line[32];
+    snprintf(line, sizeof(line), "tick %d", k);
+    sent_at[k] = now();
+    say(clients[0].fd, line);
+    double next = started + (k + 1) * TICK_MS / 1000.0;
+    pump(epoll_fd, (int)((next - now()) * 1000));
+  }
+  pump(epoll_fd, 2000);
+
+  int status;
+  bool exited = waitpid(old, &status, WNOHANG) == old && WIFEXITED(status) &&
+                WEXITSTATUS(status) == 0;
+
+  size_t gone = 0;
+  size_t lost = 0;
+  for (size_t i = 0; i < n; i++) {
+    gone += clients[i].gone;
+    // the speaker does not hear itself
+    if (i > 0)
+      lost += TICKS - clients[i].ticks;
+  }
+  printf("%s, %zu clients: %.2f ms avg / %.2f ms worst latency before, "
+         "%.2f ms worst across the handover, %zu lines lost, %zu "
+         "disconnects, old process %s\n",
+         backend, n, count_before ? total_before / count_before * 1000 : 0,
+         worst_before * 1000, worst_after * 1000, lost, gone,
+         exited ? "exited" : "still running");
+
+  if (successor > 0)
+    kill(successor, SIGTERM);
+  kill(old, SIGTERM);
+  waitpid(successor, NULL, 0);
+  unlink(SOCKET_PATH);
+  return 0;
+}
@@ -0,0 +1,121 @@
+// parse throughput of the incremental frame decoder. a stream of client frames
+// with random lengths is fed through a session sized reader in chunks of
+// varying size, the way recv would hand it over.
+// usage: bench_proto [frames]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../session.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// content lengths are uniform in [0, max_len]
+static char *make_stream(size_t frames, size_t max_len, size_t *stream_len) {
+  char *stream = malloc(frames * (8 + max_len));
+  if (!stream)
+    return NULL;
+
+  size_t off = 0;
+  srand(1);
+  for (size_t i = 0; i < frames; i++) {
+    uint32_t len = rand() % (max_len + 1);
+    uint32_t magic = htonl(PROTO_MAGIC);
+    uint32_t net_len = htonl(len);
+    memcpy(stream + off, &magic, 4);
+    memcpy(stream + off + 4, &net_len, 4);
+    memset(stream + off + 8, 'a' + i % 26, len);
+    off += 8 + len;
+  }
+  *stream_len = off;
+  return stream;
+}
+
+static int run(const char *stream, size_t stream_len, size_t frames,
+               size_t chunk) {
+  static char buf[SESSION_RX_SIZE];
+  proto_reader_t rx;
+  proto_reader_init(&rx, buf, sizeof(buf), false);
+
+  size_t decoded = 0;
+  uint64_t checksum = 0;
+  double start = now();
+  for (size_t off = 0; off < stream_len;) {
+    size_t avail;
+    char *dst = proto_reader_space(&rx, &avail);
+    size_t n = stream_len - off;
+    if (n > chunk)
+      n = chunk;
+    if (n > avail)
+      n = avail;
+    memcpy(dst, stream + off, n);
+    proto_reader_filled(&rx, n);
+    off += n;
+
+    proto_frame_t frame;
+    proto_result_e result;
+    while ((result = proto_next(&rx, &frame)) == PROTO_FRAME) {
+      decoded++;
+      checksum += frame.len ? (unsigned char)frame.content[0] : 0;
+    }
+    if (result != PROTO_NEED_MORE) {
+      fprintf(stderr, "decode error %d at byte %zu\n", result, off);
+      return 1;
+    }
+  }
+  double elapsed = now() - start;
+
+  if (decoded != frames) {
+    fprintf(stderr, "decoded %zu of %zu frames\n", decoded, frames);
+    return 1;
+  }
+  printf("chunk=%-6zu %8.3f s %12.0f frames/s %9.1f MB/s  (sum %llu)\n",
+         chunk, elapsed, frames / elapsed, stream_len / elapsed / 1e6,
+         (unsigned long long)checksum);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t frames = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+  // short chat lines are the common case, up to the largest a session takes
+  size_t max_lens[] = {64, 1023};
+  // single bytes, one small segment, a full MTU, and large reads
+  size_t chunks[] = {1, 100, 1500, 16384, 65536};
+
+  for (size_t m = 0; m < sizeof(max_lens) / sizeof(*max_lens); m++) {
+    size_t stream_len;
+    char *stream = make_stream(frames, max_lens[m], &stream_len);
+    if (!stream) {
+      perror("malloc");
+      return 1;
+    }
+    printf("frames=%zu content=0..%zu bytes\n", frames, max_lens[m]);
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(*chunks); c++) {
+      // one byte at a time is slow, so it gets a tenth of the frames
+      size_t n = chunks[c] == 1 ? frames / 10 : frames;
+      size_t len = stream_len;
+      if (n != frames) {
+        // cut the stream after n frames
+        len = 0;
+        for (size_t i = 0; i < n; i++) {
+          uint32_t flen;
+          memcpy(&flen, stream + len + 4, 4);
+          len += 8 + ntohl(flen);
+        }
+      }
+      if (run(stream, len, n, chunks[c]))
+        return 1;
+    }
+    free(stream);
+  }
+  return 0;
+}
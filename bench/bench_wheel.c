@@ -0,0 +1,110 @@
+// cost of the timer wheel with many armed timers: arming, moving and
+// cancelling n timers, then advancing through simulated minutes where every
+// timer that fires arms itself again, like a heartbeat. the sweep line is what
+// checking every deadline once per tick would cost instead. also checks that
+// no timer fires early, or late by more than two ticks and the loop's jitter.
+// run from bench/build.sh.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../wheel.h"
+
+#define START 1000000
+#define HEARTBEAT_MS 30000
+#define SIMULATED_MS (5 * 60 * 1000)
+
+typedef struct {
+  wheel_timer_t timer;
+  uint64_t deadline;
+} entry_t;
+
+static uint64_t clock_now;
+static wheel_t wheel;
+static size_t fired;
+static size_t wrong;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void expired(wheel_timer_t *timer) {
+  entry_t *entry = (entry_t *)timer;
+  if (clock_now < entry->deadline ||
+      clock_now >= entry->deadline + 3 * WHEEL_TICK_MS)
+    wrong++;
+  fired++;
+  entry->deadline = clock_now + HEARTBEAT_MS;
+  wheel_set(&wheel, &entry->timer, entry->deadline);
+}
+
+static void report(const char *what, size_t ops, double elapsed) {
+  printf("%-8s %10zu ops %8.1f ns/op\n", what, ops, elapsed * 1e9 / ops);
+}
+
+int main(int argc, char **argv) {
+  // the timer count can be given on the command line
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+  entry_t *entries = calloc(n, sizeof(*entries));
+  if (!entries) {
+    perror("calloc");
+    return 1;
+  }
+  srand(1);
+  clock_now = START;
+  wheel_init(&wheel, clock_now);
+
+  double start = now();
+  for (size_t i = 0; i < n; i++) {
+    entries[i].timer.fn = expired;
+    entries[i].deadline = START + 1 + rand() % HEARTBEAT_MS;
+    wheel_set(&wheel, &entries[i].timer, entries[i].deadline);
+  }
+  report("arm", n, now() - start);
+
+  start = now();
+  for (size_t i = 0; i < n; i++) {
+    entries[i].deadline = START + 1 + rand() % HEARTBEAT_MS;
+    wheel_set(&wheel, &entries[i].timer, entries[i].deadline);
+  }
+  report("move", n, now() - start);
+
+  start = now();
+  for (size_t i = 0; i < n; i++)
+    wheel_cancel(&wheel, &entries[i].timer);
+  for (size_t i = 0; i < n; i++)
+    wheel_set(&wheel, &entries[i].timer, entries[i].deadline);
+  report("cancel", 2 * n, now() - start);
+
+  // one advance per tick, with a bit of jitter like a real event loop
+  size_t ticks = 0;
+  start = now();
+  while (clock_now < START + SIMULATED_MS) {
+    clock_now += WHEEL_TICK_MS - 5 + rand() % 10;
+    wheel_advance(&wheel, clock_now);
+    ticks++;
+  }
+  double elapsed = now() - start;
+  report("fire", fired, elapsed);
+  printf("advance  %10zu ticks %8.1f us/tick\n", ticks, elapsed * 1e6 / ticks);
+
+  // the same ticks, looking at every deadline each time
+  size_t due = 0;
+  start = now();
+  for (size_t t = 0; t < ticks; t++) {
+    uint64_t at = START + t * WHEEL_TICK_MS;
+    for (size_t i = 0; i < n; i++)
+      due += entries[i].deadline <= at;
+  }
+  elapsed = now() - start;
+  printf("sweep    %10zu ticks %8.1f us/tick (%zu due)\n", ticks,
+         elapsed * 1e6 / ticks, due);
+
+  printf("%zu fired, %zu early or late\n", fired, wrong);
+  return wrong ? 1 : 0;
+}
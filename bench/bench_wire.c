@@ -0,0 +1,392 @@
+// bytes on the wire per message, protocol v1 against v2, each with and
+// without deflate: replays a chat transcript through ../main serve, every
+// speaker on its own connection, and counts what a listener in the lobby
+// receives for each while the speakers join, talk and leave. the server's
+// deflate metrics give the cpu it spent compressing. a transcript has one
+// "<name>: <text>" line per message, an irc or slack export cut down to that.
+// without one, a fixed mix of 50 speakers and 5000 lines of typical chat
+// lengths stands in. needs ../main, run from bench/build.sh.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../utils.h"
+#include "../zframe.h"
+
+#define MAX_SPEAKERS 500
+#define MAX_LINES 100000
+#define MAX_TEXT 1000
+#define NAME_LEN 32
+
+typedef struct {
+  char name[NAME_LEN + 1];
+  int fd;
+} speaker_t;
+
+typedef struct {
+  int speaker;
+  char *text;
+} line_t;
+
+static speaker_t speakers[MAX_SPEAKERS];
+static int speaker_count;
+static line_t lines[MAX_LINES];
+static size_t line_count;
+
+typedef struct {
+  int fd;
+  proto_reader_t rx;
+  char buf[9 + PROTO_SERVER_MAX];
+  size_t frames;
+  size_t bytes;
+} listener_t;
+
+#define LISTENERS 4
+
+static const char *listener_caps[LISTENERS] = {
+    "",
+    PROTO_CAP_V2,
+    PROTO_CAP_DEFLATE,
+    PROTO_CAP_V2 " " PROTO_CAP_DEFLATE,
+};
+static const char *listener_names[LISTENERS] = {"v1", "v2", "v1+z", "v2+z"};
+static listener_t listeners[LISTENERS];
+// frames that did not inflate back to a frame
+static size_t malformed;
+
+static int speaker_index(const char *name) {
+  for (int i = 0; i < speaker_count; i++) {
+    if (strcmp(speakers[i].name, name) == 0)
+      return i;
+  }
+  if (speaker_count == MAX_SPEAKERS)
+    return -1;
+  snprintf(speakers[speaker_count].name, NAME_LEN + 1, "%s", name);
+  return speaker_count++;
+}
+
+static void add_line(const char *name, const char *text) {
+  int speaker = speaker_index(name);
+  if (speaker == -1 || line_count == MAX_LINES)
+    return;
+  lines[line_count].speaker = speaker;
+  lines[line_count].text = strndup(text, MAX_TEXT);
+  line_count++;
+}
+
+static int load_transcript(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  char buf[4096];
+  while (fgets(buf, sizeof(buf), f)) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    char *sep = strstr(buf, ": ");
+    // commands would be run, not said
+    if (!sep || sep == buf || sep[2] == '\0' || sep[2] == '/')
+      continue;
+    *sep = '\0';
+    char name[NAME_LEN + 1];
+    snprintf(name, sizeof(name), "%.*s", NAME_LEN, buf);
+    add_line(name, sep + 2);
+  }
+  fclose(f);
+  return 0;
+}
+
+// a few talkative speakers and many quiet ones, mostly short lines with the
+// odd paragraph
+static void generate(void) {
+  static const char *names[] = {"ann",   "bob",    "carol",   "dave",
+                                "eve",   "frank",  "grace",   "heidi",
+                                "ivan",  "judy",   "mallory", "oscar",
+                                "peggy", "trent",  "victor",  "walter",
+                                "alex",  "sam",    "kim",     "chris",
+                                "pat",   "robin",  "lee",     "max",
+                                "jo"};
+  static const char *words[] = {
+      "the",    "a",     "is",     "it",     "to",      "and",    "that",
+      "i",      "you",   "we",     "this",   "deploy",  "build",  "ok",
+      "thanks", "lol",   "yes",    "no",     "maybe",   "later",  "test",
+      "works",  "fails", "on",     "my",     "machine", "merged", "review",
+      "please", "can",   "look",   "at",     "branch",  "fixed",  "broken",
+      "again",  "what",  "about",  "meeting", "lunch",  "coffee", "today"};
+  size_t name_count = sizeof(names) / sizeof(*names);
+  size_t word_count = sizeof(words) / sizeof(*words);
+
+  unsigned seed = 42;
+  for (int i = 0; i < 50; i++) {
+    char name[NAME_LEN + 1];
+    snprintf(name, sizeof(name), "%s%d", names[i % name_count], i / 25 + 1);
+    speaker_index(name);
+  }
+  for (int i = 0; i < 5000; i++) {
+    // products of two uniform picks favour the low indexes
+    int speaker = (rand_r(&seed) % 50) * (rand_r(&seed) % 50) / 50;
+    int count = 1 + rand_r(&seed) % 10;
+    if (rand_r(&seed) % 10 == 0)
+      count += 20 + rand_r(&seed) % 40;
+    char text[MAX_TEXT + 1];
+    size_t len = 0;
+    for (int w = 0; w < count && len < MAX_TEXT - 16; w++) {
+      len += snprintf(text + len, sizeof(text) - len, "%s%s", w ? " " : "",
+                      words[rand_r(&seed) % word_count]);
+    }
+    add_line(speakers[speaker].name, text);
+  }
+}
+
+static pid_t serve(const char *port, const char *metrics) {
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  // every notice on its own, so both protocols carry the same events
+  execl("../main", "../main", "serve", "-p", port, "--presence-window", "0",
+        "--metrics", metrics, "--log-level", "error", (char *)NULL);
+  perror("exec");
+  _exit(1);
+}
+
+static int dial(uint16_t port) {
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      return fd;
+    close(fd);
+    nanosleep(&(struct timespec){.tv_nsec = 20000000}, NULL);
+  }
+  return -1;
+}
+
+static void say(int fd, const char *text, size_t len) {
+  char frame[8 + MAX_TEXT + 64];
+  uint32_t magic = htonl(PROTO_MAGIC);
+  uint32_t net_len = htonl((uint32_t)len);
+  memcpy(frame, &magic, 4);
+  memcpy(frame + 4, &net_len, 4);
+  memcpy(frame + 8, text, len);
+  send_all(fd, frame, 8 + len);
+}
+
+static void on_readable(listener_t *l) {
+  size_t avail;
+  char *dst = proto_reader_space(&l->rx, &avail);
+  ssize_t n = recv(l->fd, dst, avail, MSG_DONTWAIT);
+  if (n <= 0)
+    return;
+  proto_reader_filled(&l->rx, n);
+  l->bytes += n;
+
+  proto_frame_t frame;
+  while (proto_next(&l->rx, &frame) == PROTO_FRAME) {
+    l->frames++;
+    char inner[1 + PROTO_SERVER_MAX];
+    if (frame.type == SERVER_DEFLATE) {
+      int len = zframe_inflate(frame.content, frame.len, inner, sizeof(inner));
+      if (len == -1) {
+        malformed++;
+        continue;
+      }
+      frame.type = inner[0];
+    }
+    // the caps reply is the last v1 frame
+    if (frame.type == SERVER_CAPS &&
+        strstr(listener_caps[l - listeners], PROTO_CAP_V2))
+      l->rx.v2 = true;
+  }
+}
+
+static bool pending(size_t want) {
+  for (int i = 0; i < LISTENERS; i++) {
+    if (listeners[i].frames < want)
+      return true;
+  }
+  return false;
+}
+
+// reads until every listener has had want frames since the last report, or
+// nothing arrived for a second. speakers' traffic is dropped.
+static void pump(size_t want) {
+  struct pollfd fds[LISTENERS + MAX_SPEAKERS];
+  char buf[65536];
+  while (pending(want)) {
+    int n = 0;
+    for (int i = 0; i < LISTENERS; i++)
+      fds[n++] = (struct pollfd){.fd = listeners[i].fd, .events = POLLIN};
+    for (int i = 0; i < speaker_count; i++) {
+      if (speakers[i].fd != -1)
+        fds[n++] = (struct pollfd){.fd = speakers[i].fd, .events = POLLIN};
+    }
+    if (poll(fds, n, 1000) <= 0)
+      return;
+    for (int i = 0; i < n; i++) {
+      if (!(fds[i].revents & POLLIN))
+        continue;
+      if (i < LISTENERS)
+        on_readable(&listeners[i]);
+      else
+        recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+    }
+  }
+}
+
+static void reset(void) {
+  for (int i = 0; i < LISTENERS; i++)
+    listeners[i].frames = listeners[i].bytes = 0;
+}
+
+static void report(const char *phase, size_t events, size_t text_bytes) {
+  printf("%-6s %6zu", phase, events);
+  for (int i = 0; i < LISTENERS; i++)
+    printf("  %7.1f", (double)listeners[i].bytes / events);
+  if (text_bytes)
+    printf("  (text %.1f)", (double)text_bytes / events);
+  printf("\n");
+  for (int i = 0; i < LISTENERS; i++) {
+    if (listeners[i].frames != events)
+      printf("  %s: expected %zu frames, got %zu\n", listener_names[i], events,
+             listeners[i].frames);
+  }
+  reset();
+}
+
+// the value of a metric, -1 if the endpoint did not have it
+static double scrape(uint16_t port, const char *name) {
+  int fd = dial(port);
+  if (fd == -1)
+    return -1;
+  static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+  send_all(fd, request, sizeof(request) - 1);
+  static char body[1 << 16];
+  size_t len = 0;
+  ssize_t n;
+  while (len < sizeof(body) - 1 &&
+         (n = recv(fd, body + len, sizeof(body) - 1 - len, 0)) > 0)
+    len += n;
+  close(fd);
+  body[len] = '\0';
+
+  size_t name_len = strlen(name);
+  for (char *line = body; line; line = strchr(line, '\n')) {
+    line += line != body;
+    if (strncmp(line, name, name_len) == 0 && line[name_len] == ' ')
+      return atof(line + name_len + 1);
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  const char *port = argc > 2 ? argv[2] : "18081";
+  if (argc > 1) {
+    if (load_transcript(argv[1]) == -1)
+      return 1;
+    printf("%zu lines by %d speakers from %s\n", line_count, speaker_count,
+           argv[1]);
+  } else {
+    generate();
+    printf("%zu generated lines by %d speakers\n", line_count,
+           speaker_count);
+  }
+  if (line_count == 0) {
+    fprintf(stderr, "usage: bench_wire [transcript] [port]\n");
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  uint16_t port_num = (uint16_t)atoi(port);
+  char metrics[16];
+  snprintf(metrics, sizeof(metrics), "%u", port_num + 1);
+  pid_t server = serve(port, metrics);
+  for (int i = 0; i < LISTENERS; i++) {
+    listener_t *l = &listeners[i];
+    proto_reader_init(&l->rx, l->buf, sizeof(l->buf), true);
+    l->fd = dial(port_num);
+    if (l->fd == -1) {
+      perror("connect");
+      kill(server, SIGTERM);
+      return 1;
+    }
+    if (listener_caps[i][0]) {
+      char caps[64];
+      int len = snprintf(caps, sizeof(caps), "%ccaps %s", PROTO_CONTROL,
+                         listener_caps[i]);
+      say(l->fd, caps, len);
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "~%s", listener_names[i]);
+    say(l->fd, name, strlen(name));
+  }
+  for (int i = 0; i < speaker_count; i++)
+    speakers[i].fd = -1;
+  // prompts, caps replies and each other's joins
+  pump(SIZE_MAX);
+  reset();
+  printf("%-6s %6s", "", "events");
+  for (int i = 0; i < LISTENERS; i++)
+    printf("  %7s", listener_names[i]);
+  printf("  B/event\n");
+
+  for (int i = 0; i < speaker_count; i++) {
+    speakers[i].fd = dial(port_num);
+    if (speakers[i].fd == -1) {
+      perror("connect");
+      kill(server, SIGTERM);
+      return 1;
+    }
+    say(speakers[i].fd, speakers[i].name, strlen(speakers[i].name));
+    pump(i + 1);
+  }
+  report("join", speaker_count, 0);
+
+  size_t text_bytes = 0;
+  for (size_t i = 0; i < line_count; i++) {
+    size_t len = strlen(lines[i].text);
+    say(speakers[lines[i].speaker].fd, lines[i].text, len);
+    text_bytes += len;
+    pump(i + 1);
+  }
+  report("chat", line_count, text_bytes);
+
+  for (int i = 0; i < speaker_count; i++) {
+    close(speakers[i].fd);
+    speakers[i].fd = -1;
+    pump(i + 1);
+  }
+  report("leave", speaker_count, 0);
+
+  double frames = scrape(port_num + 1, "ctalk_deflate_seconds_count");
+  double seconds = scrape(port_num + 1, "ctalk_deflate_seconds_sum");
+  if (frames > 0 && seconds >= 0)
+    printf("deflate: %.0f frames compressed, %.2f us each\n", frames,
+           seconds * 1e6 / frames);
+  if (malformed)
+    printf("%zu malformed deflate frames\n", malformed);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  for (size_t i = 0; i < line_count; i++)
+    free(lines[i].text);
+  return 0;
+}
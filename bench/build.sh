@@ -0,0 +1,10 @@
+cd "$(dirname "$0")"
+clang -std=c23 -O2 -Wall -Wextra -Werror -pedantic -o bench_clients bench_clients.c ../clients.c ../epoch.c ../outq.c ../frame.c ../hist.c ../log.c ../metrics.c ../pool.c ../utils.c ../zframe.c -lpthread -lz
+clang -std=c23 -O2 -Wall -Wextra -Werror -pedantic -o bench_chatlog bench_chatlog.c ../chatlog.c ../outq.c ../frame.c ../hist.c ../log.c ../metrics.c ../pool.c ../utils.c ../zframe.c -lpthread -lz
+clang -std=c23 -O2 -Wall -Wextra -Werror -pedantic -o bench_proto bench_proto.c ../outq.c ../frame.c ../hist.c ../log.c ../metrics.c ../pool.c ../utils.c ../zframe.c -lpthread -lz
+clang -std=c23 -O2 -Wall -Wextra -Werror -pedantic -o bench_channels bench_channels.c ../channels.c ../outq.c ../frame.c ../hist.c ../log.c ../metrics.c ../pool.c ../utils.c ../zframe.c -lpthread -lz
+clang -std=c23 -O2 -Wall -Wextra -Werror -pedantic -o bench_wheel bench_wheel.c ../wheel.c
+clang -std=c23 -O2 -Wall -Wextra -Werror -pedantic -o bench_coalesce bench_coalesce.c ../outq.c ../frame.c ../hist.c ../log.c ../metrics.c ../pool.c ../utils.c ../zframe.c -lpthread -lz
+clang -std=c23 -O2 -Wall -Wextra -Werror -pedantic -o bench_handover bench_handover.c ../outq.c ../frame.c ../hist.c ../log.c ../metrics.c ../pool.c ../utils.c ../zframe.c -lpthread -lz
+clang -std=c23 -O2 -Wall -Wextra -Werror -pedantic -o bench_wire bench_wire.c ../outq.c ../frame.c ../hist.c ../log.c ../metrics.c ../pool.c ../utils.c ../zframe.c -lpthread -lz
+clang -std=c23 -O1 -g -Wall -Wextra -Werror -pedantic -fsanitize=address,undefined -o fuzz_proto fuzz_proto.c ../outq.c ../frame.c ../hist.c ../log.c ../metrics.c ../pool.c ../utils.c ../zframe.c -lpthread -lz
@@ -0,0 +1,309 @@
+// fuzzes the incremental frame decoder. every input is fed through a reader
+// the way recv would hand it over, in chunks of random size, and checked
+// against the same input fed in one piece. the first two bytes of an input
+// pick the framing and the buffer size, the rest is the stream.
+//
+// on its own this runs a seeded random-mutation loop over well-formed and
+// broken streams and reports which decoder results it reached:
+//   usage: fuzz_proto [iterations] [seed]
+// with -DLIBFUZZER it is a libFuzzer target instead: build it with the line
+// in build.sh, plus -DLIBFUZZER and fuzzer in -fsanitize.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../utils.h"
+
+// survives NDEBUG, unlike assert
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      abort();                                                                 \
+    }                                                                          \
+  } while (0)
+
+typedef enum {
+  // client frames, <magic><length> as the server reads them
+  MODE_CLIENT,
+  // server frames <magic><length><type>, switching to v2 after a caps frame
+  // as the join client does
+  MODE_SERVER,
+  // v2 server frames from the first byte
+  MODE_V2,
+  MODES,
+} mode_e;
+
+// buffer sizes from barely a header to a client's receive buffer
+static const size_t caps[] = {9, 16, 64, 1024, 9 + PROTO_SERVER_MAX};
+
+#define MAX_FRAMES 4096
+
+// what a run decoded, to compare chunkings
+typedef struct {
+  size_t frames;
+  char types[MAX_FRAMES];
+  uint32_t lens[MAX_FRAMES];
+  uint64_t sums[MAX_FRAMES];
+  // the result that stopped the run, PROTO_NEED_MORE if the input ran out
+  proto_result_e last;
+  // last is PROTO_ERR_MAGIC from a v2 varint that never ended
+  bool overflow;
+  // the input ran out inside a frame
+  bool truncated;
+} trace_t;
+
+// results reached over all inputs, by result + 2
+static size_t seen[4];
+static size_t seen_overflow;
+static size_t seen_truncated;
+
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+// feeds data through a reader in chunks of at most chunk bytes, or random
+// ones when chunk is 0
+static void run(mode_e mode, size_t cap, const uint8_t *data, size_t size,
+                size_t chunk, trace_t *trace) {
+  static char buf[9 + PROTO_SERVER_MAX];
+  proto_reader_t rx;
+  proto_reader_init(&rx, buf, cap, mode != MODE_CLIENT);
+  rx.v2 = mode == MODE_V2;
+  trace->frames = 0;
+  trace->last = PROTO_NEED_MORE;
+  trace->overflow = false;
+  trace->truncated = false;
+
+  size_t off = 0;
+  while (true) {
+    size_t avail;
+    char *dst = proto_reader_space(&rx, &avail);
+    CHECK(dst == buf + rx.len && rx.off == 0 && rx.len + avail == cap);
+    size_t n = size - off;
+    if (n > avail)
+      n = avail;
+    size_t limit = chunk ? chunk : 1 + rng() % (cap * 2);
+    if (n > limit)
+      n = limit;
+    // a parse always leaves less than a whole frame, so the buffer never
+    // fills up with nothing to decode
+    CHECK(n > 0 || off == size);
+    if (n == 0)
+      break;
+    memcpy(dst, data + off, n);
+    proto_reader_filled(&rx, n);
+    off += n;
+
+    proto_frame_t frame;
+    proto_result_e result;
+    while ((result = proto_next(&rx, &frame)) == PROTO_FRAME) {
+      CHECK(rx.off <= rx.len && rx.len <= cap);
+      // the view lies inside what was received and ends where the next frame
+      // starts
+      CHECK(frame.content >= buf && frame.len <= cap);
+      CHECK(frame.content + frame.len == buf + rx.off);
+      CHECK(mode != MODE_CLIENT || frame.type == 0);
+      if (trace->frames < MAX_FRAMES) {
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < frame.len; i++)
+          sum = sum * 31 + (unsigned char)frame.content[i];
+        trace->types[trace->frames] = frame.type;
+        trace->lens[trace->frames] = frame.len;
+        trace->sums[trace->frames] = sum;
+      }
+      trace->frames++;
+      // the client switches to v2 right after the caps reply
+      if (mode == MODE_SERVER && !rx.v2 && frame.type == SERVER_CAPS)
+        rx.v2 = true;
+    }
+    CHECK(result >= PROTO_ERR_MAGIC && result <= PROTO_FRAME);
+    if (result != PROTO_NEED_MORE) {
+      trace->last = result;
+      // a session closes here, nothing after it is decoded
+      trace->overflow = result == PROTO_ERR_MAGIC && rx.v2;
+      // a v2 header is a varint and the type
+      if (result == PROTO_ERR_TOO_LARGE)
+        CHECK(frame.len > cap - (rx.v2 ? PROTO_VARINT_MAX + 1 : rx.header));
+      return;
+    }
+  }
+  trace->truncated = rx.len > 0;
+}
+
+static void fuzz_one(const uint8_t *data, size_t size) {
+  if (size < 2)
+    return;
+  mode_e mode = data[0] % MODES;
+  size_t cap = caps[data[1] % (sizeof(caps) / sizeof(*caps))];
+  data += 2;
+  size -= 2;
+
+  static trace_t whole, chunked;
+  run(mode, cap, data, size, SIZE_MAX, &whole);
+  run(mode, cap, data, size, 0, &chunked);
+  seen[whole.last + 2]++;
+  seen_overflow += whole.overflow;
+  seen_truncated += whole.truncated;
+
+  // how the bytes were split must not change what comes out
+  CHECK(whole.frames == chunked.frames && whole.last == chunked.last);
+  CHECK(whole.overflow == chunked.overflow);
+  CHECK(whole.truncated == chunked.truncated);
+  size_t kept = whole.frames < MAX_FRAMES ? whole.frames : MAX_FRAMES;
+  for (size_t i = 0; i < kept; i++) {
+    CHECK(whole.types[i] == chunked.types[i]);
+    CHECK(whole.lens[i] == chunked.lens[i]);
+    CHECK(whole.sums[i] == chunked.sums[i]);
+  }
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  rng_state = 0x9e3779b97f4a7c15ull ^ size;
+  fuzz_one(data, size);
+  return 0;
+}
+
+#else
+
+#define MAX_INPUT 16384
+
+typedef struct {
+  uint8_t data[MAX_INPUT];
+  size_t len;
+} input_t;
+
+static void put(input_t *in, const void *bytes, size_t n) {
+  if (n > MAX_INPUT - in->len)
+    n = MAX_INPUT - in->len;
+  memcpy(in->data + in->len, bytes, n);
+  in->len += n;
+}
+
+static void put_v1(input_t *in, mode_e mode, char type, uint32_t len,
+                   const char *content, size_t content_len) {
+  uint32_t magic = htonl(PROTO_MAGIC);
+  uint32_t net_len = htonl(len);
+  put(in, &magic, 4);
+  put(in, &net_len, 4);
+  if (mode != MODE_CLIENT)
+    put(in, &type, 1);
+  put(in, content, content_len);
+}
+
+static void put_v2(input_t *in, char type, uint64_t len, const char *content,
+                   size_t content_len) {
+  char varint[10];
+  put(in, varint, proto_put_varint(varint, len));
+  put(in, &type, 1);
+  put(in, content, content_len);
+}
+
+// a well-formed stream of a few frames in mode's framing
+static void seed(input_t *in, mode_e mode) {
+  static const char text[] = "hello there, general kenobi";
+  in->data[0] = mode;
+  in->data[1] = rng();
+  in->len = 2;
+  if (mode == MODE_SERVER)
+    put_v1(in, mode, SERVER_CAPS, 2, "v2", 2);
+  int frames = 1 + rng() % 8;
+  for (int i = 0; i < frames; i++) {
+    size_t len = rng() % sizeof(text);
+    if (mode == MODE_CLIENT)
+      put_v1(in, mode, 0, len, text, len);
+    else
+      put_v2(in, "mpCJ"[i % 4], len, text, len);
+  }
+}
+
+static void mutate(input_t *in) {
+  size_t at = 2 + (in->len > 2 ? rng() % (in->len - 2) : 0);
+  switch (rng() % 8) {
+  case 0:
+    // flip a bit, often in a header
+    if (at < in->len)
+      in->data[at] ^= 1 << (rng() % 8);
+    break;
+  case 1: {
+    // a byte that sits on a boundary of some check
+    static const uint8_t edges[] = {0x00, 0x01, 0x7f, 0x80, 0xff};
+    if (at < in->len)
+      in->data[at] = edges[rng() % sizeof(edges)];
+    break;
+  }
+  case 2:
+    // cut the stream short, most likely inside a frame
+    in->len = at;
+    break;
+  case 3: {
+    // a v1 length far past any buffer
+    uint32_t len = htonl(rng() % 2 ? UINT32_MAX : (uint32_t)rng());
+    if (at + 4 <= in->len)
+      memcpy(in->data + at, &len, 4);
+    break;
+  }
+  case 4: {
+    // a varint that does not end within PROTO_VARINT_MAX bytes
+    size_t n = PROTO_VARINT_MAX + rng() % 4;
+    for (size_t i = 0; i < n && at + i < in->len; i++)
+      in->data[at + i] = 0x80 | rng();
+    break;
+  }
+  case 5: {
+    // the magic where a frame does not start
+    uint32_t magic = htonl(PROTO_MAGIC);
+    if (at + 4 <= in->len)
+      memcpy(in->data + at, &magic, 4);
+    break;
+  }
+  case 6:
+    // garbage appended
+    for (int i = rng() % 16; i > 0 && in->len < MAX_INPUT; i--)
+      in->data[in->len++] = rng();
+    break;
+  case 7:
+    // another framing or buffer size for the same bytes
+    in->data[rng() % 2] = rng();
+    break;
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t iterations = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+  rng_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+  if (rng_state == 0)
+    rng_state = 1;
+
+  static input_t in;
+  for (size_t i = 0; i < iterations; i++) {
+    seed(&in, rng() % MODES);
+    for (int m = rng() % 4; m > 0; m--)
+      mutate(&in);
+    fuzz_one(in.data, in.len);
+  }
+
+  printf("%zu inputs: %zu clean, %zu bad magic, %zu varint overflows, %zu too "
+         "large, %zu truncated\n",
+         iterations, seen[PROTO_NEED_MORE + 2],
+         seen[PROTO_ERR_MAGIC + 2] - seen_overflow, seen_overflow,
+         seen[PROTO_ERR_TOO_LARGE + 2], seen_truncated);
+  // every error path has to have been reached
+  CHECK(seen[PROTO_ERR_MAGIC + 2] > seen_overflow && seen_overflow > 0);
+  CHECK(seen[PROTO_ERR_TOO_LARGE + 2] > 0 && seen_truncated > 0);
+  return 0;
+}
+
+#endif // LIBFUZZER
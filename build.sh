@@ -1,2 +1,2 @@
-clang -std=c23 -Wall -Wextra -Werror -pedantic -o main main.c client.c server.c utils.c -lpthread -lreadline
+clang -std=c23 -Wall -Wextra -Werror -pedantic -o main main.c bench.c client.c server.c reactor.c mpsc.c uring.c clients.c channels.c history.c chatlog.c epoch.c outq.c frame.c hist.c log.c metrics.c pool.c utils.c wheel.c federation.c handover.c presence.c event.c zframe.c -lpthread -lreadline -lz "$@"
 
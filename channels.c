@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channels.h"
+
+typedef struct {
+  pthread_mutex_t mu;
+  // written under mu, read without it as a hint
+  atomic_size_t len;
+  size_t cap;
+  client_ctx_t **members;
+} slot_t;
+
+struct channel {
+  atomic_int refs;
+  atomic_size_t members;
+  char name[MAX_CHANNEL_LEN + 1];
+  // registry list, sorted by name
+  channel_t *next;
+  slot_t slots[];
+};
+
+static int slot_count;
+static channel_t *lobby;
+// the registry is only walked on join, part and /channels
+static channel_t *channels;
+static pthread_mutex_t channels_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static channel_t *channel_new(const char *name) {
+  channel_t *channel =
+      calloc(1, sizeof(*channel) + slot_count * sizeof(channel->slots[0]));
+  if (!channel)
+    return NULL;
+  atomic_init(&channel->refs, 1);
+  strncpy(channel->name, name, MAX_CHANNEL_LEN);
+  for (int i = 0; i < slot_count; i++)
+    pthread_mutex_init(&channel->slots[i].mu, NULL);
+  return channel;
+}
+
+static void channel_free(channel_t *channel) {
+  for (int i = 0; i < slot_count; i++) {
+    pthread_mutex_destroy(&channel->slots[i].mu);
+    free(channel->slots[i].members);
+  }
+  free(channel);
+}
+
+int channels_configure(int slots) {
+  slot_count = slots > 0 ? slots : 1;
+  lobby = channel_new(CHANNELS_LOBBY);
+  if (!lobby)
+    return errno;
+  // pinned by the extra reference, the lobby never goes away
+  channels = lobby;
+  return 0;
+}
+
+channel_t *channels_lobby(void) { return lobby; }
+
+void channels_get(channel_t *channel) {
+  atomic_fetch_add_explicit(&channel->refs, 1, memory_order_relaxed);
+}
+
+void channels_put(channel_t *channel) {
+  if (atomic_fetch_sub_explicit(&channel->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  // a join may already have replaced the entry with a fresh channel
+  pthread_mutex_lock(&channels_mu);
+  for (channel_t **link = &channels; *link; link = &(*link)->next) {
+    if (*link == channel) {
+      *link = channel->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&channels_mu);
+  channel_free(channel);
+}
+
+// finds the named channel, or creates it if create is set, and takes a
+// reference on it
+static channel_t *channel_acquire(const char *name, bool create) {
+  pthread_mutex_lock(&channels_mu);
+  channel_t **link = &channels;
+  int cmp = 1;
+  while (*link && (cmp = strcmp((*link)->name, name)) < 0)
+    link = &(*link)->next;
+
+  channel_t *channel = NULL;
+  if (cmp == 0) {
+    // a channel whose last reference is being dropped counts as gone
+    channel_t *found = *link;
+    int refs = atomic_load(&found->refs);
+    while (refs > 0 &&
+           !atomic_compare_exchange_weak(&found->refs, &refs, refs + 1))
+      ;
+    if (refs > 0) {
+      channel = found;
+    } else {
+      *link = found->next;
+    }
+  }
+
+  if (!channel && create) {
+    channel = channel_new(name);
+    if (channel) {
+      channel->next = *link;
+      *link = channel;
+    }
+  }
+  pthread_mutex_unlock(&channels_mu);
+  return channel;
+}
+
+channel_t *channels_find(const char *name) {
+  return channel_acquire(name, false);
+}
+
+static int slot_add(slot_t *slot, client_ctx_t *ctx) {
+  pthread_mutex_lock(&slot->mu);
+  size_t len = atomic_load_explicit(&slot->len, memory_order_relaxed);
+  if (len == slot->cap) {
+    size_t cap = slot->cap ? slot->cap * 2 : 8;
+    client_ctx_t **members = realloc(slot->members, cap * sizeof(*members));
+    if (!members) {
+      pthread_mutex_unlock(&slot->mu);
+      return ENOMEM;
+    }
+    slot->members = members;
+    slot->cap = cap;
+  }
+  ctx->channel_pos = len;
+  slot->members[len] = ctx;
+  atomic_store_explicit(&slot->len, len + 1, memory_order_relaxed);
+  pthread_mutex_unlock(&slot->mu);
+  return 0;
+}
+
+static void slot_remove(slot_t *slot, client_ctx_t *ctx) {
+  pthread_mutex_lock(&slot->mu);
+  // the last member takes the hole, so the array stays dense
+  size_t last = atomic_load_explicit(&slot->len, memory_order_relaxed) - 1;
+  client_ctx_t *moved = slot->members[last];
+  slot->members[ctx->channel_pos] = moved;
+  moved->channel_pos = ctx->channel_pos;
+  atomic_store_explicit(&slot->len, last, memory_order_relaxed);
+  pthread_mutex_unlock(&slot->mu);
+}
+
+int channels_join(client_ctx_t *ctx, const char *name) {
+  channel_t *channel = channel_acquire(name, true);
+  if (!channel)
+    return ENOMEM;
+  if (channel == ctx->channel) {
+    channels_put(channel);
+    return 0;
+  }
+
+  // one position field per client, so it leaves before it joins
+  channels_part(ctx);
+  int err = slot_add(&channel->slots[ctx->slot], ctx);
+  if (err) {
+    channels_put(channel);
+    return err;
+  }
+  atomic_fetch_add(&channel->members, 1);
+  ctx->channel = channel;
+  return 0;
+}
+
+void channels_part(client_ctx_t *ctx) {
+  channel_t *channel = ctx->channel;
+  if (!channel)
+    return;
+  ctx->channel = NULL;
+  slot_remove(&channel->slots[ctx->slot], ctx);
+  atomic_fetch_sub(&channel->members, 1);
+  channels_put(channel);
+}
+
+const char *channels_name(const channel_t *channel) { return channel->name; }
+
+size_t channels_members(const channel_t *channel, int slot) {
+  return atomic_load_explicit(&channel->slots[slot].len, memory_order_relaxed);
+}
+
+void channels_each(channel_t *channel, int slot,
+                   void (*fn)(client_ctx_t *ctx, void *arg), void *arg) {
+  slot_t *s = &channel->slots[slot];
+  pthread_mutex_lock(&s->mu);
+  size_t len = atomic_load_explicit(&s->len, memory_order_relaxed);
+  for (size_t i = 0; i < len; i++)
+    fn(s->members[i], arg);
+  pthread_mutex_unlock(&s->mu);
+}
+
+size_t channels_list(channel_info_t *out, size_t cap) {
+  size_t count = 0;
+  pthread_mutex_lock(&channels_mu);
+  for (channel_t *channel = channels; channel; channel = channel->next) {
+    if (atomic_load(&channel->refs) == 0)
+      continue;
+    if (count < cap) {
+      memcpy(out[count].name, channel->name, sizeof(channel->name));
+      out[count].members = atomic_load(&channel->members);
+    }
+    count++;
+  }
+  pthread_mutex_unlock(&channels_mu);
+  return count;
+}
+
+bool channels_valid_name(const char *name) {
+  size_t len = strlen(name);
+  if (len == 0 || len > MAX_CHANNEL_LEN)
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    char c = name[i];
+    if (!(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') &&
+        !(c >= '0' && c <= '9') && c != '-' && c != '_')
+      return false;
+  }
+  return true;
+}
@@ -0,0 +1,57 @@
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include <stddef.h>
+
+#include "session.h"
+
+// named rooms. every joined client is in exactly one channel, the lobby until
+// it joins another. each channel keeps its members in one compact array per
+// slot, and a backend gives every event loop its own slot, so fan-out only
+// walks the members of one channel that the calling loop owns.
+
+#define MAX_CHANNEL_LEN 32
+#define CHANNELS_LOBBY "lobby"
+
+typedef struct channel channel_t;
+
+// creates the lobby, must run before the first join
+int channels_configure(int slots);
+channel_t *channels_lobby(void);
+
+// moves ctx from its current channel, if any, into the named one, creating
+// it on first use. only the thread that owns ctx may move it. returns 0, or
+// an errno value with ctx left in no channel at all.
+int channels_join(client_ctx_t *ctx, const char *name);
+// takes ctx out of its channel, the channel goes away with its last member
+void channels_part(client_ctx_t *ctx);
+
+// references for callers that hold a channel past its members, like a
+// broadcast handed to another thread
+void channels_get(channel_t *channel);
+void channels_put(channel_t *channel);
+
+// the named channel with a reference taken, NULL if nobody is in it
+channel_t *channels_find(const char *name);
+
+const char *channels_name(const channel_t *channel);
+// only a hint, members may come and go right after
+size_t channels_members(const channel_t *channel, int slot);
+
+// calls fn for every member of channel in slot. fn runs with the slot locked
+// and must not join or part.
+void channels_each(channel_t *channel, int slot,
+                   void (*fn)(client_ctx_t *ctx, void *arg), void *arg);
+
+typedef struct {
+  char name[MAX_CHANNEL_LEN + 1];
+  size_t members;
+} channel_info_t;
+
+// copies up to cap channels, sorted by name, and returns how many there are
+size_t channels_list(channel_info_t *out, size_t cap);
+
+// letters, digits, '-' and '_', at most MAX_CHANNEL_LEN of them
+bool channels_valid_name(const char *name);
+
+#endif // CHANNELS_H
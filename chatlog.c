@@ -0,0 +1,622 @@
+// ftruncate, posix_fallocate and friends are hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chatlog.h"
+#include "utils.h"
+
+// record: <length: 4><checksum: 4><type: 1><content>, padded to 4 bytes.
+// segments are preallocated with zeros, so a zero length ends the data.
+#define RECORD_HEADER 8
+#define RECORD_ALIGN 4
+// how long batch mode lets appends pile up before syncing them together
+#define COMMIT_INTERVAL_MS 5
+
+typedef struct segment {
+  // guarded by log_mu, the committer holds one while it syncs unlocked
+  int refs;
+  int fd;
+  uint64_t first_seq;
+  char *map;
+  size_t size;
+  size_t used;
+  // prefix of the segment known to be on disk
+  size_t synced;
+  time_t created;
+  // next in the retiring list
+  struct segment *next;
+} segment_t;
+
+static chatlog_options_t options;
+static bool enabled;
+
+static pthread_mutex_t log_mu = PTHREAD_MUTEX_INITIALIZER;
+// wakes the committer
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+// wakes appenders waiting for durability
+static pthread_cond_t synced_cond = PTHREAD_COND_INITIALIZER;
+static segment_t *current;
+static uint64_t next_seq;
+// every record before this one is durable
+static uint64_t synced_seq;
+static bool stopping;
+static bool committer_running;
+static pthread_t committer;
+
+// the next segment, created ahead by the committer under a temporary name so
+// a rotation on an appender's thread only swaps pointers
+static segment_t *spare;
+// the committer owes a new spare
+static bool spare_wanted;
+// the spare was taken for the records from rename_seq on and still has the
+// temporary name. none of them counts as synced until the committer renamed it.
+static bool rename_pending;
+static uint64_t rename_seq;
+// rotated out segments the committer still has to sync and seal, oldest first
+static segment_t *retiring;
+static segment_t **retiring_tail = &retiring;
+
+// sealed segments still on disk, oldest first
+static uint64_t *sealed;
+static size_t sealed_len;
+static size_t sealed_cap;
+
+// RECORDS
+
+static uint32_t checksum(const char *data, size_t len) {
+  // fnv-1a, enough to spot a torn write at the tail
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static size_t record_size(size_t len) {
+  return (RECORD_HEADER + len + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+typedef void (*visit_fn)(const char *data, uint32_t len, void *arg);
+
+// walks valid records from the start, returns where the data ends
+static size_t scan(const char *map, size_t size, visit_fn visit, void *arg,
+                   uint64_t *count) {
+  size_t off = 0;
+  *count = 0;
+  while (off + RECORD_HEADER <= size) {
+    uint32_t len, check;
+    memcpy(&len, map + off, 4);
+    memcpy(&check, map + off + 4, 4);
+    if (len == 0 || record_size(len) > size - off)
+      break;
+    const char *data = map + off + RECORD_HEADER;
+    if (checksum(data, len) != check)
+      break;
+
+    if (visit)
+      visit(data, len, arg);
+    (*count)++;
+    off += record_size(len);
+  }
+  return off;
+}
+
+// SEGMENTS
+
+static void segment_path(char *out, size_t out_len, uint64_t first_seq) {
+  snprintf(out, out_len, "%s/%020" PRIu64 ".seg", options.dir, first_seq);
+}
+
+// not a segment name, so a crash before the rename leaves nothing to recover
+static void spare_path(char *out, size_t out_len) {
+  snprintf(out, out_len, "%s/spare.seg.tmp", options.dir);
+}
+
+static void segment_put(segment_t *seg) {
+  if (--seg->refs > 0)
+    return;
+  munmap(seg->map, seg->size);
+  close(seg->fd);
+  free(seg);
+}
+
+static segment_t *segment_map(int fd, uint64_t first_seq, size_t size,
+                              int prot) {
+  segment_t *seg = calloc(1, sizeof(*seg));
+  if (!seg)
+    return NULL;
+  seg->map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (seg->map == MAP_FAILED) {
+    free(seg);
+    return NULL;
+  }
+  seg->refs = 1;
+  seg->fd = fd;
+  seg->first_seq = first_seq;
+  seg->size = size;
+  seg->created = time(NULL);
+  return seg;
+}
+
+static segment_t *segment_create(const char *path, uint64_t first_seq) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    log_perror(NULL, "chatlog: open");
+    return NULL;
+  }
+
+  // reserve the blocks up front so appends never hit ENOSPC through a fault
+  int err = posix_fallocate(fd, 0, options.segment_size);
+  if (err) {
+    errno = err;
+    log_perror(NULL, "chatlog: fallocate");
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+
+  segment_t *seg =
+      segment_map(fd, first_seq, options.segment_size, PROT_READ | PROT_WRITE);
+  if (!seg) {
+    log_perror(NULL, "chatlog: mmap");
+    close(fd);
+    unlink(path);
+  }
+  return seg;
+}
+
+static void segment_sync(segment_t *seg, size_t from, size_t to) {
+  static size_t page;
+  if (!page)
+    page = sysconf(_SC_PAGESIZE);
+
+  size_t start = from & ~(page - 1);
+  if (to > start && msync(seg->map + start, to - start, MS_SYNC) == -1)
+    log_perror(NULL, "chatlog: msync");
+}
+
+static int sealed_push(uint64_t first_seq) {
+  if (sealed_len == sealed_cap) {
+    size_t cap = sealed_cap ? sealed_cap * 2 : 16;
+    uint64_t *list = realloc(sealed, cap * sizeof(*list));
+    if (!list)
+      return -1;
+    sealed = list;
+    sealed_cap = cap;
+  }
+  sealed[sealed_len++] = first_seq;
+  return 0;
+}
+
+// compaction: history only ever needs the newest records, so whole segments
+// past the retention limit are dropped
+static void sealed_trim(void) {
+  size_t drop = sealed_len > (size_t)options.retain
+                    ? sealed_len - (size_t)options.retain
+                    : 0;
+  for (size_t i = 0; i < drop; i++) {
+    char path[4096];
+    segment_path(path, sizeof(path), sealed[i]);
+    if (unlink(path) == -1)
+      log_perror(NULL, "chatlog: unlink");
+  }
+  memmove(sealed, sealed + drop, (sealed_len - drop) * sizeof(*sealed));
+  sealed_len -= drop;
+}
+
+// makes a rotated out segment durable, shrinks the file to the bytes actually
+// used and drops segments past the retention limit. nothing else can reach
+// seg anymore, so this runs without log_mu.
+static void segment_seal(segment_t *seg) {
+  if (options.sync != CHATLOG_SYNC_NONE)
+    segment_sync(seg, seg->synced, seg->used);
+  // a smaller than configured file marks the segment as sealed on restart
+  if (ftruncate(seg->fd, seg->used) == -1)
+    log_perror(NULL, "chatlog: ftruncate");
+  if (sealed_push(seg->first_seq) == 0)
+    sealed_trim();
+  segment_put(seg);
+}
+
+// called with log_mu held. swaps in the spare and leaves the old segment to
+// the committer, so an append never waits on the disk here. only without a
+// spare, when the committer fell behind, is the next segment created inline.
+static int rotate(void) {
+  segment_t *seg = spare;
+  if (seg) {
+    spare = NULL;
+    rename_pending = true;
+    rename_seq = next_seq;
+    seg->first_seq = next_seq;
+    seg->created = time(NULL);
+  } else {
+    char path[4096];
+    segment_path(path, sizeof(path), next_seq);
+    seg = segment_create(path, next_seq);
+    if (!seg)
+      return errno ? errno : EIO;
+  }
+
+  current->next = NULL;
+  *retiring_tail = current;
+  retiring_tail = &current->next;
+  current = seg;
+  spare_wanted = true;
+  pthread_cond_signal(&commit_cond);
+  return 0;
+}
+
+// COMMITTER
+
+// called with log_mu held
+static bool commit_pending(void) {
+  return (spare_wanted && !stopping) || rename_pending || retiring ||
+         (options.sync != CHATLOG_SYNC_NONE && synced_seq != next_seq);
+}
+
+static void *commit_run(void *) {
+  pthread_mutex_lock(&log_mu);
+  while (true) {
+    while (!stopping && !commit_pending())
+      pthread_cond_wait(&commit_cond, &log_mu);
+    if (!commit_pending())
+      break;
+
+    if (options.sync == CHATLOG_SYNC_BATCH && !stopping && !rename_pending &&
+        !retiring) {
+      // let more appends land so one sync covers all of them
+      struct timespec deadline;
+      timespec_get(&deadline, TIME_UTC);
+      deadline.tv_nsec += COMMIT_INTERVAL_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&commit_cond, &log_mu, &deadline);
+    }
+
+    bool renaming = rename_pending;
+    uint64_t first_seq = rename_seq;
+    rename_pending = false;
+    segment_t *sealing = retiring;
+    retiring = NULL;
+    retiring_tail = &retiring;
+    // the temporary name is free once the taken spare is renamed below, and
+    // no rotation can take another one before this thread makes it
+    bool make_spare = spare_wanted && !spare && !stopping;
+    spare_wanted = false;
+    segment_t *seg = current;
+    seg->refs++;
+    uint64_t target = next_seq;
+    size_t from = seg->synced;
+    size_t to = seg->used;
+    pthread_mutex_unlock(&log_mu);
+
+    if (renaming) {
+      char from_path[4096], to_path[4096];
+      spare_path(from_path, sizeof(from_path));
+      segment_path(to_path, sizeof(to_path), first_seq);
+      if (rename(from_path, to_path) == -1)
+        log_perror(NULL, "chatlog: rename");
+    }
+    while (sealing) {
+      segment_t *next = sealing->next;
+      segment_seal(sealing);
+      sealing = next;
+    }
+    if (options.sync != CHATLOG_SYNC_NONE)
+      segment_sync(seg, from, to);
+    segment_t *fresh = NULL;
+    if (make_spare) {
+      char path[4096];
+      spare_path(path, sizeof(path));
+      fresh = segment_create(path, 0);
+    }
+
+    pthread_mutex_lock(&log_mu);
+    if (to > seg->synced)
+      seg->synced = to;
+    segment_put(seg);
+    if (fresh)
+      spare = fresh;
+    if (target > synced_seq)
+      synced_seq = target;
+    pthread_cond_broadcast(&synced_cond);
+  }
+  pthread_mutex_unlock(&log_mu);
+  return NULL;
+}
+
+// RECOVERY
+
+static int compare_seq(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// first sequence numbers of every segment in the directory, sorted
+static int list_segments(uint64_t **out, size_t *out_len) {
+  DIR *dir = opendir(options.dir);
+  if (!dir)
+    return errno;
+
+  uint64_t *list = NULL;
+  size_t len = 0, cap = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    char *end;
+    uint64_t seq = strtoull(entry->d_name, &end, 10);
+    if (end != entry->d_name + 20 || strcmp(end, ".seg") != 0)
+      continue;
+    if (len == cap) {
+      cap = cap ? cap * 2 : 16;
+      uint64_t *grown = realloc(list, cap * sizeof(*list));
+      if (!grown) {
+        free(list);
+        closedir(dir);
+        return ENOMEM;
+      }
+      list = grown;
+    }
+    list[len++] = seq;
+  }
+  closedir(dir);
+
+  if (len)
+    qsort(list, len, sizeof(*list), compare_seq);
+  *out = list;
+  *out_len = len;
+  return 0;
+}
+
+static segment_t *segment_open(uint64_t first_seq, int flags) {
+  char path[4096];
+  segment_path(path, sizeof(path), first_seq);
+  int fd = open(path, flags | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  int prot = flags == O_RDWR ? PROT_READ | PROT_WRITE : PROT_READ;
+  segment_t *seg = segment_map(fd, first_seq, st.st_size, prot);
+  if (!seg)
+    close(fd);
+  return seg;
+}
+
+typedef struct {
+  uint64_t skip;
+  void (*replay)(frame_t *frame);
+} replay_ctx_t;
+
+static void replay_record(const char *data, uint32_t len, void *arg) {
+  replay_ctx_t *ctx = arg;
+  if (ctx->skip > 0) {
+    ctx->skip--;
+    return;
+  }
+  frame_t *frame = frame_new_len(data[0], data + 1, len - 1);
+  if (!frame)
+    return;
+  ctx->replay(frame);
+  frame_put(frame);
+}
+
+// replays the newest records, mapping segments from the tail back only until
+// enough records are found
+static void recover_history(uint64_t *segs, size_t count, size_t replay_max,
+                            void (*replay)(frame_t *frame)) {
+  if (replay_max == 0 || count == 0)
+    return;
+
+  // the number of records in a sealed segment is the gap to the next one
+  uint64_t tail_records = 0;
+  segment_t *last = segment_open(segs[count - 1], O_RDONLY);
+  if (last) {
+    scan(last->map, last->size, NULL, NULL, &tail_records);
+    segment_put(last);
+  }
+
+  size_t first = count - 1;
+  uint64_t total = tail_records;
+  while (first > 0 && total < replay_max) {
+    first--;
+    total += segs[first + 1] - segs[first];
+  }
+
+  replay_ctx_t ctx = {
+      .skip = total > replay_max ? total - replay_max : 0,
+      .replay = replay,
+  };
+  for (size_t i = first; i < count; i++) {
+    segment_t *seg = segment_open(segs[i], O_RDONLY);
+    if (!seg)
+      continue;
+    uint64_t records;
+    scan(seg->map, seg->size, replay_record, &ctx, &records);
+    segment_put(seg);
+  }
+}
+
+// reopens the newest segment for appending if it was never sealed
+static int resume_tail(uint64_t *segs, size_t count) {
+  next_seq = 0;
+  if (count > 0) {
+    uint64_t first_seq = segs[count - 1];
+    segment_t *seg = segment_open(first_seq, O_RDWR);
+    if (seg && seg->size == options.segment_size) {
+      uint64_t records;
+      seg->used = scan(seg->map, seg->size, NULL, NULL, &records);
+      seg->synced = seg->used;
+      // whatever follows a torn record must not be mistaken for data later
+      memset(seg->map + seg->used, 0, seg->size - seg->used);
+      current = seg;
+      next_seq = first_seq + records;
+      count--;
+    } else if (seg) {
+      uint64_t records;
+      scan(seg->map, seg->size, NULL, NULL, &records);
+      next_seq = first_seq + records;
+      segment_put(seg);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (sealed_push(segs[i]) == -1)
+      return ENOMEM;
+  }
+  sealed_trim();
+
+  if (!current) {
+    char path[4096];
+    segment_path(path, sizeof(path), next_seq);
+    current = segment_create(path, next_seq);
+    if (!current)
+      return errno ? errno : EIO;
+  }
+  synced_seq = next_seq;
+  return 0;
+}
+
+// API
+
+int chatlog_open(chatlog_options_t opts, size_t replay_max,
+                 void (*replay)(frame_t *frame)) {
+  options = opts;
+  if (options.segment_size < CHATLOG_MIN_SEGMENT_SIZE)
+    options.segment_size = CHATLOG_MIN_SEGMENT_SIZE;
+  if (options.retain < 0)
+    options.retain = 0;
+
+  if (mkdir(options.dir, 0755) == -1 && errno != EEXIST) {
+    int saved = errno;
+    log_perror(NULL, "chatlog: mkdir");
+    return saved;
+  }
+
+  uint64_t *segs = NULL;
+  size_t count = 0;
+  int err = list_segments(&segs, &count);
+  if (err) {
+    log_err(NULL, "chatlog: cannot list %s: %s\n", options.dir, strerror(err));
+    return err;
+  }
+
+  recover_history(segs, count, replay_max, replay);
+  err = resume_tail(segs, count);
+  free(segs);
+  if (err)
+    return err;
+  log_info(NULL, "chat log in %s, next record %" PRIu64 "\n", options.dir,
+           next_seq);
+
+  // even without syncing, the committer prepares and seals segments
+  spare_wanted = true;
+  err = pthread_create(&committer, NULL, commit_run, NULL);
+  if (err) {
+    log_err(NULL, "pthread_create: %s\n", strerror(err));
+    return err;
+  }
+  committer_running = true;
+  enabled = true;
+  return 0;
+}
+
+int chatlog_append(frame_t *frame) {
+  if (!enabled)
+    return 0;
+
+  size_t len = 1 + frame->len;
+  size_t size = record_size(len);
+
+  pthread_mutex_lock(&log_mu);
+  if (!current || size > current->size) {
+    pthread_mutex_unlock(&log_mu);
+    return EMSGSIZE;
+  }
+
+  bool expired = current->used > 0 &&
+                 time(NULL) - current->created >= options.segment_age;
+  if (current->used + size > current->size || expired) {
+    int err = rotate();
+    if (err) {
+      pthread_mutex_unlock(&log_mu);
+      return err;
+    }
+  }
+
+  char *record = current->map + current->used;
+  uint32_t len32 = (uint32_t)len;
+  record[RECORD_HEADER] = frame->type;
+  memcpy(record + RECORD_HEADER + 1, frame->payload, frame->len);
+  uint32_t check = checksum(record + RECORD_HEADER, len);
+  memcpy(record + 4, &check, 4);
+  memcpy(record, &len32, 4);
+  current->used += size;
+  uint64_t seq = next_seq++;
+
+  // in batch mode only the first unsynced record has to wake the committer
+  if (options.sync == CHATLOG_SYNC_ALWAYS ||
+      (options.sync == CHATLOG_SYNC_BATCH && seq == synced_seq)) {
+    pthread_cond_signal(&commit_cond);
+  }
+  if (options.sync == CHATLOG_SYNC_ALWAYS) {
+    while (synced_seq <= seq && committer_running)
+      pthread_cond_wait(&synced_cond, &log_mu);
+  }
+  pthread_mutex_unlock(&log_mu);
+  return 0;
+}
+
+void chatlog_close(void) {
+  if (!enabled)
+    return;
+
+  pthread_mutex_lock(&log_mu);
+  enabled = false;
+  stopping = true;
+  pthread_cond_signal(&commit_cond);
+  pthread_mutex_unlock(&log_mu);
+  if (committer_running) {
+    pthread_join(committer, NULL);
+    committer_running = false;
+  }
+
+  pthread_mutex_lock(&log_mu);
+  if (current) {
+    if (options.sync != CHATLOG_SYNC_NONE)
+      segment_sync(current, current->synced, current->used);
+    segment_put(current);
+    current = NULL;
+  }
+  if (spare) {
+    char path[4096];
+    spare_path(path, sizeof(path));
+    unlink(path);
+    segment_put(spare);
+    spare = NULL;
+  }
+  spare_wanted = false;
+  free(sealed);
+  sealed = NULL;
+  sealed_len = sealed_cap = 0;
+  stopping = false;
+  pthread_mutex_unlock(&log_mu);
+}
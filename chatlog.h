@@ -0,0 +1,49 @@
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#include <stddef.h>
+
+#include "frame.h"
+
+// append-only on-disk log of broadcast chat frames, split into fixed-size
+// memory-mapped segments named after the sequence number of their first
+// record. a restart maps only the newest segments to rebuild the history.
+
+typedef enum {
+  // never sync explicitly, leave it to kernel writeback
+  CHATLOG_SYNC_NONE,
+  // a committer thread syncs whatever accumulated every few milliseconds
+  CHATLOG_SYNC_BATCH,
+  // appends wait until they are durable, concurrent appends share one sync.
+  // only for the threaded backend, on an event loop the wait would hold up
+  // every client of the loop
+  CHATLOG_SYNC_ALWAYS,
+} chatlog_sync_e;
+
+typedef struct {
+  const char *dir;
+  chatlog_sync_e sync;
+  size_t segment_size;
+  // seconds before a segment with anything in it is sealed
+  int segment_age;
+  // sealed segments kept on disk, older ones are deleted
+  int retain;
+} chatlog_options_t;
+
+#define CHATLOG_DEFAULT_SEGMENT_SIZE (8 * 1024 * 1024)
+#define CHATLOG_MIN_SEGMENT_SIZE (64 * 1024)
+#define CHATLOG_DEFAULT_SEGMENT_AGE 3600
+#define CHATLOG_DEFAULT_RETAIN 16
+
+// opens or creates the log in options.dir and hands the newest replay_max
+// records to replay, oldest first. returns 0 or an errno value.
+int chatlog_open(chatlog_options_t options, size_t replay_max,
+                 void (*replay)(frame_t *frame));
+// copies frame into the current segment. it never waits on the disk unless
+// the sync mode is CHATLOG_SYNC_ALWAYS, the committer creates, syncs and
+// seals segments.
+int chatlog_append(frame_t *frame);
+// syncs and unmaps everything, stopping the committer
+void chatlog_close(void);
+
+#endif // CHATLOG_H
@@ -8,10 +8,16 @@
 #include <unistd.h>
 
 #include "client.h"
+#include "event.h"
 #include "utils.h"
+#include "zframe.h"
 
 static char *user_line = NULL;
 static bool user_ended = false;
+// the server agreed to PROTO_CAP_PIPELINE, so lines go out without waiting
+// for a prompt and the current one stays up
+static bool pipelined = false;
+static char prompt[1024];
 
 static void rl_handler(char *line) {
   if (!line) {
@@ -21,6 +27,96 @@ static void rl_handler(char *line) {
   user_line = line;
 }
 
+static int send_frame(int socket_fd, const char *content, size_t len) {
+  uint32_t magic = htonl(PROTO_MAGIC);
+  uint32_t net_len = htonl((uint32_t)len);
+  if (send_all(socket_fd, (char *)&magic, 4) == -1 ||
+      send_all(socket_fd, (char *)&net_len, 4) == -1)
+    return -1;
+  return send_all(socket_fd, content, len);
+}
+
+static void print_message(const char *text, size_t len, bool editing) {
+  if (editing) {
+    write(STDOUT_FILENO, "\r\x1b[2K", 5);
+  }
+  fwrite(text, 1, len, stdout);
+  if (editing) {
+    rl_forced_update_display();
+  }
+  fflush(stdout);
+}
+
+// v2 events arrive as fields, rendered here the way the server renders them
+// for v1 clients
+static void print_event(const proto_frame_t *frame, bool editing) {
+  static char scratch[PROTO_SERVER_MAX];
+  static char text[PROTO_SERVER_MAX + 256];
+  event_t ev;
+  if (event_decode(frame->type, frame->content, frame->len, &ev, scratch,
+                   sizeof(scratch)) == -1)
+    return;
+  int len = event_render(&ev, text, sizeof(text));
+  if (len > (int)sizeof(text) - 1)
+    len = sizeof(text) - 1;
+  print_message(text, len, editing);
+}
+
+static void on_frame(int socket_fd, proto_reader_t *rx,
+                     const proto_frame_t *frame, bool *editing) {
+  if (frame->type == SERVER_DEFLATE) {
+    static char inner[1 + PROTO_SERVER_MAX];
+    int len = zframe_inflate(frame->content, frame->len, inner, sizeof(inner));
+    // never nested, inner is the only buffer
+    if (len == -1 || inner[0] == SERVER_DEFLATE) {
+      log_err(NULL, "malformed deflate frame\n");
+      return;
+    }
+    on_frame(socket_fd, rx,
+             &(proto_frame_t){
+                 .type = inner[0],
+                 .len = (uint32_t)len - 1,
+                 .content = inner + 1,
+             },
+             editing);
+    return;
+  }
+  if (frame->type == 'h') {
+    static const char pong[] = "\0pong";
+    send_frame(socket_fd, pong, sizeof(pong) - 1);
+    return;
+  }
+  if (frame->type == 'm') {
+    print_message(frame->content, frame->len, *editing);
+    return;
+  }
+  if (rx->v2 && frame->type != 'c' && frame->type != 'p') {
+    print_event(frame, *editing);
+    return;
+  }
+
+  // the rest need their content as a string
+  char buf[sizeof(prompt)];
+  size_t len = frame->len < sizeof(buf) ? frame->len : sizeof(buf) - 1;
+  memcpy(buf, frame->content, len);
+  buf[len] = '\0';
+
+  if (frame->type == 'c') {
+    pipelined = strstr(buf, PROTO_CAP_PIPELINE) != NULL;
+    // every frame after this one is v2
+    rx->v2 = rx->v2 || strstr(buf, PROTO_CAP_V2) != NULL;
+  } else if (frame->type == 'p') {
+    memcpy(prompt, buf, len + 1);
+    if (*editing) {
+      rl_set_prompt(buf);
+      rl_forced_update_display();
+    } else {
+      rl_callback_handler_install(buf, rl_handler);
+      *editing = true;
+    }
+  }
+}
+
 static int client_run(int socket_fd) {
   struct pollfd fds[2] = {
       {.fd = STDIN_FILENO, .events = POLLIN},
@@ -28,6 +124,9 @@ static int client_run(int socket_fd) {
   };
 
   bool editing = false;
+  static char rx_buf[9 + PROTO_SERVER_MAX];
+  proto_reader_t rx;
+  proto_reader_init(&rx, rx_buf, sizeof(rx_buf), true);
 
   while (true) {
     if (poll(fds, 2, -1) == -1) {
@@ -37,60 +136,34 @@ static int client_run(int socket_fd) {
       return errno;
     }
 
-    // server -> print
+    // server -> print, every frame the read completed
     if (fds[1].revents & POLLIN) {
-      char header[9];
-      if (recv_all(socket_fd, header, 9) <= 0) {
+      size_t avail;
+      char *dst = proto_reader_space(&rx, &avail);
+      ssize_t n = recv(socket_fd, dst, avail, 0);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0) {
         printf("\r\nconnection closed\n");
         if (editing)
           rl_callback_handler_remove();
         return 0;
       }
+      proto_reader_filled(&rx, n);
 
-      uint32_t magic = ntohl(*(uint32_t *)header);
-      if (magic != PROTO_MAGIC) {
-        printf("\r\nprotocol error: invalid magic number\n");
-        if (editing)
-          rl_callback_handler_remove();
-        return 1;
-      }
+      proto_frame_t frame;
+      proto_result_e result;
+      while ((result = proto_next(&rx, &frame)) == PROTO_FRAME)
+        on_frame(socket_fd, &rx, &frame, &editing);
 
-      uint32_t len = ntohl(*(uint32_t *)(header + 4));
-      char type = header[8];
-
-      char buf[1024];
-      if (len >= sizeof(buf)) {
-        printf("\r\nmessage too large\n");
+      if (result != PROTO_NEED_MORE) {
+        printf(result == PROTO_ERR_MAGIC
+                   ? "\r\nprotocol error: invalid magic number\n"
+                   : "\r\nmessage too large\n");
         if (editing)
           rl_callback_handler_remove();
         return 1;
       }
-      if (recv_all(socket_fd, buf, len) <= 0) {
-        printf("\r\nconnection closed\n");
-        if (editing)
-          rl_callback_handler_remove();
-        return 0;
-      }
-      buf[len] = '\0';
-
-      if (type == 'm') {
-        if (editing) {
-          write(STDOUT_FILENO, "\r\x1b[2K", 5);
-        }
-        fputs(buf, stdout);
-        if (editing) {
-          rl_forced_update_display();
-        }
-        fflush(stdout);
-      } else if (type == 'p') {
-        if (editing) {
-          rl_set_prompt(buf);
-          rl_forced_update_display();
-        } else {
-          rl_callback_handler_install(buf, rl_handler);
-          editing = true;
-        }
-      }
     }
 
     // stdin -> send
@@ -107,17 +180,17 @@ static int client_run(int socket_fd) {
       }
 
       if (user_line) {
-        editing = false;
         rl_callback_handler_remove();
-
-        uint32_t magic = htonl(PROTO_MAGIC);
-        uint32_t net_len = htonl((uint32_t)strlen(user_line));
-        send_all(socket_fd, (char *)&magic, 4);
-        send_all(socket_fd, (char *)&net_len, 4);
-        send_all(socket_fd, user_line, strlen(user_line));
-
+        send_frame(socket_fd, user_line, strlen(user_line));
         free(user_line);
         user_line = NULL;
+
+        // without pipelining, input waits for the server's next prompt
+        if (pipelined) {
+          rl_callback_handler_install(prompt, rl_handler);
+        } else {
+          editing = false;
+        }
       }
     }
 
@@ -154,6 +227,16 @@ int client_start(client_options_t options) {
     return errno;
   }
 
+  // asked up front, so the answer arrives with the first prompt
+  static const char caps[] =
+      "\0caps " PROTO_CAP_PIPELINE " " PROTO_CAP_PING " " PROTO_CAP_V2
+      " " PROTO_CAP_DEFLATE;
+  if (send_frame(socket_fd, caps, sizeof(caps) - 1) == -1) {
+    log_perror(NULL, "send");
+    close(socket_fd);
+    return errno;
+  }
+
   int result = client_run(socket_fd);
   close(socket_fd);
   return result;
@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clients.h"
+#include "epoch.h"
+#include "utils.h"
+
+#define MAX_CLIENTS (1 << 20)
+
+static _Atomic(client_ctx_t *) head;
+// only touched by writers
+static client_ctx_t *tail;
+static atomic_size_t count;
+// serializes writers only, readers never take it
+static pthread_mutex_t clients_mu = PTHREAD_MUTEX_INITIALIZER;
+
+// open-addressing index on name, linear probing with backward-shift deletion
+// so lookups never wade through tombstones. writers change it under
+// clients_mu. readers probe it lock-free inside an epoch: a grown table is
+// published with a release store and the old one retired, and a seqlock
+// sends a probe that overlapped entries being moved around again.
+
+typedef struct {
+  _Atomic uint64_t hash;
+  _Atomic(client_ctx_t *) ctx;
+} slot_t;
+
+typedef struct {
+  // power of two
+  size_t cap;
+  slot_t slots[];
+} table_t;
+
+typedef struct {
+  // NULL until the first insert
+  _Atomic(table_t *) table;
+  size_t used;
+  // odd while a writer moves entries
+  atomic_uint seq;
+} index_t;
+
+static index_t by_name;
+
+static uint64_t hash_name(const char *name) {
+  // fnv-1a
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (; *name; name++) {
+    h ^= (unsigned char)*name;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+// names are compared through the seqlock copy since their owners may be
+// renaming them
+static slot_t *index_find(table_t *table, uint64_t hash, const char *name) {
+  if (!table)
+    return NULL;
+
+  size_t mask = table->cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    slot_t *slot = &table->slots[i];
+    client_ctx_t *ctx = atomic_load_explicit(&slot->ctx, memory_order_acquire);
+    if (!ctx)
+      return NULL;
+    if (atomic_load_explicit(&slot->hash, memory_order_relaxed) != hash)
+      continue;
+    char other[MAX_NAME_LEN + 1];
+    clients_name(ctx, other);
+    if (strcmp(other, name) == 0)
+      return slot;
+  }
+}
+
+static void index_place(table_t *table, uint64_t hash, client_ctx_t *ctx) {
+  size_t mask = table->cap - 1;
+  size_t i = hash & mask;
+  while (atomic_load_explicit(&table->slots[i].ctx, memory_order_relaxed))
+    i = (i + 1) & mask;
+  atomic_store_explicit(&table->slots[i].hash, hash, memory_order_relaxed);
+  // readers that see ctx also see its hash and everything written to it
+  atomic_store_explicit(&table->slots[i].ctx, ctx, memory_order_release);
+}
+
+static int index_reserve(index_t *index) {
+  table_t *table = atomic_load_explicit(&index->table, memory_order_relaxed);
+  // keep the load factor at or below one half
+  if (table && (index->used + 1) * 2 <= table->cap)
+    return 0;
+
+  size_t cap = table ? table->cap * 2 : 64;
+  table_t *grown = calloc(1, sizeof(*grown) + cap * sizeof(slot_t));
+  if (!grown)
+    return ENOMEM;
+
+  grown->cap = cap;
+  for (size_t i = 0; table && i < table->cap; i++) {
+    slot_t *slot = &table->slots[i];
+    client_ctx_t *ctx = atomic_load_explicit(&slot->ctx, memory_order_relaxed);
+    if (ctx)
+      index_place(
+          grown, atomic_load_explicit(&slot->hash, memory_order_relaxed), ctx);
+  }
+  // readers still probing the old table see it as it was, which is fine for
+  // a lookup that started before the insert
+  atomic_store_explicit(&index->table, grown, memory_order_release);
+  if (table)
+    epoch_retire(table, free);
+  return 0;
+}
+
+// moves in index_erase go between these
+static void index_write_begin(index_t *index) {
+  atomic_fetch_add_explicit(&index->seq, 1, memory_order_acq_rel);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void index_write_end(index_t *index) {
+  atomic_fetch_add_explicit(&index->seq, 1, memory_order_release);
+}
+
+static void index_erase(index_t *index, slot_t *slot) {
+  table_t *table = atomic_load_explicit(&index->table, memory_order_relaxed);
+  size_t mask = table->cap - 1;
+  size_t hole = (size_t)(slot - table->slots);
+
+  // shift later members of the probe run back so no gap breaks it
+  client_ctx_t *ctx;
+  for (size_t i = (hole + 1) & mask;
+       (ctx = atomic_load_explicit(&table->slots[i].ctx, memory_order_relaxed));
+       i = (i + 1) & mask) {
+    uint64_t hash =
+        atomic_load_explicit(&table->slots[i].hash, memory_order_relaxed);
+    size_t home = hash & mask;
+    // distance from home, move it if the hole is no further than that
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      atomic_store_explicit(&table->slots[hole].hash, hash,
+                            memory_order_relaxed);
+      atomic_store_explicit(&table->slots[hole].ctx, ctx, memory_order_relaxed);
+      hole = i;
+    }
+  }
+  atomic_store_explicit(&table->slots[hole].ctx, NULL, memory_order_relaxed);
+  index->used--;
+}
+
+clients_add_result_t clients_add(client_ctx_t *ctx) {
+  pthread_mutex_lock(&clients_mu);
+
+  uint64_t name_hash = hash_name(ctx->name);
+  if (index_find(atomic_load_explicit(&by_name.table, memory_order_relaxed),
+                 name_hash, ctx->name)) {
+    pthread_mutex_unlock(&clients_mu);
+    return CLIENTS_ADD_DUPLICATE;
+  }
+  if (atomic_load(&count) >= MAX_CLIENTS) {
+    log_err(LOG_CTX(ctx), "too many clients!\n");
+    pthread_mutex_unlock(&clients_mu);
+    return CLIENTS_ADD_ERROR;
+  }
+  if (index_reserve(&by_name)) {
+    log_err(LOG_CTX(ctx), "out of memory for client index\n");
+    pthread_mutex_unlock(&clients_mu);
+    return CLIENTS_ADD_ERROR;
+  }
+  index_place(atomic_load_explicit(&by_name.table, memory_order_relaxed),
+              name_hash, ctx);
+  by_name.used++;
+
+  // appended so iteration follows join order
+  ctx->prev = tail;
+  atomic_store_explicit(&ctx->next, NULL, memory_order_relaxed);
+  ctx->registered = true;
+  // readers that see ctx also see everything written to it before this
+  if (tail) {
+    atomic_store_explicit(&tail->next, ctx, memory_order_release);
+  } else {
+    atomic_store_explicit(&head, ctx, memory_order_release);
+  }
+  tail = ctx;
+  atomic_fetch_add(&count, 1);
+
+  pthread_mutex_unlock(&clients_mu);
+  return CLIENTS_ADD_OK;
+}
+
+clients_rename_result_t clients_rename(client_ctx_t *ctx,
+                                       const char *new_name) {
+  pthread_mutex_lock(&clients_mu);
+
+  if (!ctx->registered) {
+    pthread_mutex_unlock(&clients_mu);
+    return CLIENTS_RENAME_NOT_FOUND;
+  }
+  table_t *table = atomic_load_explicit(&by_name.table, memory_order_relaxed);
+  uint64_t new_hash = hash_name(new_name);
+  if (index_find(table, new_hash, new_name)) {
+    pthread_mutex_unlock(&clients_mu);
+    return CLIENTS_RENAME_DUPLICATE;
+  }
+  // the slot count does not change, so no reserve is needed. lookups of
+  // either name that overlap the move retry rather than miss it
+  index_write_begin(&by_name);
+  index_erase(&by_name, index_find(table, hash_name(ctx->name), ctx->name));
+
+  // seqlock, an odd sequence tells readers to retry
+  atomic_fetch_add_explicit(&ctx->name_seq, 1, memory_order_acq_rel);
+  atomic_thread_fence(memory_order_release);
+  strncpy(ctx->name, new_name, MAX_NAME_LEN);
+  ctx->name[MAX_NAME_LEN] = '\0';
+  atomic_fetch_add_explicit(&ctx->name_seq, 1, memory_order_release);
+  index_place(table, new_hash, ctx);
+  by_name.used++;
+  index_write_end(&by_name);
+
+  pthread_mutex_unlock(&clients_mu);
+  return CLIENTS_RENAME_OK;
+}
+
+int clients_remove(client_ctx_t *ctx) {
+  pthread_mutex_lock(&clients_mu);
+
+  if (!ctx->registered) {
+    pthread_mutex_unlock(&clients_mu);
+    return 1;
+  }
+
+  index_write_begin(&by_name);
+  index_erase(&by_name,
+              index_find(atomic_load_explicit(&by_name.table,
+                                              memory_order_relaxed),
+                         hash_name(ctx->name), ctx->name));
+  index_write_end(&by_name);
+
+  // ctx->next stays intact so readers standing on ctx can move on
+  client_ctx_t *next = atomic_load_explicit(&ctx->next, memory_order_relaxed);
+  if (ctx->prev) {
+    atomic_store_explicit(&ctx->prev->next, next, memory_order_release);
+  } else {
+    atomic_store_explicit(&head, next, memory_order_release);
+  }
+  if (next) {
+    next->prev = ctx->prev;
+  } else {
+    tail = ctx->prev;
+  }
+  ctx->registered = false;
+  atomic_fetch_sub(&count, 1);
+
+  pthread_mutex_unlock(&clients_mu);
+  return 0;
+}
+
+client_ctx_t *clients_find_name(const char *name) {
+  uint64_t hash = hash_name(name);
+  client_ctx_t *ctx;
+  unsigned seq;
+  do {
+    seq = atomic_load_explicit(&by_name.seq, memory_order_acquire);
+    slot_t *slot = index_find(
+        atomic_load_explicit(&by_name.table, memory_order_acquire), hash, name);
+    ctx = slot ? atomic_load_explicit(&slot->ctx, memory_order_acquire) : NULL;
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) ||
+           seq != atomic_load_explicit(&by_name.seq, memory_order_relaxed));
+
+  // it may have been renamed since
+  char found[MAX_NAME_LEN + 1];
+  if (ctx) {
+    clients_name(ctx, found);
+    if (strcmp(found, name) != 0)
+      return NULL;
+  }
+  return ctx;
+}
+
+size_t clients_count(void) { return atomic_load(&count); }
+
+client_ctx_t *clients_first(void) {
+  return atomic_load_explicit(&head, memory_order_acquire);
+}
+
+client_ctx_t *clients_next(client_ctx_t *ctx) {
+  return atomic_load_explicit(&ctx->next, memory_order_acquire);
+}
+
+void clients_name(client_ctx_t *ctx, char out[static MAX_NAME_LEN + 1]) {
+  unsigned seq;
+  do {
+    seq = atomic_load_explicit(&ctx->name_seq, memory_order_acquire);
+    memcpy(out, ctx->name, MAX_NAME_LEN + 1);
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) ||
+           seq != atomic_load_explicit(&ctx->name_seq, memory_order_relaxed));
+  out[MAX_NAME_LEN] = '\0';
+}
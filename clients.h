@@ -0,0 +1,41 @@
+#ifndef CLIENTS_H
+#define CLIENTS_H
+
+#include <stddef.h>
+
+#include "session.h"
+
+// registry of clients that finished the handshake. writers serialize on a
+// mutex and publish with release stores; readers walk the list lock-free
+// between epoch_enter and epoch_exit. removed clients must be handed to
+// epoch_retire instead of being freed.
+
+typedef enum {
+  CLIENTS_ADD_OK,
+  CLIENTS_ADD_ERROR,
+  CLIENTS_ADD_DUPLICATE,
+} clients_add_result_t;
+
+typedef enum {
+  CLIENTS_RENAME_OK,
+  CLIENTS_RENAME_NOT_FOUND,
+  CLIENTS_RENAME_DUPLICATE,
+} clients_rename_result_t;
+
+clients_add_result_t clients_add(client_ctx_t *ctx);
+clients_rename_result_t clients_rename(client_ctx_t *ctx, const char *new_name);
+int clients_remove(client_ctx_t *ctx);
+size_t clients_count(void);
+
+// constant-time lookup through the name index, lock-free like iteration and
+// only valid inside an epoch, since the client may leave right after.
+client_ctx_t *clients_find_name(const char *name);
+
+// iteration, only valid inside an epoch
+client_ctx_t *clients_first(void);
+client_ctx_t *clients_next(client_ctx_t *ctx);
+
+// consistent copy of a name that its owner may be renaming concurrently
+void clients_name(client_ctx_t *ctx, char out[static MAX_NAME_LEN + 1]);
+
+#endif // CLIENTS_H
@@ -0,0 +1,146 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "utils.h"
+
+typedef struct epoch_rec {
+  // (epoch << 1) | active
+  atomic_uint_fast64_t state;
+  atomic_bool in_use;
+  int depth;
+  struct epoch_rec *next;
+} epoch_rec_t;
+
+typedef struct {
+  void *ptr;
+  void (*destroy)(void *);
+  uint64_t epoch;
+} retired_t;
+
+static atomic_uint_fast64_t global_epoch = 2;
+static _Atomic(epoch_rec_t *) recs;
+static _Thread_local epoch_rec_t *self;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static pthread_mutex_t retired_mu = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t retired_pending;
+static retired_t *retired;
+static size_t retired_len;
+static size_t retired_cap;
+
+static void rec_release(void *rec_raw) {
+  epoch_rec_t *rec = rec_raw;
+  atomic_store(&rec->state, 0);
+  atomic_store(&rec->in_use, false);
+}
+
+static void key_create(void) { pthread_key_create(&key, rec_release); }
+
+// records are never freed, threads that exit leave theirs for reuse
+static epoch_rec_t *rec_acquire(void) {
+  for (epoch_rec_t *rec = atomic_load(&recs); rec; rec = rec->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&rec->in_use, &expected, true))
+      return rec;
+  }
+
+  epoch_rec_t *rec = calloc(1, sizeof(*rec));
+  if (!rec) {
+    log_perror(NULL, "epoch: calloc");
+    abort();
+  }
+  atomic_init(&rec->in_use, true);
+  rec->next = atomic_load(&recs);
+  while (!atomic_compare_exchange_weak(&recs, &rec->next, rec)) {
+  }
+  return rec;
+}
+
+void epoch_enter(void) {
+  if (!self) {
+    pthread_once(&key_once, key_create);
+    self = rec_acquire();
+    pthread_setspecific(key, self);
+  }
+  if (self->depth++ > 0)
+    return;
+
+  // publish as active first, so an advance either sees us or happened
+  // before any pointer we are about to load
+  atomic_store(&self->state, 1);
+  uint64_t epoch = atomic_load(&global_epoch);
+  atomic_store(&self->state, (epoch << 1) | 1);
+}
+
+void epoch_exit(void) {
+  if (--self->depth > 0)
+    return;
+  atomic_store(&self->state, 0);
+}
+
+static bool try_advance(void) {
+  uint64_t epoch = atomic_load(&global_epoch);
+  for (epoch_rec_t *rec = atomic_load(&recs); rec; rec = rec->next) {
+    uint64_t state = atomic_load(&rec->state);
+    if ((state & 1) && (state >> 1) != epoch)
+      return false;
+  }
+  return atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+// called with retired_mu held
+static void reclaim_locked(void) {
+  // objects need two advances past their retirement, so try for both
+  if (try_advance())
+    try_advance();
+  uint64_t epoch = atomic_load(&global_epoch);
+
+  size_t kept = 0;
+  for (size_t i = 0; i < retired_len; i++) {
+    // a reader pinned at epoch e can only hold pointers retired at e or later,
+    // and the global epoch can't pass e + 1 while it is still active
+    if (retired[i].epoch + 2 <= epoch) {
+      retired[i].destroy(retired[i].ptr);
+    } else {
+      retired[kept++] = retired[i];
+    }
+  }
+  retired_len = kept;
+  atomic_store(&retired_pending, kept);
+}
+
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+  pthread_mutex_lock(&retired_mu);
+  if (retired_len == retired_cap) {
+    size_t cap = retired_cap ? retired_cap * 2 : 64;
+    retired_t *list = realloc(retired, cap * sizeof(*list));
+    if (!list) {
+      // better to leak than to free under a reader
+      pthread_mutex_unlock(&retired_mu);
+      log_perror(NULL, "epoch: realloc");
+      return;
+    }
+    retired = list;
+    retired_cap = cap;
+  }
+  retired[retired_len++] = (retired_t){
+      .ptr = ptr,
+      .destroy = destroy,
+      .epoch = atomic_load(&global_epoch),
+  };
+  reclaim_locked();
+  pthread_mutex_unlock(&retired_mu);
+}
+
+void epoch_reclaim(void) {
+  if (atomic_load(&retired_pending) == 0)
+    return;
+  pthread_mutex_lock(&retired_mu);
+  reclaim_locked();
+  pthread_mutex_unlock(&retired_mu);
+}
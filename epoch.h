@@ -0,0 +1,15 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// epoch based reclamation. readers bracket lock-free traversals with
+// epoch_enter/epoch_exit, writers unlink objects and hand them to
+// epoch_retire, which frees them once no reader can still hold a pointer.
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+void epoch_retire(void *ptr, void (*destroy)(void *));
+// frees whatever retired objects have become unreachable
+void epoch_reclaim(void);
+
+#endif // EPOCH_H
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "event.h"
+#include "utils.h"
+
+// RENDERING
+
+int event_render(const event_t *ev, char *buf, size_t size) {
+  switch (ev->kind) {
+  case EVENT_CHAT:
+    return snprintf(buf, size,
+                    ANSI_BOLD ANSI_BMAGENTA "%s " ANSI_RESET "%s\n", ev->name,
+                    ev->text);
+  case EVENT_DIRECT:
+    return snprintf(buf, size,
+                    ANSI_BOLD ANSI_BYELLOW "%s (private) " ANSI_RESET "%s\n",
+                    ev->name, ev->text);
+  case EVENT_JOINED:
+    return snprintf(buf, size,
+                    ANSI_BOLD ANSI_BCYAN "%s:%u " ANSI_RESET
+                                         "joined as " ANSI_BOLD ANSI_BMAGENTA
+                                         "%s" ANSI_RESET "\n",
+                    ev->ip, ev->port, ev->name);
+  case EVENT_LEFT:
+    return snprintf(buf, size,
+                    ANSI_BOLD ANSI_BCYAN "%s:%u " ANSI_RESET "disconnected\n",
+                    ev->ip, ev->port);
+  case EVENT_RENAMED:
+    return snprintf(buf, size,
+                    ANSI_BOLD ANSI_BCYAN "%s:%u " ANSI_RESET
+                                         "renamed to " ANSI_BOLD ANSI_BMAGENTA
+                                         "%s" ANSI_RESET "\n",
+                    ev->ip, ev->port, ev->name);
+  case EVENT_NOTICE:
+    return snprintf(buf, size,
+                    ANSI_BOLD ANSI_BMAGENTA "%s " ANSI_RESET "%s #%s\n",
+                    ev->name, ev->flag ? "joined" : "left", ev->channel);
+  case EVENT_SUMMARY:
+    return snprintf(buf, size,
+                    ANSI_BOLD ANSI_BCYAN "%llu users " ANSI_RESET
+                                         "%s%s" ANSI_BOLD ANSI_BMAGENTA
+                                         "%s" ANSI_RESET "\n",
+                    (unsigned long long)ev->count,
+                    ev->flag ? "joined" : "disconnected",
+                    ev->text[0] ? ": " : "", ev->text);
+  case EVENT_LINK:
+    return snprintf(buf, size,
+                    ANSI_BOLD ANSI_BCYAN "%s " ANSI_RESET "%s, %llu %s\n",
+                    ev->name, ev->flag ? "linked up" : "lost",
+                    (unsigned long long)ev->count,
+                    ev->flag ? (ev->count == 1 ? "user there" : "users there")
+                             : (ev->count == 1 ? "user gone" : "users gone"));
+  }
+  if (size > 0)
+    buf[0] = '\0';
+  return 0;
+}
+
+// ENCODING
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len;
+  bool full;
+} encoder_t;
+
+static void enc_varint(encoder_t *e, uint64_t value) {
+  char tmp[10];
+  size_t n = proto_put_varint(tmp, value);
+  if (e->full || e->size - e->len < n) {
+    e->full = true;
+    return;
+  }
+  memcpy(e->buf + e->len, tmp, n);
+  e->len += n;
+}
+
+static void enc_u8(encoder_t *e, uint8_t value) {
+  if (e->full || e->len == e->size) {
+    e->full = true;
+    return;
+  }
+  e->buf[e->len++] = (char)value;
+}
+
+static void enc_str(encoder_t *e, const char *s) {
+  size_t n = strlen(s);
+  enc_varint(e, n);
+  if (e->full || e->size - e->len < n) {
+    e->full = true;
+    return;
+  }
+  memcpy(e->buf + e->len, s, n);
+  e->len += n;
+}
+
+int event_encode(const event_t *ev, char *buf, size_t size) {
+  encoder_t e = {.buf = buf, .size = size};
+  switch (ev->kind) {
+  case EVENT_CHAT:
+  case EVENT_DIRECT:
+    enc_str(&e, ev->name);
+    enc_str(&e, ev->text);
+    break;
+  case EVENT_JOINED:
+  case EVENT_LEFT:
+  case EVENT_RENAMED:
+    enc_str(&e, ev->name);
+    enc_str(&e, ev->ip);
+    enc_varint(&e, ev->port);
+    break;
+  case EVENT_NOTICE:
+    enc_str(&e, ev->name);
+    enc_str(&e, ev->channel);
+    enc_u8(&e, ev->flag);
+    break;
+  case EVENT_SUMMARY:
+    enc_u8(&e, ev->flag);
+    enc_varint(&e, ev->count);
+    enc_str(&e, ev->text);
+    break;
+  case EVENT_LINK:
+    enc_str(&e, ev->name);
+    enc_u8(&e, ev->flag);
+    enc_varint(&e, ev->count);
+    break;
+  default:
+    return -1;
+  }
+  return e.full ? -1 : (int)e.len;
+}
+
+// DECODING
+
+typedef struct {
+  const char *p;
+  size_t left;
+  char *scratch;
+  size_t scratch_left;
+  bool bad;
+} decoder_t;
+
+static uint64_t dec_varint(decoder_t *d) {
+  uint64_t value;
+  int n = d->bad ? -1 : proto_get_varint(d->p, d->left, 10, &value);
+  if (n <= 0) {
+    d->bad = true;
+    return 0;
+  }
+  d->p += n;
+  d->left -= n;
+  return value;
+}
+
+static uint8_t dec_u8(decoder_t *d) {
+  if (d->bad || d->left == 0) {
+    d->bad = true;
+    return 0;
+  }
+  d->left--;
+  return (uint8_t)*d->p++;
+}
+
+// strings end up NUL terminated in the scratch buffer
+static const char *dec_str(decoder_t *d) {
+  uint64_t n = dec_varint(d);
+  if (d->bad || n > d->left || n >= d->scratch_left) {
+    d->bad = true;
+    return "";
+  }
+  char *s = d->scratch;
+  memcpy(s, d->p, n);
+  s[n] = '\0';
+  d->p += n;
+  d->left -= n;
+  d->scratch += n + 1;
+  d->scratch_left -= n + 1;
+  return s;
+}
+
+int event_decode(char kind, const char *content, size_t len, event_t *ev,
+                 char *scratch, size_t scratch_size) {
+  decoder_t d = {
+      .p = content,
+      .left = len,
+      .scratch = scratch,
+      .scratch_left = scratch_size,
+  };
+  *ev = (event_t){.kind = (event_kind_e)kind, .text = ""};
+  switch (kind) {
+  case EVENT_CHAT:
+  case EVENT_DIRECT:
+    ev->name = dec_str(&d);
+    ev->text = dec_str(&d);
+    break;
+  case EVENT_JOINED:
+  case EVENT_LEFT:
+  case EVENT_RENAMED:
+    ev->name = dec_str(&d);
+    ev->ip = dec_str(&d);
+    ev->port = (uint16_t)dec_varint(&d);
+    break;
+  case EVENT_NOTICE:
+    ev->name = dec_str(&d);
+    ev->channel = dec_str(&d);
+    ev->flag = dec_u8(&d);
+    break;
+  case EVENT_SUMMARY:
+    ev->flag = dec_u8(&d);
+    ev->count = dec_varint(&d);
+    ev->text = dec_str(&d);
+    break;
+  case EVENT_LINK:
+    ev->name = dec_str(&d);
+    ev->flag = dec_u8(&d);
+    ev->count = dec_varint(&d);
+    break;
+  default:
+    return -1;
+  }
+  return d.bad ? -1 : 0;
+}
+
+frame_t *event_frame(const event_t *ev) {
+  char buf[PROTO_SERVER_MAX];
+  event_render(ev, buf, sizeof(buf));
+  frame_t *frame = frame_new('m', buf);
+  if (!frame)
+    return NULL;
+
+  // v2 clients fall back to the rendered text if the fields do not fit
+  int len = event_encode(ev, buf, sizeof(buf));
+  if (len >= 0)
+    frame->v2 = frame_new_v2((char)ev->kind, buf, len);
+  return frame;
+}
@@ -0,0 +1,59 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+// what the server tells everyone, as data. v1 clients get it rendered into
+// an ANSI message, v2 clients get the fields and render it themselves the
+// same way. strings go over as <length: varint><bytes>, numbers as varints,
+// flags as one byte.
+
+typedef enum {
+  // <name><text>, said in the client's channel
+  EVENT_CHAT = 'C',
+  // <name><text>, sent to the client alone
+  EVENT_DIRECT = 'D',
+  // <name><ip><port>
+  EVENT_JOINED = 'J',
+  // <name><ip><port>
+  EVENT_LEFT = 'L',
+  // <name><ip><port>, name is the new one
+  EVENT_RENAMED = 'R',
+  // <name><channel><joined: 1>, someone came into or left a channel
+  EVENT_NOTICE = 'N',
+  // <joined: 1><count><text>, presence notices gathered over a window. text
+  // lists the names, empty when there were too many
+  EVENT_SUMMARY = 'S',
+  // <name><up: 1><count>, a federation link to node name changed, with the
+  // users behind it
+  EVENT_LINK = 'K',
+} event_kind_e;
+
+typedef struct {
+  event_kind_e kind;
+  const char *name;
+  const char *text;
+  const char *ip;
+  uint16_t port;
+  const char *channel;
+  // joined for notices and summaries, up for links
+  bool flag;
+  uint64_t count;
+} event_t;
+
+// the v1 message text, returns what snprintf does
+int event_render(const event_t *ev, char *buf, size_t size);
+// the v2 content, returns its length or -1 when it does not fit
+int event_encode(const event_t *ev, char *buf, size_t size);
+// parses v2 content, copying its strings into scratch. returns 0, or -1 if
+// it is not a known event or malformed.
+int event_decode(char kind, const char *content, size_t len, event_t *ev,
+                 char *scratch, size_t scratch_size);
+// a v1 frame of the rendered text whose v2 twin carries the event, NULL when
+// allocation fails
+frame_t *event_frame(const event_t *ev);
+
+#endif // EVENT_H
@@ -0,0 +1,1104 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "channels.h"
+#include "clients.h"
+#include "epoch.h"
+#include "federation.h"
+#include "metrics.h"
+#include "mpsc.h"
+#include "pool.h"
+#include "utils.h"
+#include "wheel.h"
+
+// every link starts with a hello naming the protocol and the node
+#define FED_VERSION "ctalk-fed 1"
+// one message: <length: 4 BE><type: 1><fields>. strings are <length: 2 BE>
+// <bytes>, ports 2 bytes BE and flags 1 byte.
+#define FED_MSG_MAX 4096
+#define FED_RX_SIZE (4 * FED_MSG_MAX)
+// a peer that falls this far behind is cut off, it gets a fresh copy of
+// everyone when it links up again
+#define FED_OUT_MAX (4 * 1024 * 1024)
+#define FED_RETRY_MIN_MS 500
+#define FED_RETRY_MAX_MS 30000
+// longest chat line a session passes on, see client_io_t
+#define FED_TEXT_MAX 1023
+
+typedef enum {
+  FED_HELLO = 'H',
+  FED_JOIN = 'J',
+  FED_LEAVE = 'L',
+  FED_RENAME = 'R',
+  FED_CHAT = 'C',
+  FED_NOTICE = 'N',
+  FED_DIRECT = 'D',
+  // the node has listed all its users after the hello
+  FED_SYNCED = 'S',
+} fed_type_e;
+
+typedef struct peer peer_t;
+typedef struct link link_t;
+
+typedef enum {
+  LINK_CONNECTING,
+  // waiting for the other side's hello
+  LINK_HELLO,
+  LINK_UP,
+  // closed during this pass of the loop, freed at its end
+  LINK_DEAD,
+} link_state_e;
+
+struct link {
+  int fd;
+  link_state_e state;
+  // the dial target this link belongs to, NULL for links the peer dialed
+  peer_t *peer;
+  char node[MAX_NODE_LEN + 1];
+  // the peer finished listing its users
+  bool synced;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  char rx[FED_RX_SIZE];
+  size_t rx_len;
+  link_t *next;
+};
+
+struct peer {
+  const char *spec;
+  struct sockaddr_in addr;
+  link_t *link;
+  // learned from its first hello, a link it dialed us on is just as good
+  char node[MAX_NODE_LEN + 1];
+  uint64_t retry_at;
+  int backoff;
+  // only the first failure in a row is worth a log line
+  bool failing;
+};
+
+// a local event on its way to the federation thread, already encoded
+typedef struct {
+  mpsc_node_t node;
+  // only for this node when set, for every linked node otherwise
+  char to[MAX_NODE_LEN + 1];
+  size_t len;
+  char data[];
+} outbound_t;
+
+// remote users by name. written by the federation thread, read by sessions
+// checking names.
+typedef struct remote remote_t;
+struct remote {
+  remote_user_t user;
+  remote_t *next;
+};
+
+static bool enabled;
+static char self_node[MAX_NODE_LEN + 1];
+static federation_handlers_t handlers;
+static int listen_fd = -1;
+static int wake_fd;
+static atomic_bool wake_pending;
+static mpsc_t inbox;
+
+// only touched by the federation thread
+static peer_t peers[FEDERATION_MAX_PEERS];
+static int peer_count;
+static link_t *links;
+
+static pthread_mutex_t users_mu = PTHREAD_MUTEX_INITIALIZER;
+static remote_t **buckets;
+static size_t bucket_count;
+static size_t remote_count;
+
+// ENCODING
+
+typedef struct {
+  char buf[FED_MSG_MAX];
+  size_t len;
+  bool overflow;
+} encoder_t;
+
+static void enc_begin(encoder_t *e, fed_type_e type) {
+  e->len = 4;
+  e->buf[e->len++] = (char)type;
+  e->overflow = false;
+}
+
+static void enc_bytes(encoder_t *e, const void *data, size_t len) {
+  if (e->overflow || e->len + len > sizeof(e->buf)) {
+    e->overflow = true;
+    return;
+  }
+  memcpy(e->buf + e->len, data, len);
+  e->len += len;
+}
+
+static void enc_u8(encoder_t *e, uint8_t value) { enc_bytes(e, &value, 1); }
+
+static void enc_u16(encoder_t *e, uint16_t value) {
+  uint16_t be = htons(value);
+  enc_bytes(e, &be, sizeof(be));
+}
+
+static void enc_str(encoder_t *e, const char *s) {
+  size_t len = strlen(s);
+  enc_u16(e, (uint16_t)len);
+  enc_bytes(e, s, len);
+}
+
+// fills in the length, returns the message size or 0 if it did not fit
+static size_t enc_end(encoder_t *e) {
+  if (e->overflow)
+    return 0;
+  uint32_t be = htonl((uint32_t)(e->len - 4));
+  memcpy(e->buf, &be, sizeof(be));
+  return e->len;
+}
+
+typedef struct {
+  const char *p;
+  size_t left;
+  bool bad;
+} decoder_t;
+
+static const char *dec_bytes(decoder_t *d, size_t len) {
+  if (d->bad || d->left < len) {
+    d->bad = true;
+    return NULL;
+  }
+  const char *p = d->p;
+  d->p += len;
+  d->left -= len;
+  return p;
+}
+
+static uint8_t dec_u8(decoder_t *d) {
+  const char *p = dec_bytes(d, 1);
+  return p ? (uint8_t)*p : 0;
+}
+
+static uint16_t dec_u16(decoder_t *d) {
+  const char *p = dec_bytes(d, 2);
+  if (!p)
+    return 0;
+  uint16_t be;
+  memcpy(&be, p, sizeof(be));
+  return ntohs(be);
+}
+
+// copies a string of at most max bytes into out, which has room for max + 1
+static void dec_str(decoder_t *d, char *out, size_t max) {
+  size_t len = dec_u16(d);
+  const char *p = len > max ? NULL : dec_bytes(d, len);
+  if (!p) {
+    d->bad = true;
+    out[0] = '\0';
+    return;
+  }
+  memcpy(out, p, len);
+  out[len] = '\0';
+}
+
+// REMOTE USERS
+
+static size_t name_hash(const char *name) {
+  // fnv-1a
+  size_t hash = 2166136261u;
+  for (; *name; name++)
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  return hash;
+}
+
+// the link that points at name's entry, or at the end of its bucket
+static remote_t **remote_slot(const char *name) {
+  remote_t **slot = &buckets[name_hash(name) & (bucket_count - 1)];
+  while (*slot && strcmp((*slot)->user.name, name) != 0)
+    slot = &(*slot)->next;
+  return slot;
+}
+
+static int remote_grow(void) {
+  size_t count = bucket_count ? bucket_count * 2 : 256;
+  remote_t **grown = calloc(count, sizeof(*grown));
+  if (!grown)
+    return -1;
+  for (size_t i = 0; i < bucket_count; i++) {
+    remote_t *r = buckets[i];
+    while (r) {
+      remote_t *next = r->next;
+      size_t index = name_hash(r->user.name) & (count - 1);
+      r->next = grown[index];
+      grown[index] = r;
+      r = next;
+    }
+  }
+  free(buckets);
+  buckets = grown;
+  bucket_count = count;
+  return 0;
+}
+
+// node claims name for one of its users. the claim of the node whose name
+// sorts first wins, so every node settles on the same owner without asking.
+// returns false if an earlier claim stands.
+static bool remote_claim(const char *node, const char *name, const char *ip,
+                         uint16_t port) {
+  // only this thread writes the table, so the answer holds until the insert
+  pthread_mutex_lock(&users_mu);
+  remote_t *r = bucket_count ? *remote_slot(name) : NULL;
+  bool beaten = r && strcmp(r->user.node, node) < 0;
+  pthread_mutex_unlock(&users_mu);
+  if (beaten)
+    return false;
+
+  epoch_enter();
+  bool local = clients_find_name(name) != NULL;
+  epoch_exit();
+  if (local) {
+    if (strcmp(self_node, node) < 0)
+      return false;
+    handlers.evicted(name, node);
+  }
+
+  pthread_mutex_lock(&users_mu);
+  if (!r) {
+    if ((remote_count >= bucket_count && remote_grow() == -1) ||
+        !(r = malloc(sizeof(*r)))) {
+      pthread_mutex_unlock(&users_mu);
+      log_perror(NULL, "federation: malloc");
+      return false;
+    }
+    remote_t **slot = remote_slot(name);
+    r->next = NULL;
+    *slot = r;
+    remote_count++;
+  }
+  snprintf(r->user.name, sizeof(r->user.name), "%s", name);
+  snprintf(r->user.node, sizeof(r->user.node), "%s", node);
+  snprintf(r->user.ip, sizeof(r->user.ip), "%s", ip);
+  r->user.port = port;
+  pthread_mutex_unlock(&users_mu);
+  return true;
+}
+
+// drops name if node owns it, copying the entry to user
+static bool remote_release(const char *node, const char *name,
+                           remote_user_t *user) {
+  pthread_mutex_lock(&users_mu);
+  remote_t **slot = bucket_count ? remote_slot(name) : NULL;
+  remote_t *r = slot ? *slot : NULL;
+  if (!r || strcmp(r->user.node, node) != 0) {
+    pthread_mutex_unlock(&users_mu);
+    return false;
+  }
+  *slot = r->next;
+  remote_count--;
+  pthread_mutex_unlock(&users_mu);
+
+  *user = r->user;
+  free(r);
+  return true;
+}
+
+// drops every user of node, returns how many there were
+static size_t remote_release_node(const char *node) {
+  size_t released = 0;
+  pthread_mutex_lock(&users_mu);
+  for (size_t i = 0; i < bucket_count; i++) {
+    remote_t **slot = &buckets[i];
+    while (*slot) {
+      remote_t *r = *slot;
+      if (strcmp(r->user.node, node) != 0) {
+        slot = &r->next;
+        continue;
+      }
+      *slot = r->next;
+      free(r);
+      released++;
+    }
+  }
+  remote_count -= released;
+  pthread_mutex_unlock(&users_mu);
+  return released;
+}
+
+static size_t remote_count_node(const char *node) {
+  size_t count = 0;
+  pthread_mutex_lock(&users_mu);
+  for (size_t i = 0; i < bucket_count; i++) {
+    for (remote_t *r = buckets[i]; r; r = r->next)
+      count += strcmp(r->user.node, node) == 0;
+  }
+  pthread_mutex_unlock(&users_mu);
+  return count;
+}
+
+bool federation_name_taken(const char *name) {
+  if (!enabled)
+    return false;
+  pthread_mutex_lock(&users_mu);
+  bool taken = bucket_count && *remote_slot(name);
+  pthread_mutex_unlock(&users_mu);
+  return taken;
+}
+
+size_t federation_users(remote_user_t *out, size_t cap) {
+  if (!enabled)
+    return 0;
+  size_t count = 0;
+  pthread_mutex_lock(&users_mu);
+  for (size_t i = 0; i < bucket_count; i++) {
+    for (remote_t *r = buckets[i]; r; r = r->next) {
+      if (count < cap)
+        out[count] = r->user;
+      count++;
+    }
+  }
+  pthread_mutex_unlock(&users_mu);
+  return count;
+}
+
+// LOCAL EVENTS
+// sessions encode their event and queue it for the federation thread, which
+// copies it onto every link. a session never waits on a peer.
+
+static void publish(const char *to, encoder_t *e) {
+  size_t len = enc_end(e);
+  if (len == 0) {
+    log_err(NULL, "federation: event too large, not sent\n");
+    return;
+  }
+  outbound_t *out = pool_buf_alloc(sizeof(*out) + len);
+  if (!out) {
+    log_perror(NULL, "federation: malloc");
+    return;
+  }
+  snprintf(out->to, sizeof(out->to), "%s", to ? to : "");
+  out->len = len;
+  memcpy(out->data, e->buf, len);
+  mpsc_push(&inbox, &out->node);
+
+  // one wakeup per drain is enough, later pushes ride along
+  if (!atomic_exchange(&wake_pending, true)) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1)
+      log_perror(NULL, "federation: eventfd write");
+  }
+}
+
+static void encode_join(encoder_t *e, const char *name, const char *ip,
+                        uint16_t port, bool announce) {
+  enc_begin(e, FED_JOIN);
+  enc_str(e, name);
+  enc_str(e, ip);
+  enc_u16(e, port);
+  enc_u8(e, announce);
+}
+
+void federation_join(const char *name, const char *ip, uint16_t port,
+                     bool announce) {
+  if (!enabled)
+    return;
+  encoder_t e;
+  encode_join(&e, name, ip, port, announce);
+  publish(NULL, &e);
+}
+
+void federation_leave(const char *name) {
+  if (!enabled)
+    return;
+  encoder_t e;
+  enc_begin(&e, FED_LEAVE);
+  enc_str(&e, name);
+  publish(NULL, &e);
+}
+
+void federation_rename(const char *old_name, const char *name,
+                       const char *ip, uint16_t port) {
+  if (!enabled)
+    return;
+  encoder_t e;
+  enc_begin(&e, FED_RENAME);
+  enc_str(&e, old_name);
+  enc_str(&e, name);
+  enc_str(&e, ip);
+  enc_u16(&e, port);
+  publish(NULL, &e);
+}
+
+void federation_chat(const char *channel, const char *name, const char *text) {
+  if (!enabled)
+    return;
+  encoder_t e;
+  enc_begin(&e, FED_CHAT);
+  enc_str(&e, channel);
+  enc_str(&e, name);
+  enc_str(&e, text);
+  publish(NULL, &e);
+}
+
+void federation_notice(const char *channel, const char *name, bool joined) {
+  if (!enabled)
+    return;
+  encoder_t e;
+  enc_begin(&e, FED_NOTICE);
+  enc_str(&e, channel);
+  enc_str(&e, name);
+  enc_u8(&e, joined);
+  publish(NULL, &e);
+}
+
+int federation_direct(const char *to, const char *from, const char *text) {
+  if (!enabled)
+    return ENOENT;
+  char node[MAX_NODE_LEN + 1];
+  pthread_mutex_lock(&users_mu);
+  remote_t *r = bucket_count ? *remote_slot(to) : NULL;
+  if (r)
+    memcpy(node, r->user.node, sizeof(node));
+  pthread_mutex_unlock(&users_mu);
+  if (!r)
+    return ENOENT;
+
+  encoder_t e;
+  enc_begin(&e, FED_DIRECT);
+  enc_str(&e, to);
+  enc_str(&e, from);
+  enc_str(&e, text);
+  publish(node, &e);
+  return 0;
+}
+
+// LINKS
+
+static void link_send(link_t *link, const char *data, size_t len) {
+  if (link->state == LINK_DEAD)
+    return;
+  if (link->out_len + len > FED_OUT_MAX) {
+    log_err(NULL, "federation: %s is not keeping up, dropping the link\n",
+            link->node);
+    shutdown(link->fd, SHUT_RDWR);
+    return;
+  }
+  if (link->out_len + len > link->out_cap) {
+    size_t cap = link->out_cap ? link->out_cap : FED_MSG_MAX;
+    while (cap < link->out_len + len)
+      cap *= 2;
+    char *out = realloc(link->out, cap);
+    if (!out) {
+      log_perror(NULL, "federation: malloc");
+      shutdown(link->fd, SHUT_RDWR);
+      return;
+    }
+    link->out = out;
+    link->out_cap = cap;
+  }
+  memcpy(link->out + link->out_len, data, len);
+  link->out_len += len;
+  metrics_add(METRIC_PEER_MESSAGES_OUT, 1);
+}
+
+static void link_encoded(link_t *link, encoder_t *e) {
+  size_t len = enc_end(e);
+  if (len)
+    link_send(link, e->buf, len);
+}
+
+// writes whatever the socket takes, a hangup shows up in the next poll
+static void link_flush(link_t *link) {
+  if (link->out_len == 0 || link->state == LINK_CONNECTING ||
+      link->state == LINK_DEAD)
+    return;
+  ssize_t sent = send(link->fd, link->out, link->out_len,
+                      MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent <= 0) {
+    if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != EINTR)
+      shutdown(link->fd, SHUT_RDWR);
+    return;
+  }
+  memmove(link->out, link->out + sent, link->out_len - sent);
+  link->out_len -= sent;
+}
+
+static link_t *link_new(int fd, link_state_e state, peer_t *peer) {
+  link_t *link = calloc(1, sizeof(*link));
+  if (!link)
+    return NULL;
+  link->fd = fd;
+  link->state = state;
+  link->peer = peer;
+  link->next = links;
+  links = link;
+  return link;
+}
+
+static void send_hello(link_t *link) {
+  encoder_t e;
+  enc_begin(&e, FED_HELLO);
+  enc_str(&e, FED_VERSION);
+  enc_str(&e, self_node);
+  link_encoded(link, &e);
+}
+
+// another working link to the same node, if there is one
+static link_t *link_find_node(const char *node, const link_t *except) {
+  for (link_t *link = links; link; link = link->next) {
+    if (link != except && link->state == LINK_UP &&
+        strcmp(link->node, node) == 0)
+      return link;
+  }
+  return NULL;
+}
+
+// announce is false when another link to the same node takes over, its
+// users only change links
+static void link_close(link_t *link, bool announce) {
+  if (link->state == LINK_DEAD)
+    return;
+  bool was_up = link->state == LINK_UP;
+  link->state = LINK_DEAD;
+  close(link->fd);
+
+  peer_t *peer = link->peer;
+  if (peer) {
+    peer->link = NULL;
+    peer->retry_at = wheel_clock() + peer->backoff;
+    peer->backoff = peer->backoff * 2 > FED_RETRY_MAX_MS ? FED_RETRY_MAX_MS
+                                                         : peer->backoff * 2;
+  }
+  if (!was_up || link_find_node(link->node, link))
+    return;
+
+  size_t users = remote_release_node(link->node);
+  if (announce) {
+    log_info(NULL, "federation: lost link to %s\n", link->node);
+    handlers.link(link->node, false, users);
+  }
+}
+
+// every local user, as joins nobody is told about, then the end marker
+static void send_sync(link_t *link) {
+  encoder_t e;
+  epoch_enter();
+  for (client_ctx_t *ctx = clients_first(); ctx; ctx = clients_next(ctx)) {
+    char name[MAX_NAME_LEN + 1];
+    clients_name(ctx, name);
+    encode_join(&e, name, ctx->ip, ctx->port, false);
+    link_encoded(link, &e);
+  }
+  epoch_exit();
+  enc_begin(&e, FED_SYNCED);
+  link_encoded(link, &e);
+}
+
+static void on_hello(link_t *link, decoder_t *d) {
+  char version[32];
+  char node[MAX_NODE_LEN + 1];
+  dec_str(d, version, sizeof(version) - 1);
+  dec_str(d, node, MAX_NODE_LEN);
+  if (d->bad || strcmp(version, FED_VERSION) != 0 || node[0] == '\0') {
+    log_err(NULL, "federation: bad hello, dropping the link\n");
+    link_close(link, true);
+    return;
+  }
+  if (strcmp(node, self_node) == 0) {
+    log_err(NULL, "federation: linked to itself, is the node name unique?\n");
+    link_close(link, true);
+    return;
+  }
+  memcpy(link->node, node, sizeof(node));
+  if (link->peer)
+    memcpy(link->peer->node, node, sizeof(node));
+
+  // both sides keep the link that the node sorting first dialed, or the
+  // newer one when the same side dialed both
+  link_t *other = link_find_node(node, link);
+  if (other) {
+    bool ours = strcmp(self_node, node) < 0;
+    bool keep_new = (link->peer != NULL) == (other->peer != NULL) ||
+                    (link->peer != NULL) == ours;
+    if (!keep_new) {
+      link_close(link, false);
+      return;
+    }
+    // its users stay, and so does knowing they were listed
+    link->synced = other->synced;
+    link_close(other, false);
+  }
+
+  link->state = LINK_UP;
+  if (link->peer) {
+    link->peer->backoff = FED_RETRY_MIN_MS;
+    link->peer->failing = false;
+  }
+  send_sync(link);
+}
+
+static void on_message(link_t *link, const char *data, size_t len) {
+  metrics_add(METRIC_PEER_MESSAGES_IN, 1);
+  decoder_t d = {.p = data + 1, .left = len - 1};
+  fed_type_e type = data[0];
+  if (type == FED_HELLO && link->state == LINK_HELLO) {
+    on_hello(link, &d);
+    return;
+  }
+  if (link->state != LINK_UP) {
+    log_err(NULL, "federation: message before hello, dropping the link\n");
+    link_close(link, true);
+    return;
+  }
+
+  char name[MAX_NAME_LEN + 1];
+  char other[MAX_NAME_LEN + 1];
+  char ip[INET_ADDRSTRLEN];
+  char channel[MAX_CHANNEL_LEN + 1];
+  char text[FED_TEXT_MAX + 1];
+  switch (type) {
+  case FED_JOIN: {
+    dec_str(&d, name, MAX_NAME_LEN);
+    dec_str(&d, ip, sizeof(ip) - 1);
+    uint16_t port = dec_u16(&d);
+    bool announce = dec_u8(&d);
+    if (d.bad || name[0] == '\0')
+      break;
+    if (remote_claim(link->node, name, ip, port))
+      handlers.joined(link->node, name, ip, port, announce);
+    return;
+  }
+  case FED_LEAVE: {
+    dec_str(&d, name, MAX_NAME_LEN);
+    if (d.bad)
+      break;
+    remote_user_t user;
+    if (remote_release(link->node, name, &user))
+      handlers.left(link->node, name, user.ip, user.port);
+    return;
+  }
+  case FED_RENAME: {
+    dec_str(&d, other, MAX_NAME_LEN);
+    dec_str(&d, name, MAX_NAME_LEN);
+    dec_str(&d, ip, sizeof(ip) - 1);
+    uint16_t port = dec_u16(&d);
+    if (d.bad || name[0] == '\0')
+      break;
+    remote_user_t user;
+    remote_release(link->node, other, &user);
+    if (remote_claim(link->node, name, ip, port))
+      handlers.renamed(link->node, other, name, ip, port);
+    return;
+  }
+  case FED_CHAT:
+    dec_str(&d, channel, MAX_CHANNEL_LEN);
+    dec_str(&d, name, MAX_NAME_LEN);
+    dec_str(&d, text, FED_TEXT_MAX);
+    if (d.bad)
+      break;
+    handlers.chat(channel, name, text);
+    return;
+  case FED_NOTICE: {
+    dec_str(&d, channel, MAX_CHANNEL_LEN);
+    dec_str(&d, name, MAX_NAME_LEN);
+    bool joined = dec_u8(&d);
+    if (d.bad)
+      break;
+    handlers.notice(channel, name, joined);
+    return;
+  }
+  case FED_DIRECT:
+    dec_str(&d, name, MAX_NAME_LEN);
+    dec_str(&d, other, MAX_NAME_LEN);
+    dec_str(&d, text, FED_TEXT_MAX);
+    if (d.bad)
+      break;
+    handlers.direct(name, other, text);
+    return;
+  case FED_SYNCED:
+    if (!link->synced) {
+      link->synced = true;
+      size_t users = remote_count_node(link->node);
+      log_info(NULL, "federation: linked to %s with %zu user%s\n",
+               link->node, users, users == 1 ? "" : "s");
+      handlers.link(link->node, true, users);
+    }
+    return;
+  default:
+    // newer nodes may know more, skipping is safe
+    log_debug(NULL, "federation: unknown message '%c' from %s\n", type,
+              link->node);
+    return;
+  }
+
+  log_err(NULL, "federation: malformed message from %s, dropping the link\n",
+          link->node);
+  link_close(link, true);
+}
+
+static void link_readable(link_t *link) {
+  while (link->state != LINK_DEAD) {
+    ssize_t n = recv(link->fd, link->rx + link->rx_len,
+                     sizeof(link->rx) - link->rx_len, MSG_DONTWAIT);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      link_close(link, true);
+      return;
+    }
+    link->rx_len += n;
+
+    size_t off = 0;
+    while (link->state != LINK_DEAD && link->rx_len - off >= 4) {
+      uint32_t be;
+      memcpy(&be, link->rx + off, sizeof(be));
+      size_t len = ntohl(be);
+      if (len == 0 || len > FED_MSG_MAX - 4) {
+        log_err(NULL, "federation: bad message length, dropping the link\n");
+        link_close(link, true);
+        return;
+      }
+      if (link->rx_len - off - 4 < len)
+        break;
+      on_message(link, link->rx + off + 4, len);
+      off += 4 + len;
+    }
+    memmove(link->rx, link->rx + off, link->rx_len - off);
+    link->rx_len -= off;
+  }
+}
+
+// nonblocking, the connect finishes when poll says the socket is writable
+static void peer_dial(peer_t *peer) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1 || set_nonblocking(fd) == -1) {
+    log_perror(NULL, "federation: socket");
+    if (fd != -1)
+      close(fd);
+    peer->retry_at = wheel_clock() + FED_RETRY_MAX_MS;
+    return;
+  }
+  int result = connect(fd, (struct sockaddr *)&peer->addr, sizeof(peer->addr));
+  if (result == -1 && errno != EINPROGRESS) {
+    if (!peer->failing)
+      log_info(NULL, "federation: cannot reach %s: %s\n", peer->spec,
+               strerror(errno));
+    peer->failing = true;
+    close(fd);
+    peer->retry_at = wheel_clock() + peer->backoff;
+    peer->backoff = peer->backoff * 2 > FED_RETRY_MAX_MS ? FED_RETRY_MAX_MS
+                                                         : peer->backoff * 2;
+    return;
+  }
+
+  peer->link = link_new(fd, result == 0 ? LINK_HELLO : LINK_CONNECTING, peer);
+  if (!peer->link) {
+    log_perror(NULL, "federation: malloc");
+    close(fd);
+    peer->retry_at = wheel_clock() + FED_RETRY_MAX_MS;
+    return;
+  }
+  if (result == 0)
+    send_hello(peer->link);
+}
+
+static void link_connected(link_t *link) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    err = errno;
+  if (err) {
+    if (!link->peer->failing)
+      log_info(NULL, "federation: cannot reach %s: %s\n", link->peer->spec,
+               strerror(err));
+    link->peer->failing = true;
+    link_close(link, true);
+    return;
+  }
+  link->state = LINK_HELLO;
+  send_hello(link);
+}
+
+static void accept_links(void) {
+  while (true) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_perror(NULL, "federation: accept");
+      return;
+    }
+    if (set_nonblocking(fd) == -1) {
+      log_perror(NULL, "federation: fcntl");
+      close(fd);
+      continue;
+    }
+    link_t *link = link_new(fd, LINK_HELLO, NULL);
+    if (!link) {
+      log_perror(NULL, "federation: malloc");
+      close(fd);
+      continue;
+    }
+    send_hello(link);
+  }
+}
+
+// copies every queued local event onto the links it is meant for. links
+// still saying hello skip them, their sync covers what happened meanwhile.
+static void drain_inbox(void) {
+  uint64_t value;
+  if (read(wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    log_perror(NULL, "federation: eventfd read");
+  // cleared before draining, so a push that misses this drain wakes us again
+  atomic_store(&wake_pending, false);
+
+  mpsc_node_t *node;
+  while ((node = mpsc_pop(&inbox))) {
+    outbound_t *out = (outbound_t *)node;
+    for (link_t *link = links; link; link = link->next) {
+      if (link->state == LINK_UP &&
+          (out->to[0] == '\0' || strcmp(out->to, link->node) == 0))
+        link_send(link, out->data, out->len);
+    }
+    pool_buf_free(out);
+  }
+}
+
+static void reap_links(void) {
+  link_t **slot = &links;
+  while (*slot) {
+    link_t *link = *slot;
+    if (link->state != LINK_DEAD) {
+      slot = &link->next;
+      continue;
+    }
+    *slot = link->next;
+    free(link->out);
+    free(link);
+  }
+}
+
+// EVENT LOOP
+
+// milliseconds until the next dial is due, -1 if none is waiting
+static int dial_due(uint64_t now) {
+  int wait = -1;
+  for (int i = 0; i < peer_count; i++) {
+    peer_t *peer = &peers[i];
+    // a link the node dialed us on does just as well
+    if (peer->link || (peer->node[0] && link_find_node(peer->node, NULL)))
+      continue;
+    if (peer->retry_at <= now) {
+      peer_dial(peer);
+      if (peer->link)
+        continue;
+    }
+    int left = (int)(peer->retry_at - now);
+    if (wait < 0 || left < wait)
+      wait = left;
+  }
+  return wait;
+}
+
+static void *federation_run(void *) {
+  struct pollfd *fds = NULL;
+  link_t **polled = NULL;
+  size_t cap = 0;
+  // deliveries to local clients leave together once a pass is done
+  outq_batch_begin();
+  while (true) {
+    int wait = dial_due(wheel_clock());
+    long held = outq_batch_wait();
+    if (held >= 0 && (wait < 0 || held / 1000 < wait))
+      wait = (int)(held / 1000);
+
+    size_t count = 0;
+    for (link_t *link = links; link; link = link->next)
+      count++;
+    if (count + 2 > cap) {
+      size_t grown = (count + 2) * 2;
+      struct pollfd *grown_fds = realloc(fds, grown * sizeof(*fds));
+      if (grown_fds)
+        fds = grown_fds;
+      link_t **grown_polled = realloc(polled, grown * sizeof(*polled));
+      if (grown_polled)
+        polled = grown_polled;
+      if (!grown_fds || !grown_polled) {
+        log_perror(NULL, "federation: malloc");
+        sleep(1);
+        continue;
+      }
+      cap = grown;
+    }
+
+    size_t n = 0;
+    fds[n++] = (struct pollfd){.fd = wake_fd, .events = POLLIN};
+    fds[n++] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+    for (link_t *link = links; link; link = link->next) {
+      short events = POLLIN;
+      if (link->state == LINK_CONNECTING || link->out_len > 0)
+        events = link->state == LINK_CONNECTING ? POLLOUT : POLLIN | POLLOUT;
+      polled[n] = link;
+      fds[n++] = (struct pollfd){.fd = link->fd, .events = events};
+    }
+
+    if (poll(fds, n, wait) == -1) {
+      if (errno == EINTR)
+        continue;
+      log_perror(NULL, "federation: poll");
+      sleep(1);
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN)
+      drain_inbox();
+    if (fds[1].revents & POLLIN)
+      accept_links();
+    for (size_t i = 2; i < n; i++) {
+      link_t *link = polled[i];
+      short revents = fds[i].revents;
+      if (!revents || link->state == LINK_DEAD)
+        continue;
+      if (link->state == LINK_CONNECTING) {
+        link_connected(link);
+        continue;
+      }
+      if (revents & (POLLIN | POLLHUP | POLLERR))
+        link_readable(link);
+    }
+
+    // replies and everything drained above leave in one write per link
+    for (link_t *link = links; link; link = link->next)
+      link_flush(link);
+    reap_links();
+    outq_batch_flush();
+    epoch_reclaim();
+  }
+  return NULL;
+}
+
+// SETUP
+
+// ip:port, or just a port when default_ip is set
+static int parse_addr(const char *spec, const char *default_ip,
+                      struct sockaddr_in *addr) {
+  char ip[INET_ADDRSTRLEN];
+  const char *port = strrchr(spec, ':');
+  if (port) {
+    size_t len = port - spec;
+    if (len >= sizeof(ip))
+      return EINVAL;
+    memcpy(ip, spec, len);
+    ip[len] = '\0';
+    port++;
+  } else if (default_ip) {
+    snprintf(ip, sizeof(ip), "%s", default_ip);
+    port = spec;
+  } else {
+    return EINVAL;
+  }
+
+  char *end;
+  long value = strtol(port, &end, 10);
+  if (*port == '\0' || *end != '\0' || value <= 0 || value > 65535)
+    return EINVAL;
+  *addr = (struct sockaddr_in){
+      .sin_family = AF_INET,
+      .sin_port = htons((uint16_t)value),
+  };
+  if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1)
+    return EINVAL;
+  return 0;
+}
+
+static int open_peer_listener(const char *spec) {
+  struct sockaddr_in addr;
+  if (parse_addr(spec, "127.0.0.1", &addr)) {
+    log_err(NULL, "federation: bad listen address '%s'\n", spec);
+    errno = EINVAL;
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    log_perror(NULL, "federation: socket");
+    return -1;
+  }
+  int opt = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, SOMAXCONN) == -1 || set_nonblocking(fd) == -1) {
+    int saved = errno;
+    log_perror(NULL, "federation: listen");
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+int federation_start(federation_options_t options,
+                     const federation_handlers_t *handlers_) {
+  if (!options.node || options.node[0] == '\0' ||
+      strlen(options.node) > MAX_NODE_LEN) {
+    log_err(NULL, "federation: node names are 1 to %d characters\n",
+            MAX_NODE_LEN);
+    return EINVAL;
+  }
+  snprintf(self_node, sizeof(self_node), "%s", options.node);
+  handlers = *handlers_;
+
+  peer_count = options.peer_count;
+  for (int i = 0; i < peer_count; i++) {
+    peers[i] = (peer_t){.spec = options.peers[i], .backoff = FED_RETRY_MIN_MS};
+    if (parse_addr(options.peers[i], NULL, &peers[i].addr)) {
+      log_err(NULL, "federation: bad peer address '%s', expected ip:port\n",
+              options.peers[i]);
+      return EINVAL;
+    }
+  }
+
+  if (options.listen) {
+    listen_fd = open_peer_listener(options.listen);
+    if (listen_fd == -1)
+      return errno;
+  }
+  mpsc_init(&inbox);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd == -1) {
+    int saved = errno;
+    log_perror(NULL, "federation: eventfd");
+    if (listen_fd != -1)
+      close(listen_fd);
+    return saved;
+  }
+
+  // sessions start publishing from here on
+  enabled = true;
+  pthread_t tid;
+  int err = pthread_create(&tid, NULL, federation_run, NULL);
+  if (err) {
+    log_err(NULL, "pthread_create: %s\n", strerror(err));
+    enabled = false;
+    return err;
+  }
+  pthread_detach(tid);
+  log_info(NULL, "federation: node %s, %d peer%s%s%s\n", self_node,
+           peer_count, peer_count == 1 ? "" : "s",
+           options.listen ? ", links on " : "",
+           options.listen ? options.listen : "");
+  return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "session.h"
+
+// links server processes into one cluster. every node dials the peers it was
+// given and accepts links from the others, so nodes that all know each other
+// form a full mesh and every event crosses each link once: a chat message
+// costs one frame per peer node, not one per remote user. nothing is passed
+// on, a node only speaks for its own clients. dropped links are dialed again
+// with backoff, and the users behind them are gone until the link is back.
+//
+// names are unique across the cluster. a node refuses names its peers have
+// announced, and when two nodes hand out the same name at once, the claim of
+// the node whose name sorts first wins everywhere and the other user is
+// disconnected.
+
+#define FEDERATION_MAX_PEERS 32
+#define MAX_NODE_LEN 32
+
+typedef struct {
+  // unique name of this node, <hostname>:<port> when NULL
+  const char *node;
+  // [ip:]port to accept peer links on, 127.0.0.1 without an ip. NULL only
+  // dials out.
+  const char *listen;
+  // ip:port of the nodes to dial
+  const char *peers[FEDERATION_MAX_PEERS];
+  int peer_count;
+} federation_options_t;
+
+// what the server does with events from other nodes. all of them run on the
+// federation thread.
+typedef struct {
+  // announce is false for users a node lists when a link comes up
+  void (*joined)(const char *node, const char *name, const char *ip,
+                 uint16_t port, bool announce);
+  void (*left)(const char *node, const char *name, const char *ip,
+               uint16_t port);
+  void (*renamed)(const char *node, const char *old_name, const char *name,
+                  const char *ip, uint16_t port);
+  void (*chat)(const char *channel, const char *name, const char *text);
+  void (*notice)(const char *channel, const char *name, bool joined);
+  void (*direct)(const char *to, const char *from, const char *text);
+  // a local user lost its name to a claim from node
+  void (*evicted)(const char *name, const char *node);
+  // a link came up with users behind it, or went down and took them along
+  void (*link)(const char *node, bool up, size_t users);
+} federation_handlers_t;
+
+// starts the federation thread. returns 0 or an errno value.
+int federation_start(federation_options_t options,
+                     const federation_handlers_t *handlers);
+
+// local events, queued for every linked node. they return right away and do
+// nothing while federation is off. announce is false for users that only
+// moved here in a handover.
+void federation_join(const char *name, const char *ip, uint16_t port,
+                     bool announce);
+void federation_leave(const char *name);
+void federation_rename(const char *old_name, const char *name,
+                       const char *ip, uint16_t port);
+void federation_chat(const char *channel, const char *name, const char *text);
+void federation_notice(const char *channel, const char *name, bool joined);
+// returns 0 if a user on another node has that name and the message is on
+// its way there, ENOENT otherwise
+int federation_direct(const char *to, const char *from, const char *text);
+
+// whether a user on another node has name
+bool federation_name_taken(const char *name);
+
+typedef struct {
+  char name[MAX_NAME_LEN + 1];
+  char node[MAX_NODE_LEN + 1];
+  char ip[INET_ADDRSTRLEN];
+  uint16_t port;
+} remote_user_t;
+
+// copies up to cap users of other nodes and returns how many there are
+size_t federation_users(remote_user_t *out, size_t cap);
+
+#endif // FEDERATION_H
@@ -0,0 +1,94 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+#include "pool.h"
+#include "utils.h"
+
+static frame_t *frame_alloc(char type, const char *content, size_t len) {
+  frame_t *frame = pool_buf_alloc(sizeof(*frame) + len);
+  if (!frame)
+    return NULL;
+
+  atomic_init(&frame->refs, 1);
+  frame->len = (uint32_t)len;
+  frame->type = type;
+  frame->v2 = NULL;
+  atomic_init(&frame->z, NULL);
+  memcpy(frame->payload, content, len);
+  return frame;
+}
+
+frame_t *frame_new_len(char type, const char *content, size_t len) {
+  frame_t *frame = frame_alloc(type, content, len);
+  if (!frame)
+    return NULL;
+
+  uint32_t magic = htonl(PROTO_MAGIC);
+  uint32_t net_len = htonl((uint32_t)len);
+  frame->version = 1;
+  frame->header_len = 9;
+  memcpy(frame->header, &magic, 4);
+  memcpy(frame->header + 4, &net_len, 4);
+  frame->header[8] = type;
+  return frame;
+}
+
+frame_t *frame_new(char type, const char *content) {
+  return frame_new_len(type, content, strlen(content));
+}
+
+frame_t *frame_new_v2(char type, const char *content, size_t len) {
+  frame_t *frame = frame_alloc(type, content, len);
+  if (!frame)
+    return NULL;
+
+  frame->version = 2;
+  size_t n = proto_put_varint(frame->header, len);
+  frame->header[n] = type;
+  frame->header_len = (uint8_t)(n + 1);
+  return frame;
+}
+
+frame_t *frame_for_v2(frame_t *frame) {
+  if (frame->version == 2 || frame->v2) {
+    frame_t *v2 = frame->version == 2 ? frame : frame->v2;
+    frame_get(v2);
+    return v2;
+  }
+  return frame_new_v2(frame->type, frame->payload, frame->len);
+}
+
+void frame_get(frame_t *frame) { atomic_fetch_add(&frame->refs, 1); }
+
+void frame_put(frame_t *frame) {
+  if (atomic_fetch_sub(&frame->refs, 1) == 1) {
+    if (frame->v2)
+      frame_put(frame->v2);
+    frame_t *z = atomic_load(&frame->z);
+    if (z && z != frame)
+      frame_put(z);
+    pool_buf_free(frame);
+  }
+}
+
+int frame_iov(frame_t *frame, size_t off, struct iovec *iov) {
+  int count = 0;
+  if (off < frame->header_len) {
+    iov[count++] = (struct iovec){
+        .iov_base = frame->header + off,
+        .iov_len = frame->header_len - off,
+    };
+    off = 0;
+  } else {
+    off -= frame->header_len;
+  }
+  if (off < frame->len) {
+    iov[count++] = (struct iovec){
+        .iov_base = frame->payload + off,
+        .iov_len = frame->len - off,
+    };
+  }
+  return count;
+}
@@ -0,0 +1,48 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// an encoded server frame. immutable once built but for its cached
+// compressed form, so a single instance is shared by every recipient of a
+// broadcast and released by the last one.
+typedef struct frame {
+  atomic_int refs;
+  uint32_t len;
+  // 1 or 2, the protocol version it is framed for
+  uint8_t version;
+  char type;
+  // v1: <magic: 4><length: 4 BE><type: 1>, v2: <length: varint><type: 1>
+  uint8_t header_len;
+  char header[9];
+  // the same thing for v2 clients, typically as an event, NULL if they get
+  // the content as it is. a v1 frame holds a reference on it.
+  struct frame *v2;
+  // the SERVER_DEFLATE form in the same framing, or the frame itself when
+  // compressing does not pay. NULL until a deflate client needs it, see
+  // zframe_for.
+  _Atomic(struct frame *) z;
+  char payload[];
+} frame_t;
+
+frame_t *frame_new(char type, const char *content);
+frame_t *frame_new_len(char type, const char *content, size_t len);
+frame_t *frame_new_v2(char type, const char *content, size_t len);
+// a reference on what a v2 client gets for frame: frame itself when it is
+// v2 already, its v2 twin, or else a v2 copy of its content. NULL when the
+// copy cannot be allocated.
+frame_t *frame_for_v2(frame_t *frame);
+void frame_get(frame_t *frame);
+void frame_put(frame_t *frame);
+
+static inline size_t frame_size(const frame_t *frame) {
+  return frame->header_len + frame->len;
+}
+
+// fills at most 2 iovecs with the bytes of frame past off, returns the count
+int frame_iov(frame_t *frame, size_t off, struct iovec *iov);
+
+#endif // FRAME_H
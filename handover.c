@@ -0,0 +1,789 @@
+// clock_gettime is hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "channels.h"
+#include "chatlog.h"
+#include "handover.h"
+#include "history.h"
+#include "log.h"
+#include "outq.h"
+
+// the successor opens with this, a different version is turned away
+#define HANDOVER_VERSION "ctalk-handover 2"
+// fds one message can carry, the kernel's SCM_MAX_FD
+#define HANDOVER_FDS_MAX 253
+// state bytes per message, well under the default socket buffer
+#define HANDOVER_CHUNK (64 * 1024)
+// how long the new process waits for the old one to be gone
+#define HANDOVER_EXIT_WAIT_MS 10000
+
+// messages on the handover socket, one type byte first. the old process
+// sends data chunks with fds attached in the order the state refers to them,
+// then the totals, and exits once the new process acknowledged.
+typedef enum {
+  MSG_DATA = 'D',
+  // <state bytes: 8 BE><fds: 4 BE>
+  MSG_END = 'E',
+  MSG_ACK = 'K',
+} handover_msg_e;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ENCODING
+// the state is one buffer, integers are big-endian, strings and byte runs
+// carry a 4 byte length:
+//   <listeners: 4><fd index: 4>...
+//   <history: 4><frame>...
+//   <sessions: 4><session>...
+// a frame is <type: 1><bytes>, a session <fd index: 4><ip><port: 2><name>
+// <state: 1><attempts: 1><flags: 1><prompt><deadline: 8><last_rx: 8>
+// <ping_sent: 8><channel><rx bytes><tx count: 4><tx off: 4><frame>...
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+  bool failed;
+} buffer_t;
+
+static void put_bytes(buffer_t *b, const void *data, size_t len) {
+  if (b->failed)
+    return;
+  if (b->len + len > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + len)
+      cap *= 2;
+    char *buf = realloc(b->buf, cap);
+    if (!buf) {
+      b->failed = true;
+      return;
+    }
+    b->buf = buf;
+    b->cap = cap;
+  }
+  memcpy(b->buf + b->len, data, len);
+  b->len += len;
+}
+
+static void put_u8(buffer_t *b, uint8_t value) { put_bytes(b, &value, 1); }
+
+static void put_u16(buffer_t *b, uint16_t value) {
+  uint16_t be = htons(value);
+  put_bytes(b, &be, sizeof(be));
+}
+
+static void put_u32(buffer_t *b, uint32_t value) {
+  uint32_t be = htonl(value);
+  put_bytes(b, &be, sizeof(be));
+}
+
+static void put_u64(buffer_t *b, uint64_t value) {
+  put_u32(b, (uint32_t)(value >> 32));
+  put_u32(b, (uint32_t)value);
+}
+
+static void put_run(buffer_t *b, const void *data, size_t len) {
+  put_u32(b, (uint32_t)len);
+  put_bytes(b, data, len);
+}
+
+static void put_str(buffer_t *b, const char *s) { put_run(b, s, strlen(s)); }
+
+// <version: 1><type: 1><payload>, then the v2 twin if there is one
+static void put_frame(buffer_t *b, const frame_t *frame) {
+  put_u8(b, frame->version);
+  put_u8(b, (uint8_t)frame->type);
+  put_run(b, frame->payload, frame->len);
+  put_u8(b, frame->v2 != NULL);
+  if (frame->v2)
+    put_frame(b, frame->v2);
+}
+
+typedef struct {
+  const char *p;
+  size_t left;
+  bool bad;
+} decoder_t;
+
+static const char *dec_bytes(decoder_t *d, size_t len) {
+  if (d->bad || d->left < len) {
+    d->bad = true;
+    return NULL;
+  }
+  const char *p = d->p;
+  d->p += len;
+  d->left -= len;
+  return p;
+}
+
+static uint8_t dec_u8(decoder_t *d) {
+  const char *p = dec_bytes(d, 1);
+  return p ? (uint8_t)*p : 0;
+}
+
+static uint16_t dec_u16(decoder_t *d) {
+  const char *p = dec_bytes(d, 2);
+  if (!p)
+    return 0;
+  uint16_t be;
+  memcpy(&be, p, sizeof(be));
+  return ntohs(be);
+}
+
+static uint32_t dec_u32(decoder_t *d) {
+  const char *p = dec_bytes(d, 4);
+  if (!p)
+    return 0;
+  uint32_t be;
+  memcpy(&be, p, sizeof(be));
+  return ntohl(be);
+}
+
+static uint64_t dec_u64(decoder_t *d) {
+  uint64_t high = dec_u32(d);
+  return high << 32 | dec_u32(d);
+}
+
+// a byte run of at most max bytes, NULL if it is longer or cut off
+static const char *dec_run(decoder_t *d, size_t max, size_t *len) {
+  *len = dec_u32(d);
+  if (*len > max) {
+    d->bad = true;
+    return NULL;
+  }
+  return dec_bytes(d, *len);
+}
+
+// copies a string of at most max bytes into out, which has room for max + 1
+static void dec_str(decoder_t *d, char *out, size_t max) {
+  size_t len;
+  const char *p = dec_run(d, max, &len);
+  if (!p) {
+    d->bad = true;
+    out[0] = '\0';
+    return;
+  }
+  memcpy(out, p, len);
+  out[len] = '\0';
+}
+
+static frame_t *dec_frame(decoder_t *d) {
+  uint8_t version = dec_u8(d);
+  char type = (char)dec_u8(d);
+  size_t len;
+  const char *payload = dec_run(d, UINT32_MAX, &len);
+  if (!payload)
+    return NULL;
+  frame_t *frame = version == 2 ? frame_new_v2(type, payload, len)
+                                : frame_new_len(type, payload, len);
+  if (!frame) {
+    d->bad = true;
+    return NULL;
+  }
+  // only v1 frames have a twin
+  if (dec_u8(d)) {
+    frame->v2 = version == 1 ? dec_frame(d) : NULL;
+    if (!frame->v2)
+      d->bad = true;
+  }
+  return frame;
+}
+
+// OLD PROCESS
+
+static const char *socket_path;
+static int listen_fd = -1;
+static handover_freeze_fn freeze;
+
+// filled by the frozen event loops
+static pthread_mutex_t export_mu = PTHREAD_MUTEX_INITIALIZER;
+static int *export_fds;
+static size_t export_fd_count;
+static size_t export_fd_cap;
+static buffer_t export_listeners;
+static size_t export_listener_count;
+static buffer_t export_sessions;
+static size_t export_session_count;
+
+// returns the fd's index in the handover, or -1
+static int64_t export_fd(int fd) {
+  if (export_fd_count == export_fd_cap) {
+    size_t cap = export_fd_cap ? export_fd_cap * 2 : 1024;
+    int *fds = realloc(export_fds, cap * sizeof(*fds));
+    if (!fds)
+      return -1;
+    export_fds = fds;
+    export_fd_cap = cap;
+  }
+  export_fds[export_fd_count] = fd;
+  return (int64_t)export_fd_count++;
+}
+
+void handover_add_listener(int fd) {
+  pthread_mutex_lock(&export_mu);
+  int64_t index = export_fd(fd);
+  if (index == -1) {
+    export_listeners.failed = true;
+  } else {
+    put_u32(&export_listeners, (uint32_t)index);
+    export_listener_count++;
+  }
+  pthread_mutex_unlock(&export_mu);
+}
+
+void handover_add_session(client_ctx_t *ctx, const proto_reader_t *rx) {
+  frame_t **tx;
+  size_t tx_count;
+  size_t tx_off;
+  if (outq_export(ctx->out, &tx, &tx_count, &tx_off) == -1) {
+    log_err(LOG_CTX(ctx), "handover: lost the send backlog\n");
+    tx = NULL;
+    tx_count = tx_off = 0;
+  }
+
+  pthread_mutex_lock(&export_mu);
+  buffer_t *b = &export_sessions;
+  int64_t index = export_fd(ctx->fd);
+  if (index == -1)
+    b->failed = true;
+  put_u32(b, (uint32_t)index);
+  put_str(b, ctx->ip);
+  put_u16(b, ctx->port);
+  put_str(b, ctx->name);
+  put_u8(b, (uint8_t)ctx->state);
+  put_u8(b, (uint8_t)ctx->attempts);
+  put_u8(b, (uint8_t)(ctx->pipelined | ctx->ping << 1 | ctx->v2 << 2 |
+                      ctx->deflate << 3));
+  put_str(b, ctx->prompt);
+  put_u64(b, ctx->deadline);
+  put_u64(b, ctx->last_rx);
+  put_u64(b, ctx->ping_sent);
+  put_str(b, ctx->state == SESSION_CHAT ? channels_name(ctx->channel) : "");
+  put_run(b, rx->buf + rx->off, rx->len - rx->off);
+  put_u32(b, (uint32_t)tx_count);
+  put_u32(b, (uint32_t)tx_off);
+  for (size_t i = 0; i < tx_count; i++)
+    put_frame(b, tx[i]);
+  export_session_count++;
+  pthread_mutex_unlock(&export_mu);
+
+  for (size_t i = 0; i < tx_count; i++)
+    frame_put(tx[i]);
+  free(tx);
+}
+
+void handover_park(void) {
+  while (true)
+    pause();
+}
+
+// everything the frozen loops exported, plus the history
+static int build_state(buffer_t *state) {
+  put_u32(state, (uint32_t)export_listener_count);
+  put_bytes(state, export_listeners.buf, export_listeners.len);
+
+  frame_t *history[HISTORY_MAX_LEN];
+  size_t history_count = history_snapshot(history, HISTORY_MAX_LEN);
+  put_u32(state, (uint32_t)history_count);
+  for (size_t i = 0; i < history_count; i++) {
+    put_frame(state, history[i]);
+    frame_put(history[i]);
+  }
+
+  put_u32(state, (uint32_t)export_session_count);
+  put_bytes(state, export_sessions.buf, export_sessions.len);
+  if (state->failed || export_listeners.failed || export_sessions.failed)
+    return ENOMEM;
+  return 0;
+}
+
+static int send_msg(int sock, struct msghdr *msg) {
+  while (sendmsg(sock, msg, MSG_NOSIGNAL) == -1) {
+    if (errno != EINTR)
+      return errno;
+  }
+  return 0;
+}
+
+// the state in chunks, each carrying the next fds along
+static int send_state(int sock, const buffer_t *state) {
+  size_t off = 0;
+  size_t fd_off = 0;
+  while (off < state->len || fd_off < export_fd_count) {
+    size_t len = state->len - off;
+    if (len > HANDOVER_CHUNK)
+      len = HANDOVER_CHUNK;
+    size_t fds = export_fd_count - fd_off;
+    if (fds > HANDOVER_FDS_MAX)
+      fds = HANDOVER_FDS_MAX;
+
+    char type = MSG_DATA;
+    struct iovec iov[2] = {
+        {.iov_base = &type, .iov_len = 1},
+        {.iov_base = state->buf + off, .iov_len = len},
+    };
+    union {
+      char buf[CMSG_SPACE(HANDOVER_FDS_MAX * sizeof(int))];
+      struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    if (fds > 0) {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = CMSG_SPACE(fds * sizeof(int));
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(fds * sizeof(int));
+      memcpy(CMSG_DATA(cmsg), export_fds + fd_off, fds * sizeof(int));
+    }
+    int err = send_msg(sock, &msg);
+    if (err)
+      return err;
+    off += len;
+    fd_off += fds;
+  }
+
+  buffer_t end = {0};
+  put_u8(&end, MSG_END);
+  put_u64(&end, state->len);
+  put_u32(&end, (uint32_t)export_fd_count);
+  if (end.failed)
+    return ENOMEM;
+  struct iovec iov = {.iov_base = end.buf, .iov_len = end.len};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  int err = send_msg(sock, &msg);
+  free(end.buf);
+  return err;
+}
+
+static int wait_ack(int sock) {
+  char ack;
+  ssize_t n;
+  while ((n = recv(sock, &ack, 1, 0)) == -1 && errno == EINTR)
+    ;
+  if (n == -1)
+    return errno;
+  return n == 1 && ack == MSG_ACK ? 0 : EPROTO;
+}
+
+// stops everything and passes it on, then exits
+static void hand_over(int sock) {
+  uint64_t start = now_us();
+  log_info(NULL, "handover: successor connected, stopping event loops\n");
+  freeze();
+  uint64_t frozen = now_us();
+
+  buffer_t state = {0};
+  int err = build_state(&state);
+  if (!err)
+    err = send_state(sock, &state);
+  if (!err)
+    err = wait_ack(sock);
+  if (err) {
+    // the loops cannot pick up where they stopped, the clients are lost
+    log_err(NULL, "handover: failed with everything stopped, exiting: %s\n",
+            strerror(err));
+    log_stop();
+    _exit(1);
+  }
+
+  uint64_t done = now_us();
+  log_info(NULL,
+           "handover: %zu sessions and %zu listeners, %zu state bytes, in "
+           "%.1f ms (%.1f ms stopping the loops)\n",
+           export_session_count, export_listener_count, state.len,
+           (done - start) / 1000.0, (frozen - start) / 1000.0);
+  // the successor binds it again once this process is gone
+  unlink(socket_path);
+  chatlog_close();
+  log_stop();
+  _exit(0);
+}
+
+static void *handover_run(void *) {
+  while (true) {
+    int sock = accept(listen_fd, NULL, NULL);
+    if (sock == -1) {
+      if (errno != EINTR)
+        log_perror(NULL, "handover: accept");
+      continue;
+    }
+
+    char hello[64];
+    ssize_t n = recv(sock, hello, sizeof(hello), 0);
+    if (n != (ssize_t)strlen(HANDOVER_VERSION) ||
+        memcmp(hello, HANDOVER_VERSION, n) != 0) {
+      log_err(NULL, "handover: turned away a successor speaking another "
+                    "protocol\n");
+      close(sock);
+      continue;
+    }
+    hand_over(sock);
+  }
+  return NULL;
+}
+
+int handover_listen(const char *path, handover_freeze_fn freeze_) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_err(NULL, "handover: socket path too long\n");
+    return ENAMETOOLONG;
+  }
+  strcpy(addr.sun_path, path);
+
+  listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    log_perror(NULL, "handover: socket");
+    return errno;
+  }
+  // left behind by a process that did not get to hand over
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, 1) == -1) {
+    int saved = errno;
+    log_perror(NULL, "handover: bind");
+    close(listen_fd);
+    return saved;
+  }
+  socket_path = path;
+  freeze = freeze_;
+
+  pthread_t tid;
+  int err = pthread_create(&tid, NULL, handover_run, NULL);
+  if (err) {
+    log_err(NULL, "pthread_create: %s\n", strerror(err));
+    close(listen_fd);
+    return err;
+  }
+  pthread_detach(tid);
+  log_info(NULL, "handover: a successor can take over on %s\n", path);
+  return 0;
+}
+
+// NEW PROCESS
+
+typedef struct {
+  const int *fds;
+  size_t count;
+  // every fd goes to exactly one owner, so a bad index cannot close one twice
+  bool *used;
+} fd_table_t;
+
+static int dec_fd(decoder_t *d, fd_table_t *table) {
+  uint32_t index = dec_u32(d);
+  if (d->bad || index >= table->count || table->used[index]) {
+    d->bad = true;
+    return -1;
+  }
+  table->used[index] = true;
+  return table->fds[index];
+}
+
+static int decode_state(decoder_t *d, const int *fds, size_t fd_count,
+                        handover_t *out) {
+  fd_table_t table = {.fds = fds, .count = fd_count};
+  table.used = calloc(fd_count ? fd_count : 1, sizeof(*table.used));
+  if (!table.used)
+    return ENOMEM;
+
+  size_t listen_count = dec_u32(d);
+  if (!d->bad && listen_count > fd_count)
+    d->bad = true;
+  if (!d->bad) {
+    out->listen_fds =
+        malloc((listen_count ? listen_count : 1) * sizeof(*out->listen_fds));
+    if (!out->listen_fds)
+      d->bad = true;
+  }
+  for (size_t i = 0; !d->bad && i < listen_count; i++) {
+    out->listen_fds[i] = dec_fd(d, &table);
+    out->listen_count++;
+  }
+
+  size_t history_len = dec_u32(d);
+  if (!d->bad && history_len > HISTORY_MAX_LEN)
+    d->bad = true;
+  if (!d->bad) {
+    out->history = calloc(history_len ? history_len : 1, sizeof(frame_t *));
+    if (!out->history)
+      d->bad = true;
+  }
+  for (size_t i = 0; !d->bad && i < history_len; i++) {
+    frame_t *frame = dec_frame(d);
+    if (frame)
+      out->history[out->history_len++] = frame;
+  }
+
+  size_t session_count = dec_u32(d);
+  if (!d->bad && session_count > fd_count)
+    d->bad = true;
+  if (!d->bad) {
+    out->sessions =
+        calloc(session_count ? session_count : 1, sizeof(*out->sessions));
+    if (!out->sessions)
+      d->bad = true;
+  }
+  for (size_t i = 0; !d->bad && i < session_count; i++) {
+    handover_session_t *s = &out->sessions[i];
+    s->fd = dec_fd(d, &table);
+    // counted now, so a session cut off halfway is still freed
+    out->session_count++;
+    dec_str(d, s->ip, sizeof(s->ip) - 1);
+    s->port = dec_u16(d);
+    dec_str(d, s->name, MAX_NAME_LEN);
+    s->state = dec_u8(d) == SESSION_CHAT ? SESSION_CHAT : SESSION_HANDSHAKE;
+    s->attempts = dec_u8(d);
+    uint8_t flags = dec_u8(d);
+    s->pipelined = flags & 1;
+    s->ping = flags & 2;
+    s->v2 = flags & 4;
+    s->deflate = flags & 8;
+    dec_str(d, s->prompt, sizeof(s->prompt) - 1);
+    s->deadline = dec_u64(d);
+    s->last_rx = dec_u64(d);
+    s->ping_sent = dec_u64(d);
+    dec_str(d, s->channel, MAX_CHANNEL_LEN);
+
+    size_t rx_len;
+    const char *rx = dec_run(d, SESSION_RX_SIZE, &rx_len);
+    if (rx && rx_len > 0) {
+      s->rx = malloc(rx_len);
+      if (s->rx) {
+        memcpy(s->rx, rx, rx_len);
+        s->rx_len = rx_len;
+      } else {
+        d->bad = true;
+      }
+    }
+
+    size_t tx_count = dec_u32(d);
+    s->tx_off = dec_u32(d);
+    if (tx_count > OUTQ_SLOTS)
+      d->bad = true;
+    if (!d->bad && tx_count > 0) {
+      s->tx = calloc(tx_count, sizeof(*s->tx));
+      if (!s->tx)
+        d->bad = true;
+    }
+    for (size_t j = 0; !d->bad && j < tx_count; j++) {
+      frame_t *frame = dec_frame(d);
+      if (frame)
+        s->tx[s->tx_count++] = frame;
+    }
+  }
+
+  if (!d->bad && d->left > 0)
+    d->bad = true;
+  // fds the state never mentioned
+  for (size_t i = 0; i < fd_count; i++) {
+    if (!table.used[i])
+      close(fds[i]);
+  }
+  free(table.used);
+  return d->bad ? EPROTO : 0;
+}
+
+// reads chunks until the end marker, collecting the state and the fds
+static int receive_state(int sock, buffer_t *state, int **fds,
+                         size_t *fd_count) {
+  char *chunk = malloc(1 + HANDOVER_CHUNK);
+  if (!chunk)
+    return ENOMEM;
+  size_t fd_cap = 0;
+  int err = 0;
+  while (true) {
+    union {
+      char buf[CMSG_SPACE(HANDOVER_FDS_MAX * sizeof(int))];
+      struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = chunk, .iov_len = 1 + HANDOVER_CHUNK};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n = recvmsg(sock, &msg, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      err = errno;
+      break;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (*fd_count + count > fd_cap) {
+        size_t cap = fd_cap ? fd_cap * 2 : 1024;
+        while (cap < *fd_count + count)
+          cap *= 2;
+        int *grown = realloc(*fds, cap * sizeof(*grown));
+        if (!grown) {
+          // closed right away, the handover fails below anyway
+          for (size_t i = 0; i < count; i++)
+            close(((int *)CMSG_DATA(cmsg))[i]);
+          err = ENOMEM;
+          continue;
+        }
+        *fds = grown;
+        fd_cap = cap;
+      }
+      memcpy(*fds + *fd_count, CMSG_DATA(cmsg), count * sizeof(int));
+      *fd_count += count;
+    }
+    if (err)
+      break;
+    if (n == 0 || msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+      err = EPROTO;
+      break;
+    }
+
+    if (chunk[0] == MSG_DATA) {
+      put_bytes(state, chunk + 1, n - 1);
+      if (state->failed) {
+        err = ENOMEM;
+        break;
+      }
+      continue;
+    }
+    decoder_t d = {.p = chunk + 1, .left = n - 1};
+    uint64_t len = dec_u64(&d);
+    uint32_t count = dec_u32(&d);
+    if (chunk[0] != MSG_END || d.bad || len != state->len ||
+        count != *fd_count)
+      err = EPROTO;
+    break;
+  }
+  free(chunk);
+  return err;
+}
+
+// the listeners are shared until the old process is gone, and it still holds
+// the metrics and federation ports
+static void wait_exit(int sock) {
+  struct pollfd pfd = {.fd = sock, .events = POLLIN};
+  uint64_t deadline = now_us() + HANDOVER_EXIT_WAIT_MS * 1000;
+  while (true) {
+    uint64_t now = now_us();
+    int wait = now < deadline ? (int)((deadline - now) / 1000) : 0;
+    int ready = poll(&pfd, 1, wait);
+    if (ready == -1 && errno == EINTR)
+      continue;
+    if (ready <= 0) {
+      log_err(NULL, "handover: the old process is still around\n");
+      return;
+    }
+    char byte;
+    if (recv(sock, &byte, 1, 0) <= 0)
+      return;
+  }
+}
+
+int handover_take(const char *path, handover_t *out) {
+  *out = (handover_t){0};
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_err(NULL, "handover: socket path too long\n");
+    return ENAMETOOLONG;
+  }
+  strcpy(addr.sun_path, path);
+
+  uint64_t start = now_us();
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    log_perror(NULL, "handover: socket");
+    return errno;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      send(sock, HANDOVER_VERSION, strlen(HANDOVER_VERSION), MSG_NOSIGNAL) ==
+          -1) {
+    int saved = errno;
+    log_perror(NULL, "handover: connect");
+    close(sock);
+    return saved;
+  }
+
+  buffer_t state = {0};
+  int *fds = NULL;
+  size_t fd_count = 0;
+  int err = receive_state(sock, &state, &fds, &fd_count);
+  if (err) {
+    for (size_t i = 0; i < fd_count; i++)
+      close(fds[i]);
+  } else {
+    decoder_t d = {.p = state.buf, .left = state.len};
+    err = decode_state(&d, fds, fd_count, out);
+  }
+  free(fds);
+  free(state.buf);
+
+  char ack = MSG_ACK;
+  if (!err && send(sock, &ack, 1, MSG_NOSIGNAL) == -1)
+    err = errno;
+  if (err) {
+    log_err(NULL, "handover: %s\n", strerror(err));
+    handover_free(out);
+    close(sock);
+    return err;
+  }
+  uint64_t received = now_us();
+  wait_exit(sock);
+  close(sock);
+
+  uint64_t done = now_us();
+  log_info(NULL,
+           "handover: took over %zu sessions and %zu listeners in %.1f ms, "
+           "%.1f ms of it waiting for the old process to exit\n",
+           out->session_count, out->listen_count, (done - start) / 1000.0,
+           (done - received) / 1000.0);
+  return 0;
+}
+
+void handover_free(handover_t *taken) {
+  for (size_t i = 0; i < taken->listen_count; i++) {
+    if (taken->listen_fds[i] != -1)
+      close(taken->listen_fds[i]);
+  }
+  for (size_t i = 0; i < taken->history_len; i++)
+    frame_put(taken->history[i]);
+  for (size_t i = 0; i < taken->session_count; i++) {
+    handover_session_t *s = &taken->sessions[i];
+    if (s->fd != -1)
+      close(s->fd);
+    free(s->rx);
+    for (size_t j = 0; j < s->tx_count; j++)
+      frame_put(s->tx[j]);
+    free(s->tx);
+  }
+  free(taken->listen_fds);
+  free(taken->history);
+  free(taken->sessions);
+  *taken = (handover_t){0};
+}
+
+void handover_load_rx(proto_reader_t *rx, const handover_session_t *s) {
+  size_t avail;
+  char *dst = proto_reader_space(rx, &avail);
+  size_t len = s->rx_len < avail ? s->rx_len : avail;
+  memcpy(dst, s->rx, len);
+  proto_reader_filled(rx, len);
+}
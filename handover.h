@@ -0,0 +1,87 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "channels.h"
+#include "frame.h"
+#include "session.h"
+#include "utils.h"
+
+// hot restart. a server started with --handover <path> waits on that unix
+// socket for its successor. a process started with --takeover <path>
+// connects, the old one stops its event loops, and passes its listeners and
+// every client socket over with SCM_RIGHTS, together with each session's
+// state, the frames it had not written yet and the chat history. once the
+// new process has it all, the old one exits and the new one serves the same
+// sockets. clients stay connected, whatever they send meanwhile waits in the
+// socket.
+
+// a session as the old process left it
+typedef struct handover_session {
+  int fd;
+  char ip[INET_ADDRSTRLEN];
+  uint16_t port;
+  char name[MAX_NAME_LEN + 1];
+  session_state_e state;
+  int attempts;
+  bool pipelined;
+  bool ping;
+  bool v2;
+  bool deflate;
+  char prompt[SESSION_PROMPT_SIZE];
+  uint64_t deadline;
+  uint64_t last_rx;
+  uint64_t ping_sent;
+  // empty during the handshake
+  char channel[MAX_CHANNEL_LEN + 1];
+  // received but not parsed yet, less than a whole frame
+  char *rx;
+  size_t rx_len;
+  // queued but not written yet, the first tx_off bytes of tx[0] already went
+  // out. the session owns a reference on each frame.
+  frame_t **tx;
+  size_t tx_count;
+  size_t tx_off;
+} handover_session_t;
+
+typedef struct {
+  int *listen_fds;
+  size_t listen_count;
+  // lobby history, oldest first, a reference on each
+  frame_t **history;
+  size_t history_len;
+  handover_session_t *sessions;
+  size_t session_count;
+} handover_t;
+
+// OLD PROCESS
+
+// stops every event loop for good. each one exports its sessions and
+// listeners with the calls below, then parks in handover_park. returns once
+// all of them did.
+typedef void (*handover_freeze_fn)(void);
+
+// listens on path for a successor and hands everything over when one
+// connects. returns 0 or an errno value.
+int handover_listen(const char *path, handover_freeze_fn freeze);
+
+// called by frozen event loops, from any thread. a session's queue is closed
+// and emptied into the handover.
+void handover_add_listener(int fd);
+void handover_add_session(client_ctx_t *ctx, const proto_reader_t *rx);
+// blocks a frozen event loop until the process exits
+void handover_park(void);
+
+// NEW PROCESS
+
+// takes over from the process listening on path, waiting until it exited.
+// returns 0 or an errno value.
+int handover_take(const char *path, handover_t *out);
+// closes listeners nobody adopted and drops what is left
+void handover_free(handover_t *taken);
+// refills a fresh reader with what the session had received
+void handover_load_rx(proto_reader_t *rx, const handover_session_t *s);
+
+#endif // HANDOVER_H
@@ -0,0 +1,69 @@
+#include "hist.h"
+
+static int bucket_of(uint64_t value) {
+  if (value < 2 * HIST_SUB)
+    return (int)value;
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - HIST_SUB_BITS;
+  int top = (int)(value >> shift);
+  return 2 * HIST_SUB + (shift - 1) * HIST_SUB + (top - HIST_SUB);
+}
+
+static uint64_t bucket_high(int bucket) {
+  if (bucket < 2 * HIST_SUB)
+    return bucket;
+  int shift = (bucket - 2 * HIST_SUB) / HIST_SUB + 1;
+  uint64_t top = (bucket - 2 * HIST_SUB) % HIST_SUB + HIST_SUB;
+  return ((top + 1) << shift) - 1;
+}
+
+static void raise_max(_Atomic uint64_t *max, uint64_t value) {
+  uint64_t seen = atomic_load_explicit(max, memory_order_relaxed);
+  while (value > seen && !atomic_compare_exchange_weak_explicit(
+                             max, &seen, value, memory_order_relaxed,
+                             memory_order_relaxed)) {
+  }
+}
+
+void hist_record(hist_t *hist, uint64_t value) {
+  atomic_fetch_add_explicit(&hist->buckets[bucket_of(value)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+  raise_max(&hist->max, value);
+}
+
+void hist_merge(hist_t *into, const hist_t *from) {
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    uint64_t n = atomic_load_explicit(&from->buckets[i], memory_order_relaxed);
+    if (n)
+      atomic_fetch_add_explicit(&into->buckets[i], n, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(
+      &into->count, atomic_load_explicit(&from->count, memory_order_relaxed),
+      memory_order_relaxed);
+  atomic_fetch_add_explicit(
+      &into->sum, atomic_load_explicit(&from->sum, memory_order_relaxed),
+      memory_order_relaxed);
+  raise_max(&into->max, atomic_load_explicit(&from->max, memory_order_relaxed));
+}
+
+uint64_t hist_percentile(const hist_t *hist, double p) {
+  uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+  if (count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(p * count + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t high = bucket_high(i);
+      return high < max ? high : max;
+    }
+  }
+  return max;
+}
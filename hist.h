@@ -0,0 +1,30 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// log-linear latency histogram: values below 64 are exact, above that every
+// power of two is split into 32 buckets, so any recorded value is off by at
+// most ~3% while the whole u64 range fits in a fixed array. updates are
+// relaxed atomics, so readers may merge while writers record, but writers
+// sharing one histogram contend on it; keep one per thread and merge.
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (2 * HIST_SUB + (64 - HIST_SUB_BITS - 1) * HIST_SUB)
+
+typedef struct {
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+  _Atomic uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+void hist_record(hist_t *hist, uint64_t value);
+void hist_merge(hist_t *into, const hist_t *from);
+// smallest recorded value v such that at least p of all values are <= v,
+// reported as the upper edge of its bucket. p is in [0, 1].
+uint64_t hist_percentile(const hist_t *hist, double p);
+
+#endif // HIST_H
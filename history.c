@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "history.h"
+
+// frames pushed out of the ring are handed to the epoch this many at a time
+// per thread, so an append only takes the epoch's lock once in a while
+#define RETIRE_BATCH 32
+
+typedef struct {
+  // seqlock, odd while an append rewrites the slot
+  atomic_uint seq;
+  // position in the stream, so readers can tell a slot from a lapped one
+  _Atomic uint64_t pos;
+  // NULL until the first lap fills the slot
+  _Atomic(frame_t *) frame;
+} slot_t;
+
+static slot_t *slots;
+// power of two, at least len
+static size_t cap;
+static size_t len;
+static atomic_uint_least64_t next;
+
+typedef struct {
+  size_t len;
+  frame_t *frames[RETIRE_BATCH];
+} batch_t;
+
+static _Thread_local batch_t *batch;
+// hands a thread's partial batch to the epoch when the thread ends
+static pthread_key_t batch_key;
+static pthread_once_t batch_once = PTHREAD_ONCE_INIT;
+
+int history_configure(size_t history_len) {
+  if (history_len == 0)
+    return 0;
+
+  size_t slot_count = 1;
+  while (slot_count < history_len)
+    slot_count <<= 1;
+  slots = calloc(slot_count, sizeof(*slots));
+  if (!slots)
+    return ENOMEM;
+  cap = slot_count;
+  len = history_len;
+  return 0;
+}
+
+size_t history_len(void) { return len; }
+
+static void batch_free(void *batch_raw) {
+  batch_t *b = batch_raw;
+  for (size_t i = 0; i < b->len; i++)
+    frame_put(b->frames[i]);
+  free(b);
+}
+
+static void batch_retire(void *batch_raw) {
+  epoch_retire(batch_raw, batch_free);
+}
+
+static void batch_key_create(void) {
+  pthread_key_create(&batch_key, batch_retire);
+}
+
+// a replay may be copying frame right now, so it is put after a grace period
+static void displace(frame_t *frame) {
+  if (!batch) {
+    pthread_once(&batch_once, batch_key_create);
+    batch = malloc(sizeof(*batch));
+    // better to leak than to put it under a reader
+    if (!batch)
+      return;
+    batch->len = 0;
+    pthread_setspecific(batch_key, batch);
+  }
+  batch->frames[batch->len++] = frame;
+  if (batch->len == RETIRE_BATCH) {
+    pthread_setspecific(batch_key, NULL);
+    epoch_retire(batch, batch_free);
+    batch = NULL;
+  }
+}
+
+void history_append(frame_t *frame) {
+  if (!slots)
+    return;
+
+  uint64_t pos = atomic_fetch_add(&next, 1);
+  slot_t *slot = &slots[pos & (cap - 1)];
+
+  // appends only meet here when they are a whole lap apart
+  unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+  while ((seq & 1) ||
+         !atomic_compare_exchange_weak_explicit(&slot->seq, &seq, seq + 1,
+                                                memory_order_acquire,
+                                                memory_order_relaxed)) {
+    sched_yield();
+    seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+  }
+  atomic_thread_fence(memory_order_release);
+
+  frame_t *old = atomic_load_explicit(&slot->frame, memory_order_relaxed);
+  // a later lap got here first and keeps the slot
+  if (old && atomic_load_explicit(&slot->pos, memory_order_relaxed) > pos) {
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+    return;
+  }
+  frame_get(frame);
+  atomic_store_explicit(&slot->pos, pos, memory_order_relaxed);
+  atomic_store_explicit(&slot->frame, frame, memory_order_relaxed);
+  atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+  if (old)
+    displace(old);
+}
+
+size_t history_snapshot(frame_t **frames, size_t max) {
+  if (!slots)
+    return 0;
+  if (max > len)
+    max = len;
+
+  epoch_enter();
+  uint64_t end = atomic_load(&next);
+  uint64_t start = end > max ? end - max : 0;
+  size_t count = 0;
+  for (uint64_t pos = start; pos < end; pos++) {
+    slot_t *slot = &slots[pos & (cap - 1)];
+    frame_t *frame;
+    uint64_t slot_pos;
+    unsigned seq;
+    do {
+      seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+      frame = atomic_load_explicit(&slot->frame, memory_order_relaxed);
+      slot_pos = atomic_load_explicit(&slot->pos, memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) ||
+             seq != atomic_load_explicit(&slot->seq, memory_order_relaxed));
+    // skip slots still holding an older lap, their writer has not landed yet
+    if (!frame || slot_pos != pos)
+      continue;
+    // a displaced frame is only put once the epoch is over
+    frame_get(frame);
+    frames[count++] = frame;
+  }
+  epoch_exit();
+  return count;
+}
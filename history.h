@@ -0,0 +1,27 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+
+#include "frame.h"
+#include "outq.h"
+
+// bounded ring of the most recent chat frames, replayed to clients as they
+// join. slots hold the frames inline under a sequence each: appends take no
+// lock and allocate once per batch of displaced frames, and a snapshot only
+// retries a slot that an append is rewriting at that moment.
+
+#define HISTORY_DEFAULT_LEN 50
+// a replay is queued all at once, so it has to fit in a client's queue
+#define HISTORY_MAX_LEN (OUTQ_SLOTS / 2)
+
+// keeps the last len frames, 0 turns history off. call before serving.
+int history_configure(size_t len);
+size_t history_len(void);
+
+void history_append(frame_t *frame);
+// stores references to at most max of the newest frames, oldest first, and
+// returns how many. the caller puts them.
+size_t history_snapshot(frame_t **frames, size_t max);
+
+#endif // HISTORY_H
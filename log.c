@@ -0,0 +1,401 @@
+// clock_gettime and gmtime_r are hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+
+// per thread, a handful of the longest lines fit
+#define RING_SIZE (32 * 1024)
+#define LOG_LINE_MAX 1024
+// the writer wakes at least this often, or when a ring is half full
+#define FLUSH_MS 5
+#define OUT_SIZE (64 * 1024)
+#define LEVEL_PAD 0xff
+
+typedef struct {
+  // whole record with its text, rounded up to 8
+  uint32_t size;
+  // LEVEL_PAD for the filler before the ring wraps
+  uint8_t level;
+  bool has_ctx;
+  uint16_t port;
+  uint32_t len;
+  char ip[INET6_ADDRSTRLEN];
+  struct timespec ts;
+  char text[];
+} record_t;
+
+// single producer, the owning thread, and single consumer, the writer.
+// rings are never freed, threads that exit leave theirs for reuse.
+typedef struct ring {
+  atomic_size_t head;
+  // keeps the two ends off the same cache line
+  char pad[64];
+  atomic_size_t tail;
+  atomic_uint_fast64_t dropped;
+  atomic_bool in_use;
+  struct ring *next;
+  _Alignas(8) char buf[RING_SIZE];
+} ring_t;
+
+static log_options_t options = {.level = LOG_LEVEL_INFO};
+static atomic_bool running;
+static _Atomic(ring_t *) rings;
+static _Thread_local ring_t *self;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static pthread_t writer;
+static atomic_bool stopping;
+static atomic_bool poked;
+static pthread_mutex_t wake_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+// dropped lines the writer has already reported
+static uint64_t reported;
+
+static const char *level_names[] = {
+    [LOG_LEVEL_DEBUG] = "debug",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_ERROR] = "error",
+};
+static const char *level_colors[] = {
+    [LOG_LEVEL_DEBUG] = ANSI_BBLUE,
+    [LOG_LEVEL_INFO] = ANSI_BGREEN,
+    [LOG_LEVEL_ERROR] = ANSI_BRED,
+};
+
+// FORMATTING
+
+static size_t append(char *out, size_t cap, size_t off, const char *fmt, ...) {
+  if (off >= cap)
+    return off;
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(out + off, cap - off, fmt, args);
+  va_end(args);
+  if (n < 0)
+    return off;
+  return off + (size_t)n < cap ? off + n : cap - 1;
+}
+
+static size_t append_json(char *out, size_t cap, size_t off, const char *s,
+                          size_t len) {
+  for (size_t i = 0; i < len && off + 7 < cap; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      out[off++] = '\\';
+      out[off++] = c;
+    } else if (c < 0x20) {
+      off += snprintf(out + off, cap - off, "\\u%04x", c);
+    } else {
+      out[off++] = c;
+    }
+  }
+  out[off] = '\0';
+  return off;
+}
+
+// writes one finished line into out, always newline terminated
+static size_t format_record(char *out, size_t cap, const record_t *rec) {
+  const char *level = level_names[rec->level];
+  size_t len = rec->len;
+  // the callers end their lines themselves
+  if (len > 0 && rec->text[len - 1] == '\n')
+    len--;
+
+  char stamp[32] = "";
+  if (options.format != LOG_FORMAT_PRETTY) {
+    struct tm tm;
+    gmtime_r(&rec->ts.tv_sec, &tm);
+    size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(stamp + n, sizeof(stamp) - n, ".%03ldZ", rec->ts.tv_nsec / 1000000);
+  }
+
+  size_t off = 0;
+  switch (options.format) {
+  case LOG_FORMAT_PRETTY:
+    off = append(out, cap, off, ANSI_BOLD "%s%s " ANSI_RESET,
+                 level_colors[rec->level], level);
+    if (rec->has_ctx) {
+      off = append(out, cap, off, ANSI_BOLD ANSI_BCYAN "%s:%u " ANSI_RESET,
+                   rec->ip, rec->port);
+    }
+    off = append(out, cap, off, "%.*s\n", (int)len, rec->text);
+    break;
+  case LOG_FORMAT_PLAIN:
+    off = append(out, cap, off, "%s %s ", stamp, level);
+    if (rec->has_ctx)
+      off = append(out, cap, off, "%s:%u ", rec->ip, rec->port);
+    off = append(out, cap, off, "%.*s\n", (int)len, rec->text);
+    break;
+  case LOG_FORMAT_JSON:
+    off = append(out, cap, off, "{\"ts\":\"%s\",\"level\":\"%s\",", stamp,
+                 level);
+    if (rec->has_ctx) {
+      off = append(out, cap, off, "\"peer\":\"%s:%u\",", rec->ip, rec->port);
+    }
+    off = append(out, cap, off, "\"msg\":\"");
+    off = append_json(out, cap, off, rec->text, len);
+    off = append(out, cap, off, "\"}\n");
+    break;
+  }
+
+  // a truncated line still ends the line
+  if (off == cap - 1)
+    out[off - 1] = '\n';
+  return off;
+}
+
+static void write_out(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, buf, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+// RINGS
+
+static void ring_release(void *ring_raw) {
+  ring_t *ring = ring_raw;
+  atomic_store(&ring->in_use, false);
+}
+
+static void key_create(void) { pthread_key_create(&key, ring_release); }
+
+static ring_t *ring_acquire(void) {
+  for (ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&ring->in_use, &expected, true))
+      return ring;
+  }
+
+  ring_t *ring = calloc(1, sizeof(*ring));
+  if (!ring)
+    return NULL;
+  atomic_init(&ring->in_use, true);
+  ring->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+  }
+  return ring;
+}
+
+static void ring_push(ring_t *ring, const record_t *hdr, const char *text) {
+  size_t need = (sizeof(record_t) + hdr->len + 7) & ~(size_t)7;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t off = head % RING_SIZE;
+  // records never wrap, the rest of the ring is padded out instead
+  size_t filler = RING_SIZE - off < need ? RING_SIZE - off : 0;
+
+  if (head + filler + need - tail > RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  if (filler) {
+    record_t *pad = (record_t *)(ring->buf + off);
+    pad->size = filler;
+    pad->level = LEVEL_PAD;
+    head += filler;
+    off = 0;
+  }
+
+  record_t *rec = (record_t *)(ring->buf + off);
+  *rec = *hdr;
+  rec->size = need;
+  memcpy(rec->text, text, hdr->len);
+  atomic_store_explicit(&ring->head, head + need, memory_order_release);
+
+  if (head + need - tail > RING_SIZE / 2 && !atomic_exchange(&poked, true))
+    pthread_cond_signal(&wake);
+}
+
+// formats everything the ring holds into out, flushing it when full
+static size_t ring_drain(ring_t *ring, char *out, size_t out_len) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  while (tail < head) {
+    const record_t *rec = (const record_t *)(ring->buf + tail % RING_SIZE);
+    if (rec->level != LEVEL_PAD) {
+      if (OUT_SIZE - out_len < LOG_LINE_MAX * 2) {
+        write_out(out, out_len);
+        out_len = 0;
+      }
+      out_len += format_record(out + out_len, OUT_SIZE - out_len, rec);
+    }
+    tail += rec->size;
+  }
+  atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  return out_len;
+}
+
+static size_t drain_all(char *out) {
+  size_t out_len = 0;
+  uint64_t dropped = 0;
+  for (ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+    out_len = ring_drain(ring, out, out_len);
+    dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  }
+
+  if (dropped > reported) {
+    if (OUT_SIZE - out_len < LOG_LINE_MAX) {
+      write_out(out, out_len);
+      out_len = 0;
+    }
+    _Alignas(record_t) char text[sizeof(record_t) + 64];
+    record_t *rec = (record_t *)text;
+    *rec = (record_t){.level = LOG_LEVEL_ERROR};
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->len = snprintf(rec->text, sizeof(text) - sizeof(*rec),
+                        "log rings overflowed, dropped %llu lines\n",
+                        (unsigned long long)(dropped - reported));
+    out_len += format_record(out + out_len, OUT_SIZE - out_len, rec);
+    reported = dropped;
+  }
+
+  write_out(out, out_len);
+  return out_len;
+}
+
+static void *writer_run(void *arg) {
+  (void)arg;
+  char *out = malloc(OUT_SIZE);
+  if (!out)
+    return NULL;
+
+  while (!atomic_load(&stopping)) {
+    drain_all(out);
+
+    pthread_mutex_lock(&wake_mu);
+    if (!atomic_exchange(&poked, false) && !atomic_load(&stopping)) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += FLUSH_MS * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&wake, &wake_mu, &deadline);
+      atomic_store(&poked, false);
+    }
+    pthread_mutex_unlock(&wake_mu);
+  }
+
+  drain_all(out);
+  free(out);
+  return NULL;
+}
+
+// PUBLIC
+
+void log_configure(log_options_t opts) { options = opts; }
+
+int log_start(void) {
+  if (atomic_load(&running))
+    return 0;
+  atomic_store(&stopping, false);
+  int err = pthread_create(&writer, NULL, writer_run, NULL);
+  if (err)
+    return err;
+  atomic_store(&running, true);
+  return 0;
+}
+
+void log_stop(void) {
+  if (!atomic_exchange(&running, false))
+    return;
+  atomic_store(&stopping, true);
+  pthread_cond_signal(&wake);
+  pthread_join(writer, NULL);
+}
+
+uint64_t log_dropped(void) {
+  uint64_t dropped = 0;
+  for (ring_t *ring = atomic_load(&rings); ring; ring = ring->next)
+    dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  return dropped;
+}
+
+static void log_vwrite(log_level_e level, const log_ctx_t *ctx,
+                       const char *fmt, va_list args) {
+  if (level < options.level)
+    return;
+
+  char text[LOG_LINE_MAX];
+  int len = vsnprintf(text, sizeof(text), fmt, args);
+  if (len < 0)
+    return;
+  if ((size_t)len >= sizeof(text))
+    len = sizeof(text) - 1;
+
+  record_t hdr = {.level = level, .has_ctx = ctx != NULL, .len = len};
+  if (ctx) {
+    snprintf(hdr.ip, sizeof(hdr.ip), "%s", ctx->ip);
+    hdr.port = ctx->port;
+  }
+  clock_gettime(CLOCK_REALTIME, &hdr.ts);
+
+  if (atomic_load_explicit(&running, memory_order_relaxed)) {
+    if (!self) {
+      pthread_once(&key_once, key_create);
+      self = ring_acquire();
+      pthread_setspecific(key, self);
+    }
+    if (self) {
+      ring_push(self, &hdr, text);
+      return;
+    }
+  }
+
+  // no writer, format here and emit the line in one write
+  _Alignas(record_t) char buf[sizeof(record_t) + LOG_LINE_MAX];
+  record_t *rec = (record_t *)buf;
+  *rec = hdr;
+  memcpy(rec->text, text, len);
+  char out[LOG_LINE_MAX * 2];
+  write_out(out, format_record(out, sizeof(out), rec));
+}
+
+void log_debug(const log_ctx_t *ctx, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  log_vwrite(LOG_LEVEL_DEBUG, ctx, fmt, args);
+  va_end(args);
+}
+
+void log_info(const log_ctx_t *ctx, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  log_vwrite(LOG_LEVEL_INFO, ctx, fmt, args);
+  va_end(args);
+}
+
+void log_err(const log_ctx_t *ctx, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  log_vwrite(LOG_LEVEL_ERROR, ctx, fmt, args);
+  va_end(args);
+}
+
+void log_perror(const log_ctx_t *ctx, const char *s) {
+  const char *reason = strerror(errno);
+  log_err(ctx, "%s: %s\n", s, reason);
+}
@@ -0,0 +1,52 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// log lines go to stderr. until log_start is called every call writes its
+// line synchronously. after it, each thread appends to its own lock-free ring
+// and a writer thread drains all of them in batches, so logging never blocks
+// on stderr. a full ring drops the line and counts it instead of waiting.
+
+typedef enum {
+  LOG_LEVEL_DEBUG,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_ERROR,
+} log_level_e;
+
+typedef enum {
+  // colored, for a terminal
+  LOG_FORMAT_PRETTY,
+  // timestamped lines without escape codes
+  LOG_FORMAT_PLAIN,
+  // one json object per line
+  LOG_FORMAT_JSON,
+} log_format_e;
+
+typedef struct {
+  // lines below this level are discarded before formatting
+  log_level_e level;
+  log_format_e format;
+} log_options_t;
+
+typedef struct {
+  const char *ip;
+  uint16_t port;
+} log_ctx_t;
+
+#define LOG_CTX(ctx) (&(log_ctx_t){.ip = (ctx)->ip, .port = (ctx)->port})
+
+void log_configure(log_options_t options);
+// starts the writer thread, returns 0 or an errno value
+int log_start(void);
+// drains every ring and stops the writer, later lines are synchronous again
+void log_stop(void);
+// lines lost to full rings so far
+uint64_t log_dropped(void);
+
+void log_debug(const log_ctx_t *ctx, const char *fmt, ...);
+void log_info(const log_ctx_t *ctx, const char *fmt, ...);
+void log_err(const log_ctx_t *ctx, const char *fmt, ...);
+void log_perror(const log_ctx_t *ctx, const char *s);
+
+#endif // LOG_H
@@ -3,29 +3,375 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bench.h"
 #include "client.h"
+#include "history.h"
 #include "server.h"
 #include "utils.h"
+#include "zframe.h"
 
 #define print_basic_usage()                                                    \
   fprintf(stderr,                                                              \
           ANSI_BOLD ANSI_BCYAN "usage: " ANSI_RESET ANSI_GREEN                 \
-                               "%s <serve|join>\n",                            \
+                               "%s <serve|join|bench>\n",                      \
           argv[0])
 
-static struct option long_options[] = {
+static struct option join_options[] = {
     {"host", required_argument, 0, 'h'},
     {"port", required_argument, 0, 'p'},
     {},
 };
 
+static struct option bench_options[] = {
+    {"host", required_argument, 0, 'h'},
+    {"port", required_argument, 0, 'p'},
+    {"clients", required_argument, 0, 'c'},
+    {"threads", required_argument, 0, 't'},
+    {"rate", required_argument, 0, 'r'},
+    {"duration", required_argument, 0, 'd'},
+    {"size", required_argument, 0, 'S'},
+    {},
+};
+
+static struct option serve_options[] = {
+    {"backend", required_argument, 0, 'b'},
+    {"shards", required_argument, 0, 'n'},
+    {"history", required_argument, 0, 'H'},
+    {"log-dir", required_argument, 0, 'L'},
+    {"log-sync", required_argument, 0, 'y'},
+    {"log-segment-size", required_argument, 0, 'z'},
+    {"hwm", required_argument, 0, 'w'},
+    {"slow-policy", required_argument, 0, 's'},
+    {"log-level", required_argument, 0, 'l'},
+    {"log-format", required_argument, 0, 'f'},
+    {"metrics", required_argument, 0, 'M'},
+    {"handshake-timeout", required_argument, 0, 'T'},
+    {"idle-timeout", required_argument, 0, 'I'},
+    {"heartbeat", required_argument, 0, 'P'},
+    {"flush-delay", required_argument, 0, 'D'},
+    {"flush-bytes", required_argument, 0, 'B'},
+    {"presence-window", required_argument, 0, 'W'},
+    {"presence-cap", required_argument, 0, 'K'},
+    {"deflate-level", required_argument, 0, 'Z'},
+    {"port", required_argument, 0, 'p'},
+    {"node", required_argument, 0, 'N'},
+    {"peer-listen", required_argument, 0, 'A'},
+    {"peer", required_argument, 0, 'C'},
+    {"handover", required_argument, 0, 'O'},
+    {"takeover", required_argument, 0, 'R'},
+    {},
+};
+
+int handle_serve(int argc, char *argv[static argc]) {
+  server_options_t options = {
+      .backend = SERVER_BACKEND_EPOLL,
+      .history = HISTORY_DEFAULT_LEN,
+      .chatlog =
+          {
+              .sync = CHATLOG_SYNC_BATCH,
+              .segment_size = CHATLOG_DEFAULT_SEGMENT_SIZE,
+              .segment_age = CHATLOG_DEFAULT_SEGMENT_AGE,
+              .retain = CHATLOG_DEFAULT_RETAIN,
+          },
+      .outq =
+          {
+              .hwm = OUTQ_DEFAULT_HWM,
+              .policy = OUTQ_DROP_OLDEST,
+              .flush_bytes = OUTQ_DEFAULT_FLUSH_BYTES,
+          },
+      .handshake_timeout = SERVER_DEFAULT_HANDSHAKE_TIMEOUT,
+      .heartbeat = SERVER_DEFAULT_HEARTBEAT,
+      .presence =
+          {
+              .window = PRESENCE_DEFAULT_WINDOW,
+              .cap = PRESENCE_DEFAULT_CAP,
+          },
+      .deflate_level = ZFRAME_DEFAULT_LEVEL,
+      .port = SERVER_DEFAULT_PORT,
+  };
+  log_options_t log_options = {
+      .level = LOG_LEVEL_INFO,
+      .format = LOG_FORMAT_PRETTY,
+  };
+
+  int opt;
+  optind = 2;
+  while ((opt = getopt_long(
+              argc, argv,
+              ":b:n:H:L:y:z:w:s:l:f:M:T:I:P:D:B:W:K:Z:p:N:A:C:O:R:",
+              serve_options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      if (strcmp(optarg, "epoll") == 0) {
+        options.backend = SERVER_BACKEND_EPOLL;
+      } else if (strcmp(optarg, "threaded") == 0) {
+        options.backend = SERVER_BACKEND_THREADED;
+      } else if (strcmp(optarg, "uring") == 0) {
+        options.backend = SERVER_BACKEND_URING;
+      } else {
+        log_err(NULL,
+                "unknown backend '%s', expected epoll, threaded or uring\n",
+                optarg);
+        return 1;
+      }
+      break;
+    case 'n': {
+      char *end;
+      long shards = strtol(optarg, &end, 10);
+      if (*end != '\0' || shards < 0 || shards > 1024) {
+        log_err(NULL, "invalid shard count '%s', expected 0 to 1024\n",
+                optarg);
+        return 1;
+      }
+      options.shards = shards;
+      break;
+    }
+    case 'H': {
+      char *end;
+      long history = strtol(optarg, &end, 10);
+      if (*end != '\0' || history < 0 || history > HISTORY_MAX_LEN) {
+        log_err(NULL, "invalid history length '%s', expected 0 to %d\n",
+                optarg, HISTORY_MAX_LEN);
+        return 1;
+      }
+      options.history = history;
+      break;
+    }
+    case 'L':
+      options.chatlog.dir = optarg;
+      break;
+    case 'y':
+      if (strcmp(optarg, "none") == 0) {
+        options.chatlog.sync = CHATLOG_SYNC_NONE;
+      } else if (strcmp(optarg, "batch") == 0) {
+        options.chatlog.sync = CHATLOG_SYNC_BATCH;
+      } else if (strcmp(optarg, "always") == 0) {
+        options.chatlog.sync = CHATLOG_SYNC_ALWAYS;
+      } else {
+        log_err(NULL,
+                "unknown log sync mode '%s', expected none, batch or always\n",
+                optarg);
+        return 1;
+      }
+      break;
+    case 'z': {
+      char *end;
+      long size = strtol(optarg, &end, 10);
+      if (*end != '\0' || size < CHATLOG_MIN_SEGMENT_SIZE) {
+        log_err(NULL, "invalid segment size '%s', minimum is %d bytes\n",
+                optarg, CHATLOG_MIN_SEGMENT_SIZE);
+        return 1;
+      }
+      options.chatlog.segment_size = size;
+      break;
+    }
+    case 'w': {
+      char *end;
+      long hwm = strtol(optarg, &end, 10);
+      if (*end != '\0' || hwm < OUTQ_MIN_HWM) {
+        log_err(NULL, "invalid high-water mark '%s', minimum is %d bytes\n",
+                optarg, OUTQ_MIN_HWM);
+        return 1;
+      }
+      options.outq.hwm = hwm;
+      break;
+    }
+    case 's':
+      if (strcmp(optarg, "drop") == 0) {
+        options.outq.policy = OUTQ_DROP_OLDEST;
+      } else if (strcmp(optarg, "coalesce") == 0) {
+        options.outq.policy = OUTQ_COALESCE;
+      } else if (strcmp(optarg, "disconnect") == 0) {
+        options.outq.policy = OUTQ_DISCONNECT;
+      } else {
+        log_err(NULL,
+                "unknown slow policy '%s', expected drop, coalesce or "
+                "disconnect\n",
+                optarg);
+        return 1;
+      }
+      break;
+    case 'D': {
+      char *end;
+      long delay = strtol(optarg, &end, 10);
+      if (*end != '\0' || delay < 0 || delay > OUTQ_MAX_FLUSH_DELAY) {
+        log_err(NULL, "invalid flush delay '%s', expected 0 to %d us\n",
+                optarg, OUTQ_MAX_FLUSH_DELAY);
+        return 1;
+      }
+      options.outq.flush_delay = delay;
+      break;
+    }
+    case 'B': {
+      char *end;
+      long bytes = strtol(optarg, &end, 10);
+      if (*end != '\0' || bytes < 1) {
+        log_err(NULL, "invalid flush size '%s', expected at least 1 byte\n",
+                optarg);
+        return 1;
+      }
+      options.outq.flush_bytes = bytes;
+      break;
+    }
+    case 'W': {
+      char *end;
+      long window = strtol(optarg, &end, 10);
+      if (*end != '\0' || window < 0 || window > PRESENCE_MAX_WINDOW) {
+        log_err(NULL, "invalid presence window '%s', expected 0 to %d ms\n",
+                optarg, PRESENCE_MAX_WINDOW);
+        return 1;
+      }
+      options.presence.window = window;
+      break;
+    }
+    case 'K': {
+      char *end;
+      long cap = strtol(optarg, &end, 10);
+      if (*end != '\0' || cap < 0 || cap > PRESENCE_MAX_CAP) {
+        log_err(NULL, "invalid presence cap '%s', expected 0 to %d names\n",
+                optarg, PRESENCE_MAX_CAP);
+        return 1;
+      }
+      options.presence.cap = cap;
+      break;
+    }
+    case 'Z': {
+      char *end;
+      long level = strtol(optarg, &end, 10);
+      if (*end != '\0' || level < 0 || level > ZFRAME_MAX_LEVEL) {
+        log_err(NULL, "invalid deflate level '%s', expected 0 to %d\n",
+                optarg, ZFRAME_MAX_LEVEL);
+        return 1;
+      }
+      options.deflate_level = level;
+      break;
+    }
+    case 'l':
+      if (strcmp(optarg, "debug") == 0) {
+        log_options.level = LOG_LEVEL_DEBUG;
+      } else if (strcmp(optarg, "info") == 0) {
+        log_options.level = LOG_LEVEL_INFO;
+      } else if (strcmp(optarg, "error") == 0) {
+        log_options.level = LOG_LEVEL_ERROR;
+      } else {
+        log_err(NULL,
+                "unknown log level '%s', expected debug, info or error\n",
+                optarg);
+        return 1;
+      }
+      break;
+    case 'M':
+      options.metrics = optarg;
+      break;
+    case 'T': {
+      char *end;
+      long seconds = strtol(optarg, &end, 10);
+      if (*end != '\0' || seconds < 0 || seconds > SERVER_MAX_TIMEOUT) {
+        log_err(NULL, "invalid handshake timeout '%s', expected 0 to %d\n",
+                optarg, SERVER_MAX_TIMEOUT);
+        return 1;
+      }
+      options.handshake_timeout = seconds;
+      break;
+    }
+    case 'I': {
+      char *end;
+      long seconds = strtol(optarg, &end, 10);
+      if (*end != '\0' || seconds < 0 || seconds > SERVER_MAX_TIMEOUT) {
+        log_err(NULL, "invalid idle timeout '%s', expected 0 to %d\n", optarg,
+                SERVER_MAX_TIMEOUT);
+        return 1;
+      }
+      options.idle_timeout = seconds;
+      break;
+    }
+    case 'P': {
+      char *end;
+      long seconds = strtol(optarg, &end, 10);
+      if (*end != '\0' || seconds < 0 || seconds > SERVER_MAX_TIMEOUT) {
+        log_err(NULL, "invalid heartbeat interval '%s', expected 0 to %d\n",
+                optarg, SERVER_MAX_TIMEOUT);
+        return 1;
+      }
+      options.heartbeat = seconds;
+      break;
+    }
+    case 'p': {
+      char *end;
+      long port = strtol(optarg, &end, 10);
+      if (*end != '\0' || port < 1 || port > UINT16_MAX) {
+        log_err(NULL, "invalid port '%s'\n", optarg);
+        return 1;
+      }
+      options.port = port;
+      break;
+    }
+    case 'N':
+      options.federation.node = optarg;
+      break;
+    case 'A':
+      options.federation.listen = optarg;
+      break;
+    case 'C':
+      if (options.federation.peer_count == FEDERATION_MAX_PEERS) {
+        log_err(NULL, "too many peers, at most %d\n", FEDERATION_MAX_PEERS);
+        return 1;
+      }
+      options.federation.peers[options.federation.peer_count++] = optarg;
+      break;
+    case 'O':
+      options.handover = optarg;
+      break;
+    case 'R':
+      options.takeover = optarg;
+      break;
+    case 'f':
+      if (strcmp(optarg, "pretty") == 0) {
+        log_options.format = LOG_FORMAT_PRETTY;
+      } else if (strcmp(optarg, "plain") == 0) {
+        log_options.format = LOG_FORMAT_PLAIN;
+      } else if (strcmp(optarg, "json") == 0) {
+        log_options.format = LOG_FORMAT_JSON;
+      } else {
+        log_err(NULL,
+                "unknown log format '%s', expected pretty, plain or json\n",
+                optarg);
+        return 1;
+      }
+      break;
+    case '?':
+      log_err(NULL, "unknown option '-%c'\n", optopt);
+      return 1;
+    case ':':
+      log_err(NULL, "missing argument after '-%c'\n", optopt);
+      return 1;
+    }
+  }
+
+  if (options.chatlog.sync == CHATLOG_SYNC_ALWAYS &&
+      options.backend != SERVER_BACKEND_THREADED) {
+    log_err(NULL, "log sync mode 'always' needs the threaded backend\n");
+    return 1;
+  }
+
+  log_configure(log_options);
+  int err = log_start();
+  if (err) {
+    log_err(NULL, "log writer: %s\n", strerror(err));
+    return 1;
+  }
+  int result = server_start(options);
+  log_stop();
+  return result;
+}
+
 int handle_join(int argc, char *argv[static argc]) {
   char *host = nullptr;
   int port = -1;
 
   int opt;
   optind = 2;
-  while ((opt = getopt_long(argc, argv, ":h:p:", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, ":h:p:", join_options, NULL)) != -1) {
     switch (opt) {
     case 'h':
       host = optarg;
@@ -61,6 +407,101 @@ int handle_join(int argc, char *argv[static argc]) {
   });
 }
 
+int handle_bench(int argc, char *argv[static argc]) {
+  bench_options_t options = {
+      .host = "127.0.0.1",
+      .port = 8080,
+      .clients = BENCH_DEFAULT_CLIENTS,
+      .threads = 1,
+      .rate = BENCH_DEFAULT_RATE,
+      .duration = BENCH_DEFAULT_DURATION,
+      .size = BENCH_DEFAULT_SIZE,
+  };
+
+  int opt;
+  optind = 2;
+  while ((opt = getopt_long(argc, argv, ":h:p:c:t:r:d:S:", bench_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      options.host = optarg;
+      break;
+    case 'p': {
+      int port = atoi(optarg);
+      if (port < 0 || port > UINT16_MAX) {
+        log_err(NULL, "invalid port '%s'\n", optarg);
+        return 1;
+      }
+      options.port = port;
+      break;
+    }
+    case 'c': {
+      char *end;
+      long clients = strtol(optarg, &end, 10);
+      if (*end != '\0' || clients < 1 || clients > 1000000) {
+        log_err(NULL, "invalid client count '%s', expected 1 to 1000000\n",
+                optarg);
+        return 1;
+      }
+      options.clients = clients;
+      break;
+    }
+    case 't': {
+      char *end;
+      long threads = strtol(optarg, &end, 10);
+      if (*end != '\0' || threads < 1 || threads > 1024) {
+        log_err(NULL, "invalid thread count '%s', expected 1 to 1024\n",
+                optarg);
+        return 1;
+      }
+      options.threads = threads;
+      break;
+    }
+    case 'r': {
+      char *end;
+      double rate = strtod(optarg, &end);
+      if (*end != '\0' || !(rate >= 0)) {
+        log_err(NULL, "invalid rate '%s'\n", optarg);
+        return 1;
+      }
+      options.rate = rate;
+      break;
+    }
+    case 'd': {
+      char *end;
+      double duration = strtod(optarg, &end);
+      if (*end != '\0' || !(duration > 0)) {
+        log_err(NULL, "invalid duration '%s'\n", optarg);
+        return 1;
+      }
+      options.duration = duration;
+      break;
+    }
+    case 'S': {
+      char *end;
+      long size = strtol(optarg, &end, 10);
+      if (*end != '\0' || size < BENCH_MIN_SIZE || size > BENCH_MAX_SIZE) {
+        log_err(NULL, "invalid message size '%s', expected %d to %d\n",
+                optarg, BENCH_MIN_SIZE, BENCH_MAX_SIZE);
+        return 1;
+      }
+      options.size = size;
+      break;
+    }
+    case '?':
+      log_err(NULL, "unknown option '-%c'\n", optopt);
+      return 1;
+    case ':':
+      log_err(NULL, "missing argument after '-%c'\n", optopt);
+      return 1;
+    }
+  }
+
+  if (options.threads > options.clients)
+    options.threads = options.clients;
+  return bench_start(options);
+}
+
 int main(int argc, char *argv[static argc]) {
   if (argc < 2) {
     print_basic_usage();
@@ -68,9 +509,11 @@ int main(int argc, char *argv[static argc]) {
   }
 
   if (strcmp(argv[1], "serve") == 0) {
-    return server_start();
+    return handle_serve(argc, argv);
   } else if (strcmp(argv[1], "join") == 0) {
     return handle_join(argc, argv);
+  } else if (strcmp(argv[1], "bench") == 0) {
+    return handle_bench(argc, argv);
   } else {
     print_basic_usage();
     return 1;
@@ -0,0 +1,395 @@
+// clock_gettime is hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "log.h"
+#include "metrics.h"
+#include "outq.h"
+#include "pool.h"
+#include "utils.h"
+
+// threads beyond this many share shards round robin
+#define SHARDS 64
+#define RESPONSE_SIZE (64 * 1024)
+#define MAX_POOLS 32
+
+typedef struct {
+  _Atomic uint64_t counters[METRIC_COUNTERS];
+  hist_t hists[METRIC_HISTS];
+} shard_t;
+
+static atomic_bool enabled;
+static shard_t shards[SHARDS];
+static atomic_uint next_shard;
+static _Thread_local shard_t *self;
+static int listen_fd = -1;
+
+typedef struct {
+  const char *name;
+  const char *help;
+} metric_info_t;
+
+static const metric_info_t counter_info[] = {
+    [METRIC_BYTES_IN] = {"ctalk_received_bytes_total",
+                         "Bytes read from client sockets."},
+    [METRIC_BYTES_OUT] = {"ctalk_sent_bytes_total",
+                          "Bytes written to client sockets."},
+    [METRIC_CONNECTIONS_OPENED] = {"ctalk_connections_opened_total",
+                                   "Connections accepted."},
+    [METRIC_CONNECTIONS_CLOSED] = {"ctalk_connections_closed_total",
+                                   "Connections closed."},
+    [METRIC_HANDSHAKE_FAILURES] = {"ctalk_handshake_failures_total",
+                                   "Clients dropped for too many bad names."},
+    [METRIC_MESSAGES] = {"ctalk_messages_total",
+                         "Chat messages received from joined clients."},
+    [METRIC_HANDSHAKE_TIMEOUTS] = {"ctalk_handshake_timeouts_total",
+                                   "Clients dropped for not picking a name "
+                                   "in time."},
+    [METRIC_IDLE_TIMEOUTS] = {"ctalk_idle_timeouts_total",
+                              "Joined clients dropped for sending nothing "
+                              "for too long."},
+    [METRIC_HEARTBEAT_TIMEOUTS] = {"ctalk_heartbeat_timeouts_total",
+                                   "Clients dropped for not answering a "
+                                   "ping."},
+    [METRIC_PINGS] = {"ctalk_pings_total", "Pings sent to quiet clients."},
+    [METRIC_PEER_MESSAGES_OUT] = {"ctalk_peer_messages_sent_total",
+                                  "Federation messages queued for peer "
+                                  "nodes."},
+    [METRIC_PEER_MESSAGES_IN] = {"ctalk_peer_messages_received_total",
+                                 "Federation messages received from peer "
+                                 "nodes."},
+    [METRIC_PRESENCE_GATHERED] = {"ctalk_presence_gathered_total",
+                                  "Join and disconnect notices sent as part "
+                                  "of a summary."},
+    [METRIC_DEFLATE_IN] = {"ctalk_deflate_input_bytes_total",
+                           "Bytes of frames queued for deflate clients, "
+                           "before compression."},
+    [METRIC_DEFLATE_OUT] = {"ctalk_deflate_output_bytes_total",
+                            "Bytes those frames were queued as, compressed "
+                            "or as they were when that did not pay."},
+};
+
+static const metric_info_t hist_info[] = {
+    [METRIC_FANOUT] = {"ctalk_fanout_seconds",
+                       "Time from parsing a chat message until every "
+                       "recipient queue has it."},
+    [METRIC_SEND] = {"ctalk_send_seconds",
+                     "Time spent in one write to a client socket."},
+    [METRIC_COMMAND] = {"ctalk_command_seconds",
+                        "Time spent handling a slash command."},
+    [METRIC_BACKLOG] = {"ctalk_backlog_bytes",
+                        "Bytes already queued for a client when a frame has "
+                        "to wait behind them."},
+    [METRIC_DEFLATE] = {"ctalk_deflate_seconds",
+                        "Time spent compressing a frame, once per frame and "
+                        "framing however many clients get it."},
+};
+
+static shard_t *shard(void) {
+  if (!self)
+    self = &shards[atomic_fetch_add(&next_shard, 1) % SHARDS];
+  return self;
+}
+
+uint64_t metrics_now(void) {
+  if (!atomic_load_explicit(&enabled, memory_order_relaxed))
+    return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_add(metric_counter_e counter, uint64_t n) {
+  if (!atomic_load_explicit(&enabled, memory_order_relaxed))
+    return;
+  atomic_fetch_add_explicit(&shard()->counters[counter], n,
+                            memory_order_relaxed);
+}
+
+void metrics_record(metric_hist_e hist, uint64_t value) {
+  if (!atomic_load_explicit(&enabled, memory_order_relaxed))
+    return;
+  hist_record(&shard()->hists[hist], value);
+}
+
+void metrics_since(metric_hist_e hist, uint64_t start) {
+  if (!start)
+    return;
+  uint64_t now = metrics_now();
+  metrics_record(hist, now > start ? now - start : 0);
+}
+
+// RENDERING
+
+static size_t append(char *out, size_t cap, size_t off, const char *fmt, ...) {
+  if (off >= cap)
+    return off;
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(out + off, cap - off, fmt, args);
+  va_end(args);
+  if (n < 0)
+    return off;
+  return off + (size_t)n < cap ? off + n : cap - 1;
+}
+
+static size_t append_counter(char *out, size_t cap, size_t off,
+                             const char *name, const char *help,
+                             const char *type, uint64_t value) {
+  return append(out, cap, off, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name,
+                help, name, type, name, (unsigned long long)value);
+}
+
+// the histograms go out as summaries, so the quantiles keep their precision
+static size_t append_summary(char *out, size_t cap, size_t off,
+                             const metric_info_t *info, const hist_t *hist,
+                             double scale) {
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+  off = append(out, cap, off, "# HELP %s %s\n# TYPE %s summary\n", info->name,
+               info->help, info->name);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    off = append(out, cap, off, "%s{quantile=\"%g\"} %.9g\n", info->name,
+                 quantiles[i], hist_percentile(hist, quantiles[i]) * scale);
+  }
+  return append(out, cap, off, "%s_sum %.9g\n%s_count %llu\n", info->name,
+                atomic_load(&hist->sum) * scale, info->name,
+                (unsigned long long)atomic_load(&hist->count));
+}
+
+typedef struct {
+  const char *name;
+  const char *help;
+  const char *type;
+  size_t field;
+} pool_metric_t;
+
+static const pool_metric_t pool_metrics[] = {
+    {"ctalk_pool_objects_in_use", "Objects currently allocated from a pool.",
+     "gauge", offsetof(pool_stats_t, in_use)},
+    {"ctalk_pool_objects_high_water",
+     "Most objects out of a pool depot at once, thread caches included.",
+     "gauge", offsetof(pool_stats_t, high_water)},
+    {"ctalk_pool_reserved_bytes", "Slab memory a pool holds.", "gauge",
+     offsetof(pool_stats_t, reserved_bytes)},
+    {"ctalk_pool_allocations_total", "Allocations served by a pool.",
+     "counter", offsetof(pool_stats_t, allocs)},
+    {"ctalk_pool_recycled_total",
+     "Allocations served by an object freed before.", "counter",
+     offsetof(pool_stats_t, recycled)},
+};
+
+static size_t append_pools(char *out, size_t cap, size_t off) {
+  pool_stats_t pools[MAX_POOLS];
+  size_t count = pool_stats(pools, MAX_POOLS);
+  if (count > MAX_POOLS)
+    count = MAX_POOLS;
+
+  for (size_t m = 0; m < sizeof(pool_metrics) / sizeof(pool_metrics[0]);
+       m++) {
+    const pool_metric_t *metric = &pool_metrics[m];
+    off = append(out, cap, off, "# HELP %s %s\n# TYPE %s %s\n", metric->name,
+                 metric->help, metric->name, metric->type);
+    for (size_t i = 0; i < count; i++) {
+      uint64_t value;
+      memcpy(&value, (const char *)&pools[i] + metric->field, sizeof(value));
+      off = append(out, cap, off, "%s{pool=\"%s\"} %llu\n", metric->name,
+                   pools[i].name, (unsigned long long)value);
+    }
+  }
+  return off;
+}
+
+static size_t render(char *out, size_t cap) {
+  uint64_t counters[METRIC_COUNTERS] = {0};
+  // merged copies are too big for the stack
+  static hist_t hists[METRIC_HISTS];
+  memset(hists, 0, sizeof(hists));
+
+  for (int i = 0; i < SHARDS; i++) {
+    for (int c = 0; c < METRIC_COUNTERS; c++)
+      counters[c] += atomic_load_explicit(&shards[i].counters[c],
+                                          memory_order_relaxed);
+    for (int h = 0; h < METRIC_HISTS; h++)
+      hist_merge(&hists[h], &shards[i].hists[h]);
+  }
+
+  size_t off = 0;
+  for (int c = 0; c < METRIC_COUNTERS; c++) {
+    off = append_counter(out, cap, off, counter_info[c].name,
+                         counter_info[c].help, "counter", counters[c]);
+  }
+  uint64_t opened = counters[METRIC_CONNECTIONS_OPENED];
+  uint64_t closed = counters[METRIC_CONNECTIONS_CLOSED];
+  off = append_counter(out, cap, off, "ctalk_connections_active",
+                       "Connections currently open.", "gauge",
+                       opened > closed ? opened - closed : 0);
+
+  for (int h = 0; h < METRIC_HISTS; h++) {
+    off = append_summary(out, cap, off, &hist_info[h], &hists[h],
+                         h == METRIC_BACKLOG ? 1 : 1e-9);
+  }
+
+  outq_stats_t outq = outq_stats();
+  off = append_counter(out, cap, off, "ctalk_outq_drop_oldest_total",
+                       "Times a slow reader had its oldest frames dropped.",
+                       "counter", outq.drop_oldest);
+  off = append_counter(out, cap, off, "ctalk_outq_dropped_frames_total",
+                       "Frames dropped from slow reader queues.", "counter",
+                       outq.dropped_frames);
+  off = append_counter(out, cap, off, "ctalk_outq_coalesce_total",
+                       "Times a slow reader backlog was coalesced.", "counter",
+                       outq.coalesce);
+  off = append_counter(out, cap, off, "ctalk_outq_coalesced_frames_total",
+                       "Frames replaced by a skipped notice.", "counter",
+                       outq.coalesced_frames);
+  off = append_counter(out, cap, off, "ctalk_outq_disconnect_total",
+                       "Slow readers disconnected.", "counter",
+                       outq.disconnect);
+  off = append_counter(out, cap, off, "ctalk_log_dropped_total",
+                       "Log lines lost to full log rings.", "counter",
+                       log_dropped());
+  return append_pools(out, cap, off);
+}
+
+// ENDPOINT
+
+// reads up to the end of the request headers, whatever they ask for
+static void read_request(int fd) {
+  char req[2048];
+  size_t len = 0;
+  while (len < sizeof(req) - 1) {
+    ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+    if (n <= 0)
+      return;
+    len += n;
+    req[len] = '\0';
+    if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+      return;
+  }
+}
+
+static void *serve_run(void *) {
+  char *body = malloc(RESPONSE_SIZE);
+  if (!body) {
+    log_perror(NULL, "metrics: malloc");
+    return NULL;
+  }
+
+  while (true) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno != EINTR && errno != ECONNABORTED)
+        log_perror(NULL, "metrics: accept");
+      continue;
+    }
+
+    // a stalled scraper must not wedge the endpoint
+    struct timeval timeout = {.tv_sec = 1};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    read_request(fd);
+    size_t len = render(body, RESPONSE_SIZE);
+    char head[160];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n",
+                            len);
+    if (send_all(fd, head, head_len) == 0)
+      send_all(fd, body, len);
+    close(fd);
+  }
+  return NULL;
+}
+
+static int open_endpoint(const char *listen_on) {
+  if (strchr(listen_on, '/')) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(listen_on) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(addr.sun_path, listen_on);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      return -1;
+    // a socket left behind by an earlier run
+    unlink(listen_on);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, 16) == -1) {
+      int saved = errno;
+      close(fd);
+      errno = saved;
+      return -1;
+    }
+    return fd;
+  }
+
+  char *end;
+  long port = strtol(listen_on, &end, 10);
+  if (*end != '\0' || port < 1 || port > UINT16_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  // loopback only, the numbers are not meant for the outside
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 16) == -1) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+int metrics_serve(const char *listen_on) {
+  listen_fd = open_endpoint(listen_on);
+  if (listen_fd == -1) {
+    int saved = errno;
+    log_perror(NULL, "metrics");
+    return saved;
+  }
+
+  atomic_store(&enabled, true);
+  pthread_t tid;
+  int err = pthread_create(&tid, NULL, serve_run, NULL);
+  if (err) {
+    log_err(NULL, "pthread_create: %s\n", strerror(err));
+    atomic_store(&enabled, false);
+    close(listen_fd);
+    return err;
+  }
+  pthread_detach(tid);
+  log_info(NULL, "serving metrics on %s\n", listen_on);
+  return 0;
+}
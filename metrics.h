@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+// process wide counters and latency histograms. each thread updates its own
+// shard with relaxed atomics, the endpoint sums all shards when scraped.
+// nothing is recorded until metrics_serve has been called.
+
+typedef enum {
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_CONNECTIONS_OPENED,
+  METRIC_CONNECTIONS_CLOSED,
+  METRIC_HANDSHAKE_FAILURES,
+  METRIC_MESSAGES,
+  METRIC_HANDSHAKE_TIMEOUTS,
+  METRIC_IDLE_TIMEOUTS,
+  METRIC_HEARTBEAT_TIMEOUTS,
+  METRIC_PINGS,
+  METRIC_PEER_MESSAGES_OUT,
+  METRIC_PEER_MESSAGES_IN,
+  METRIC_PRESENCE_GATHERED,
+  METRIC_DEFLATE_IN,
+  METRIC_DEFLATE_OUT,
+  METRIC_COUNTERS,
+} metric_counter_e;
+
+typedef enum {
+  // parsing a chat message until every recipient queue has it, in ns
+  METRIC_FANOUT,
+  // one write to a recipient socket, in ns
+  METRIC_SEND,
+  // handling a slash command, in ns
+  METRIC_COMMAND,
+  // bytes already waiting in a queue when a frame has to join them
+  METRIC_BACKLOG,
+  // compressing one frame for deflate clients, in ns
+  METRIC_DEFLATE,
+  METRIC_HISTS,
+} metric_hist_e;
+
+// monotonic nanoseconds, 0 while metrics are off
+uint64_t metrics_now(void);
+void metrics_add(metric_counter_e counter, uint64_t n);
+void metrics_record(metric_hist_e hist, uint64_t value);
+// records metrics_now() - start, unless start is 0
+void metrics_since(metric_hist_e hist, uint64_t start);
+
+// serves the metrics in prometheus text format over http, on a unix socket
+// if listen contains a '/' and on that port of 127.0.0.1 otherwise. returns
+// 0 or an errno value.
+int metrics_serve(const char *listen);
+
+#endif // METRICS_H
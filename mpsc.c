@@ -0,0 +1,44 @@
+#include "mpsc.h"
+
+void mpsc_init(mpsc_t *q) {
+  atomic_init(&q->stub.next, NULL);
+  atomic_init(&q->head, &q->stub);
+  q->tail = &q->stub;
+}
+
+void mpsc_push(mpsc_t *q, mpsc_node_t *node) {
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  mpsc_node_t *prev = atomic_exchange(&q->head, node);
+  // between the exchange and this store the chain is briefly broken
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+mpsc_node_t *mpsc_pop(mpsc_t *q) {
+  mpsc_node_t *tail = q->tail;
+  mpsc_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  if (tail == &q->stub) {
+    if (!next)
+      return NULL;
+    q->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+
+  // tail is the last node, unless a producer is still linking after it
+  if (tail != atomic_load(&q->head))
+    return NULL;
+
+  // park the stub behind tail so tail can be handed out
+  mpsc_push(q, &q->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// intrusive, unbounded multi-producer single-consumer queue. producers are
+// wait-free (one exchange), the consumer never takes a lock. embed an
+// mpsc_node_t in whatever is being queued.
+
+typedef struct mpsc_node mpsc_node_t;
+struct mpsc_node {
+  _Atomic(mpsc_node_t *) next;
+};
+
+typedef struct {
+  // producers swap themselves in here
+  _Atomic(mpsc_node_t *) head;
+  // consumer side only
+  mpsc_node_t *tail;
+  mpsc_node_t stub;
+} mpsc_t;
+
+void mpsc_init(mpsc_t *q);
+void mpsc_push(mpsc_t *q, mpsc_node_t *node);
+// returns NULL when empty, or when a producer is halfway through a push; that
+// producer will have its node visible on the next call
+mpsc_node_t *mpsc_pop(mpsc_t *q);
+
+#endif // MPSC_H
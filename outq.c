@@ -0,0 +1,720 @@
+// clock_gettime is hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "outq.h"
+#include "pool.h"
+#include "utils.h"
+#include "zframe.h"
+
+static outq_options_t options = {
+    .hwm = OUTQ_DEFAULT_HWM,
+    .policy = OUTQ_DROP_OLDEST,
+    .flush_bytes = OUTQ_DEFAULT_FLUSH_BYTES,
+};
+
+static struct {
+  atomic_uint_least64_t drop_oldest;
+  atomic_uint_least64_t dropped_frames;
+  atomic_uint_least64_t coalesce;
+  atomic_uint_least64_t coalesced_frames;
+  atomic_uint_least64_t disconnect;
+  atomic_uint_least64_t writes;
+} stats;
+
+void outq_configure(outq_options_t opts) {
+  if (opts.hwm < OUTQ_MIN_HWM)
+    opts.hwm = OUTQ_MIN_HWM;
+  options = opts;
+}
+
+outq_stats_t outq_stats(void) {
+  return (outq_stats_t){
+      .drop_oldest = atomic_load(&stats.drop_oldest),
+      .dropped_frames = atomic_load(&stats.dropped_frames),
+      .coalesce = atomic_load(&stats.coalesce),
+      .coalesced_frames = atomic_load(&stats.coalesced_frames),
+      .disconnect = atomic_load(&stats.disconnect),
+      .writes = atomic_load(&stats.writes),
+  };
+}
+
+static void outq_abort(outq_t *q);
+static int outq_flush_locked(outq_t *q);
+
+// FLUSHER
+// drains queues of blocking sockets whose owner thread is parked in recv
+
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t flusher_mu = PTHREAD_MUTEX_INITIALIZER;
+static outq_t **flusher_list;
+static size_t flusher_len;
+static size_t flusher_cap;
+static int flusher_wake = -1;
+
+static int flusher_append(outq_t *q) {
+  if (flusher_len == flusher_cap) {
+    size_t cap = flusher_cap ? flusher_cap * 2 : 64;
+    outq_t **list = realloc(flusher_list, cap * sizeof(*list));
+    if (!list)
+      return -1;
+    flusher_list = list;
+    flusher_cap = cap;
+  }
+  flusher_list[flusher_len++] = q;
+  return 0;
+}
+
+static void *flusher_run(void *) {
+  outq_t **pending = NULL;
+  struct pollfd *fds = NULL;
+  size_t cap = 0;
+
+  while (true) {
+    pthread_mutex_lock(&flusher_mu);
+    size_t count = flusher_len;
+    if (!fds || count > cap) {
+      outq_t **p = realloc(pending, count * sizeof(*p));
+      struct pollfd *f = realloc(fds, (count + 1) * sizeof(*f));
+      if (p)
+        pending = p;
+      if (f)
+        fds = f;
+      if (!p || !f) {
+        pthread_mutex_unlock(&flusher_mu);
+        log_perror(NULL, "flusher: realloc");
+        sleep(1);
+        continue;
+      }
+      cap = count;
+    }
+    if (count)
+      memcpy(pending, flusher_list, count * sizeof(*pending));
+    flusher_len = 0;
+    pthread_mutex_unlock(&flusher_mu);
+
+    fds[0] = (struct pollfd){.fd = flusher_wake, .events = POLLIN};
+    for (size_t i = 0; i < count; i++) {
+      fds[i + 1] = (struct pollfd){.fd = pending[i]->fd, .events = POLLOUT};
+    }
+
+    if (poll(fds, count + 1, -1) == -1 && errno != EINTR) {
+      log_perror(NULL, "flusher: poll");
+    }
+    if (fds[0].revents & POLLIN) {
+      uint64_t drained;
+      read(flusher_wake, &drained, sizeof(drained));
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      outq_t *q = pending[i];
+      bool keep = false;
+
+      pthread_mutex_lock(&q->mu);
+      if (!q->closed && fds[i + 1].revents) {
+        outq_flush_locked(q);
+      }
+      keep = !q->closed && q->count > 0;
+      q->flusher_queued = keep;
+      pthread_mutex_unlock(&q->mu);
+
+      if (keep) {
+        pthread_mutex_lock(&flusher_mu);
+        keep = flusher_append(q) == 0;
+        pthread_mutex_unlock(&flusher_mu);
+        if (!keep) {
+          // nothing else will retry this queue, so give up on the client
+          pthread_mutex_lock(&q->mu);
+          q->flusher_queued = false;
+          outq_abort(q);
+          pthread_mutex_unlock(&q->mu);
+        }
+      }
+      if (!keep)
+        outq_put(q);
+    }
+  }
+  return NULL;
+}
+
+static void flusher_start(void) {
+  flusher_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (flusher_wake == -1) {
+    log_perror(NULL, "eventfd");
+    return;
+  }
+
+  pthread_t tid;
+  int err = pthread_create(&tid, NULL, flusher_run, NULL);
+  if (err) {
+    log_err(NULL, "pthread_create: %s\n", strerror(err));
+    close(flusher_wake);
+    flusher_wake = -1;
+    return;
+  }
+  pthread_detach(tid);
+}
+
+// called with q->mu held
+static void flusher_add(outq_t *q) {
+  pthread_once(&flusher_once, flusher_start);
+  if (flusher_wake == -1 || q->flusher_queued)
+    return;
+
+  pthread_mutex_lock(&flusher_mu);
+  int err = flusher_append(q);
+  pthread_mutex_unlock(&flusher_mu);
+  if (err == -1)
+    return;
+
+  q->flusher_queued = true;
+  outq_get(q);
+  uint64_t one = 1;
+  write(flusher_wake, &one, sizeof(one));
+}
+
+// QUEUE
+
+static pool_t outq_pool = POOL_INIT("outq", sizeof(outq_t));
+
+outq_t *outq_new(int fd, outq_drain_e drain) {
+  outq_t *q = pool_alloc(&outq_pool);
+  if (!q)
+    return NULL;
+  memset(q, 0, sizeof(*q));
+  atomic_init(&q->refs, 1);
+  pthread_mutex_init(&q->mu, NULL);
+  q->fd = fd;
+  q->drain = drain;
+  return q;
+}
+
+void outq_get(outq_t *q) { atomic_fetch_add(&q->refs, 1); }
+
+static void outq_clear(outq_t *q, size_t keep) {
+  while (q->count > keep) {
+    size_t last = (q->head + q->count - 1) % OUTQ_SLOTS;
+    q->bytes -= frame_size(q->frames[last]);
+    frame_put(q->frames[last]);
+    q->count--;
+  }
+  if (q->count == 0) {
+    q->bytes = 0;
+    q->head_off = 0;
+    q->inflight = 0;
+  }
+}
+
+void outq_put(outq_t *q) {
+  if (atomic_fetch_sub(&q->refs, 1) != 1)
+    return;
+  outq_clear(q, 0);
+  pool_buf_free(q->frames);
+  pthread_mutex_destroy(&q->mu);
+  pool_free(&outq_pool, q);
+}
+
+void outq_close(outq_t *q) {
+  pthread_mutex_lock(&q->mu);
+  q->closed = true;
+  outq_clear(q, 0);
+  pthread_mutex_unlock(&q->mu);
+}
+
+// makes the owner notice: a blocked recv returns 0 and epoll reports a hangup
+static void outq_abort(outq_t *q) {
+  q->closed = true;
+  outq_clear(q, 0);
+  shutdown(q->fd, SHUT_RDWR);
+}
+
+void outq_shutdown(outq_t *q) {
+  pthread_mutex_lock(&q->mu);
+  if (!q->closed && q->drain != OUTQ_DRAIN_DEFERRED)
+    outq_flush_locked(q);
+  // the flush may have aborted already
+  if (!q->closed)
+    outq_abort(q);
+  pthread_mutex_unlock(&q->mu);
+}
+
+static ssize_t send_some(int fd, struct iovec *iov, int iovcnt) {
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+  while (true) {
+    uint64_t start = metrics_now();
+    atomic_fetch_add_explicit(&stats.writes, 1, memory_order_relaxed);
+    ssize_t sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    metrics_since(METRIC_SEND, start);
+    if (sent >= 0) {
+      metrics_add(METRIC_BYTES_OUT, sent);
+      return sent;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return -1;
+  }
+}
+
+// drops sent bytes from the head of the queue
+static void outq_advance(outq_t *q, size_t sent) {
+  q->bytes -= sent;
+  while (sent > 0) {
+    frame_t *frame = q->frames[q->head];
+    size_t rest = frame_size(frame) - q->head_off;
+    if (sent < rest) {
+      q->head_off += sent;
+      break;
+    }
+    sent -= rest;
+    frame_put(frame);
+    q->head = (q->head + 1) % OUTQ_SLOTS;
+    q->count--;
+    q->head_off = 0;
+  }
+}
+
+// frames that fit in one sendmsg call
+#define FLUSH_BATCH 64
+
+static int outq_flush_locked(outq_t *q) {
+  while (q->count > 0) {
+    struct iovec iov[FLUSH_BATCH * 2];
+    int iovcnt = 0;
+    size_t batch = q->count < FLUSH_BATCH ? q->count : FLUSH_BATCH;
+    for (size_t i = 0; i < batch; i++) {
+      frame_t *frame = q->frames[(q->head + i) % OUTQ_SLOTS];
+      iovcnt += frame_iov(frame, i == 0 ? q->head_off : 0, iov + iovcnt);
+    }
+
+    ssize_t sent = send_some(q->fd, iov, iovcnt);
+    if (sent == -1) {
+      outq_abort(q);
+      return -1;
+    }
+    if (sent == 0)
+      return 0;
+
+    outq_advance(q, sent);
+  }
+
+  q->throttled = false;
+  return 0;
+}
+
+int outq_flush(outq_t *q) {
+  pthread_mutex_lock(&q->mu);
+  int result =
+      q->closed || q->drain == OUTQ_DRAIN_DEFERRED ? 0 : outq_flush_locked(q);
+  pthread_mutex_unlock(&q->mu);
+  return result;
+}
+
+static int outq_append(outq_t *q, frame_t *frame) {
+  if (!q->frames) {
+    q->frames = pool_buf_alloc(OUTQ_SLOTS * sizeof(*q->frames));
+    if (!q->frames)
+      return -1;
+  }
+  size_t tail = (q->head + q->count) % OUTQ_SLOTS;
+  frame_get(frame);
+  q->frames[tail] = frame;
+  q->count++;
+  q->bytes += frame_size(frame);
+  return 0;
+}
+
+// frames at the head that a policy must leave alone: one partially written,
+// or however many a deferred write is still reading from
+static size_t outq_pinned(outq_t *q) {
+  if (q->inflight > 0)
+    return q->inflight;
+  return q->head_off > 0 ? 1 : 0;
+}
+
+static size_t outq_droppable(outq_t *q) { return q->count - outq_pinned(q); }
+
+// makes room for a frame of len bytes, returns -1 if the client was dropped
+static int outq_apply_policy(outq_t *q, size_t len) {
+  bool full = q->count + 2 > OUTQ_SLOTS || q->bytes + len > options.hwm;
+  if (!full)
+    return 0;
+
+  bool first = !q->throttled;
+  q->throttled = true;
+
+  switch (options.policy) {
+  case OUTQ_DROP_OLDEST: {
+    uint64_t dropped = 0;
+    while (outq_droppable(q) > 0 &&
+           (q->count + 2 > OUTQ_SLOTS || q->bytes + len > options.hwm)) {
+      // oldest unsent frame sits right after the pinned ones, which shift
+      // up one slot to take its place
+      size_t pinned = outq_pinned(q);
+      size_t victim = (q->head + pinned) % OUTQ_SLOTS;
+      q->bytes -= frame_size(q->frames[victim]);
+      frame_put(q->frames[victim]);
+      for (size_t i = pinned; i > 0; i--) {
+        q->frames[(q->head + i) % OUTQ_SLOTS] =
+            q->frames[(q->head + i - 1) % OUTQ_SLOTS];
+      }
+      q->head = (q->head + 1) % OUTQ_SLOTS;
+      q->count--;
+      dropped++;
+    }
+    atomic_fetch_add(&stats.dropped_frames, dropped);
+    uint64_t fired = atomic_fetch_add(&stats.drop_oldest, 1) + 1;
+    if (first)
+      log_info(NULL, "fd %d: slow reader, dropping oldest frames (%lu total)\n",
+               q->fd, (unsigned long)fired);
+    return 0;
+  }
+  case OUTQ_COALESCE: {
+    size_t dropped = outq_droppable(q);
+    outq_clear(q, q->count - dropped);
+    q->skipped += dropped;
+    atomic_fetch_add(&stats.coalesced_frames, dropped);
+    uint64_t fired = atomic_fetch_add(&stats.coalesce, 1) + 1;
+    if (first)
+      log_info(NULL, "fd %d: slow reader, coalescing backlog (%lu total)\n",
+               q->fd, (unsigned long)fired);
+    return 0;
+  }
+  case OUTQ_DISCONNECT:
+  default: {
+    uint64_t fired = atomic_fetch_add(&stats.disconnect, 1) + 1;
+    log_info(NULL, "fd %d: slow reader, disconnecting (%lu total)\n", q->fd,
+             (unsigned long)fired);
+    outq_abort(q);
+    return -1;
+  }
+  }
+}
+
+// tells the client how much a coalesce threw away, ahead of the next frame
+static void outq_append_notice(outq_t *q) {
+  if (q->skipped == 0)
+    return;
+
+  char notice[96];
+  snprintf(notice, sizeof(notice),
+           ANSI_BOLD ANSI_BYELLOW "... %zu messages skipped ...\n" ANSI_RESET,
+           q->skipped);
+  frame_t *notice_frame = q->v2 ? frame_new_v2('m', notice, strlen(notice))
+                                : frame_new('m', notice);
+  if (notice_frame && outq_append(q, notice_frame) == 0)
+    q->skipped = 0;
+  if (notice_frame)
+    frame_put(notice_frame);
+}
+
+// writes what the socket takes now and leaves the rest to the drainer
+static int outq_start_locked(outq_t *q) {
+  if (q->drain == OUTQ_DRAIN_DEFERRED)
+    return 0;
+
+  int result = outq_flush_locked(q);
+  if (result == 0 && q->count > 0 && q->drain == OUTQ_DRAIN_FLUSHER)
+    flusher_add(q);
+  return result;
+}
+
+// BATCHING
+
+typedef struct {
+  bool open;
+  outq_t **held;
+  size_t len;
+  size_t cap;
+  // when the first queue of this round was held, in microseconds
+  uint64_t since;
+} batch_t;
+
+static _Thread_local batch_t batch;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// pushes that the calling thread's batch will write later
+static bool outq_holds(outq_t *q) {
+  return batch.open && q->drain != OUTQ_DRAIN_DEFERRED;
+}
+
+// called instead of outq_start_locked while the caller has a batch open
+static int outq_hold_locked(outq_t *q) {
+  if (q->bytes >= options.flush_bytes)
+    return outq_start_locked(q);
+  // another thread's batch already has it and flushes it just as soon
+  if (q->held)
+    return 0;
+
+  if (batch.len == batch.cap) {
+    size_t cap = batch.cap ? batch.cap * 2 : 64;
+    outq_t **held = realloc(batch.held, cap * sizeof(*held));
+    if (!held)
+      return outq_start_locked(q);
+    batch.held = held;
+    batch.cap = cap;
+  }
+  if (batch.len == 0)
+    batch.since = now_us();
+  outq_get(q);
+  batch.held[batch.len++] = q;
+  q->held = true;
+  return 0;
+}
+
+void outq_batch_begin(void) { batch.open = true; }
+
+long outq_batch_wait(void) {
+  if (batch.len == 0)
+    return -1;
+  uint64_t waited = now_us() - batch.since;
+  return waited >= options.flush_delay ? 0 : (long)(options.flush_delay - waited);
+}
+
+void outq_batch_flush(void) {
+  for (size_t i = 0; i < batch.len; i++) {
+    outq_t *q = batch.held[i];
+    pthread_mutex_lock(&q->mu);
+    q->held = false;
+    // a failed write aborts the queue, its owner sees the hangup
+    if (!q->closed)
+      outq_start_locked(q);
+    pthread_mutex_unlock(&q->mu);
+    outq_put(q);
+  }
+  batch.len = 0;
+}
+
+void outq_batch_end(void) {
+  outq_batch_flush();
+  free(batch.held);
+  batch = (batch_t){0};
+}
+
+// the rest of a push, with q->mu held and frame in the queue's encoding
+static int outq_push_locked(outq_t *q, frame_t *frame) {
+  size_t len = frame_size(frame);
+
+  // fast path: nothing queued, so the frame can go straight out
+  size_t off = 0;
+  bool hold = outq_holds(q);
+  if (q->count == 0 && q->drain != OUTQ_DRAIN_DEFERRED && !hold) {
+    struct iovec iov[2];
+    ssize_t sent = send_some(q->fd, iov, frame_iov(frame, 0, iov));
+    if (sent == -1) {
+      outq_abort(q);
+      return -1;
+    }
+    off = sent;
+    if (off == len)
+      return 0;
+  }
+
+  if (off == 0 && outq_apply_policy(q, len) == -1)
+    return -1;
+
+  if (off == 0)
+    outq_append_notice(q);
+  metrics_record(METRIC_BACKLOG, q->bytes);
+
+  if (outq_append(q, frame) == -1)
+    return -1;
+  if (off > 0) {
+    q->head_off = off;
+    q->bytes -= off;
+  }
+
+  return hold ? outq_hold_locked(q) : outq_start_locked(q);
+}
+
+// a reference on frame in the queue's encoding, NULL when it cannot be
+// allocated. looked up under q->mu so no push can slip in between an upgrade
+// and the frames that follow it.
+static frame_t *outq_encode(outq_t *q, frame_t *frame) {
+  frame_t *v2 = q->v2 ? frame_for_v2(frame) : NULL;
+  if (q->v2 && !v2)
+    return NULL;
+  if (v2)
+    frame = v2;
+  if (!q->deflate) {
+    if (!v2)
+      frame_get(frame);
+    return frame;
+  }
+
+  frame_t *z = zframe_for(frame);
+  metrics_add(METRIC_DEFLATE_IN, frame_size(frame));
+  metrics_add(METRIC_DEFLATE_OUT, frame_size(z));
+  if (v2)
+    frame_put(v2);
+  return z;
+}
+
+static int outq_push_encoded(outq_t *q, frame_t *frame) {
+  frame = outq_encode(q, frame);
+  if (!frame)
+    return -1;
+  int result = outq_push_locked(q, frame);
+  frame_put(frame);
+  return result;
+}
+
+int outq_push_frame(outq_t *q, frame_t *frame) {
+  pthread_mutex_lock(&q->mu);
+  // the owner may already be tearing the client down
+  int result = q->closed ? 0 : outq_push_encoded(q, frame);
+  pthread_mutex_unlock(&q->mu);
+  return result;
+}
+
+int outq_push_frames(outq_t *q, frame_t **frames, size_t count) {
+  pthread_mutex_lock(&q->mu);
+  if (q->closed) {
+    pthread_mutex_unlock(&q->mu);
+    return 0;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    frame_t *frame = outq_encode(q, frames[i]);
+    int result = frame ? outq_apply_policy(q, frame_size(frame)) : -1;
+    if (result == 0) {
+      outq_append_notice(q);
+      result = outq_append(q, frame);
+    }
+    if (frame)
+      frame_put(frame);
+    if (result == -1) {
+      pthread_mutex_unlock(&q->mu);
+      return -1;
+    }
+  }
+
+  int result = outq_holds(q) ? outq_hold_locked(q) : outq_start_locked(q);
+  pthread_mutex_unlock(&q->mu);
+  return result;
+}
+
+int outq_push(outq_t *q, char type, const char *content) {
+  pthread_mutex_lock(&q->mu);
+  int result = 0;
+  if (!q->closed) {
+    frame_t *frame = frame_new(type, content);
+    result = frame ? outq_push_encoded(q, frame) : -1;
+    if (frame)
+      frame_put(frame);
+  }
+  pthread_mutex_unlock(&q->mu);
+  return result;
+}
+
+int outq_upgrade(outq_t *q, frame_t *last, bool v2, bool deflate) {
+  pthread_mutex_lock(&q->mu);
+  int result = 0;
+  if (!q->closed && last)
+    result = outq_push_encoded(q, last);
+  q->v2 = q->v2 || v2;
+  q->deflate = q->deflate || deflate;
+  pthread_mutex_unlock(&q->mu);
+  return result;
+}
+
+// HANDOVER
+
+int outq_export(outq_t *q, frame_t ***frames, size_t *count, size_t *head_off) {
+  pthread_mutex_lock(&q->mu);
+  *frames = NULL;
+  *count = 0;
+  *head_off = 0;
+  if (!q->closed && q->count > 0) {
+    frame_t **out = malloc(q->count * sizeof(*out));
+    if (!out) {
+      pthread_mutex_unlock(&q->mu);
+      return -1;
+    }
+    // the references move over, nothing is left to clear
+    for (size_t i = 0; i < q->count; i++) {
+      out[i] = q->frames[(q->head + i) % OUTQ_SLOTS];
+    }
+    *frames = out;
+    *count = q->count;
+    *head_off = q->head_off;
+    q->count = 0;
+    q->bytes = 0;
+    q->head_off = 0;
+  }
+  q->closed = true;
+  pthread_mutex_unlock(&q->mu);
+  return 0;
+}
+
+int outq_import(outq_t *q, frame_t **frames, size_t count, size_t head_off) {
+  pthread_mutex_lock(&q->mu);
+  if (q->closed || q->count > 0 || count > OUTQ_SLOTS - 1) {
+    pthread_mutex_unlock(&q->mu);
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (outq_append(q, frames[i]) == -1) {
+      outq_clear(q, 0);
+      pthread_mutex_unlock(&q->mu);
+      return -1;
+    }
+  }
+  if (count > 0 && head_off < frame_size(frames[0])) {
+    q->head_off = head_off;
+    q->bytes -= head_off;
+  }
+  int result = outq_start_locked(q);
+  pthread_mutex_unlock(&q->mu);
+  return result;
+}
+
+int outq_claim(outq_t *q, struct iovec *iov, int *iovcnt, frame_t **frames,
+               int max_frames) {
+  pthread_mutex_lock(&q->mu);
+  if (q->closed || q->inflight > 0) {
+    pthread_mutex_unlock(&q->mu);
+    return 0;
+  }
+
+  size_t batch = q->count < (size_t)max_frames ? q->count : (size_t)max_frames;
+  *iovcnt = 0;
+  for (size_t i = 0; i < batch; i++) {
+    frame_t *frame = q->frames[(q->head + i) % OUTQ_SLOTS];
+    *iovcnt += frame_iov(frame, i == 0 ? q->head_off : 0, iov + *iovcnt);
+    // outq_abort may clear the queue while the write is still running
+    frame_get(frame);
+    frames[i] = frame;
+  }
+  q->inflight = batch;
+  pthread_mutex_unlock(&q->mu);
+  return batch;
+}
+
+void outq_complete(outq_t *q, size_t sent) {
+  pthread_mutex_lock(&q->mu);
+  if (!q->closed && q->inflight > 0) {
+    q->inflight = 0;
+    outq_advance(q, sent);
+    if (q->count == 0)
+      q->throttled = false;
+  }
+  pthread_mutex_unlock(&q->mu);
+}
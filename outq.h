@@ -0,0 +1,150 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+
+// bounded per-client queue of encoded server frames. producers never block on
+// the socket: frames are written with MSG_DONTWAIT and whatever is left is
+// drained later, either by the reactor on EPOLLOUT or by the flusher thread.
+
+typedef enum {
+  // discard the oldest queued frames until the new one fits
+  OUTQ_DROP_OLDEST,
+  // replace the whole backlog with a single "skipped" notice
+  OUTQ_COALESCE,
+  // give up on the client and shut its socket down
+  OUTQ_DISCONNECT,
+} outq_policy_e;
+
+typedef struct {
+  size_t hwm;
+  outq_policy_e policy;
+  // microseconds a batch may hold frames back for more to join them, 0
+  // writes them once the event loop iteration that queued them is done
+  unsigned flush_delay;
+  // a held queue is written right away once it has this many bytes
+  size_t flush_bytes;
+} outq_options_t;
+
+#define OUTQ_DEFAULT_HWM (256 * 1024)
+#define OUTQ_MIN_HWM 4096
+#define OUTQ_DEFAULT_FLUSH_BYTES (32 * 1024)
+// a second, past that the batch is not worth the wait
+#define OUTQ_MAX_FLUSH_DELAY 1000000
+
+void outq_configure(outq_options_t options);
+
+#define OUTQ_SLOTS 256
+
+// who writes what a push could not send right away
+typedef enum {
+  // the owner calls outq_flush once the socket is writable
+  OUTQ_DRAIN_OWNER,
+  // the shared flusher thread polls the socket on the owner's behalf
+  OUTQ_DRAIN_FLUSHER,
+  // pushes never write, the owner claims frames and submits them itself
+  OUTQ_DRAIN_DEFERRED,
+} outq_drain_e;
+
+typedef struct {
+  atomic_int refs;
+  pthread_mutex_t mu;
+  int fd;
+  outq_drain_e drain;
+  bool flusher_queued;
+  bool closed;
+  // over the high-water mark since the last time the queue drained
+  bool throttled;
+  // waiting in some thread's batch
+  bool held;
+  // the client negotiated protocol v2, frames are queued in that encoding
+  bool v2;
+  // the client negotiated deflate, frames are queued as zframe_for gives them
+  bool deflate;
+  size_t head;
+  size_t count;
+  // bytes of the head frame already written
+  size_t head_off;
+  // head frames claimed by a deferred write that has not completed yet
+  size_t inflight;
+  size_t bytes;
+  size_t skipped;
+  // allocated the first time the socket pushes back, each slot holds a
+  // reference on a shared frame
+  frame_t **frames;
+} outq_t;
+
+outq_t *outq_new(int fd, outq_drain_e drain);
+void outq_get(outq_t *q);
+void outq_put(outq_t *q);
+
+// queues a frame, then writes as much as the socket takes. the queue takes
+// its own reference only if the frame has to wait.
+int outq_push_frame(outq_t *q, frame_t *frame);
+// queues several frames and writes them together, in as few calls as the
+// socket allows
+int outq_push_frames(outq_t *q, frame_t **frames, size_t count);
+// encodes a one-off frame and pushes it
+int outq_push(outq_t *q, char type, const char *content);
+// pushes last, the reply that switched encodings, as the queue encodes
+// frames so far, then has every later push encoded in v2 and/or deflated,
+// whichever thread it comes from. encodings are only ever turned on.
+int outq_upgrade(outq_t *q, frame_t *last, bool v2, bool deflate);
+// returns 0 once drained or when the socket would block, -1 on error
+int outq_flush(outq_t *q);
+// deferred queues only. fills iov with up to max_frames head frames, storing
+// a reference to each in frames, and pins them against the slow reader
+// policy. returns the number of frames claimed, 0 if there is nothing to send
+// or a write is already in flight.
+int outq_claim(outq_t *q, struct iovec *iov, int *iovcnt, frame_t **frames,
+               int max_frames);
+// releases the claim after the owner's write finished with sent bytes
+void outq_complete(outq_t *q, size_t sent);
+// stop all further writes, must be called before the owner closes the fd
+void outq_close(outq_t *q);
+// disconnects the client from any thread: writes what the socket takes right
+// away, then shuts the socket down so the owner sees a hangup
+void outq_shutdown(outq_t *q);
+
+// HANDOVER
+// closes the queue and moves what it still had to send into a malloc'd
+// array, the first head_off bytes of the first frame were already written.
+// the caller owns the array and a reference on every frame in it.
+int outq_export(outq_t *q, frame_t ***frames, size_t *count, size_t *head_off);
+// queues frames exported by another process on a fresh queue, skipping
+// head_off bytes of the first one, then writes what the socket takes. the
+// queue takes its own references.
+int outq_import(outq_t *q, frame_t **frames, size_t count, size_t head_off);
+
+// BATCHING
+// an event loop thread opens a batch once. from then on its pushes to queues
+// that write on push are only queued, and outq_batch_flush writes everything
+// a queue collected in one sendmsg, instead of one per frame. pushes from
+// threads without a batch are written right away as before.
+void outq_batch_begin(void);
+// microseconds until the held queues are due, 0 if they are, -1 if none are
+// held
+long outq_batch_wait(void);
+void outq_batch_flush(void);
+// flushes and closes the batch, before the thread exits
+void outq_batch_end(void);
+
+typedef struct {
+  uint64_t drop_oldest;
+  uint64_t dropped_frames;
+  uint64_t coalesce;
+  uint64_t coalesced_frames;
+  uint64_t disconnect;
+  // sendmsg calls, including ones the socket turned away
+  uint64_t writes;
+} outq_stats_t;
+
+outq_stats_t outq_stats(void);
+
+#endif // OUTQ_H
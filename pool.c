@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "pool.h"
+
+#define POOL_MAX 32
+// free objects a thread keeps per pool before handing half of them back
+#define CACHE_MAX 64
+#define SLAB_SIZE (64 * 1024)
+
+struct obj {
+  obj_t *next;
+};
+
+typedef struct {
+  obj_t *head;
+  size_t len;
+  // only written by the owning thread, summed by pool_stats
+  _Atomic uint64_t allocs;
+  _Atomic uint64_t frees;
+} cache_t;
+
+typedef struct thread_caches {
+  cache_t caches[POOL_MAX];
+  atomic_bool in_use;
+  struct thread_caches *next;
+} thread_caches_t;
+
+static pool_t *pools[POOL_MAX];
+static atomic_int pool_count;
+static pthread_mutex_t pools_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic(thread_caches_t *) threads;
+static _Thread_local thread_caches_t *self;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static int pool_id(pool_t *pool) {
+  int id = atomic_load_explicit(&pool->id, memory_order_acquire);
+  if (id)
+    return id - 1;
+
+  pthread_mutex_lock(&pools_mu);
+  id = atomic_load(&pool->id);
+  if (!id) {
+    int count = atomic_load(&pool_count);
+    if (count == POOL_MAX) {
+      log_err(NULL, "pool: too many pools, raise POOL_MAX\n");
+      abort();
+    }
+    // every object can hold a free list link and stays 16-byte aligned
+    if (pool->size < sizeof(obj_t))
+      pool->size = sizeof(obj_t);
+    pool->size = (pool->size + 15) & ~(size_t)15;
+    pools[count] = pool;
+    atomic_store(&pool_count, count + 1);
+    id = count + 1;
+    atomic_store_explicit(&pool->id, id, memory_order_release);
+  }
+  pthread_mutex_unlock(&pools_mu);
+  return id - 1;
+}
+
+// moves the first n objects of a thread cache to the depot
+static void give_back(pool_t *pool, cache_t *cache, size_t n) {
+  obj_t *first = cache->head;
+  obj_t *last = first;
+  for (size_t i = 1; i < n; i++)
+    last = last->next;
+  cache->head = last->next;
+  cache->len -= n;
+
+  pthread_mutex_lock(&pool->mu);
+  last->next = pool->depot;
+  pool->depot = first;
+  pool->depot_len += n;
+  pool->out -= n;
+  pthread_mutex_unlock(&pool->mu);
+}
+
+static void caches_release(void *caches_raw) {
+  thread_caches_t *t = caches_raw;
+  int count = atomic_load(&pool_count);
+  for (int i = 0; i < count; i++) {
+    if (t->caches[i].len)
+      give_back(pools[i], &t->caches[i], t->caches[i].len);
+  }
+  // frees later in the exit path attach again
+  self = NULL;
+  atomic_store(&t->in_use, false);
+}
+
+static void key_create(void) { pthread_key_create(&key, caches_release); }
+
+// blocks are never freed, threads that exit leave theirs for reuse
+static thread_caches_t *caches(void) {
+  if (self)
+    return self;
+  pthread_once(&key_once, key_create);
+
+  thread_caches_t *t;
+  for (t = atomic_load(&threads); t; t = t->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&t->in_use, &expected, true))
+      break;
+  }
+  if (!t) {
+    t = calloc(1, sizeof(*t));
+    if (!t) {
+      log_perror(NULL, "pool: calloc");
+      abort();
+    }
+    atomic_init(&t->in_use, true);
+    t->next = atomic_load(&threads);
+    while (!atomic_compare_exchange_weak(&threads, &t->next, t)) {
+    }
+  }
+  pthread_setspecific(key, t);
+  self = t;
+  return t;
+}
+
+static void count(_Atomic uint64_t *counter) {
+  // single writer, so no read-modify-write is needed
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+#ifndef POOL_MALLOC
+// takes half a cache worth from the depot, carving a new slab if it is empty
+static int refill(pool_t *pool, cache_t *cache) {
+  pthread_mutex_lock(&pool->mu);
+  if (!pool->depot) {
+    size_t n = SLAB_SIZE / pool->size;
+    if (n < 4)
+      n = 4;
+    char *slab = malloc(n * pool->size);
+    if (!slab) {
+      pthread_mutex_unlock(&pool->mu);
+      return -1;
+    }
+    for (size_t i = n; i-- > 0;) {
+      obj_t *obj = (obj_t *)(slab + i * pool->size);
+      obj->next = pool->depot;
+      pool->depot = obj;
+    }
+    pool->depot_len += n;
+    pool->carved += n;
+    pool->reserved += n * pool->size;
+  }
+
+  size_t n = pool->depot_len < CACHE_MAX / 2 ? pool->depot_len : CACHE_MAX / 2;
+  for (size_t i = 0; i < n; i++) {
+    obj_t *obj = pool->depot;
+    pool->depot = obj->next;
+    obj->next = cache->head;
+    cache->head = obj;
+  }
+  pool->depot_len -= n;
+  cache->len += n;
+  pool->out += n;
+  if (pool->out > pool->high_water)
+    pool->high_water = pool->out;
+  pthread_mutex_unlock(&pool->mu);
+  return 0;
+}
+#endif
+
+void *pool_alloc(pool_t *pool) {
+  cache_t *cache = &caches()->caches[pool_id(pool)];
+#ifdef POOL_MALLOC
+  void *ptr = malloc(pool->size);
+  if (ptr)
+    count(&cache->allocs);
+  return ptr;
+#else
+  if (!cache->head && refill(pool, cache) == -1)
+    return NULL;
+  obj_t *obj = cache->head;
+  cache->head = obj->next;
+  cache->len--;
+  count(&cache->allocs);
+  return obj;
+#endif
+}
+
+void pool_free(pool_t *pool, void *ptr) {
+  if (!ptr)
+    return;
+  cache_t *cache = &caches()->caches[pool_id(pool)];
+  count(&cache->frees);
+#ifdef POOL_MALLOC
+  free(ptr);
+#else
+  obj_t *obj = ptr;
+  obj->next = cache->head;
+  cache->head = obj;
+  cache->len++;
+  if (cache->len > CACHE_MAX)
+    give_back(pool, cache, CACHE_MAX / 2);
+#endif
+}
+
+// BUFFERS
+
+#define BUF_CLASSES 8
+// keeps the class in front of the buffer without breaking alignment
+#define BUF_HEADER 16
+
+static pool_t buf_pools[BUF_CLASSES] = {
+    POOL_INIT("buf_64", BUF_HEADER + 64),
+    POOL_INIT("buf_128", BUF_HEADER + 128),
+    POOL_INIT("buf_256", BUF_HEADER + 256),
+    POOL_INIT("buf_512", BUF_HEADER + 512),
+    POOL_INIT("buf_1k", BUF_HEADER + 1024),
+    POOL_INIT("buf_2k", BUF_HEADER + 2048),
+    POOL_INIT("buf_4k", BUF_HEADER + 4096),
+    POOL_INIT("buf_8k", BUF_HEADER + 8192),
+};
+
+void *pool_buf_alloc(size_t size) {
+  int cls = 0;
+  while (cls < BUF_CLASSES && ((size_t)64 << cls) < size)
+    cls++;
+
+  char *raw = cls < BUF_CLASSES ? pool_alloc(&buf_pools[cls])
+                                : malloc(BUF_HEADER + size);
+  if (!raw)
+    return NULL;
+  memcpy(raw, &cls, sizeof(cls));
+  return raw + BUF_HEADER;
+}
+
+void pool_buf_free(void *buf) {
+  if (!buf)
+    return;
+  char *raw = (char *)buf - BUF_HEADER;
+  int cls;
+  memcpy(&cls, raw, sizeof(cls));
+  if (cls < BUF_CLASSES) {
+    pool_free(&buf_pools[cls], raw);
+  } else {
+    free(raw);
+  }
+}
+
+// STATS
+
+size_t pool_stats(pool_stats_t *out, size_t cap) {
+  int total = atomic_load(&pool_count);
+  size_t n = (size_t)total < cap ? (size_t)total : cap;
+  for (size_t i = 0; i < n; i++) {
+    pool_t *pool = pools[i];
+    uint64_t allocs = 0;
+    uint64_t frees = 0;
+    for (thread_caches_t *t = atomic_load(&threads); t; t = t->next) {
+      allocs += atomic_load_explicit(&t->caches[i].allocs,
+                                     memory_order_relaxed);
+      frees += atomic_load_explicit(&t->caches[i].frees, memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&pool->mu);
+#ifdef POOL_MALLOC
+    uint64_t recycled = 0;
+#else
+    uint64_t recycled = allocs > pool->carved ? allocs - pool->carved : 0;
+#endif
+    out[i] = (pool_stats_t){
+        .name = pool->name,
+        .size = pool->size,
+        .in_use = allocs > frees ? allocs - frees : 0,
+        .high_water = pool->high_water,
+        .reserved_bytes = pool->reserved,
+        .allocs = allocs,
+        .recycled = recycled,
+    };
+    pthread_mutex_unlock(&pool->mu);
+  }
+  return total;
+}
@@ -0,0 +1,62 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// fixed-size object pools. every thread keeps a small cache of free objects
+// per pool and only takes the pool lock to trade half a cache with the shared
+// depot, which is refilled from 64 KiB slabs. objects may be freed on any
+// thread. slabs are never handed back, so memory stays at the high-water mark.
+//
+// ./build.sh -DPOOL_MALLOC turns every pool into plain malloc and free, to
+// compare rss and throughput against the system allocator. only allocations
+// and objects in use are counted then.
+
+typedef struct obj obj_t;
+
+typedef struct {
+  const char *name;
+  size_t size;
+  // 1 + index into the thread caches, 0 until the first allocation
+  atomic_int id;
+  pthread_mutex_t mu;
+  obj_t *depot;
+  size_t depot_len;
+  // objects handed out of the depot, in use or in some thread's cache
+  size_t out;
+  size_t high_water;
+  size_t carved;
+  size_t reserved;
+} pool_t;
+
+#define POOL_INIT(name_, size_)                                               \
+  {.name = (name_), .size = (size_), .mu = PTHREAD_MUTEX_INITIALIZER}
+
+// contents are undefined, like malloc. NULL with errno set on failure.
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *obj);
+
+// size-classed buffers from 64 bytes to 8 KiB, larger ones come from malloc
+void *pool_buf_alloc(size_t size);
+void pool_buf_free(void *buf);
+
+typedef struct {
+  const char *name;
+  size_t size;
+  uint64_t in_use;
+  // most objects out of the depot at once, thread caches included
+  uint64_t high_water;
+  uint64_t reserved_bytes;
+  uint64_t allocs;
+  // allocations served by an object that was freed before
+  uint64_t recycled;
+} pool_stats_t;
+
+// copies stats for up to cap pools that have been used, returns how many
+// there are
+size_t pool_stats(pool_stats_t *out, size_t cap);
+
+#endif // POOL_H
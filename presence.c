@@ -0,0 +1,196 @@
+// nanosleep is hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "event.h"
+#include "metrics.h"
+#include "presence.h"
+#include "session.h"
+#include "utils.h"
+#include "wheel.h"
+
+typedef enum {
+  PRESENCE_JOINED,
+  PRESENCE_LEFT,
+  PRESENCE_KINDS,
+} presence_kind_e;
+
+// notices of one kind gathered within a window
+typedef struct {
+  size_t count;
+  // the first one, sent as it is when nothing followed it
+  char ip[INET_ADDRSTRLEN];
+  uint16_t port;
+  // the first options.cap names
+  char (*names)[MAX_NAME_LEN + 1];
+} batch_t;
+
+static presence_options_t options;
+static void (*send_frame)(frame_t *frame);
+
+static pthread_mutex_t presence_mu = PTHREAD_MUTEX_INITIALIZER;
+// wakes the presence thread when a batch gets its first notice
+static pthread_cond_t presence_cond = PTHREAD_COND_INITIALIZER;
+static batch_t batches[PRESENCE_KINDS];
+// wheel_clock() before which notices are gathered instead of sent
+static uint64_t quiet_at;
+
+// NOTICES
+
+static frame_t *single_notice(presence_kind_e kind, const char *name,
+                              const char *ip, uint16_t port) {
+  return event_frame(&(event_t){
+      .kind = kind == PRESENCE_JOINED ? EVENT_JOINED : EVENT_LEFT,
+      .name = name,
+      .ip = ip,
+      .port = port,
+  });
+}
+
+// "3 users joined: ann, bob, cat", or just the count once there are more
+// than the cap or the names do not fit a frame
+static frame_t *summary(presence_kind_e kind, const batch_t *batch) {
+  char list[PROTO_SERVER_MAX - 64];
+  size_t len = 0;
+  bool listed = batch->count <= (size_t)options.cap;
+  for (size_t i = 0; listed && i < batch->count; i++) {
+    int n = snprintf(list + len, sizeof(list) - len, "%s%s", i ? ", " : "",
+                     batch->names[i]);
+    if ((size_t)n >= sizeof(list) - len)
+      listed = false;
+    else
+      len += n;
+  }
+
+  return event_frame(&(event_t){
+      .kind = EVENT_SUMMARY,
+      .flag = kind == PRESENCE_JOINED,
+      .count = batch->count,
+      .text = listed ? list : "",
+  });
+}
+
+// empties batch into at most one frame, with presence_mu held
+static frame_t *take(presence_kind_e kind, batch_t *batch) {
+  if (batch->count == 0)
+    return NULL;
+  frame_t *frame =
+      batch->count == 1
+          ? single_notice(kind, batch->names[0], batch->ip, batch->port)
+          : summary(kind, batch);
+  if (batch->count > 1)
+    metrics_add(METRIC_PRESENCE_GATHERED, batch->count);
+  batch->count = 0;
+  return frame;
+}
+
+static void deliver(frame_t *frame) {
+  if (!frame) {
+    log_perror(NULL, "presence: malloc");
+    return;
+  }
+  send_frame(frame);
+  frame_put(frame);
+}
+
+static void notice(presence_kind_e kind, const char *name, const char *ip,
+                   uint16_t port) {
+  pthread_mutex_lock(&presence_mu);
+  uint64_t now = wheel_clock();
+  bool idle = batches[PRESENCE_JOINED].count == 0 &&
+              batches[PRESENCE_LEFT].count == 0;
+  if (options.window == 0 || (idle && now >= quiet_at)) {
+    // nothing went out lately, this one does not wait
+    quiet_at = now + options.window;
+    pthread_mutex_unlock(&presence_mu);
+    deliver(single_notice(kind, name, ip, port));
+    return;
+  }
+
+  batch_t *batch = &batches[kind];
+  if (batch->count == 0) {
+    snprintf(batch->ip, sizeof(batch->ip), "%s", ip);
+    batch->port = port;
+  }
+  // the first name is kept even at a cap of 0, a lone notice needs it
+  if (batch->count < (size_t)options.cap || batch->count == 0)
+    snprintf(batch->names[batch->count], MAX_NAME_LEN + 1, "%s", name);
+  batch->count++;
+  if (idle)
+    pthread_cond_signal(&presence_cond);
+  pthread_mutex_unlock(&presence_mu);
+}
+
+void presence_joined(const char *name, const char *ip, uint16_t port) {
+  notice(PRESENCE_JOINED, name, ip, port);
+}
+
+void presence_left(const char *name, const char *ip, uint16_t port) {
+  notice(PRESENCE_LEFT, name, ip, port);
+}
+
+// PRESENCE THREAD
+// sends what a window gathered once it is over
+
+static void *presence_run(void *) {
+  pthread_mutex_lock(&presence_mu);
+  while (true) {
+    while (batches[PRESENCE_JOINED].count == 0 &&
+           batches[PRESENCE_LEFT].count == 0)
+      pthread_cond_wait(&presence_cond, &presence_mu);
+
+    // quiet_at only moves while nothing is gathered, so it holds still
+    uint64_t now = wheel_clock();
+    if (now < quiet_at) {
+      uint64_t ms = quiet_at - now;
+      pthread_mutex_unlock(&presence_mu);
+      nanosleep(&(struct timespec){.tv_sec = ms / 1000,
+                                   .tv_nsec = (ms % 1000) * 1000000L},
+                NULL);
+      pthread_mutex_lock(&presence_mu);
+      continue;
+    }
+
+    frame_t *joined = take(PRESENCE_JOINED, &batches[PRESENCE_JOINED]);
+    frame_t *left = take(PRESENCE_LEFT, &batches[PRESENCE_LEFT]);
+    quiet_at = now + options.window;
+    pthread_mutex_unlock(&presence_mu);
+    if (joined)
+      deliver(joined);
+    if (left)
+      deliver(left);
+    pthread_mutex_lock(&presence_mu);
+  }
+  return NULL;
+}
+
+int presence_start(presence_options_t opts, void (*send)(frame_t *frame)) {
+  options = opts;
+  send_frame = send;
+  if (options.window == 0)
+    return 0;
+
+  for (int kind = 0; kind < PRESENCE_KINDS; kind++) {
+    // room for the first name even at a cap of 0
+    size_t slots = options.cap > 0 ? (size_t)options.cap : 1;
+    batches[kind].names = calloc(slots, sizeof(*batches[kind].names));
+    if (!batches[kind].names) {
+      log_perror(NULL, "presence: calloc");
+      return ENOMEM;
+    }
+  }
+  pthread_t tid;
+  int err = pthread_create(&tid, NULL, presence_run, NULL);
+  if (err) {
+    log_err(NULL, "pthread_create: %s\n", strerror(err));
+    return err;
+  }
+  pthread_detach(tid);
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+// join and disconnect notices. the first one after a quiet window goes out
+// right away as before, the ones following it within the window are
+// gathered into one summary per kind, so a reconnect storm costs every
+// client a frame per window instead of one per user.
+
+typedef struct {
+  // milliseconds after a notice during which the next ones are gathered, 0
+  // sends every notice on its own
+  int window;
+  // names a summary lists, past that it only gives the count
+  int cap;
+} presence_options_t;
+
+#define PRESENCE_DEFAULT_WINDOW 250
+#define PRESENCE_MAX_WINDOW 10000
+#define PRESENCE_DEFAULT_CAP 20
+// what still fits one frame at the longest names
+#define PRESENCE_MAX_CAP 100
+
+// send gets every notice and summary and keeps its own reference, from
+// whichever thread reported the event or from the presence thread. returns 0
+// or an errno value.
+int presence_start(presence_options_t options, void (*send)(frame_t *frame));
+void presence_joined(const char *name, const char *ip, uint16_t port);
+void presence_left(const char *name, const char *ip, uint16_t port);
+
+#endif // PRESENCE_H
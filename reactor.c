@@ -0,0 +1,528 @@
+// pthread barriers are hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "channels.h"
+#include "epoch.h"
+#include "handover.h"
+#include "metrics.h"
+#include "mpsc.h"
+#include "pool.h"
+#include "reactor.h"
+#include "session.h"
+#include "utils.h"
+#include "wheel.h"
+
+#define MAX_EVENTS 256
+
+typedef struct conn conn_t;
+struct conn {
+  client_ctx_t ctx;
+  client_io_t io;
+  char rx_buf[SESSION_RX_SIZE];
+  proto_reader_t rx;
+  // armed for ctx.deadline on the owning shard's wheel
+  wheel_timer_t timer;
+  // the owning shard's connection list
+  conn_t *prev;
+  conn_t *next;
+};
+
+// a broadcast handed from one shard to another
+typedef struct {
+  mpsc_node_t node;
+  frame_t *frame;
+  // NULL for every registered client
+  channel_t *channel;
+  int exclude_fd;
+} relay_t;
+
+typedef struct {
+  int id;
+  int epoll_fd;
+  int listen_fd;
+  // eventfd other shards write to after queueing relays
+  int wake_fd;
+  atomic_bool wake_pending;
+  mpsc_t inbox;
+  // only touched by the shard's own thread
+  conn_t *conns;
+  wheel_t timers;
+} shard_t;
+
+static pool_t conn_pool = POOL_INIT("epoll_conn", sizeof(conn_t));
+static pool_t relay_pool = POOL_INIT("relay", sizeof(relay_t));
+
+static shard_t *shards;
+// published once every shard is set up, other threads may broadcast before
+static atomic_int shard_count;
+static _Thread_local shard_t *self;
+
+// epoll tags for the two fds of a shard that are not connections
+static char listen_tag;
+static char wake_tag;
+
+static conn_t *conn_new(int fd) {
+  conn_t *conn = pool_alloc(&conn_pool);
+  if (!conn)
+    return NULL;
+  memset(conn, 0, sizeof(*conn));
+  conn->ctx.out = outq_new(fd, OUTQ_DRAIN_OWNER);
+  if (!conn->ctx.out) {
+    pool_free(&conn_pool, conn);
+    return NULL;
+  }
+
+  conn->ctx.fd = fd;
+  conn->io.fd = fd;
+  conn->io.out = conn->ctx.out;
+  proto_reader_init(&conn->rx, conn->rx_buf, sizeof(conn->rx_buf), false);
+  return conn;
+}
+
+static void conn_free(void *conn_raw) {
+  conn_t *conn = conn_raw;
+  outq_put(conn->ctx.out);
+  pool_free(&conn_pool, conn);
+}
+
+static void conn_link(shard_t *shard, conn_t *conn) {
+  conn->next = shard->conns;
+  if (shard->conns)
+    shard->conns->prev = conn;
+  shard->conns = conn;
+}
+
+static void conn_unlink(shard_t *shard, conn_t *conn) {
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    shard->conns = conn->next;
+  }
+  if (conn->next)
+    conn->next->prev = conn->prev;
+}
+
+static void conn_close(shard_t *shard, conn_t *conn) {
+  session_close(&conn->io, &conn->ctx);
+  wheel_cancel(&shard->timers, &conn->timer);
+  conn_unlink(shard, conn);
+  // last words like a goodbye may still be held by the batch
+  outq_flush(conn->ctx.out);
+  outq_close(conn->ctx.out);
+  // closing the fd also removes it from the epoll set
+  close(conn->ctx.fd);
+  epoch_retire(conn, conn_free);
+}
+
+// sessions only move their deadline while handling input or a timeout, so
+// the timer follows it after each of those
+static void conn_rearm(shard_t *shard, conn_t *conn) {
+  wheel_set(&shard->timers, &conn->timer, conn->ctx.deadline);
+}
+
+static void conn_expired(wheel_timer_t *timer) {
+  conn_t *conn = (conn_t *)((char *)timer - offsetof(conn_t, timer));
+  if (session_timeout(&conn->io, &conn->ctx) == SESSION_CLOSE) {
+    conn_close(self, conn);
+    return;
+  }
+  conn_rearm(self, conn);
+}
+
+// puts a new connection in the shard's epoll set and list, frees it on error
+static int conn_add(shard_t *shard, conn_t *conn) {
+  conn->ctx.slot = shard->id;
+  conn->timer.fn = conn_expired;
+  struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+      .data.ptr = conn,
+  };
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, conn->ctx.fd, &ev) == -1) {
+    log_perror(LOG_CTX(&conn->ctx), "epoll_ctl");
+    close(conn->ctx.fd);
+    outq_put(conn->ctx.out);
+    pool_free(&conn_pool, conn);
+    return -1;
+  }
+  conn_link(shard, conn);
+  return 0;
+}
+
+static void accept_all(shard_t *shard) {
+  while (true) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = accept(shard->listen_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_perror(NULL, "accept");
+      return;
+    }
+
+    if (set_nonblocking(fd) == -1) {
+      log_perror(NULL, "fcntl");
+      close(fd);
+      continue;
+    }
+
+    conn_t *conn = conn_new(fd);
+    if (!conn) {
+      log_perror(NULL, "malloc");
+      close(fd);
+      continue;
+    }
+    conn->ctx.port = ntohs(addr.sin_port);
+    inet_ntop(AF_INET, &addr.sin_addr, conn->ctx.ip, sizeof(conn->ctx.ip));
+    log_info(NULL, "accepted connection from %s:%u\n", conn->ctx.ip,
+             conn->ctx.port);
+    if (conn_add(shard, conn) == -1)
+      continue;
+
+    session_open(&conn->io, &conn->ctx);
+    conn_rearm(shard, conn);
+  }
+}
+
+// edge triggered, so keep reading until the socket would block
+static session_result_t conn_readable(conn_t *conn) {
+  while (true) {
+    size_t avail;
+    char *dst = proto_reader_space(&conn->rx, &avail);
+    ssize_t n = recv(conn->ctx.fd, dst, avail, 0);
+    if (n == 0)
+      return SESSION_CLOSE;
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return SESSION_CONTINUE;
+      log_perror(LOG_CTX(&conn->ctx), "recv");
+      return SESSION_CLOSE;
+    }
+
+    metrics_add(METRIC_BYTES_IN, n);
+    proto_reader_filled(&conn->rx, n);
+    if (session_parse(&conn->io, &conn->ctx, &conn->rx) ==
+        SESSION_CLOSE)
+      return SESSION_CLOSE;
+  }
+}
+
+// BROADCAST
+// every shard fans a frame out to its own connections. frames from other
+// shards arrive through the inbox, so no connection is touched off its shard.
+
+typedef struct {
+  frame_t *frame;
+  int exclude_fd;
+} delivery_t;
+
+static void deliver_one(client_ctx_t *ctx, void *delivery_raw) {
+  delivery_t *delivery = delivery_raw;
+  if (ctx->fd == delivery->exclude_fd)
+    return;
+  if (outq_push_frame(ctx->out, delivery->frame) == -1) {
+    log_err(LOG_CTX(ctx), "broadcast failed\n");
+  }
+}
+
+static void deliver(shard_t *shard, channel_t *channel, frame_t *frame,
+                    int exclude_fd) {
+  delivery_t delivery = {.frame = frame, .exclude_fd = exclude_fd};
+  if (channel) {
+    channels_each(channel, shard->id, deliver_one, &delivery);
+    return;
+  }
+  for (conn_t *conn = shard->conns; conn; conn = conn->next) {
+    // registered is only written by sessions running on this thread
+    if (conn->ctx.registered)
+      deliver_one(&conn->ctx, &delivery);
+  }
+}
+
+int reactor_broadcast(channel_t *channel, frame_t *frame, int exclude_fd) {
+  int err = 0;
+  int count = atomic_load(&shard_count);
+  for (int i = 0; i < count; i++) {
+    shard_t *shard = &shards[i];
+    if (shard == self)
+      continue;
+    // shards without members of the channel are left alone. one that gains
+    // a member right now misses this frame, as if the member joined later.
+    if (channel && channels_members(channel, i) == 0)
+      continue;
+
+    relay_t *relay = pool_alloc(&relay_pool);
+    if (!relay) {
+      log_perror(NULL, "broadcast: malloc");
+      err = -1;
+      continue;
+    }
+    frame_get(frame);
+    relay->frame = frame;
+    if (channel)
+      channels_get(channel);
+    relay->channel = channel;
+    relay->exclude_fd = exclude_fd;
+    mpsc_push(&shard->inbox, &relay->node);
+
+    // one wakeup per drain is enough, later pushes ride along
+    if (!atomic_exchange(&shard->wake_pending, true)) {
+      uint64_t one = 1;
+      if (write(shard->wake_fd, &one, sizeof(one)) == -1)
+        log_perror(NULL, "broadcast: eventfd write");
+    }
+  }
+
+  // a thread that is no shard, like the federation one, relays to all of them
+  if (self)
+    deliver(self, channel, frame, exclude_fd);
+  return err;
+}
+
+static void drain_inbox(shard_t *shard) {
+  uint64_t value;
+  if (read(shard->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    log_perror(NULL, "eventfd read");
+  // cleared before draining, so a push that misses this drain wakes us again
+  atomic_store(&shard->wake_pending, false);
+
+  mpsc_node_t *node;
+  while ((node = mpsc_pop(&shard->inbox))) {
+    relay_t *relay = (relay_t *)node;
+    deliver(shard, relay->channel, relay->frame, relay->exclude_fd);
+    frame_put(relay->frame);
+    if (relay->channel)
+      channels_put(relay->channel);
+    pool_free(&relay_pool, relay);
+  }
+}
+
+// HANDOVER
+// a freeze stops every shard at a barrier first, so none relays anything once
+// the others exported. then each delivers what was relayed to it before, hands
+// its connections and listener over and parks.
+
+static atomic_bool freezing;
+static pthread_barrier_t frozen;
+
+static void shard_freeze(shard_t *shard) {
+  pthread_barrier_wait(&frozen);
+  drain_inbox(shard);
+  for (conn_t *conn = shard->conns; conn; conn = conn->next)
+    handover_add_session(&conn->ctx, &conn->rx);
+  handover_add_listener(shard->listen_fd);
+  pthread_barrier_wait(&frozen);
+  handover_park();
+}
+
+void reactor_freeze(void) {
+  int count = atomic_load(&shard_count);
+  pthread_barrier_init(&frozen, NULL, count + 1);
+  atomic_store(&freezing, true);
+  for (int i = 0; i < count; i++) {
+    uint64_t one = 1;
+    if (write(shards[i].wake_fd, &one, sizeof(one)) == -1)
+      log_perror(NULL, "freeze: eventfd write");
+  }
+  // once for every shard stopping, once for every shard done exporting
+  pthread_barrier_wait(&frozen);
+  pthread_barrier_wait(&frozen);
+}
+
+// a session the previous process handed over, resumed on shard
+static void shard_adopt(shard_t *shard, handover_session_t *s) {
+  if (set_nonblocking(s->fd) == -1) {
+    log_perror(NULL, "fcntl");
+    return;
+  }
+  conn_t *conn = conn_new(s->fd);
+  if (!conn) {
+    log_perror(NULL, "malloc");
+    return;
+  }
+  // the connection owns the fd from here on
+  s->fd = -1;
+  if (conn_add(shard, conn) == -1)
+    return;
+
+  handover_load_rx(&conn->rx, s);
+  if (session_resume(&conn->io, &conn->ctx, s) == SESSION_CLOSE) {
+    conn_close(shard, conn);
+    return;
+  }
+  conn_rearm(shard, conn);
+}
+
+// EVENT LOOP
+
+static int shard_add(shard_t *shard, int fd, void *tag) {
+  struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLET,
+      .data.ptr = tag,
+  };
+  return epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int shard_init(shard_t *shard, int id, int listen_fd) {
+  shard->id = id;
+  shard->listen_fd = listen_fd;
+  mpsc_init(&shard->inbox);
+  wheel_init(&shard->timers, wheel_clock());
+
+  if (set_nonblocking(listen_fd) == -1) {
+    log_perror(NULL, "fcntl");
+    return errno;
+  }
+
+  shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (shard->epoll_fd == -1) {
+    log_perror(NULL, "epoll_create1");
+    return errno;
+  }
+  shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (shard->wake_fd == -1) {
+    int saved = errno;
+    log_perror(NULL, "eventfd");
+    close(shard->epoll_fd);
+    return saved;
+  }
+
+  if (shard_add(shard, listen_fd, &listen_tag) == -1 ||
+      shard_add(shard, shard->wake_fd, &wake_tag) == -1) {
+    int saved = errno;
+    log_perror(NULL, "epoll_ctl");
+    close(shard->wake_fd);
+    close(shard->epoll_fd);
+    return saved;
+  }
+  return 0;
+}
+
+// the sooner of the next timer and the held frames coming due, NULL to
+// sleep until an event
+static struct timespec *shard_timeout(shard_t *shard, struct timespec *ts) {
+  long wait = outq_batch_wait();
+  int timer = wheel_timeout(&shard->timers, wheel_clock());
+  if (timer >= 0 && (wait < 0 || (long)timer * 1000 < wait))
+    wait = (long)timer * 1000;
+  if (wait < 0)
+    return NULL;
+  ts->tv_sec = wait / 1000000;
+  ts->tv_nsec = wait % 1000000 * 1000;
+  return ts;
+}
+
+static int shard_loop(shard_t *shard) {
+  self = shard;
+
+  struct epoll_event events[MAX_EVENTS];
+  // frames queued while handling events leave together once they are done
+  outq_batch_begin();
+  while (true) {
+    struct timespec ts;
+    int n = epoll_pwait2(shard->epoll_fd, events, MAX_EVENTS,
+                         shard_timeout(shard, &ts), NULL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      int saved = errno;
+      log_perror(NULL, "epoll_pwait2");
+      return saved;
+    }
+
+    for (int i = 0; i < n; i++) {
+      void *tag = events[i].data.ptr;
+      if (tag == &listen_tag) {
+        accept_all(shard);
+        continue;
+      }
+      if (tag == &wake_tag) {
+        drain_inbox(shard);
+        continue;
+      }
+
+      conn_t *conn = tag;
+      uint32_t flags = events[i].events;
+      if (flags & (EPOLLERR | EPOLLHUP)) {
+        conn_close(shard, conn);
+        continue;
+      }
+      if (flags & (EPOLLIN | EPOLLRDHUP)) {
+        if (conn_readable(conn) == SESSION_CLOSE) {
+          conn_close(shard, conn);
+          continue;
+        }
+        conn_rearm(shard, conn);
+      }
+      if (flags & EPOLLOUT) {
+        if (outq_flush(conn->ctx.out) == -1) {
+          conn_close(shard, conn);
+          continue;
+        }
+      }
+    }
+    if (atomic_load(&freezing))
+      shard_freeze(shard);
+
+    wheel_advance(&shard->timers, wheel_clock());
+    if (outq_batch_wait() == 0)
+      outq_batch_flush();
+    epoch_reclaim();
+  }
+}
+
+static void *shard_thread(void *shard_raw) {
+  shard_t *shard = shard_raw;
+  int err = shard_loop(shard);
+  log_err(NULL, "shard %d stopped: %s\n", shard->id, strerror(err));
+  return NULL;
+}
+
+int reactor_run(const int *listen_fds, int count, handover_t *taken) {
+  shards = calloc(count, sizeof(*shards));
+  if (!shards) {
+    log_perror(NULL, "malloc");
+    return errno;
+  }
+  // shards may broadcast to each other as soon as they start
+  for (int i = 0; i < count; i++) {
+    int err = shard_init(&shards[i], i, listen_fds[i]);
+    if (err)
+      return err;
+  }
+  // handed over sessions are spread over the shards before any of them runs
+  if (taken) {
+    for (size_t i = 0; i < taken->session_count; i++)
+      shard_adopt(&shards[i % count], &taken->sessions[i]);
+    handover_free(taken);
+  }
+  atomic_store(&shard_count, count);
+
+  // the calling thread becomes shard 0
+  for (int i = 1; i < count; i++) {
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, shard_thread, &shards[i]);
+    if (err) {
+      log_err(NULL, "pthread_create: %s\n", strerror(err));
+      return err;
+    }
+    pthread_detach(tid);
+  }
+  log_info(NULL, "running %d reactor shard%s\n", count, count == 1 ? "" : "s");
+
+  return shard_loop(&shards[0]);
+}
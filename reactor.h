@@ -0,0 +1,23 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "channels.h"
+#include "frame.h"
+#include "handover.h"
+
+// edge-triggered epoll event loops, one shard per listener. every connection
+// is a non-blocking session owned by the shard that accepted it. the calling
+// thread runs shard 0 and only returns on error. sessions taken over from
+// the previous process are resumed first, spread over the shards, and taken
+// is freed.
+int reactor_run(const int *listen_fds, int count, handover_t *taken);
+
+// hands frame to every member of channel, or every registered client when
+// channel is NULL, except exclude_fd. clients on other shards than the
+// calling one get it through their inbox, from any other thread all do.
+int reactor_broadcast(channel_t *channel, frame_t *frame, int exclude_fd);
+
+// handover_freeze_fn for the shards
+void reactor_freeze(void);
+
+#endif // REACTOR_H
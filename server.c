@@ -1,142 +1,153 @@
 #include <arpa/inet.h>
+// SO_REUSEPORT, which glibc hides in strict iso mode
+#include <asm/socket.h>
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 
+#include "channels.h"
+#include "chatlog.h"
+#include "clients.h"
+#include "epoch.h"
+#include "event.h"
+#include "federation.h"
+#include "frame.h"
+#include "handover.h"
+#include "history.h"
+#include "metrics.h"
+#include "pool.h"
+#include "presence.h"
+#include "reactor.h"
+#include "server.h"
+#include "session.h"
+#include "uring.h"
 #include "utils.h"
+#include "wheel.h"
+#include "zframe.h"
 
-#define MAX_CLIENTS 64
-#define MAX_NAME_LEN 32
+static server_backend_e backend;
+// in milliseconds, 0 turns the check off
+static uint64_t handshake_timeout;
+static uint64_t idle_timeout;
+static uint64_t heartbeat;
+// whether clients may negotiate PROTO_CAP_DEFLATE
+static bool deflate_enabled;
 
 typedef struct {
-  int fd;
-  char ip[INET_ADDRSTRLEN];
-  uint16_t port;
-  char name[MAX_NAME_LEN + 1];
-} client_ctx_t;
+  frame_t *frame;
+  int exclude_fd;
+} delivery_t;
 
-// guaranteed null sentinel
-static client_ctx_t *clients[MAX_CLIENTS + 1];
-static pthread_mutex_t clients_mu = PTHREAD_MUTEX_INITIALIZER;
-
-typedef enum {
-  CLIENTS_ADD_OK,
-  CLIENTS_ADD_ERROR,
-  CLIENTS_ADD_DUPLICATE,
-} clients_add_result_t;
-
-static clients_add_result_t clients_add(client_ctx_t *ctx) {
-  pthread_mutex_lock(&clients_mu);
-
-  int i = 0;
-  while (clients[i]) {
-    if (strcmp(clients[i]->name, ctx->name) == 0) {
-      pthread_mutex_unlock(&clients_mu);
-      return CLIENTS_ADD_DUPLICATE;
-    }
-    i++;
-    if (i >= MAX_CLIENTS) {
-      log_err(LOG_CTX(ctx), "too many clients!\n");
-      pthread_mutex_unlock(&clients_mu);
-      return CLIENTS_ADD_ERROR;
-    }
+static void deliver_one(client_ctx_t *ctx, void *delivery_raw) {
+  delivery_t *delivery = delivery_raw;
+  if (ctx->fd == delivery->exclude_fd)
+    return;
+  if (outq_push_frame(ctx->out, delivery->frame) == -1) {
+    log_err(LOG_CTX(ctx), "broadcast failed\n");
   }
-
-  clients[i] = ctx;
-  pthread_mutex_unlock(&clients_mu);
-  return CLIENTS_ADD_OK;
 }
 
-typedef enum {
-  CLIENTS_RENAME_OK,
-  CLIENTS_RENAME_NOT_FOUND,
-  CLIENTS_RENAME_DUPLICATE,
-} clients_rename_result_t;
-
-static clients_rename_result_t clients_rename(int client_fd,
-                                              const char *new_name) {
-  pthread_mutex_lock(&clients_mu);
-
-  int i = 0;
-  int index = -1;
-  while (clients[i]) {
-    if (strcmp(clients[i]->name, new_name) == 0) {
-      pthread_mutex_unlock(&clients_mu);
-      return CLIENTS_RENAME_DUPLICATE;
-    }
-    if (clients[i]->fd == client_fd) {
-      index = i;
-    }
-    i++;
-  }
+// a NULL channel reaches every registered client
+static int broadcast_frame(channel_t *channel, int exclude_fd,
+                           frame_t *frame) {
+  // event loop backends each deliver to the clients they own
+  if (backend == SERVER_BACKEND_EPOLL)
+    return reactor_broadcast(channel, frame, exclude_fd);
+  if (backend == SERVER_BACKEND_URING)
+    return uring_broadcast(channel, frame, exclude_fd);
 
-  if (index == -1) {
-    pthread_mutex_unlock(&clients_mu);
-    return CLIENTS_RENAME_NOT_FOUND;
+  // client threads all share the one member slot
+  delivery_t delivery = {.frame = frame, .exclude_fd = exclude_fd};
+  if (channel) {
+    channels_each(channel, 0, deliver_one, &delivery);
+    return 0;
   }
+  epoch_enter();
+  for (client_ctx_t *ctx = clients_first(); ctx; ctx = clients_next(ctx))
+    deliver_one(ctx, &delivery);
+  epoch_exit();
+  return 0;
+}
 
-  strncpy(clients[index]->name, new_name, MAX_NAME_LEN);
-  clients[index]->name[MAX_NAME_LEN] = '\0';
-  pthread_mutex_unlock(&clients_mu);
-  return CLIENTS_RENAME_OK;
+// join and disconnect notices, alone or summarized, reach everyone
+static void broadcast_presence(frame_t *frame) {
+  broadcast_frame(NULL, -1, frame);
 }
 
-static int clients_remove(int client_fd) {
-  pthread_mutex_lock(&clients_mu);
+// queues frame for one client, whichever thread owns it
+static int send_frame(client_ctx_t *ctx, frame_t *frame) {
+  // the ring only learns about queued frames from its own thread
+  if (backend == SERVER_BACKEND_URING)
+    return uring_send(ctx, frame);
+  return outq_push_frame(ctx->out, frame);
+}
 
-  int i = 0;
-  while (clients[i] && clients[i]->fd != client_fd) {
-    i++;
-  }
-  if (!clients[i]) {
-    pthread_mutex_unlock(&clients_mu);
-    return 1;
-  }
+// encoded once for each protocol version and shared by every recipient
+// queue
+static frame_t *broadcast_new(const event_t *ev) {
+  frame_t *frame = event_frame(ev);
+  if (!frame)
+    log_perror(NULL, "broadcast: malloc");
+  return frame;
+}
 
-  for (int j = i; clients[j]; j++) {
-    clients[j] = clients[j + 1];
-  }
-  pthread_mutex_unlock(&clients_mu);
-  return 0;
+// a NULL channel reaches everyone
+static int broadcast(channel_t *channel, const event_t *ev) {
+  frame_t *frame = broadcast_new(ev);
+  if (!frame)
+    return -1;
+
+  int result = broadcast_frame(channel, -1, frame);
+  frame_put(frame);
+  return result;
 }
 
-static size_t clients_clone(client_ctx_t *out, int exclude_fd) {
-  pthread_mutex_lock(&clients_mu);
+// chat from a member of channel. what is said in the lobby is also kept for
+// replay to later joiners.
+static int broadcast_chat(channel_t *channel, int exclude_fd, const char *name,
+                          const char *text) {
+  frame_t *frame =
+      broadcast_new(&(event_t){.kind = EVENT_CHAT, .name = name, .text = text});
+  if (!frame)
+    return -1;
 
-  int count = 0;
-  for (int i = 0; clients[i]; i++) {
-    if (clients[i]->fd != exclude_fd) {
-      out[count++] = *clients[i];
-    }
+  if (channel == channels_lobby()) {
+    history_append(frame);
+    int err = chatlog_append(frame);
+    if (err)
+      log_err(NULL, "chat log append failed: %s\n", strerror(err));
   }
-
-  pthread_mutex_unlock(&clients_mu);
-  return count;
+  int result = broadcast_frame(channel, exclude_fd, frame);
+  frame_put(frame);
+  return result;
 }
 
-static int broadcast(int exclude_fd, const char *fmt, ...) {
-  char buf[1152];
-  va_list args;
-  va_start(args, fmt);
-  vsnprintf(buf, sizeof(buf), fmt, args);
-  va_end(args);
-
-  client_ctx_t ctxs[MAX_CLIENTS];
-  size_t count = clients_clone(ctxs, exclude_fd);
+// sends recent chat to a client that just joined, in a single write
+static void replay_history(client_io_t *io) {
+  size_t len = history_len();
+  if (len == 0 || !io->out)
+    return;
 
-  for (size_t i = 0; i < count; i++) {
-    if (proto_send(ctxs[i].fd, 'm', buf) == -1) {
-      log_err(&(log_ctx_t){.ip = ctxs[i].ip, .port = ctxs[i].port},
-              "broadcast failed\n");
-    }
+  frame_t **frames = malloc(len * sizeof(*frames));
+  if (!frames) {
+    log_perror(NULL, "malloc");
+    return;
   }
-  return 0;
+  size_t count = history_snapshot(frames, len);
+  if (count > 0 && outq_push_frames(io->out, frames, count) == -1)
+    log_err(NULL, "history replay failed\n");
+  for (size_t i = 0; i < count; i++)
+    frame_put(frames[i]);
+  free(frames);
 }
 
 typedef enum {
@@ -144,15 +155,10 @@ typedef enum {
   HANDSHAKE_DUPLICATE,
   HANDSHAKE_TOO_LONG,
   HANDSHAKE_EMPTY,
-  HANDSHAKE_ERROR,
 } handshake_result_t;
 
 static handshake_result_t client_try_handshake(client_io_t *io,
                                                client_ctx_t *ctx) {
-  ssize_t n =
-      io_prompt(io, ANSI_BOLD ANSI_BYELLOW "enter a display name " ANSI_RESET);
-  if (n <= 0)
-    return HANDSHAKE_ERROR;
   if (strlen(io->buf) == 0)
     return HANDSHAKE_EMPTY;
   if (strlen(io->buf) > MAX_NAME_LEN)
@@ -161,10 +167,46 @@ static handshake_result_t client_try_handshake(client_io_t *io,
   strncpy(ctx->name, io->buf, MAX_NAME_LEN);
   ctx->name[MAX_NAME_LEN] = '\0';
 
+  // users on other nodes only live in the federation's table
+  if (federation_name_taken(ctx->name))
+    return HANDSHAKE_DUPLICATE;
+
   return clients_add(ctx) == CLIENTS_ADD_DUPLICATE ? HANDSHAKE_DUPLICATE
                                                    : HANDSHAKE_OK;
 }
 
+// command output for the caller alone. lines are packed into as few frames
+// as the client reader takes, so a long listing costs a handful of writes.
+typedef struct {
+  client_io_t *io;
+  size_t len;
+  char buf[PROTO_SERVER_MAX + 1];
+} reply_t;
+
+static void reply_flush(reply_t *reply) {
+  if (reply->len == 0)
+    return;
+  reply->buf[reply->len] = '\0';
+  io_send(reply->io, 'm', reply->buf);
+  reply->len = 0;
+}
+
+static void reply_line(reply_t *reply, const char *fmt, ...) {
+  char line[1152];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (n < 0)
+    return;
+  size_t len = (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1;
+
+  if (reply->len + len > PROTO_SERVER_MAX)
+    reply_flush(reply);
+  memcpy(reply->buf + reply->len, line, len);
+  reply->len += len;
+}
+
 typedef enum {
   CMD_OK,
   CMD_QUIT,
@@ -182,79 +224,278 @@ typedef struct {
 static cmd_result_t cmd_help(client_io_t *io, client_ctx_t *ctx, char *args);
 static cmd_result_t cmd_users(client_io_t *io, client_ctx_t *ctx, char *args);
 static cmd_result_t cmd_rename(client_io_t *io, client_ctx_t *ctx, char *args);
+static cmd_result_t cmd_msg(client_io_t *io, client_ctx_t *ctx, char *args);
+static cmd_result_t cmd_join(client_io_t *io, client_ctx_t *ctx, char *args);
+static cmd_result_t cmd_part(client_io_t *io, client_ctx_t *ctx, char *args);
+static cmd_result_t cmd_channels(client_io_t *io, client_ctx_t *ctx,
+                                 char *args);
 static cmd_result_t cmd_quit(client_io_t *io, client_ctx_t *ctx, char *args);
 
 static const cmd_t cmds[] = {
     {"help", "show this menu", cmd_help},
     {"users", "list connected users", cmd_users},
     {"rename", "change your display name", cmd_rename},
+    {"msg", "send a private message", cmd_msg},
+    {"join", "switch to a channel, creating it", cmd_join},
+    {"part", "leave the channel for the lobby", cmd_part},
+    {"channels", "list channels", cmd_channels},
     {"quit", "disconnect", cmd_quit},
 };
 
-static cmd_result_t cmd_help(client_io_t *, client_ctx_t *, char *) {
+static cmd_result_t cmd_help(client_io_t *io, client_ctx_t *, char *) {
+  reply_t reply = {.io = io};
   size_t count = sizeof(cmds) / sizeof(cmds[0]);
   for (size_t i = 0; i < count; i++) {
-    broadcast(
-        -1, ANSI_BOLD ANSI_BGREEN "    /%-8s" ANSI_RESET "  " ANSI_CYAN "%s\n",
-        cmds[i].name, cmds[i].help);
+    reply_line(&reply,
+               ANSI_BOLD ANSI_BGREEN "    /%-8s" ANSI_RESET "  " ANSI_CYAN
+                                     "%s\n",
+               cmds[i].name, cmds[i].help);
   }
+  reply_flush(&reply);
   return CMD_OK;
 }
-static cmd_result_t cmd_users(client_io_t *, client_ctx_t *, char *) {
-  client_ctx_t clients[MAX_CLIENTS];
-  size_t count = clients_clone(clients, -1);
+typedef struct {
+  char name[MAX_NAME_LEN + 1];
+  char ip[INET_ADDRSTRLEN];
+  uint16_t port;
+} user_info_t;
+
+static cmd_result_t cmd_users(client_io_t *io, client_ctx_t *, char *) {
+  // clients joining while we walk the list are simply left out
+  size_t cap = clients_count() + 16;
+  user_info_t *users = malloc(cap * sizeof(*users));
+  if (!users) {
+    log_perror(NULL, "malloc");
+    return CMD_OK;
+  }
+
+  size_t count = 0;
+  epoch_enter();
+  for (client_ctx_t *c = clients_first(); c && count < cap;
+       c = clients_next(c)) {
+    clients_name(c, users[count].name);
+    memcpy(users[count].ip, c->ip, sizeof(c->ip));
+    users[count].port = c->port;
+    count++;
+  }
+  epoch_exit();
+
+  // then everyone on other nodes, tagged with their node
+  size_t remote_cap = federation_users(NULL, 0) + 16;
+  remote_user_t *remotes = malloc(remote_cap * sizeof(*remotes));
+  size_t remote_count = 0;
+  if (remotes) {
+    remote_count = federation_users(remotes, remote_cap);
+    if (remote_count > remote_cap)
+      remote_count = remote_cap;
+  }
 
   size_t longest_name = 0;
   for (size_t i = 0; i < count; i++) {
-    size_t name_len = strlen(clients[i].name);
+    size_t name_len = strlen(users[i].name);
     if (name_len > longest_name) {
       longest_name = name_len;
     }
   }
+  for (size_t i = 0; i < remote_count; i++) {
+    size_t name_len = strlen(remotes[i].name);
+    if (name_len > longest_name)
+      longest_name = name_len;
+  }
 
+  reply_t reply = {.io = io};
   for (size_t i = 0; i < count; i++) {
-    broadcast(-1,
-              ANSI_BOLD ANSI_GREEN "    %-*s" ANSI_RESET ANSI_CYAN
-                                   "  %s:%u\n" ANSI_RESET,
-              longest_name, clients[i].name, clients[i].ip, clients[i].port);
+    reply_line(&reply,
+               ANSI_BOLD ANSI_GREEN "    %-*s" ANSI_RESET ANSI_CYAN
+                                    "  %s:%u\n" ANSI_RESET,
+               (int)longest_name, users[i].name, users[i].ip, users[i].port);
   }
+  for (size_t i = 0; i < remote_count; i++) {
+    reply_line(&reply,
+               ANSI_BOLD ANSI_GREEN "    %-*s" ANSI_RESET ANSI_CYAN
+                                    "  %s:%u" ANSI_BBLACK " on %s\n" ANSI_RESET,
+               (int)longest_name, remotes[i].name, remotes[i].ip,
+               remotes[i].port, remotes[i].node);
+  }
+  reply_flush(&reply);
+  free(remotes);
+  free(users);
   return CMD_OK;
 }
-static cmd_result_t cmd_rename(client_io_t *, client_ctx_t *ctx, char *args) {
+static cmd_result_t cmd_rename(client_io_t *io, client_ctx_t *ctx,
+                               char *args) {
   if (!args) {
-    broadcast(-1, ANSI_BOLD ANSI_BRED "error " ANSI_RESET "missing new name\n");
+    io_message(io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET "missing new name\n");
     return CMD_OK;
   }
   if (strlen(args) == 0) {
-    broadcast(-1,
-              ANSI_BOLD ANSI_BRED "error " ANSI_RESET "name cannot be empty\n");
+    io_message(io,
+               ANSI_BOLD ANSI_BRED "error " ANSI_RESET "name cannot be empty\n");
     return CMD_OK;
   }
   if (strlen(args) > MAX_NAME_LEN) {
-    broadcast(-1,
-              ANSI_BOLD ANSI_BRED "error " ANSI_RESET
-                                  "name must be at most %d characters long\n",
-              MAX_NAME_LEN);
+    io_message(io,
+               ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                   "name must be at most %d characters long\n",
+               MAX_NAME_LEN);
+    return CMD_OK;
+  }
+
+  if (federation_name_taken(args)) {
+    io_message(io,
+               ANSI_BOLD ANSI_BRED "error " ANSI_RESET "name already taken\n");
     return CMD_OK;
   }
 
-  int err = clients_rename(ctx->fd, args);
+  char old_name[MAX_NAME_LEN + 1];
+  memcpy(old_name, ctx->name, sizeof(old_name));
+  int err = clients_rename(ctx, args);
   if (err == CLIENTS_RENAME_NOT_FOUND) {
-    broadcast(-1, ANSI_BOLD ANSI_BRED
-              "error " ANSI_RESET "you are not registered, disconnecting\n");
+    io_message(io, ANSI_BOLD ANSI_BRED
+               "error " ANSI_RESET "you are not registered, disconnecting\n");
     return CMD_QUIT;
   } else if (err == CLIENTS_RENAME_DUPLICATE) {
-    broadcast(-1,
-              ANSI_BOLD ANSI_BRED "error " ANSI_RESET "name already taken\n");
+    io_message(io,
+               ANSI_BOLD ANSI_BRED "error " ANSI_RESET "name already taken\n");
+    return CMD_OK;
+  }
+
+  broadcast(NULL, &(event_t){.kind = EVENT_RENAMED,
+                             .name = ctx->name,
+                             .ip = ctx->ip,
+                             .port = ctx->port});
+  federation_rename(old_name, ctx->name, ctx->ip, ctx->port);
+
+  return CMD_OK;
+}
+static frame_t *private_frame(const char *from, const char *text) {
+  frame_t *frame =
+      event_frame(&(event_t){.kind = EVENT_DIRECT, .name = from, .text = text});
+  if (!frame)
+    log_perror(NULL, "msg: malloc");
+  return frame;
+}
+
+static cmd_result_t cmd_msg(client_io_t *io, client_ctx_t *ctx, char *args) {
+  char *text = strchr(args, ' ');
+  if (text)
+    *text++ = '\0';
+  if (args[0] == '\0' || !text || text[0] == '\0') {
+    io_message(io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                       "usage: /msg <name> <text>\n");
     return CMD_OK;
   }
 
-  broadcast(-1,
-            ANSI_BOLD ANSI_BCYAN "%s:%u " ANSI_RESET
-                                 "renamed to " ANSI_BOLD ANSI_BMAGENTA
-                                 "%s" ANSI_RESET "\n",
-            ctx->ip, ctx->port, ctx->name);
+  frame_t *frame = private_frame(ctx->name, text);
+  if (!frame)
+    return CMD_OK;
+
+  // the name index finds the recipient without walking the registry, and it
+  // stays valid until the epoch ends even if the recipient leaves
+  epoch_enter();
+  client_ctx_t *target = clients_find_name(args);
+  int result = target ? send_frame(target, frame) : 0;
+  epoch_exit();
+  frame_put(frame);
+  // names the registry does not know may belong to another node
+  bool remote = !target && federation_direct(args, ctx->name, text) == 0;
+
+  if (!target && !remote) {
+    io_message(io,
+               ANSI_BOLD ANSI_BRED "error " ANSI_RESET "no user named '%s'\n",
+               args);
+  } else if (result == -1) {
+    io_message(io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                       "could not reach '%s'\n",
+               args);
+  } else {
+    io_message(io,
+               ANSI_BOLD ANSI_BYELLOW "to %s (private) " ANSI_RESET "%s\n",
+               args, text);
+  }
+  return CMD_OK;
+}
+
+// moves ctx and tells both channels, the old one first
+static cmd_result_t switch_channel(client_io_t *io, client_ctx_t *ctx,
+                                   const char *name) {
+  channel_t *old = ctx->channel;
+  // the old channel may close when ctx was its last member
+  channels_get(old);
+  int err = channels_join(ctx, name);
+  if (err) {
+    log_err(LOG_CTX(ctx), "join #%s: %s\n", name, strerror(err));
+    io_message(io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                       "could not join #%s, disconnecting\n",
+               name);
+    channels_put(old);
+    return CMD_QUIT;
+  }
+
+  broadcast(old, &(event_t){.kind = EVENT_NOTICE,
+                            .name = ctx->name,
+                            .channel = channels_name(old),
+                            .flag = false});
+  federation_notice(channels_name(old), ctx->name, false);
+  channels_put(old);
+  broadcast(ctx->channel, &(event_t){.kind = EVENT_NOTICE,
+                                     .name = ctx->name,
+                                     .channel = name,
+                                     .flag = true});
+  federation_notice(name, ctx->name, true);
+  return CMD_OK;
+}
+
+static cmd_result_t cmd_join(client_io_t *io, client_ctx_t *ctx, char *args) {
+  if (args[0] == '#')
+    args++;
+  if (!channels_valid_name(args)) {
+    io_message(io,
+               ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                   "channel names are 1 to %d letters, "
+                                   "digits, '-' or '_'\n",
+               MAX_CHANNEL_LEN);
+    return CMD_OK;
+  }
+  if (strcmp(args, channels_name(ctx->channel)) == 0) {
+    io_message(io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                       "you are already in #%s\n",
+               args);
+    return CMD_OK;
+  }
+  return switch_channel(io, ctx, args);
+}
+static cmd_result_t cmd_part(client_io_t *io, client_ctx_t *ctx, char *) {
+  if (ctx->channel == channels_lobby()) {
+    io_message(io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                       "the lobby cannot be left\n");
+    return CMD_OK;
+  }
+  return switch_channel(io, ctx, CHANNELS_LOBBY);
+}
+static cmd_result_t cmd_channels(client_io_t *io, client_ctx_t *ctx, char *) {
+  // channels opened while we copy the list are simply left out
+  size_t cap = channels_list(NULL, 0) + 16;
+  channel_info_t *infos = malloc(cap * sizeof(*infos));
+  if (!infos) {
+    log_perror(NULL, "malloc");
+    return CMD_OK;
+  }
+  size_t count = channels_list(infos, cap);
+  if (count > cap)
+    count = cap;
 
+  reply_t reply = {.io = io};
+  for (size_t i = 0; i < count; i++) {
+    bool current = strcmp(infos[i].name, channels_name(ctx->channel)) == 0;
+    reply_line(&reply,
+               ANSI_BOLD ANSI_GREEN "  %c #%-*s" ANSI_RESET ANSI_CYAN
+                                    "  %zu %s\n" ANSI_RESET,
+               current ? '*' : ' ', MAX_CHANNEL_LEN, infos[i].name,
+               infos[i].members, infos[i].members == 1 ? "user" : "users");
+  }
+  reply_flush(&reply);
+  free(infos);
   return CMD_OK;
 }
 static cmd_result_t cmd_quit(client_io_t *, client_ctx_t *, char *) {
@@ -264,7 +505,7 @@ static cmd_result_t cmd_quit(client_io_t *, client_ctx_t *, char *) {
 static cmd_result_t handle_client_command(client_io_t *io, client_ctx_t *ctx) {
   char *input = io->buf + 1;
   if (strlen(input) == 0) {
-    broadcast(-1, ANSI_BOLD ANSI_BRED "error " ANSI_RESET "empty command\n");
+    io_message(io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET "empty command\n");
     return CMD_OK;
   }
 
@@ -282,127 +523,689 @@ static cmd_result_t handle_client_command(client_io_t *io, client_ctx_t *ctx) {
     }
   }
 
-  broadcast(-1,
-            ANSI_BOLD ANSI_BRED "error " ANSI_RESET
-                                "unknown command '%s', try /help\n",
-            input);
+  io_message(io,
+             ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                 "unknown command '%s', try /help\n",
+             input);
   return CMD_OK;
 }
 
-static void *handle_client(void *ctx_raw) {
-  client_ctx_t *ctx = ctx_raw;
-  client_io_t io = {.fd = ctx->fd};
-  log_info(LOG_CTX(ctx), "started on thread %p\n", (void *)pthread_self());
+// pipelined clients keep showing the last prompt, so they only get changes
+static void send_prompt(client_io_t *io, client_ctx_t *ctx, const char *fmt,
+                        ...) {
+  char prompt[SESSION_PROMPT_SIZE];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(prompt, sizeof(prompt), fmt, args);
+  va_end(args);
 
-  for (int attempts = 0; attempts < 3; attempts++) {
-    switch (client_try_handshake(&io, ctx)) {
-    case HANDSHAKE_OK:
-      goto handshake_done;
-    case HANDSHAKE_DUPLICATE:
-      io_message(&io, ANSI_BOLD ANSI_BRED
-                 "error " ANSI_RESET
-                 "name already taken, please choose another\n");
-      log_info(LOG_CTX(ctx), "handshake attempt %d: duplicate name '%s'\n",
-               attempts + 1, io.buf);
-      break;
-    case HANDSHAKE_TOO_LONG:
-      io_message(&io,
-                 ANSI_BOLD ANSI_BRED
-                 "error " ANSI_RESET
-                 "name must be at most %d characters long\n",
-                 MAX_NAME_LEN);
-      log_info(LOG_CTX(ctx), "handshake attempt %d: name too long '%s'\n",
-               attempts + 1, io.buf);
-      break;
-    case HANDSHAKE_EMPTY:
-      io_message(&io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET
-                                          "name cannot be empty\n");
-      log_info(LOG_CTX(ctx), "handshake attempt %d: empty name\n",
-               attempts + 1);
-      break;
-    case HANDSHAKE_ERROR:
-      log_info(LOG_CTX(ctx),
-               "handshake attempt %d: error during prompt, disconnecting\n",
-               attempts + 1);
-      goto cleanup;
+  if (ctx->pipelined && strcmp(prompt, ctx->prompt) == 0)
+    return;
+  memcpy(ctx->prompt, prompt, sizeof(prompt));
+  io_send(io, SERVER_PROMPT, prompt);
+}
+
+static void prompt_name(client_io_t *io, client_ctx_t *ctx) {
+  send_prompt(io, ctx,
+              ANSI_BOLD ANSI_BYELLOW "enter a display name " ANSI_RESET);
+}
+
+static void prompt_chat(client_io_t *io, client_ctx_t *ctx) {
+  if (ctx->channel == channels_lobby()) {
+    send_prompt(io, ctx, ANSI_BOLD ANSI_BMAGENTA "%s " ANSI_RESET, ctx->name);
+    return;
+  }
+  send_prompt(io, ctx,
+              ANSI_BOLD ANSI_BMAGENTA "%s " ANSI_BCYAN "#%s " ANSI_RESET,
+              ctx->name, channels_name(ctx->channel));
+}
+
+void session_open(client_io_t *io, client_ctx_t *ctx) {
+  metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+  ctx->state = SESSION_HANDSHAKE;
+  ctx->attempts = 0;
+  ctx->last_rx = wheel_clock();
+  ctx->ping_sent = 0;
+  ctx->deadline = handshake_timeout ? ctx->last_rx + handshake_timeout : 0;
+  prompt_name(io, ctx);
+}
+
+session_result_t session_resume(client_io_t *io, client_ctx_t *ctx,
+                                const handover_session_t *s) {
+  metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+  memcpy(ctx->ip, s->ip, sizeof(ctx->ip));
+  ctx->port = s->port;
+  memcpy(ctx->name, s->name, sizeof(ctx->name));
+  ctx->state = SESSION_HANDSHAKE;
+  ctx->attempts = s->attempts;
+  ctx->pipelined = s->pipelined;
+  ctx->ping = s->ping;
+  ctx->v2 = s->v2;
+  // the successor may have turned compression off, plain frames still do
+  ctx->deflate = s->deflate && deflate_enabled;
+  memcpy(ctx->prompt, s->prompt, sizeof(ctx->prompt));
+  ctx->deadline = s->deadline;
+  ctx->last_rx = s->last_rx;
+  ctx->ping_sent = s->ping_sent;
+  // before anything can be broadcast to it
+  if (ctx->v2 || ctx->deflate)
+    outq_upgrade(io->out, NULL, ctx->v2, ctx->deflate);
+
+  if (s->state == SESSION_CHAT) {
+    if (clients_add(ctx) != CLIENTS_ADD_OK) {
+      log_err(LOG_CTX(ctx), "resume: '%s' is taken\n", ctx->name);
+      return SESSION_CLOSE;
     }
+    int err = channels_join(ctx, s->channel[0] ? s->channel : CHANNELS_LOBBY);
+    if (err) {
+      log_err(LOG_CTX(ctx), "resume: join #%s: %s\n", s->channel,
+              strerror(err));
+      clients_remove(ctx);
+      return SESSION_CLOSE;
+    }
+    ctx->state = SESSION_CHAT;
+    federation_join(ctx->name, ctx->ip, ctx->port, false);
+  }
+  if (outq_import(io->out, s->tx, s->tx_count, s->tx_off) == -1) {
+    log_err(LOG_CTX(ctx), "resume: could not queue the backlog\n");
+    return SESSION_CLOSE;
   }
+  log_debug(LOG_CTX(ctx), "resumed\n");
+  return SESSION_CONTINUE;
+}
 
-  io_message(&io, "too many failed attempts, disconnecting\n");
-  log_info(LOG_CTX(ctx), "handshake failed: too many attempts\n");
-  goto cleanup;
-
-handshake_done:
-  log_info(LOG_CTX(ctx), "joined as '%s'\n", ctx->name);
-  broadcast(-1,
-            ANSI_BOLD ANSI_BCYAN "%s:%u " ANSI_RESET
-                                 "joined as " ANSI_BOLD ANSI_BMAGENTA
-                                 "%s" ANSI_RESET "\n",
-            ctx->ip, ctx->port, ctx->name);
-
-  ssize_t bytes;
-  while ((bytes = io_prompt(&io, ANSI_BOLD ANSI_BMAGENTA "%s " ANSI_RESET,
-                            ctx->name)) > 0) {
-    log_info(LOG_CTX(ctx), "message: %s\n", io.buf);
-    broadcast(ctx->fd, ANSI_BOLD ANSI_BMAGENTA "%s " ANSI_RESET "%s\n",
-              ctx->name, io.buf);
-    if (io.buf[0] == '/') {
-      cmd_result_t result = handle_client_command(&io, ctx);
-      if (result == CMD_QUIT) {
-        break;
-      }
+// the earliest check a joined client needs. traffic does not move it, the
+// check itself looks at last_rx and schedules the next one.
+static void session_schedule(client_ctx_t *ctx) {
+  uint64_t deadline = idle_timeout ? ctx->last_rx + idle_timeout : 0;
+  if (heartbeat && ctx->ping) {
+    uint64_t check =
+        (ctx->ping_sent ? ctx->ping_sent : ctx->last_rx) + heartbeat;
+    if (!deadline || check < deadline)
+      deadline = check;
+  }
+  ctx->deadline = deadline;
+}
+
+static session_result_t session_handshake(client_io_t *io, client_ctx_t *ctx) {
+  int attempt = ++ctx->attempts;
+
+  switch (client_try_handshake(io, ctx)) {
+  case HANDSHAKE_OK: {
+    int err = channels_join(ctx, CHANNELS_LOBBY);
+    if (err) {
+      log_err(LOG_CTX(ctx), "join lobby: %s\n", strerror(err));
+      clients_remove(ctx);
+      return SESSION_CLOSE;
     }
+    ctx->state = SESSION_CHAT;
+    session_schedule(ctx);
+    log_info(LOG_CTX(ctx), "joined as '%s'\n", ctx->name);
+    replay_history(io);
+    presence_joined(ctx->name, ctx->ip, ctx->port);
+    federation_join(ctx->name, ctx->ip, ctx->port, true);
+    prompt_chat(io, ctx);
+    return SESSION_CONTINUE;
   }
-  if (bytes == -1) {
-    log_perror(LOG_CTX(ctx), "io_prompt");
+  case HANDSHAKE_DUPLICATE:
+    io_message(io, ANSI_BOLD ANSI_BRED
+               "error " ANSI_RESET
+               "name already taken, please choose another\n");
+    log_info(LOG_CTX(ctx), "handshake attempt %d: duplicate name '%s'\n",
+             attempt, io->buf);
+    break;
+  case HANDSHAKE_TOO_LONG:
+    io_message(io,
+               ANSI_BOLD ANSI_BRED
+               "error " ANSI_RESET "name must be at most %d characters long\n",
+               MAX_NAME_LEN);
+    log_info(LOG_CTX(ctx), "handshake attempt %d: name too long '%s'\n",
+             attempt, io->buf);
+    break;
+  case HANDSHAKE_EMPTY:
+    io_message(io, ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                       "name cannot be empty\n");
+    log_info(LOG_CTX(ctx), "handshake attempt %d: empty name\n", attempt);
+    break;
   }
 
-  clients_remove(ctx->fd);
-  broadcast(-1, ANSI_BOLD ANSI_BCYAN "%s:%u " ANSI_RESET "disconnected\n",
-            ctx->ip, ctx->port, ctx->name);
+  if (attempt >= 3) {
+    io_message(io, "too many failed attempts, disconnecting\n");
+    log_info(LOG_CTX(ctx), "handshake failed: too many attempts\n");
+    metrics_add(METRIC_HANDSHAKE_FAILURES, 1);
+    return SESSION_CLOSE;
+  }
+  prompt_name(io, ctx);
+  return SESSION_CONTINUE;
+}
+
+session_result_t session_input(client_io_t *io, client_ctx_t *ctx) {
+  if (ctx->state == SESSION_HANDSHAKE)
+    return session_handshake(io, ctx);
+
+  // commands answer the caller alone and are not repeated as chat
+  if (io->buf[0] == '/') {
+    uint64_t start = metrics_now();
+    cmd_result_t result = handle_client_command(io, ctx);
+    metrics_since(METRIC_COMMAND, start);
+    if (result == CMD_QUIT) {
+      return SESSION_CLOSE;
+    }
+  } else {
+    log_debug(LOG_CTX(ctx), "message: %s\n", io->buf);
+    uint64_t start = metrics_now();
+    broadcast_chat(ctx->channel, ctx->fd, ctx->name, io->buf);
+    federation_chat(channels_name(ctx->channel), ctx->name, io->buf);
+    metrics_since(METRIC_FANOUT, start);
+    metrics_add(METRIC_MESSAGES, 1);
+  }
+  prompt_chat(io, ctx);
+  return SESSION_CONTINUE;
+}
+
+session_result_t session_timeout(client_io_t *io, client_ctx_t *ctx) {
+  uint64_t now = wheel_clock();
+  if (ctx->state == SESSION_HANDSHAKE) {
+    if (now < ctx->deadline)
+      return SESSION_CONTINUE;
+    io_message(io, "took too long to pick a name, disconnecting\n");
+    log_info(LOG_CTX(ctx), "handshake timed out\n");
+    metrics_add(METRIC_HANDSHAKE_TIMEOUTS, 1);
+    return SESSION_CLOSE;
+  }
+
+  if (idle_timeout && now >= ctx->last_rx + idle_timeout) {
+    io_message(io, "idle for too long, disconnecting\n");
+    log_info(LOG_CTX(ctx), "idle timeout\n");
+    metrics_add(METRIC_IDLE_TIMEOUTS, 1);
+    return SESSION_CLOSE;
+  }
+
+  if (heartbeat && ctx->ping) {
+    // any frame since the ping counts as the answer
+    if (ctx->ping_sent && ctx->last_rx >= ctx->ping_sent)
+      ctx->ping_sent = 0;
+    if (ctx->ping_sent && now >= ctx->ping_sent + heartbeat) {
+      log_info(LOG_CTX(ctx), "heartbeat timeout\n");
+      metrics_add(METRIC_HEARTBEAT_TIMEOUTS, 1);
+      return SESSION_CLOSE;
+    }
+    if (!ctx->ping_sent && now >= ctx->last_rx + heartbeat) {
+      io_send(io, SERVER_PING, "");
+      ctx->ping_sent = now;
+      metrics_add(METRIC_PINGS, 1);
+    }
+  }
+
+  session_schedule(ctx);
+  return SESSION_CONTINUE;
+}
+
+static bool control_word(const char *word, size_t len, const char *expected) {
+  return len == strlen(expected) && memcmp(word, expected, len) == 0;
+}
+
+// answers "caps" with the requested extensions this server supports. "pong"
+// needs no answer, every frame already counts as a sign of life.
+static void session_control(client_io_t *io, client_ctx_t *ctx,
+                            const char *content, size_t len) {
+  if (control_word(content, len, "pong"))
+    return;
+
+  static const char caps[] = "caps";
+  size_t caps_len = sizeof(caps) - 1;
+  if (len < caps_len || memcmp(content, caps, caps_len) != 0 ||
+      (len > caps_len && content[caps_len] != ' ')) {
+    log_info(LOG_CTX(ctx), "ignoring unknown control frame\n");
+    return;
+  }
+
+  size_t i = caps_len;
+  bool v2 = false;
+  bool deflate = false;
+  while (i < len) {
+    while (i < len && content[i] == ' ')
+      i++;
+    size_t start = i;
+    while (i < len && content[i] != ' ')
+      i++;
+    if (control_word(content + start, i - start, PROTO_CAP_PIPELINE))
+      ctx->pipelined = true;
+    if (control_word(content + start, i - start, PROTO_CAP_PING))
+      ctx->ping = true;
+    if (control_word(content + start, i - start, PROTO_CAP_V2))
+      v2 = !ctx->v2;
+    if (control_word(content + start, i - start, PROTO_CAP_DEFLATE))
+      deflate = !ctx->deflate && deflate_enabled;
+  }
+
+  char accepted[64];
+  snprintf(accepted, sizeof(accepted), "%s%s%s%s",
+           ctx->pipelined ? " " PROTO_CAP_PIPELINE : "",
+           ctx->ping ? " " PROTO_CAP_PING : "",
+           ctx->v2 || v2 ? " " PROTO_CAP_V2 : "",
+           ctx->deflate || deflate ? " " PROTO_CAP_DEFLATE : "");
+  // without the leading space
+  const char *list = accepted[0] ? accepted + 1 : accepted;
+  if (v2 || deflate) {
+    // the reply is the last frame in the old encoding, the client switches
+    // right after it
+    frame_t *reply = frame_new(SERVER_CAPS, list);
+    if (!reply || outq_upgrade(io->out, reply, v2, deflate) == -1)
+      log_err(LOG_CTX(ctx), "caps: switching encodings failed\n");
+    if (reply)
+      frame_put(reply);
+    ctx->v2 = ctx->v2 || v2;
+    ctx->deflate = ctx->deflate || deflate;
+  } else {
+    io_send(io, SERVER_CAPS, list);
+  }
+  // caps asked for after joining start the heartbeat right away
+  if (ctx->state == SESSION_CHAT)
+    session_schedule(ctx);
+}
+
+session_result_t session_parse(client_io_t *io, client_ctx_t *ctx,
+                               proto_reader_t *rx) {
+  ctx->last_rx = wheel_clock();
+  proto_frame_t frame;
+  proto_result_e result;
+  while ((result = proto_next(rx, &frame)) == PROTO_FRAME) {
+    if (frame.len > 0 && frame.content[0] == PROTO_CONTROL) {
+      session_control(io, ctx, frame.content + 1, frame.len - 1);
+      continue;
+    }
+    if (frame.len >= sizeof(io->buf)) {
+      log_err(LOG_CTX(ctx), "message too large (%u bytes)\n", frame.len);
+      return SESSION_CLOSE;
+    }
+
+    memcpy(io->buf, frame.content, frame.len);
+    io->buf[frame.len] = '\0';
+    if (session_input(io, ctx) == SESSION_CLOSE)
+      return SESSION_CLOSE;
+  }
+
+  if (result == PROTO_ERR_MAGIC) {
+    log_err(LOG_CTX(ctx), "invalid magic number\n");
+    return SESSION_CLOSE;
+  }
+  if (result == PROTO_ERR_TOO_LARGE) {
+    log_err(LOG_CTX(ctx), "message too large (%u bytes)\n", frame.len);
+    return SESSION_CLOSE;
+  }
+  return SESSION_CONTINUE;
+}
+
+void session_close(client_io_t *, client_ctx_t *ctx) {
+  metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+  if (ctx->state == SESSION_HANDSHAKE) {
+    log_info(LOG_CTX(ctx), "disconnected during handshake\n");
+    return;
+  }
+
+  channels_part(ctx);
+  clients_remove(ctx);
+  federation_leave(ctx->name);
+  presence_left(ctx->name, ctx->ip, ctx->port);
   log_info(LOG_CTX(ctx), "disconnected\n");
+}
 
-cleanup:
-  close(ctx->fd);
-  free(ctx);
-  return NULL;
+// FEDERATION
+// what users on other nodes do, shown like the same thing done here. these
+// run on the federation thread, which owns no clients, so every frame takes
+// the broadcast path of the backend.
+
+static void remote_joined(const char *, const char *name, const char *ip,
+                          uint16_t port, bool announce) {
+  if (announce)
+    presence_joined(name, ip, port);
 }
 
-int server_start() {
-  signal(SIGPIPE, SIG_IGN);
+static void remote_left(const char *, const char *name, const char *ip,
+                        uint16_t port) {
+  presence_left(name, ip, port);
+}
 
-  int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (socket_fd == -1) {
-    log_perror(NULL, "socket");
-    return errno;
+static void remote_renamed(const char *, const char *, const char *name,
+                           const char *ip, uint16_t port) {
+  broadcast(NULL, &(event_t){.kind = EVENT_RENAMED,
+                             .name = name,
+                             .ip = ip,
+                             .port = port});
+}
+
+// channels nobody here is in are skipped
+static void remote_chat(const char *channel_name, const char *name,
+                        const char *text) {
+  channel_t *channel = channels_find(channel_name);
+  if (!channel)
+    return;
+  broadcast_chat(channel, -1, name, text);
+  channels_put(channel);
+}
+
+static void remote_notice(const char *channel_name, const char *name,
+                          bool joined) {
+  channel_t *channel = channels_find(channel_name);
+  if (!channel)
+    return;
+  broadcast(channel, &(event_t){.kind = EVENT_NOTICE,
+                                .name = name,
+                                .channel = channel_name,
+                                .flag = joined});
+  channels_put(channel);
+}
+
+static void remote_direct(const char *to, const char *from, const char *text) {
+  frame_t *frame = private_frame(from, text);
+  if (!frame)
+    return;
+  // the ring only takes frames from other threads by name
+  if (backend == SERVER_BACKEND_URING) {
+    uring_post(NULL, to, frame, -1);
+  } else {
+    epoch_enter();
+    client_ctx_t *target = clients_find_name(to);
+    if (target)
+      outq_push_frame(target->out, frame);
+    epoch_exit();
   }
+  frame_put(frame);
+}
 
-  // allow reuse of port
-  int opt = 1;
-  if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ==
-      -1) {
-    log_perror(NULL, "setsockopt");
-    goto error;
+static void remote_evicted(const char *name, const char *node) {
+  epoch_enter();
+  client_ctx_t *ctx = clients_find_name(name);
+  if (ctx) {
+    log_info(LOG_CTX(ctx), "'%s' was taken on %s first, disconnecting\n",
+             name, node);
+    char notice[128];
+    snprintf(notice, sizeof(notice),
+             ANSI_BOLD ANSI_BRED "error " ANSI_RESET
+                                 "'%s' is taken on %s, disconnecting\n",
+             name, node);
+    if (backend == SERVER_BACKEND_URING) {
+      // a shutdown from here would drop the notice queued for the ring
+      frame_t *frame = frame_new(SERVER_MESSAGE, notice);
+      if (!frame) {
+        log_perror(NULL, "evict: malloc");
+      } else {
+        uring_post_close(name, frame);
+        frame_put(frame);
+      }
+    } else {
+      outq_push(ctx->out, SERVER_MESSAGE, notice);
+      // its owner sees the hangup and closes the session as usual
+      outq_shutdown(ctx->out);
+    }
   }
+  epoch_exit();
+}
 
-  // bind to port and start listening
-  struct sockaddr_in addr = {
-      .sin_family = AF_INET,
-      .sin_port = htons(8080),
-      .sin_addr.s_addr = INADDR_ANY,
-  };
-  if (bind(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-    log_perror(NULL, "bind");
-    goto error;
+static void remote_link(const char *node, bool up, size_t users) {
+  broadcast(NULL, &(event_t){.kind = EVENT_LINK,
+                             .name = node,
+                             .flag = up,
+                             .count = users});
+}
+
+static const federation_handlers_t federation_handlers = {
+    .joined = remote_joined,
+    .left = remote_left,
+    .renamed = remote_renamed,
+    .chat = remote_chat,
+    .notice = remote_notice,
+    .direct = remote_direct,
+    .evicted = remote_evicted,
+    .link = remote_link,
+};
+
+static pool_t ctx_pool = POOL_INIT("threaded_ctx", sizeof(client_ctx_t));
+
+// what a client thread owns besides its context, freed when it ends
+typedef struct {
+  client_ctx_t *ctx;
+  // handed over by the previous process and already resumed
+  bool resumed;
+  // buffered, so pipelined frames cost one recv between them
+  char rx_buf[SESSION_RX_SIZE];
+  proto_reader_t rx;
+} client_thread_t;
+
+static void client_free(void *ctx_raw) {
+  client_ctx_t *ctx = ctx_raw;
+  outq_put(ctx->out);
+  pool_free(&ctx_pool, ctx);
+}
+
+// THREADED HANDOVER
+// with a handover socket, client threads and the accept loop also wait on
+// freeze_fd. a freeze lets all of them stop first, so nobody pushes to a
+// queue that was already handed over, and only then do they export.
+
+static int freeze_fd = -1;
+static pthread_mutex_t freeze_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t freeze_cond = PTHREAD_COND_INITIALIZER;
+// threads a freeze waits for, the accept loop included
+static int live_threads = 1;
+static int stopped_threads;
+static int exported_threads;
+static bool exporting;
+
+static void thread_counted(int delta) {
+  pthread_mutex_lock(&freeze_mu);
+  live_threads += delta;
+  pthread_cond_broadcast(&freeze_cond);
+  pthread_mutex_unlock(&freeze_mu);
+}
+
+// hands over the calling thread's session, or the listener for the accept
+// loop, once every thread stopped
+static void thread_freeze(client_thread_t *thread, int listen_fd) {
+  pthread_mutex_lock(&freeze_mu);
+  stopped_threads++;
+  pthread_cond_broadcast(&freeze_cond);
+  while (!exporting)
+    pthread_cond_wait(&freeze_cond, &freeze_mu);
+  pthread_mutex_unlock(&freeze_mu);
+
+  if (thread) {
+    handover_add_session(thread->ctx, &thread->rx);
+  } else {
+    handover_add_listener(listen_fd);
   }
-  if (listen(socket_fd, 10) == -1) {
-    log_perror(NULL, "listen");
+
+  pthread_mutex_lock(&freeze_mu);
+  exported_threads++;
+  pthread_cond_broadcast(&freeze_cond);
+  pthread_mutex_unlock(&freeze_mu);
+  handover_park();
+}
+
+static void threaded_freeze(void) {
+  // never read, so it stays readable for every later poll too
+  uint64_t one = 1;
+  if (write(freeze_fd, &one, sizeof(one)) == -1)
+    log_perror(NULL, "freeze: eventfd write");
+
+  pthread_mutex_lock(&freeze_mu);
+  while (stopped_threads < live_threads)
+    pthread_cond_wait(&freeze_cond, &freeze_mu);
+  exporting = true;
+  pthread_cond_broadcast(&freeze_cond);
+  while (exported_threads < live_threads)
+    pthread_cond_wait(&freeze_cond, &freeze_mu);
+  pthread_mutex_unlock(&freeze_mu);
+}
+
+// THREADED
+
+static void *handle_client(void *thread_raw) {
+  client_thread_t *thread = thread_raw;
+  client_ctx_t *ctx = thread->ctx;
+  client_io_t io = {.fd = ctx->fd, .out = ctx->out};
+  log_info(LOG_CTX(ctx), "started on thread %p\n", (void *)pthread_self());
+
+  // everything one read makes this thread send leaves together, the thread
+  // blocks in recv, so it does not hold frames any longer than that
+  outq_batch_begin();
+  if (!thread->resumed)
+    session_open(&io, ctx);
+  outq_batch_flush();
+
+  proto_reader_t *rx = &thread->rx;
+  while (true) {
+    // every client has its own thread, so it waits for its deadline itself
+    if (ctx->deadline || freeze_fd != -1) {
+      int wait = -1;
+      if (ctx->deadline) {
+        uint64_t now = wheel_clock();
+        wait = ctx->deadline > now ? (int)(ctx->deadline - now) : 0;
+      }
+      struct pollfd pfd[2] = {
+          {.fd = io.fd, .events = POLLIN},
+          {.fd = freeze_fd, .events = POLLIN},
+      };
+      int ready = poll(pfd, freeze_fd != -1 ? 2 : 1, wait);
+      if (ready == -1 && errno == EINTR)
+        continue;
+      if (ready == -1) {
+        log_perror(LOG_CTX(ctx), "poll");
+        break;
+      }
+      if (pfd[1].revents & POLLIN)
+        thread_freeze(thread, -1);
+      if (ready == 0) {
+        if (session_timeout(&io, ctx) == SESSION_CLOSE)
+          break;
+        outq_batch_flush();
+        continue;
+      }
+    }
+
+    size_t avail;
+    char *dst = proto_reader_space(rx, &avail);
+    ssize_t n = recv(io.fd, dst, avail, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      log_perror(LOG_CTX(ctx), "recv");
+    if (n <= 0)
+      break;
+
+    metrics_add(METRIC_BYTES_IN, n);
+    proto_reader_filled(rx, n);
+    if (session_parse(&io, ctx, rx) == SESSION_CLOSE)
+      break;
+    outq_batch_flush();
+  }
+
+  session_close(&io, ctx);
+  outq_batch_end();
+  outq_close(ctx->out);
+  close(ctx->fd);
+  // broadcasters may still be walking past ctx
+  epoch_retire(ctx, client_free);
+  free(thread);
+  // only now, everything this thread pushed is queued
+  thread_counted(-1);
+  return NULL;
+}
+
+// a context for fd with its queue, NULL with errno set
+static client_thread_t *client_thread_new(int fd) {
+  client_thread_t *thread = malloc(sizeof(*thread));
+  client_ctx_t *ctx = pool_alloc(&ctx_pool);
+  if (!thread || !ctx)
+    goto error;
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->fd = fd;
+  // the thread is parked in recv, so a flusher drains what the socket
+  // could not take right away
+  ctx->out = outq_new(fd, OUTQ_DRAIN_FLUSHER);
+  if (!ctx->out)
     goto error;
+  thread->ctx = ctx;
+  thread->resumed = false;
+  proto_reader_init(&thread->rx, thread->rx_buf, sizeof(thread->rx_buf),
+                    false);
+  return thread;
+
+error:
+  int saved = errno;
+  free(thread);
+  pool_free(&ctx_pool, ctx);
+  errno = saved;
+  return NULL;
+}
+
+// returns 0 or an errno value, the thread owns everything once it runs
+static int client_thread_start(client_thread_t *thread) {
+  // counted before it runs, so a freeze cannot miss it
+  thread_counted(1);
+  pthread_t client_tid;
+  int create_err = pthread_create(&client_tid, NULL, handle_client, thread);
+  if (create_err) {
+    log_err(NULL, "pthread_create: %s\n", strerror(create_err));
+    thread_counted(-1);
+    return create_err;
   }
+  int detach_err = pthread_detach(client_tid);
+  assert(detach_err == 0);
+  return 0;
+}
 
-  log_info(NULL, "started listening on port 8080\n");
+// resumes a handed over session on a thread of its own
+static void adopt_client(handover_session_t *s) {
+  if (set_blocking(s->fd) == -1) {
+    log_perror(NULL, "fcntl");
+    return;
+  }
+  client_thread_t *thread = client_thread_new(s->fd);
+  if (!thread) {
+    log_perror(NULL, "malloc");
+    return;
+  }
+  client_ctx_t *ctx = thread->ctx;
+  client_io_t io = {.fd = ctx->fd, .out = ctx->out};
+  // the thread owns the fd from here on
+  s->fd = -1;
+  handover_load_rx(&thread->rx, s);
+  thread->resumed = true;
+  if (session_resume(&io, ctx, s) == SESSION_CLOSE ||
+      client_thread_start(thread)) {
+    session_close(&io, ctx);
+    outq_close(ctx->out);
+    close(ctx->fd);
+    epoch_retire(ctx, client_free);
+    free(thread);
+  }
+}
+
+static int serve_threaded(int socket_fd, handover_t *taken) {
+  if (taken) {
+    for (size_t i = 0; i < taken->session_count; i++)
+      adopt_client(&taken->sessions[i]);
+    handover_free(taken);
+  }
 
   while (true) {
+    if (freeze_fd != -1) {
+      struct pollfd pfd[2] = {
+          {.fd = socket_fd, .events = POLLIN},
+          {.fd = freeze_fd, .events = POLLIN},
+      };
+      if (poll(pfd, 2, -1) == -1 && errno != EINTR) {
+        log_perror(NULL, "poll");
+        return errno;
+      }
+      if (pfd[1].revents & POLLIN)
+        thread_freeze(NULL, socket_fd);
+      if (!(pfd[0].revents & POLLIN))
+        continue;
+    }
+
     // accept with ip
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
@@ -413,7 +1216,7 @@ int server_start() {
       if (errno == EINTR)
         continue;
       log_perror(NULL, "accept");
-      goto error;
+      return errno;
     }
 
     char client_ip[INET_ADDRSTRLEN];
@@ -422,35 +1225,247 @@ int server_start() {
     log_info(NULL, "accepted connection from %s:%u\n", client_ip, client_port);
 
     // box information to pass into client handler
-    client_ctx_t *ctx = malloc(sizeof(*ctx));
-    if (!ctx) {
+    client_thread_t *thread = client_thread_new(client_fd);
+    if (!thread) {
+      int saved = errno;
       log_perror(NULL, "malloc");
       close(client_fd);
-      goto error;
+      return saved;
     }
-    ctx->fd = client_fd;
-    ctx->port = client_port;
-    memcpy(ctx->ip, client_ip, sizeof(client_ip));
+    thread->ctx->port = client_port;
+    memcpy(thread->ctx->ip, client_ip, sizeof(client_ip));
 
-    pthread_t client_tid;
-    int create_err = pthread_create(&client_tid, NULL, handle_client, ctx);
+    int create_err = client_thread_start(thread);
     if (create_err) {
-      fprintf(stderr, "pthread_create: %s\n", strerror(create_err));
-      free(ctx);
+      client_free(thread->ctx);
+      free(thread);
       close(client_fd);
-      close(socket_fd);
       return create_err;
     }
+  }
+}
 
-    int detach_err = pthread_detach(client_tid);
-    assert(detach_err == 0);
+// returns a listening socket on port, or -1 with errno set
+static int open_listener(uint16_t port, bool reuseport) {
+  int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (socket_fd == -1) {
+    log_perror(NULL, "socket");
+    return -1;
   }
 
-  close(socket_fd);
-  return 0;
+  // allow reuse of port
+  int opt = 1;
+  if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ==
+      -1) {
+    log_perror(NULL, "setsockopt");
+    goto error;
+  }
+  // every shard binds its own socket and the kernel spreads connections
+  if (reuseport && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+                              sizeof(opt)) == -1) {
+    log_perror(NULL, "setsockopt");
+    goto error;
+  }
+
+  // bind to port and start listening
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = INADDR_ANY,
+  };
+  if (bind(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    log_perror(NULL, "bind");
+    goto error;
+  }
+  if (listen(socket_fd, SOMAXCONN) == -1) {
+    log_perror(NULL, "listen");
+    goto error;
+  }
+  return socket_fd;
 
 error:
   int saved = errno;
   close(socket_fd);
-  return saved;
+  errno = saved;
+  return -1;
+}
+
+static int serve_epoll(uint16_t port, int shards, handover_t *taken) {
+  int *listen_fds = calloc(shards, sizeof(*listen_fds));
+  if (!listen_fds) {
+    log_perror(NULL, "malloc");
+    return errno;
+  }
+  // one shard per listener the previous process had
+  for (int i = 0; taken && i < shards; i++) {
+    listen_fds[i] = taken->listen_fds[i];
+    taken->listen_fds[i] = -1;
+  }
+  for (int i = 0; !taken && i < shards; i++) {
+    listen_fds[i] = open_listener(port, true);
+    if (listen_fds[i] == -1) {
+      int saved = errno;
+      while (i--)
+        close(listen_fds[i]);
+      free(listen_fds);
+      return saved;
+    }
+  }
+
+  log_info(NULL, "started listening on port %u\n", port);
+  log_info(NULL, "using epoll backend\n");
+  int result = reactor_run(listen_fds, shards, taken);
+
+  for (int i = 0; i < shards; i++)
+    close(listen_fds[i]);
+  free(listen_fds);
+  return result;
+}
+
+// the listener the previous process handed over, the rest are closed
+static int taken_listener(handover_t *taken) {
+  int fd = taken->listen_fds[0];
+  taken->listen_fds[0] = -1;
+  if (taken->listen_count > 1)
+    log_info(NULL, "handover: dropping %zu extra listeners\n",
+             taken->listen_count - 1);
+  return fd;
+}
+
+int server_start(server_options_t options) {
+  signal(SIGPIPE, SIG_IGN);
+  outq_configure(options.outq);
+  // the old process still holds the other ports until this returns
+  handover_t taken_state;
+  handover_t *taken = NULL;
+  if (options.takeover) {
+    int err = handover_take(options.takeover, &taken_state);
+    if (err)
+      return err;
+    taken = &taken_state;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (taken->listen_count == 0 ||
+        getsockname(taken->listen_fds[0], (struct sockaddr *)&addr,
+                    &addr_len) == -1) {
+      log_err(NULL, "handover: no listener was handed over\n");
+      handover_free(taken);
+      return EPROTO;
+    }
+    // clients keep connecting where they did
+    options.port = ntohs(addr.sin_port);
+  }
+  if (options.metrics) {
+    int err = metrics_serve(options.metrics);
+    if (err)
+      return err;
+  }
+  backend = options.backend;
+  handshake_timeout = (uint64_t)options.handshake_timeout * 1000;
+  idle_timeout = (uint64_t)options.idle_timeout * 1000;
+  heartbeat = (uint64_t)options.heartbeat * 1000;
+  deflate_enabled = options.deflate_level > 0;
+  if (deflate_enabled)
+    zframe_configure(options.deflate_level);
+  if (backend == SERVER_BACKEND_EPOLL && taken) {
+    options.shards = (int)taken->listen_count;
+  } else if (backend == SERVER_BACKEND_EPOLL && options.shards <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    options.shards = cpus > 0 ? cpus : 1;
+  }
+  // a member slot per shard, the other backends fan out from one slot
+  int err = channels_configure(
+      backend == SERVER_BACKEND_EPOLL ? options.shards : 1);
+  if (err) {
+    log_err(NULL, "channels: %s\n", strerror(err));
+    return err;
+  }
+  err = history_configure(options.history);
+  if (err) {
+    log_err(NULL, "history: %s\n", strerror(err));
+    return err;
+  }
+  // what was said before the restart goes straight back into the history,
+  // after a handover it came along
+  if (taken) {
+    for (size_t i = 0; i < taken->history_len; i++)
+      history_append(taken->history[i]);
+  }
+  if (options.chatlog.dir) {
+    err = chatlog_open(options.chatlog, taken ? 0 : history_len(),
+                       history_append);
+    if (err)
+      return err;
+  }
+  // before anyone can join, here or on a peer
+  err = presence_start(options.presence, broadcast_presence);
+  if (err)
+    return err;
+  if (options.federation.listen || options.federation.peer_count > 0) {
+    // tells nodes on different hosts and ports apart without configuration
+    char node[MAX_NODE_LEN + 1];
+    struct utsname host;
+    if (!options.federation.node) {
+      if (uname(&host) == -1)
+        snprintf(host.nodename, sizeof(host.nodename), "localhost");
+      snprintf(node, sizeof(node), "%.*s:%u", MAX_NODE_LEN - 6, host.nodename,
+               options.port);
+      options.federation.node = node;
+    }
+    err = federation_start(options.federation, &federation_handlers);
+    if (err)
+      return err;
+  }
+
+  if (options.handover) {
+    handover_freeze_fn freeze = reactor_freeze;
+    if (backend == SERVER_BACKEND_URING)
+      freeze = uring_freeze;
+    if (backend == SERVER_BACKEND_THREADED) {
+      freeze_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (freeze_fd == -1) {
+        log_perror(NULL, "eventfd");
+        return errno;
+      }
+      freeze = threaded_freeze;
+    }
+    err = handover_listen(options.handover, freeze);
+    if (err)
+      return err;
+  }
+
+  switch (options.backend) {
+  case SERVER_BACKEND_THREADED: {
+    int socket_fd =
+        taken ? taken_listener(taken) : open_listener(options.port, false);
+    if (socket_fd == -1)
+      return errno;
+    // the epoll backend leaves it nonblocking
+    if (taken && set_blocking(socket_fd) == -1) {
+      log_perror(NULL, "fcntl");
+      return errno;
+    }
+
+    log_info(NULL, "started listening on port %u\n", options.port);
+    log_info(NULL, "using threaded backend\n");
+    int result = serve_threaded(socket_fd, taken);
+    close(socket_fd);
+    return result;
+  }
+  case SERVER_BACKEND_URING: {
+    int socket_fd =
+        taken ? taken_listener(taken) : open_listener(options.port, false);
+    if (socket_fd == -1)
+      return errno;
+
+    log_info(NULL, "started listening on port %u\n", options.port);
+    log_info(NULL, "using io_uring backend\n");
+    int result = uring_run(socket_fd, taken);
+    close(socket_fd);
+    return result;
+  }
+  case SERVER_BACKEND_EPOLL:
+  default:
+    return serve_epoll(options.port, options.shards, taken);
+  }
 }
@@ -1,6 +1,59 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-int server_start();
+#include "chatlog.h"
+#include "federation.h"
+#include "outq.h"
+#include "presence.h"
+
+typedef enum {
+  SERVER_BACKEND_EPOLL,
+  SERVER_BACKEND_THREADED,
+  SERVER_BACKEND_URING,
+} server_backend_e;
+
+#define SERVER_DEFAULT_PORT 8080
+#define SERVER_DEFAULT_HANDSHAKE_TIMEOUT 30
+#define SERVER_DEFAULT_HEARTBEAT 30
+// a day, in seconds, for every timeout option
+#define SERVER_MAX_TIMEOUT 86400
+
+typedef struct {
+  server_backend_e backend;
+  uint16_t port;
+  // epoll reactor shards, each with its own SO_REUSEPORT listener. 0 means
+  // one per online cpu
+  int shards;
+  // chat messages replayed to new joiners, 0 disables
+  size_t history;
+  // persistent chat log, disabled while dir is NULL
+  chatlog_options_t chatlog;
+  outq_options_t outq;
+  // seconds a client gets to pick a name, 0 waits forever
+  int handshake_timeout;
+  // seconds without a frame from a joined client before it is dropped, 0
+  // keeps quiet clients around
+  int idle_timeout;
+  // seconds of quiet before a client that negotiated pings is pinged, and
+  // again before it is dropped for not answering. 0 turns pings off.
+  int heartbeat;
+  // how join and disconnect notices are gathered into summaries
+  presence_options_t presence;
+  // zlib level for clients that negotiate deflate, 0 turns it off
+  int deflate_level;
+  // port on 127.0.0.1 or unix socket path for the metrics endpoint, NULL
+  // turns metrics off
+  const char *metrics;
+  // links to other nodes, off unless it listens for or dials peers
+  federation_options_t federation;
+  // unix socket a successor can take over the clients from, NULL turns hot
+  // restarts off
+  const char *handover;
+  // handover socket of the running server to take over from instead of
+  // binding port, NULL starts fresh
+  const char *takeover;
+} server_options_t;
+
+int server_start(server_options_t);
 
 #endif // SERVER_H
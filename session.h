@@ -0,0 +1,87 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+#define MAX_NAME_LEN 32
+#define SESSION_PROMPT_SIZE 128
+
+typedef enum {
+  SESSION_HANDSHAKE,
+  SESSION_CHAT,
+} session_state_e;
+
+typedef struct client_ctx client_ctx_t;
+
+struct client_ctx {
+  int fd;
+  char ip[INET_ADDRSTRLEN];
+  uint16_t port;
+  char name[MAX_NAME_LEN + 1];
+  outq_t *out;
+  session_state_e state;
+  int attempts;
+  // negotiated PROTO_CAP_PIPELINE, prompts are only sent when they change
+  bool pipelined;
+  // negotiated PROTO_CAP_PING, quiet clients are pinged before they time out
+  bool ping;
+  // negotiated PROTO_CAP_V2, its queue encodes every frame after the caps
+  // reply in v2
+  bool v2;
+  // negotiated PROTO_CAP_DEFLATE, its queue compresses frames after the caps
+  // reply
+  bool deflate;
+  char prompt[SESSION_PROMPT_SIZE];
+  // wheel_clock() times. the backend arms a timer for deadline whenever it
+  // changes and calls session_timeout when it fires, 0 means no timer.
+  uint64_t deadline;
+  uint64_t last_rx;
+  // when the unanswered ping went out, 0 while none is
+  uint64_t ping_sent;
+  // event loop that owns the client, picks its member slot in a channel
+  int slot;
+  // current channel and the index into its member slot, owned by channels.c
+  struct channel *channel;
+  size_t channel_pos;
+  // registry links and rename seqlock, owned by clients.c
+  _Atomic(client_ctx_t *) next;
+  client_ctx_t *prev;
+  atomic_uint name_seq;
+  bool registered;
+};
+
+typedef enum {
+  SESSION_CONTINUE,
+  SESSION_CLOSE,
+} session_result_t;
+
+// transport independent chat logic, driven by whichever backend owns the fd.
+// each client message is passed in io->buf, replies go through io.
+void session_open(client_io_t *io, client_ctx_t *ctx);
+session_result_t session_input(client_io_t *io, client_ctx_t *ctx);
+// ctx->deadline passed. enforces the handshake deadline and the idle timeout
+// and pings quiet clients, then moves the deadline to the next check.
+session_result_t session_timeout(client_io_t *io, client_ctx_t *ctx);
+void session_close(client_io_t *io, client_ctx_t *ctx);
+
+struct handover_session;
+// instead of session_open for a session the previous process handed over:
+// restores its state, name and channel and queues what it had not sent yet.
+// the backend refills the reader itself.
+session_result_t session_resume(client_io_t *io, client_ctx_t *ctx,
+                                const struct handover_session *s);
+
+// room for one whole client frame: <magic: 4><length: 4 BE><content>
+#define SESSION_RX_SIZE (8 + sizeof(((client_io_t *)0)->buf))
+
+// feeds every complete frame in rx to session_input and handles control
+// frames itself, the partial tail stays in rx. returns SESSION_CLOSE on
+// protocol errors or when the session asks to end.
+session_result_t session_parse(client_io_t *io, client_ctx_t *ctx,
+                               proto_reader_t *rx);
+
+#endif // SESSION_H
@@ -0,0 +1,898 @@
+// syscall() and MAP_ANONYMOUS, there is no liburing to hide them behind
+#define _DEFAULT_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "clients.h"
+#include "epoch.h"
+#include "handover.h"
+#include "metrics.h"
+#include "mpsc.h"
+#include "pool.h"
+#include "session.h"
+#include "uring.h"
+#include "utils.h"
+#include "wheel.h"
+
+#define RING_ENTRIES 1024
+// receive buffers the kernel picks from, shared by every connection
+#define RECV_BUFS 1024
+#define RECV_BUF_SIZE 2048
+#define RECV_GROUP 0
+// frames per sendmsg
+#define SEND_BATCH 64
+// completions handled before queued sends are submitted, so one busy client
+// cannot pile up more replies than its queue holds
+#define REAP_BATCH 32
+// milliseconds a closing connection gets to send what its session queued
+// last, a goodbye or a timeout notice
+#define LINGER_MS 1000
+
+// stored in the low bits of user_data, connections are at least 8 aligned
+typedef enum {
+  OP_ACCEPT,
+  OP_RECV,
+  OP_SEND,
+  // the eventfd other threads write to after posting
+  OP_WAKE,
+  // cancellations during a handover, nothing to do when they complete
+  OP_CANCEL,
+} op_e;
+
+#define OP_MASK 7
+
+typedef struct conn conn_t;
+struct conn {
+  client_ctx_t ctx;
+  client_io_t io;
+  char rx_buf[SESSION_RX_SIZE];
+  proto_reader_t rx;
+  // armed for ctx.deadline
+  wheel_timer_t timer;
+  conn_t *prev;
+  conn_t *next;
+  // queued frames waiting for the next submission
+  bool dirty;
+  conn_t *dirty_next;
+  // the session is over, only its last frames are still being sent
+  bool closing;
+  // nothing more is sent either. a connection is freed once it is finished
+  // and nothing is in flight
+  bool finished;
+  bool recv_armed;
+  bool sending;
+  struct msghdr msg;
+  struct iovec iov[SEND_BATCH * 2];
+  frame_t *inflight[SEND_BATCH];
+  int inflight_count;
+  // when the send was queued, its time in the kernel is the send metric
+  uint64_t send_start;
+};
+
+static struct {
+  int fd;
+  int listen_fd;
+
+  // submission ring, tail is ours and head the kernel's
+  _Atomic unsigned *sq_head;
+  _Atomic unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;
+  unsigned to_submit;
+
+  // completion ring, head is ours and tail the kernel's
+  _Atomic unsigned *cq_head;
+  _Atomic unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  unsigned short buf_tail;
+
+  conn_t *conns;
+  conn_t *dirty;
+  wheel_t timers;
+
+  // frames posted by other threads
+  mpsc_t inbox;
+  int wake_fd;
+  atomic_bool wake_pending;
+  uint64_t wake_value;
+  // set once the inbox is ready, posts before that have nobody to reach
+  atomic_bool running;
+
+  // a handover asked the loop to stop, it cancels what is in flight and
+  // exports once nothing is
+  atomic_bool freezing;
+  bool cancelled;
+  bool accept_armed;
+  bool wake_armed;
+} ring;
+
+// a frame posted from another thread
+typedef struct {
+  mpsc_node_t node;
+  frame_t *frame;
+  // NULL for every registered client
+  channel_t *channel;
+  int exclude_fd;
+  // only for the client of that name when set
+  char to[MAX_NAME_LEN + 1];
+  // disconnect that client once frame is queued
+  bool close;
+} relay_t;
+
+static pool_t relay_pool = POOL_INIT("uring_relay", sizeof(relay_t));
+static _Thread_local bool on_loop;
+
+// SYSCALLS
+
+static int ring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(unsigned to_submit, unsigned min_complete,
+                      unsigned flags, void *arg, size_t arg_size) {
+  return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                      flags, arg, arg_size);
+}
+
+static int ring_register(unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+// RING
+
+static int ring_init(void) {
+  struct io_uring_params params = {
+      .flags = IORING_SETUP_CQSIZE,
+      // multishot requests can post many completions per submission
+      .cq_entries = RING_ENTRIES * 4,
+  };
+  ring.fd = ring_setup(RING_ENTRIES, &params);
+  if (ring.fd == -1) {
+    log_perror(NULL, "io_uring_setup");
+    return errno;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_size > sq_size)
+    sq_size = cq_size;
+
+  char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd,
+                  IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    log_perror(NULL, "mmap");
+    return errno;
+  }
+  char *cq = sq;
+  if (!single) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd,
+              IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      log_perror(NULL, "mmap");
+      return errno;
+    }
+  }
+  ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd,
+                   IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    log_perror(NULL, "mmap");
+    return errno;
+  }
+
+  ring.sq_head = (_Atomic unsigned *)(sq + params.sq_off.head);
+  ring.sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sq_entries = params.sq_entries;
+  ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring.sqe_tail = atomic_load_explicit(ring.sq_tail, memory_order_relaxed);
+
+  ring.cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+static void buf_recycle(unsigned short bid) {
+  struct io_uring_buf *buf =
+      &ring.buf_ring->bufs[ring.buf_tail & (RECV_BUFS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring.bufs + (size_t)bid * RECV_BUF_SIZE);
+  buf->len = RECV_BUF_SIZE;
+  buf->bid = bid;
+  ring.buf_tail++;
+  atomic_store_explicit((_Atomic unsigned short *)&ring.buf_ring->tail,
+                        ring.buf_tail, memory_order_release);
+}
+
+static int bufs_init(void) {
+  ring.buf_ring = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+  if (ring.buf_ring == MAP_FAILED) {
+    log_perror(NULL, "mmap");
+    return errno;
+  }
+  ring.bufs = malloc((size_t)RECV_BUFS * RECV_BUF_SIZE);
+  if (!ring.bufs) {
+    log_perror(NULL, "malloc");
+    return errno;
+  }
+
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (uint64_t)(uintptr_t)ring.buf_ring,
+      .ring_entries = RECV_BUFS,
+      .bgid = RECV_GROUP,
+  };
+  if (ring_register(IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    log_perror(NULL, "io_uring_register");
+    return errno;
+  }
+
+  for (unsigned i = 0; i < RECV_BUFS; i++)
+    buf_recycle(i);
+  return 0;
+}
+
+// hands everything queued so far to the kernel. a wait of 0 returns right
+// away, otherwise it waits up to wait ms for a completion, or forever if -1.
+static int ring_submit(int wait) {
+  atomic_store_explicit(ring.sq_tail, ring.sqe_tail, memory_order_release);
+  while (true) {
+    int submitted;
+    if (wait > 0) {
+      // like the epoll_wait timeout, so the timer wheel gets its turn
+      struct __kernel_timespec ts = {
+          .tv_sec = wait / 1000,
+          .tv_nsec = (long long)(wait % 1000) * 1000000,
+      };
+      struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+      submitted =
+          ring_enter(ring.to_submit, 1,
+                     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                     sizeof(arg));
+    } else {
+      submitted = ring_enter(ring.to_submit, wait ? 1 : 0,
+                             wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }
+    if (submitted == -1) {
+      if (errno == EINTR)
+        continue;
+      // the wait ran out, nothing was submitted or it would have said so
+      if (errno == ETIME)
+        return 0;
+      log_perror(NULL, "io_uring_enter");
+      return -1;
+    }
+    ring.to_submit -= submitted;
+    return 0;
+  }
+}
+
+static struct io_uring_sqe *sqe_get(void) {
+  unsigned head = atomic_load_explicit(ring.sq_head, memory_order_acquire);
+  if (ring.sqe_tail - head >= ring.sq_entries) {
+    // without SQPOLL the kernel consumes every entry during the enter
+    if (ring_submit(0) == -1)
+      return NULL;
+    head = atomic_load_explicit(ring.sq_head, memory_order_acquire);
+    if (ring.sqe_tail - head >= ring.sq_entries)
+      return NULL;
+  }
+
+  unsigned index = ring.sqe_tail & ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sq_array[index] = index;
+  ring.sqe_tail++;
+  ring.to_submit++;
+  return sqe;
+}
+
+// OPERATIONS
+
+static int arm_accept(void) {
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = ring.listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = OP_ACCEPT;
+  ring.accept_armed = true;
+  return 0;
+}
+
+static int arm_wake(void) {
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = ring.wake_fd;
+  sqe->addr = (uintptr_t)&ring.wake_value;
+  sqe->len = sizeof(ring.wake_value);
+  sqe->user_data = OP_WAKE;
+  ring.wake_armed = true;
+  return 0;
+}
+
+static int arm_recv(conn_t *conn) {
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->ctx.fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_GROUP;
+  sqe->user_data = (uintptr_t)conn | OP_RECV;
+  conn->recv_armed = true;
+  return 0;
+}
+
+static int submit_send(conn_t *conn) {
+  int iovcnt;
+  conn->inflight_count = outq_claim(conn->ctx.out, conn->iov, &iovcnt,
+                                    conn->inflight, SEND_BATCH);
+  if (conn->inflight_count == 0)
+    return 0;
+
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe) {
+    outq_complete(conn->ctx.out, 0);
+    for (int i = 0; i < conn->inflight_count; i++)
+      frame_put(conn->inflight[i]);
+    conn->inflight_count = 0;
+    return -1;
+  }
+
+  conn->msg = (struct msghdr){.msg_iov = conn->iov, .msg_iovlen = iovcnt};
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->ctx.fd;
+  sqe->addr = (uintptr_t)&conn->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t)conn | OP_SEND;
+  conn->sending = true;
+  conn->send_start = metrics_now();
+  return 0;
+}
+
+// CONNECTIONS
+
+static pool_t conn_pool = POOL_INIT("uring_conn", sizeof(conn_t));
+
+static void mark_dirty(conn_t *conn) {
+  if (conn->dirty || conn->closing)
+    return;
+  conn->dirty = true;
+  conn->dirty_next = ring.dirty;
+  ring.dirty = conn;
+}
+
+static void conn_free(void *conn_raw) {
+  conn_t *conn = conn_raw;
+  outq_put(conn->ctx.out);
+  pool_free(&conn_pool, conn);
+}
+
+// called once at the end of every event that touched a connection
+static void conn_maybe_free(conn_t *conn) {
+  if (!conn->finished || conn->recv_armed || conn->sending || conn->dirty)
+    return;
+  close(conn->ctx.fd);
+  epoch_retire(conn, conn_free);
+}
+
+// stops all writes, once the last frames went out or ran out of time
+static void conn_finish(conn_t *conn) {
+  if (conn->finished)
+    return;
+  conn->finished = true;
+  wheel_cancel(&ring.timers, &conn->timer);
+  outq_close(conn->ctx.out);
+  // completes the pending recv and fails any blocked send
+  shutdown(conn->ctx.fd, SHUT_RDWR);
+}
+
+static void conn_close(conn_t *conn) {
+  if (conn->closing)
+    return;
+  conn->closing = true;
+
+  session_close(&conn->io, &conn->ctx);
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    ring.conns = conn->next;
+  }
+  if (conn->next)
+    conn->next->prev = conn->prev;
+
+  // nothing more is read, but what the session queued last still goes out
+  // with one more send, unless a handover is underway
+  shutdown(conn->ctx.fd, SHUT_RD);
+  if (!conn->sending && !ring.cancelled)
+    submit_send(conn);
+  // nothing was queued, or the send could not be submitted
+  if (!conn->sending) {
+    conn_finish(conn);
+    return;
+  }
+  wheel_set(&ring.timers, &conn->timer, wheel_clock() + LINGER_MS);
+}
+
+static void flush_dirty(void) {
+  conn_t *conn = ring.dirty;
+  ring.dirty = NULL;
+  while (conn) {
+    conn_t *next = conn->dirty_next;
+    conn->dirty = false;
+    // a frozen loop leaves queued frames for the handover
+    if (!conn->closing && !conn->sending && !ring.cancelled &&
+        submit_send(conn) == -1) {
+      log_err(LOG_CTX(&conn->ctx), "submission queue full\n");
+      conn_close(conn);
+    }
+    conn_maybe_free(conn);
+    conn = next;
+  }
+}
+
+// sessions only move their deadline while handling input or a timeout, so
+// the timer follows it after each of those
+static void conn_rearm(conn_t *conn) {
+  if (!conn->closing)
+    wheel_set(&ring.timers, &conn->timer, conn->ctx.deadline);
+}
+
+static void conn_expired(wheel_timer_t *timer) {
+  conn_t *conn = (conn_t *)((char *)timer - offsetof(conn_t, timer));
+  if (conn->closing) {
+    // the client did not take its last frames in time
+    conn_finish(conn);
+  } else if (session_timeout(&conn->io, &conn->ctx) == SESSION_CLOSE) {
+    // sends the timeout notice before the socket is shut down
+    conn_close(conn);
+  } else {
+    // the ping goes out with the next submission
+    mark_dirty(conn);
+    conn_rearm(conn);
+  }
+  conn_maybe_free(conn);
+}
+
+typedef struct {
+  frame_t *frame;
+  int exclude_fd;
+} delivery_t;
+
+int uring_send(client_ctx_t *ctx, frame_t *frame) {
+  if (outq_push_frame(ctx->out, frame) == -1)
+    return -1;
+  // ctx is the first member of its connection
+  mark_dirty((conn_t *)ctx);
+  return 0;
+}
+
+static void deliver_one(client_ctx_t *ctx, void *delivery_raw) {
+  delivery_t *delivery = delivery_raw;
+  if (ctx->fd == delivery->exclude_fd)
+    return;
+  if (uring_send(ctx, delivery->frame) == -1) {
+    log_err(LOG_CTX(ctx), "broadcast failed\n");
+  }
+}
+
+static int post(channel_t *channel, const char *to, frame_t *frame,
+                int exclude_fd, bool close) {
+  if (!atomic_load(&ring.running))
+    return 0;
+  relay_t *relay = pool_alloc(&relay_pool);
+  if (!relay) {
+    log_perror(NULL, "post: malloc");
+    return -1;
+  }
+  frame_get(frame);
+  relay->frame = frame;
+  if (channel)
+    channels_get(channel);
+  relay->channel = channel;
+  relay->exclude_fd = exclude_fd;
+  snprintf(relay->to, sizeof(relay->to), "%s", to ? to : "");
+  relay->close = close;
+  mpsc_push(&ring.inbox, &relay->node);
+
+  // one wakeup per drain is enough, later posts ride along
+  if (!atomic_exchange(&ring.wake_pending, true)) {
+    uint64_t one = 1;
+    if (write(ring.wake_fd, &one, sizeof(one)) == -1)
+      log_perror(NULL, "post: eventfd write");
+  }
+  return 0;
+}
+
+int uring_post(channel_t *channel, const char *to, frame_t *frame,
+               int exclude_fd) {
+  return post(channel, to, frame, exclude_fd, false);
+}
+
+int uring_post_close(const char *to, frame_t *frame) {
+  return post(NULL, to, frame, -1, true);
+}
+
+int uring_broadcast(channel_t *channel, frame_t *frame, int exclude_fd) {
+  if (!on_loop)
+    return uring_post(channel, NULL, frame, exclude_fd);
+  delivery_t delivery = {.frame = frame, .exclude_fd = exclude_fd};
+  if (channel) {
+    channels_each(channel, 0, deliver_one, &delivery);
+    return 0;
+  }
+  for (conn_t *conn = ring.conns; conn; conn = conn->next) {
+    if (conn->ctx.registered)
+      deliver_one(&conn->ctx, &delivery);
+  }
+  return 0;
+}
+
+// COMPLETIONS
+
+static void drain_inbox(void) {
+  mpsc_node_t *node;
+  while ((node = mpsc_pop(&ring.inbox))) {
+    relay_t *relay = (relay_t *)node;
+    if (relay->to[0]) {
+      epoch_enter();
+      client_ctx_t *ctx = clients_find_name(relay->to);
+      if (ctx) {
+        uring_send(ctx, relay->frame);
+        // the frame goes out before the socket is shut down
+        if (relay->close) {
+          conn_close((conn_t *)ctx);
+          conn_maybe_free((conn_t *)ctx);
+        }
+      }
+      epoch_exit();
+    } else {
+      uring_broadcast(relay->channel, relay->frame, relay->exclude_fd);
+    }
+    frame_put(relay->frame);
+    if (relay->channel)
+      channels_put(relay->channel);
+    pool_free(&relay_pool, relay);
+  }
+}
+
+static void on_wake(struct io_uring_cqe *cqe) {
+  ring.wake_armed = false;
+  if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+    errno = -cqe->res;
+    log_perror(NULL, "eventfd read");
+  }
+  // cleared before draining, so a post that misses this drain wakes us again
+  atomic_store(&ring.wake_pending, false);
+  if (!atomic_load(&ring.freezing) && arm_wake() == -1)
+    log_err(NULL, "could not re-arm the wakeup read\n");
+  drain_inbox();
+}
+
+// a connection on the list, its session not started yet
+static conn_t *conn_new(int fd) {
+  conn_t *conn = pool_alloc(&conn_pool);
+  if (!conn)
+    return NULL;
+  memset(conn, 0, sizeof(*conn));
+  conn->ctx.out = outq_new(fd, OUTQ_DRAIN_DEFERRED);
+  if (!conn->ctx.out) {
+    pool_free(&conn_pool, conn);
+    return NULL;
+  }
+  conn->ctx.fd = fd;
+  conn->io.fd = fd;
+  conn->io.out = conn->ctx.out;
+  conn->timer.fn = conn_expired;
+  proto_reader_init(&conn->rx, conn->rx_buf, sizeof(conn->rx_buf), false);
+
+  conn->next = ring.conns;
+  if (ring.conns)
+    ring.conns->prev = conn;
+  ring.conns = conn;
+  return conn;
+}
+
+// once the session started: its timer, what it queued and the first receive
+static void conn_start(conn_t *conn) {
+  conn_rearm(conn);
+  mark_dirty(conn);
+  if (arm_recv(conn) == -1) {
+    log_err(LOG_CTX(&conn->ctx), "submission queue full\n");
+    conn_close(conn);
+    conn_maybe_free(conn);
+  }
+}
+
+static void on_accept(struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    ring.accept_armed = false;
+    if (!ring.cancelled && arm_accept() == -1)
+      log_err(NULL, "could not re-arm accept\n");
+  }
+
+  if (cqe->res < 0) {
+    if (cqe->res != -ECANCELED) {
+      errno = -cqe->res;
+      log_perror(NULL, "accept");
+    }
+    return;
+  }
+
+  int fd = cqe->res;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) == -1) {
+    log_perror(NULL, "getpeername");
+    close(fd);
+    return;
+  }
+
+  conn_t *conn = conn_new(fd);
+  if (!conn) {
+    log_perror(NULL, "malloc");
+    close(fd);
+    return;
+  }
+  conn->ctx.port = ntohs(addr.sin_port);
+  inet_ntop(AF_INET, &addr.sin_addr, conn->ctx.ip, sizeof(conn->ctx.ip));
+  log_info(NULL, "accepted connection from %s:%u\n", conn->ctx.ip,
+           conn->ctx.port);
+
+  session_open(&conn->io, &conn->ctx);
+  conn_start(conn);
+}
+
+static void on_recv(conn_t *conn, struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    conn->recv_armed = false;
+
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    const char *data = ring.bufs + (size_t)bid * RECV_BUF_SIZE;
+    size_t left = cqe->res;
+    metrics_add(METRIC_BYTES_IN, left);
+
+    // a parse always leaves less than a whole frame, so rx never fills up
+    while (left > 0 && !conn->closing) {
+      size_t n;
+      char *dst = proto_reader_space(&conn->rx, &n);
+      if (n > left)
+        n = left;
+      memcpy(dst, data, n);
+      proto_reader_filled(&conn->rx, n);
+      data += n;
+      left -= n;
+
+      if (session_parse(&conn->io, &conn->ctx, &conn->rx) == SESSION_CLOSE) {
+        conn_close(conn);
+      }
+    }
+    buf_recycle(bid);
+    mark_dirty(conn);
+    conn_rearm(conn);
+  } else if (cqe->res == 0) {
+    conn_close(conn);
+  } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+    // running out of buffers only stops the multishot, anything else is fatal
+    if (cqe->res != -ECONNRESET) {
+      errno = -cqe->res;
+      log_perror(LOG_CTX(&conn->ctx), "recv");
+    }
+    conn_close(conn);
+  }
+
+  if (!conn->recv_armed && !conn->closing && !ring.cancelled &&
+      arm_recv(conn) == -1) {
+    log_err(LOG_CTX(&conn->ctx), "submission queue full\n");
+    conn_close(conn);
+  }
+  conn_maybe_free(conn);
+}
+
+static void on_send(conn_t *conn, struct io_uring_cqe *cqe) {
+  conn->sending = false;
+  metrics_since(METRIC_SEND, conn->send_start);
+  if (cqe->res > 0)
+    metrics_add(METRIC_BYTES_OUT, cqe->res);
+  outq_complete(conn->ctx.out, cqe->res > 0 ? cqe->res : 0);
+  for (int i = 0; i < conn->inflight_count; i++)
+    frame_put(conn->inflight[i]);
+  conn->inflight_count = 0;
+
+  // a send cancelled for a handover leaves its frames queued
+  if (cqe->res < 0 && cqe->res != -ECANCELED) {
+    if (!conn->closing && cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+      errno = -cqe->res;
+      log_perror(LOG_CTX(&conn->ctx), "sendmsg");
+    }
+    conn_close(conn);
+    conn_finish(conn);
+  } else if (conn->closing) {
+    // the rest of the last frames, then the connection is done
+    if (conn->finished || ring.cancelled || submit_send(conn) == -1 ||
+        !conn->sending)
+      conn_finish(conn);
+  } else {
+    // whatever was queued meanwhile, or the rest of a short write
+    mark_dirty(conn);
+  }
+  conn_maybe_free(conn);
+}
+
+static void reap(void) {
+  unsigned head = atomic_load_explicit(ring.cq_head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(ring.cq_tail, memory_order_acquire);
+  if (tail - head > REAP_BATCH)
+    tail = head + REAP_BATCH;
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe cqe = ring.cqes[head & ring.cq_mask];
+    // free the slot first, handlers may queue more work
+    atomic_store_explicit(ring.cq_head, head + 1, memory_order_release);
+
+    conn_t *conn = (conn_t *)(uintptr_t)(cqe.user_data & ~(uint64_t)OP_MASK);
+    switch (cqe.user_data & OP_MASK) {
+    case OP_ACCEPT:
+      on_accept(&cqe);
+      break;
+    case OP_RECV:
+      on_recv(conn, &cqe);
+      break;
+    case OP_SEND:
+      on_send(conn, &cqe);
+      break;
+    case OP_WAKE:
+      on_wake(&cqe);
+      break;
+    case OP_CANCEL:
+      break;
+    }
+  }
+}
+
+// HANDOVER
+// a freeze cancels the accept and every receive and send in flight, waits for
+// their completions, then hands over the connections with whatever their
+// queues still hold
+
+static pthread_barrier_t frozen;
+
+static int cancel_fd(int fd) {
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = OP_CANCEL;
+  return 0;
+}
+
+// true once nothing that could still touch a connection is in flight
+static bool ring_quiesce(void) {
+  if (!ring.cancelled) {
+    ring.cancelled = true;
+    if (cancel_fd(ring.listen_fd) == -1)
+      log_err(NULL, "freeze: submission queue full\n");
+    for (conn_t *conn = ring.conns; conn; conn = conn->next) {
+      if (cancel_fd(conn->ctx.fd) == -1)
+        log_err(LOG_CTX(&conn->ctx), "freeze: submission queue full\n");
+    }
+  }
+  if (ring.accept_armed || ring.wake_armed)
+    return false;
+  for (conn_t *conn = ring.conns; conn; conn = conn->next) {
+    if (conn->recv_armed || conn->sending)
+      return false;
+  }
+  return true;
+}
+
+static void ring_freeze(void) {
+  drain_inbox();
+  for (conn_t *conn = ring.conns; conn; conn = conn->next)
+    handover_add_session(&conn->ctx, &conn->rx);
+  handover_add_listener(ring.listen_fd);
+  pthread_barrier_wait(&frozen);
+  handover_park();
+}
+
+void uring_freeze(void) {
+  pthread_barrier_init(&frozen, NULL, 2);
+  atomic_store(&ring.freezing, true);
+  uint64_t one = 1;
+  if (atomic_load(&ring.running) &&
+      write(ring.wake_fd, &one, sizeof(one)) == -1)
+    log_perror(NULL, "freeze: eventfd write");
+  pthread_barrier_wait(&frozen);
+}
+
+// a session the previous process handed over
+static void ring_adopt(handover_session_t *s) {
+  conn_t *conn = conn_new(s->fd);
+  if (!conn) {
+    log_perror(NULL, "malloc");
+    return;
+  }
+  // the connection owns the fd from here on
+  s->fd = -1;
+  handover_load_rx(&conn->rx, s);
+  if (session_resume(&conn->io, &conn->ctx, s) == SESSION_CLOSE) {
+    conn_close(conn);
+    conn_maybe_free(conn);
+    return;
+  }
+  conn_start(conn);
+}
+
+int uring_run(int listen_fd, handover_t *taken) {
+  ring.listen_fd = listen_fd;
+
+  int err = ring_init();
+  if (!err)
+    err = bufs_init();
+  if (err)
+    return err;
+  if (arm_accept() == -1)
+    return EBUSY;
+
+  on_loop = true;
+  mpsc_init(&ring.inbox);
+  ring.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ring.wake_fd == -1) {
+    log_perror(NULL, "eventfd");
+    return errno;
+  }
+  if (arm_wake() == -1)
+    return EBUSY;
+  atomic_store(&ring.running, true);
+
+  wheel_init(&ring.timers, wheel_clock());
+  if (taken) {
+    for (size_t i = 0; i < taken->session_count; i++)
+      ring_adopt(&taken->sessions[i]);
+    handover_free(taken);
+  }
+  while (true) {
+    if (atomic_load(&ring.freezing) && ring_quiesce())
+      ring_freeze();
+    // every send queued by the last batch of completions goes out here
+    flush_dirty();
+    if (ring_submit(wheel_timeout(&ring.timers, wheel_clock())) == -1)
+      return errno;
+    reap();
+    wheel_advance(&ring.timers, wheel_clock());
+    epoch_reclaim();
+  }
+}
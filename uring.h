@@ -0,0 +1,32 @@
+#ifndef URING_H
+#define URING_H
+
+#include "channels.h"
+#include "frame.h"
+#include "handover.h"
+
+// single threaded io_uring event loop: multishot accept, multishot recv into
+// kernel-selected provided buffers, and every send queued during one pass of
+// the loop submitted together in a single io_uring_enter. sessions taken over
+// from the previous process are resumed first and taken is freed.
+int uring_run(int listen_fd, handover_t *taken);
+
+// queues frame for every member of channel, or every registered client when
+// channel is NULL, except exclude_fd. the sends go out with the next
+// submission. from other threads it is posted to the loop instead.
+int uring_broadcast(channel_t *channel, frame_t *frame, int exclude_fd);
+// queues frame for one client, must be called from the loop thread
+int uring_send(client_ctx_t *ctx, frame_t *frame);
+// hands frame to the loop from any other thread, for the client named to, or
+// like uring_broadcast when to is NULL. the loop delivers it after its next
+// wakeup.
+int uring_post(channel_t *channel, const char *to, frame_t *frame,
+               int exclude_fd);
+// like uring_post for the client named to, which the loop then disconnects
+// once frame has gone out
+int uring_post_close(const char *to, frame_t *frame);
+
+// handover_freeze_fn for the loop
+void uring_freeze(void);
+
+#endif // URING_H
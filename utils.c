@@ -1,47 +1,14 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "pool.h"
 #include "utils.h"
 
-// LOGGING
-
-static void log_prefix(const log_ctx_t *ctx, const char *level_color,
-                       const char *level) {
-  if (ctx) {
-    fprintf(stderr,
-            ANSI_BOLD "%s%s " ANSI_RESET ANSI_BOLD ANSI_BCYAN
-                      "%s:%u " ANSI_RESET,
-            level_color, level, ctx->ip, ctx->port);
-  } else {
-    fprintf(stderr, ANSI_BOLD "%s%s " ANSI_RESET, level_color, level);
-  }
-}
-
-void log_info(const log_ctx_t *ctx, const char *fmt, ...) {
-  log_prefix(ctx, ANSI_BGREEN, "info");
-  va_list args;
-  va_start(args, fmt);
-  vfprintf(stderr, fmt, args);
-  va_end(args);
-}
-
-void log_err(const log_ctx_t *ctx, const char *fmt, ...) {
-  log_prefix(ctx, ANSI_BRED, "error");
-  va_list args;
-  va_start(args, fmt);
-  vfprintf(stderr, fmt, args);
-  va_end(args);
-}
-
-void log_perror(const log_ctx_t *ctx, const char *s) {
-  log_prefix(ctx, ANSI_BRED, "error");
-  fprintf(stderr, "%s: %s\n", s, strerror(errno));
-}
-
 // LOW LEVEL IO
 
 int send_all(int fd, const char *buf, size_t len) {
@@ -55,15 +22,18 @@ int send_all(int fd, const char *buf, size_t len) {
   return 0;
 }
 
-ssize_t recv_all(int fd, char *buf, size_t len) {
-  size_t received = 0;
-  while (received < len) {
-    ssize_t n = recv(fd, buf + received, len - received, 0);
-    if (n <= 0)
-      return n;
-    received += n;
-  }
-  return (ssize_t)received;
+int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int set_blocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
 }
 
 // PROTOCOL
@@ -74,7 +44,7 @@ int proto_send(int fd, char type, const char *content) {
   uint32_t magic = htonl(PROTO_MAGIC);
 
   size_t total_len = 4 + 4 + 1 + len;
-  char *full_msg = malloc(total_len);
+  char *full_msg = pool_buf_alloc(total_len);
   if (!full_msg)
     return -1;
 
@@ -84,55 +54,125 @@ int proto_send(int fd, char type, const char *content) {
   memcpy(full_msg + 9, content, len);
 
   int result = send_all(fd, full_msg, total_len);
-  free(full_msg);
+  pool_buf_free(full_msg);
   return result;
 }
 
-ssize_t proto_recv(int fd, char *buf, size_t buf_len) {
-  char header[8];
-  ssize_t n = recv_all(fd, header, 8);
-  if (n <= 0)
-    return n;
+size_t proto_put_varint(char *buf, uint64_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    buf[n++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  buf[n++] = (char)value;
+  return n;
+}
 
-  uint32_t received_magic = ntohl(*(uint32_t *)header);
-  if (received_magic != PROTO_MAGIC) {
-    log_err(NULL, "invalid magic number\n");
-    return -1;
+int proto_get_varint(const char *buf, size_t len, size_t max,
+                     uint64_t *value) {
+  *value = 0;
+  for (size_t i = 0; i < max; i++) {
+    if (i == len)
+      return 0;
+    uint8_t byte = (uint8_t)buf[i];
+    *value |= (uint64_t)(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80))
+      return (int)i + 1;
   }
+  return -1;
+}
 
-  uint32_t len = ntohl(*(uint32_t *)(header + 4));
-  if (len >= buf_len || len > 4096) {
-    log_err(NULL, "proto_recv: message too large (%u bytes)\n", len);
-    return -1;
+void proto_reader_init(proto_reader_t *r, char *buf, size_t cap, bool typed) {
+  *r = (proto_reader_t){.buf = buf, .cap = cap, .header = typed ? 9 : 8};
+}
+
+char *proto_reader_space(proto_reader_t *r, size_t *avail) {
+  if (r->off > 0) {
+    memmove(r->buf, r->buf + r->off, r->len - r->off);
+    r->len -= r->off;
+    r->off = 0;
   }
+  *avail = r->cap - r->len;
+  return r->buf + r->len;
+}
 
-  n = recv_all(fd, buf, len);
-  if (n <= 0)
-    return n;
+void proto_reader_filled(proto_reader_t *r, size_t n) { r->len += n; }
+
+// <length: varint><type: 1><content>
+static proto_result_e proto_next_v2(proto_reader_t *r, proto_frame_t *frame) {
+  size_t avail = r->len - r->off;
+  const char *start = r->buf + r->off;
+  uint64_t len;
+  int n = proto_get_varint(start, avail, PROTO_VARINT_MAX, &len);
+  if (n == -1)
+    return PROTO_ERR_MAGIC;
+  if (n == 0 || avail < (size_t)n + 1)
+    return PROTO_NEED_MORE;
+
+  size_t header = n + 1;
+  if (len > r->cap - header) {
+    frame->len = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+    return PROTO_ERR_TOO_LARGE;
+  }
+  frame->len = (uint32_t)len;
+  if (avail - header < frame->len)
+    return PROTO_NEED_MORE;
+
+  frame->type = start[n];
+  frame->content = start + header;
+  r->off += header + frame->len;
+  return PROTO_FRAME;
+}
 
-  buf[len] = '\0';
-  return (ssize_t)len;
+proto_result_e proto_next(proto_reader_t *r, proto_frame_t *frame) {
+  if (r->v2)
+    return proto_next_v2(r, frame);
+
+  size_t avail = r->len - r->off;
+  if (avail < r->header)
+    return PROTO_NEED_MORE;
+
+  const char *start = r->buf + r->off;
+  uint32_t magic, len;
+  memcpy(&magic, start, 4);
+  memcpy(&len, start + 4, 4);
+  if (ntohl(magic) != PROTO_MAGIC)
+    return PROTO_ERR_MAGIC;
+
+  frame->len = ntohl(len);
+  if (frame->len > r->cap - r->header)
+    return PROTO_ERR_TOO_LARGE;
+  if (avail - r->header < frame->len)
+    return PROTO_NEED_MORE;
+
+  frame->type = r->header == 9 ? start[8] : 0;
+  frame->content = start + r->header;
+  r->off += r->header + frame->len;
+  return PROTO_FRAME;
 }
 
 // HIGHER LEVEL IO
 
+int io_send(client_io_t *io, char type, const char *content) {
+  if (io->out)
+    return outq_push(io->out, type, content);
+  return proto_send(io->fd, type, content);
+}
+
 int io_message(client_io_t *io, const char *fmt, ...) {
   char buf[1152];
   va_list args;
   va_start(args, fmt);
   vsnprintf(buf, sizeof(buf), fmt, args);
   va_end(args);
-  return proto_send(io->fd, 'm', buf);
+  return io_send(io, 'm', buf);
 }
 
-ssize_t io_prompt(client_io_t *io, const char *fmt, ...) {
+int io_prompt(client_io_t *io, const char *fmt, ...) {
   char buf[128];
   va_list args;
   va_start(args, fmt);
   vsnprintf(buf, sizeof(buf), fmt, args);
   va_end(args);
-
-  if (proto_send(io->fd, 'p', buf) == -1)
-    return -1;
-  return proto_recv(io->fd, io->buf, sizeof(io->buf));
+  return io_send(io, 'p', buf);
 }
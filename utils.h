@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include "log.h"
+#include "outq.h"
+
 #define ANSI_RESET "\x1b[0m"
 #define ANSI_BOLD "\x1b[1m"
 
@@ -27,44 +30,107 @@
 #define ANSI_BCYAN "\x1b[96m"
 #define ANSI_BWHITE "\x1b[97m"
 
-// LOGGING
-
-typedef struct {
-  const char *ip;
-  uint16_t port;
-} log_ctx_t;
-
-void log_info(const log_ctx_t *ctx, const char *fmt, ...);
-void log_err(const log_ctx_t *ctx, const char *fmt, ...);
-void log_perror(const log_ctx_t *ctx, const char *s);
-
-#define LOG_CTX(ctx) (&(log_ctx_t){.ip = (ctx)->ip, .port = (ctx)->port})
-
 // LOW LEVEL IO
 int send_all(int fd, const char *buf, size_t len);
-ssize_t recv_all(int fd, char *buf, size_t len);
+int set_nonblocking(int fd);
+int set_blocking(int fd);
 
 // PROTOCOL
 #define PROTO_MAGIC 0x43484154
 // server message: <length: 4 BE><type: 1><content>
 int proto_send(int fd, char type, const char *content);
+// largest server frame content a client has to buffer
+#define PROTO_SERVER_MAX 4096
+// v2 server message, once the client negotiated PROTO_CAP_V2:
+// <length of content: varint><type: 1><content>
+//
+// varints are little endian base 128, 7 bits a byte and the top bit set on
+// all but the last. a length takes at most this many bytes.
+#define PROTO_VARINT_MAX 5
+size_t proto_put_varint(char *buf, uint64_t value);
+// reads a varint of at most max bytes, returns how many it took, 0 if buf
+// ends first and -1 if it runs past max
+int proto_get_varint(const char *buf, size_t len, size_t max,
+                     uint64_t *value);
 // client message: <length: 4 BE><content>
-ssize_t proto_recv(int fd, char *buf, size_t buf_len);
+//
+// incremental decoder over a connection's receive buffer. recv straight into
+// proto_reader_space, then take every complete frame with proto_next. frames
+// point into the buffer and stay valid until the next proto_reader_space.
+typedef struct {
+  char *buf;
+  size_t cap;
+  size_t len;
+  // first byte not yet decoded
+  size_t off;
+  // 9 for server frames, which carry a type byte, 8 for client frames
+  size_t header;
+  // server frames past the caps reply that accepted PROTO_CAP_V2
+  bool v2;
+} proto_reader_t;
+
+typedef struct {
+  // 0 for client frames
+  char type;
+  uint32_t len;
+  const char *content;
+} proto_frame_t;
+
+typedef enum {
+  // or, for v2 frames, a length varint that never ends
+  PROTO_ERR_MAGIC = -2,
+  // the frame can never fit the buffer, frame->len says how big it claimed
+  PROTO_ERR_TOO_LARGE = -1,
+  PROTO_NEED_MORE = 0,
+  PROTO_FRAME = 1,
+} proto_result_e;
+
+void proto_reader_init(proto_reader_t *r, char *buf, size_t cap, bool typed);
+// moves the undecoded tail to the front and returns where to receive into
+char *proto_reader_space(proto_reader_t *r, size_t *avail);
+void proto_reader_filled(proto_reader_t *r, size_t n);
+proto_result_e proto_next(proto_reader_t *r, proto_frame_t *frame);
+// client frames starting with this byte are protocol control, not user input.
+// "\0caps <name>..." asks for extensions and is answered by a SERVER_CAPS
+// frame listing the accepted ones.
+#define PROTO_CONTROL '\0'
+// the server only sends prompts when they change, so the client may send
+// the next line without waiting for one
+#define PROTO_CAP_PIPELINE "pipeline"
+// the server sends SERVER_PING to a quiet client, which answers with any
+// frame, "\0pong" if it has nothing else to say
+#define PROTO_CAP_PING "ping"
+// every server frame after the caps reply uses v2 framing, and broadcasts
+// arrive as the typed events in event.h for the client to render
+#define PROTO_CAP_V2 "v2"
+// any server frame after the caps reply may come as a SERVER_DEFLATE frame,
+// see zframe.h
+#define PROTO_CAP_DEFLATE "deflate"
 
 // HIGHER LEVEL IO
 
 typedef enum {
   SERVER_PROMPT = 'p',
   SERVER_MESSAGE = 'm',
+  // reply to a caps request, the extensions the server agreed to
+  SERVER_CAPS = 'c',
+  // heartbeat, only sent to clients that negotiated PROTO_CAP_PING
+  SERVER_PING = 'h',
+  // <type: 1><content> of another frame, raw deflate against the preset
+  // dictionary, only sent to clients that negotiated PROTO_CAP_DEFLATE
+  SERVER_DEFLATE = 'z',
 } server_message_e;
 
 typedef struct {
   int fd;
+  // when set, frames are queued here instead of blocking on the socket
+  outq_t *out;
   char buf[1024];
 } client_io_t;
 
-// like recv, returns bytes read, 0 on close, -1 on error
+int io_send(client_io_t *io, char type, const char *content);
 int io_message(client_io_t *io, const char *fmt, ...);
-ssize_t io_prompt(client_io_t *io, const char *fmt, ...);
+// only sends the prompt, the reply arrives as the next client message
+int io_prompt(client_io_t *io, const char *fmt, ...);
 
 #endif // UTILS_H
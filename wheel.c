@@ -0,0 +1,161 @@
+// clock_gettime is hidden in strict iso mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <time.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+// ticks the top level covers
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static void list_init(wheel_timer_t *head) {
+  head->next = head;
+  head->prev = head;
+}
+
+static bool list_empty(const wheel_timer_t *head) { return head->next == head; }
+
+static void list_unlink(wheel_timer_t *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+static void list_append(wheel_timer_t *head, wheel_timer_t *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+// moves every timer of src onto the empty list dst
+static void list_take(wheel_timer_t *dst, wheel_timer_t *src) {
+  list_init(dst);
+  if (list_empty(src))
+    return;
+  dst->next = src->next;
+  dst->prev = src->prev;
+  dst->next->prev = dst;
+  dst->prev->next = dst;
+  list_init(src);
+}
+
+// the lowest level whose range still holds the timer, slots above level 0
+// are cascaded into the ones below when the lower level wraps around
+static void place(wheel_t *wheel, wheel_timer_t *timer) {
+  if (timer->expires <= wheel->now)
+    timer->expires = wheel->now + 1;
+  uint64_t expires = timer->expires;
+  uint64_t delta = expires - wheel->now;
+
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+    level++;
+  // too far for the top level, park it a full turn ahead and place it again
+  // when that slot is cascaded
+  if (delta >= WHEEL_SPAN)
+    expires = wheel->now + WHEEL_SPAN - 1;
+
+  size_t index = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  list_append(&wheel->slots[level][index], timer);
+}
+
+uint64_t wheel_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheel_init(wheel_t *wheel, uint64_t now) {
+  wheel->now = now / WHEEL_TICK_MS;
+  wheel->len = 0;
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+      list_init(&wheel->slots[level][i]);
+  }
+}
+
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer) {
+  if (!timer->next)
+    return;
+  list_unlink(timer);
+  wheel->len--;
+}
+
+void wheel_set(wheel_t *wheel, wheel_timer_t *timer, uint64_t deadline) {
+  if (deadline == 0) {
+    wheel_cancel(wheel, timer);
+    return;
+  }
+  if (timer->next && timer->deadline == deadline)
+    return;
+
+  wheel_cancel(wheel, timer);
+  timer->deadline = deadline;
+  // rounded up, so a timer never fires before its deadline
+  timer->expires = (deadline + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+  place(wheel, timer);
+  wheel->len++;
+}
+
+static void cascade(wheel_t *wheel) {
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    size_t index = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    wheel_timer_t moving;
+    list_take(&moving, &wheel->slots[level][index]);
+    while (!list_empty(&moving)) {
+      wheel_timer_t *timer = moving.next;
+      list_unlink(timer);
+      place(wheel, timer);
+    }
+    // the next level only moves when this one wrapped around as well
+    if (index != 0)
+      break;
+  }
+}
+
+void wheel_advance(wheel_t *wheel, uint64_t now) {
+  uint64_t target = now / WHEEL_TICK_MS;
+  // nothing can come due, so skip the idle ticks
+  if (wheel->len == 0) {
+    if (target > wheel->now)
+      wheel->now = target;
+    return;
+  }
+
+  while (wheel->now < target) {
+    wheel->now++;
+    if ((wheel->now & WHEEL_MASK) == 0)
+      cascade(wheel);
+
+    // taken off the slot first, so callbacks can arm and cancel anything
+    wheel_timer_t due;
+    list_take(&due, &wheel->slots[0][wheel->now & WHEEL_MASK]);
+    while (!list_empty(&due)) {
+      wheel_timer_t *timer = due.next;
+      list_unlink(timer);
+      wheel->len--;
+      timer->fn(timer);
+    }
+  }
+}
+
+int wheel_timeout(const wheel_t *wheel, uint64_t now) {
+  if (wheel->len == 0)
+    return -1;
+
+  // the next armed level 0 slot, or the next cascade, whichever comes first
+  uint64_t tick = wheel->now + 1;
+  while ((tick & WHEEL_MASK) != 0 &&
+         list_empty(&wheel->slots[0][tick & WHEEL_MASK]))
+    tick++;
+
+  uint64_t at = tick * WHEEL_TICK_MS;
+  if (at <= now)
+    return 0;
+  return at - now > INT_MAX ? INT_MAX : (int)(at - now);
+}
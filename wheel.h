@@ -0,0 +1,53 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// hierarchical timer wheel for one event loop. timers are intrusive, so
+// arming and cancelling is a list splice with no allocation, and advancing
+// only visits the slots that came due. four levels of 64 slots with 100 ms
+// ticks reach about 19 days, later deadlines go around the top level again.
+// timers never fire before their deadline, but may be a couple of ticks late.
+
+#define WHEEL_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_timer wheel_timer_t;
+
+struct wheel_timer {
+  // NULL while the timer is not armed
+  wheel_timer_t *next;
+  wheel_timer_t *prev;
+  // tick it fires on
+  uint64_t expires;
+  // what it was armed for, in the caller's milliseconds
+  uint64_t deadline;
+  void (*fn)(wheel_timer_t *timer);
+};
+
+typedef struct {
+  // last tick that has been run
+  uint64_t now;
+  size_t len;
+  // list heads, each slot is a circular list through its sentinel
+  wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+// CLOCK_MONOTONIC in milliseconds, the time every call below takes
+uint64_t wheel_clock(void);
+
+void wheel_init(wheel_t *wheel, uint64_t now);
+// arms timer for deadline, moving it if it was armed for another one. a
+// deadline of 0 cancels it. fn must be set first.
+void wheel_set(wheel_t *wheel, wheel_timer_t *timer, uint64_t deadline);
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer);
+// runs every timer that came due by now. fn may set or cancel any timer,
+// including the one that fired.
+void wheel_advance(wheel_t *wheel, uint64_t now);
+// milliseconds until wheel_advance has work to do, -1 if nothing is armed
+int wheel_timeout(const wheel_t *wheel, uint64_t now);
+
+#endif // WHEEL_H
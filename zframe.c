@@ -0,0 +1,173 @@
+// next_in is const with this
+#define ZLIB_CONST
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "metrics.h"
+#include "utils.h"
+#include "zframe.h"
+
+// frames are at most a few kB, so a small window and hash table do as well
+// as the defaults. a compressor takes (1 << (WINDOW_BITS + 2)) + (1 <<
+// (MEM_LEVEL + 9)) bytes, 64 kB.
+#define WINDOW_BITS 13
+#define MEM_LEVEL 6
+// compressors kept around for the next frame, about one per thread that
+// compresses at the same time
+#define IDLE_STREAMS 64
+
+// part of the protocol: both ends prime their streams with it, so changing
+// it needs a new cap. matches nearer the end are cheaper to encode, so the
+// most common strings come last.
+static const char dictionary[] =
+    // command replies and the server's own notices
+    ANSI_BOLD ANSI_BRED "error " ANSI_RESET "unknown command\n"
+    "name cannot be empty\n"
+    "idle for too long, disconnecting\n" ANSI_BOLD ANSI_BYELLOW
+    "... messages skipped ...\n" ANSI_RESET ANSI_BOLD ANSI_BGREEN "    "
+    ANSI_RESET ANSI_CYAN "  127.0.0.1:\n" ANSI_RESET
+    // link changes, summaries and channel notices
+    "linked up, users there"
+    "lost, users gone" ANSI_BOLD ANSI_BCYAN "users " ANSI_RESET
+    "disconnected: joined: " ANSI_BOLD ANSI_BMAGENTA " " ANSI_RESET
+    "left #lobby\n" ANSI_BOLD ANSI_BMAGENTA " " ANSI_RESET "joined #lobby\n"
+    // common words of chat text
+    "the and that this you have for with not what but are was just it's "
+    "can do we be if on at so in of to is it i a "
+    "thanks yes no ok lol :) "
+    // joins, leaves and renames, then chat. v2 events carry the ip as a
+    // length prefixed string
+    "\t127.0.0.1" ANSI_BOLD ANSI_BCYAN "127.0.0.1:" ANSI_RESET
+    "renamed to " ANSI_BOLD ANSI_BMAGENTA ANSI_RESET "\n" ANSI_BOLD
+    ANSI_BCYAN "127.0.0.1:" ANSI_RESET "disconnected\n" ANSI_BOLD ANSI_BCYAN
+    "127.0.0.1:" ANSI_RESET "joined as " ANSI_BOLD ANSI_BMAGENTA ANSI_RESET
+    "\n" ANSI_BOLD ANSI_BYELLOW " (private) " ANSI_RESET ANSI_BOLD
+    ANSI_BMAGENTA " " ANSI_RESET;
+
+static int level = ZFRAME_DEFAULT_LEVEL;
+
+void zframe_configure(int lvl) { level = lvl; }
+
+// COMPRESSORS
+
+static pthread_mutex_t idle_mu = PTHREAD_MUTEX_INITIALIZER;
+static z_stream *idle[IDLE_STREAMS];
+static size_t idle_len;
+
+static z_stream *stream_take(void) {
+  pthread_mutex_lock(&idle_mu);
+  z_stream *s = idle_len > 0 ? idle[--idle_len] : NULL;
+  pthread_mutex_unlock(&idle_mu);
+  if (s)
+    return s;
+
+  s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+  if (deflateInit2(s, level, Z_DEFLATED, -WINDOW_BITS, MEM_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+static void stream_give(z_stream *s) {
+  pthread_mutex_lock(&idle_mu);
+  if (idle_len < IDLE_STREAMS) {
+    idle[idle_len++] = s;
+    s = NULL;
+  }
+  pthread_mutex_unlock(&idle_mu);
+  if (s) {
+    deflateEnd(s);
+    free(s);
+  }
+}
+
+// the SERVER_DEFLATE twin of frame, frame itself when compression does not
+// pay, or NULL when it failed
+static frame_t *compress_frame(frame_t *frame) {
+  // the twin has to come out smaller than <type><content>
+  if (frame->len < 2)
+    return frame;
+  z_stream *s = stream_take();
+  if (!s)
+    return NULL;
+
+  uint64_t start = metrics_now();
+  char out[PROTO_SERVER_MAX];
+  size_t limit = frame->len - 1 < sizeof(out) ? frame->len - 1 : sizeof(out);
+  deflateReset(s);
+  deflateSetDictionary(s, (const Bytef *)dictionary, sizeof(dictionary) - 1);
+  s->next_out = (Bytef *)out;
+  s->avail_out = limit;
+  s->next_in = (const Bytef *)&frame->type;
+  s->avail_in = 1;
+  int rc = deflate(s, Z_NO_FLUSH);
+  if (rc == Z_OK) {
+    s->next_in = (const Bytef *)frame->payload;
+    s->avail_in = frame->len;
+    rc = deflate(s, Z_FINISH);
+  }
+  size_t len = limit - s->avail_out;
+  stream_give(s);
+  metrics_since(METRIC_DEFLATE, start);
+
+  // anything else means out filled up first
+  if (rc != Z_STREAM_END)
+    return frame;
+  return frame->version == 2 ? frame_new_v2(SERVER_DEFLATE, out, len)
+                             : frame_new_len(SERVER_DEFLATE, out, len);
+}
+
+frame_t *zframe_for(frame_t *frame) {
+  frame_t *z = atomic_load_explicit(&frame->z, memory_order_acquire);
+  if (!z) {
+    z = compress_frame(frame);
+    // it goes out as it is, the next client tries again
+    if (!z) {
+      frame_get(frame);
+      return frame;
+    }
+    // another client's push may have got there first
+    frame_t *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&frame->z, &expected, z,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+      if (z != frame)
+        frame_put(z);
+      z = expected;
+    }
+  }
+  frame_get(z);
+  return z;
+}
+
+// DECOMPRESSION
+
+int zframe_inflate(const char *content, size_t len, char *buf, size_t size) {
+  static _Thread_local z_stream s;
+  static _Thread_local bool ready;
+  if (!ready) {
+    if (inflateInit2(&s, -MAX_WBITS) != Z_OK)
+      return -1;
+    ready = true;
+  } else if (inflateReset(&s) != Z_OK) {
+    return -1;
+  }
+  // raw streams take their dictionary up front
+  if (inflateSetDictionary(&s, (const Bytef *)dictionary,
+                           sizeof(dictionary) - 1) != Z_OK)
+    return -1;
+
+  s.next_in = (const Bytef *)content;
+  s.avail_in = len;
+  s.next_out = (Bytef *)buf;
+  s.avail_out = size;
+  if (inflate(&s, Z_FINISH) != Z_STREAM_END || s.avail_out == size)
+    return -1;
+  return (int)(size - s.avail_out);
+}
@@ -0,0 +1,30 @@
+#ifndef ZFRAME_H
+#define ZFRAME_H
+
+#include <stddef.h>
+
+#include "frame.h"
+
+// deflate for server frames. each frame is compressed on its own, as a raw
+// deflate stream primed with a preset dictionary of what chat traffic looks
+// like, instead of through a stream kept per connection. that costs some of
+// the ratio, but the compressed frame is the same for every client that
+// negotiated it, so a broadcast is compressed once per framing rather than
+// once per recipient.
+
+#define ZFRAME_DEFAULT_LEVEL 6
+#define ZFRAME_MAX_LEVEL 9
+
+// zlib compression level, 1 to ZFRAME_MAX_LEVEL. call before any frame is
+// compressed.
+void zframe_configure(int level);
+// a reference on what a deflate client gets for frame, which must be in the
+// client's framing: its SERVER_DEFLATE twin, made by the first client to need
+// it, or frame itself when compressing does not make it smaller
+frame_t *zframe_for(frame_t *frame);
+// inflates the content of a SERVER_DEFLATE frame into buf, which ends up
+// holding <type><content> of the original. returns its length, or -1 if the
+// content is malformed or does not fit.
+int zframe_inflate(const char *content, size_t len, char *buf, size_t size);
+
+#endif // ZFRAME_H